@@ -0,0 +1,511 @@
+/*
+ * minifs_bench: formats a fresh image and times the public API.
+ *
+ * Every operation is timed on its own; each phase reports its
+ * throughput and latency percentiles as JSON (default) or CSV.
+ *
+ *   minifs_bench [--files N] [--fanout F] [--depth D]
+ *                [--small BYTES] [--large BYTES] [--large-files N]
+ *                [--mode pread|mmap|uring] [--cache BLOCKS]
+ *                [--format json|csv] [--out FILE] [--image PATH] [--keep]
+ *                [--stats]
+ *
+ * --stats writes the library's own counters (stats.h) to stderr.
+ */
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "disk.h"
+#include "fs.h"
+#include "logging.h"
+#include "path.h"
+#include "stats.h"
+
+#define BENCH_BLOCK_SIZE 4096
+#define MAX_PATH_LEN 256
+#define MAX_PHASES 32
+#define MAX_DEPTH 8
+
+typedef struct {
+    size_t files;
+    size_t fanout;
+    size_t depth;
+    size_t small_size;
+    size_t large_size;
+    size_t large_files;
+    DiskMode mode;
+    size_t cache_blocks;
+    bool csv;
+    const char* out_fn;
+    const char* image_fn;
+    bool keep;
+    bool stats;
+} BenchConfig;
+
+typedef struct {
+    char name[32];
+    size_t count;
+    size_t failures;
+    size_t bytes;  // Payload moved, for read and write phases.
+    double total_s;
+    double mean_us, p50_us, p90_us, p99_us, max_us;
+} PhaseResult;
+
+// --------------- LOCAL ---------------
+
+static BenchConfig config = {
+    .files = 1000,
+    .fanout = 4,
+    .depth = 3,
+    .small_size = 100,
+    .large_size = 1 << 20,
+    .large_files = 4,
+    .mode = DISK_MODE_PREAD,
+    .cache_blocks = DEFAULT_CACHE_CAPACITY,
+    .csv = false,
+    .out_fn = NULL,
+    .image_fn = "minifs_bench.img",
+    .keep = false,
+    .stats = false,
+};
+
+static PhaseResult results[MAX_PHASES];
+static size_t nresults = 0;
+
+// Latencies (in microseconds) of the phase being measured.
+static double* samples = NULL;
+static size_t nsamples = 0;
+static size_t samples_cap = 0;
+
+static double now_s(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (double)ts.tv_sec + (double)ts.tv_nsec / 1e9;
+}
+
+static void add_sample(double us) {
+    if (nsamples == samples_cap) {
+        samples_cap = samples_cap ? samples_cap * 2 : 1024;
+        samples = (double*)realloc(samples, samples_cap * sizeof(double));
+        if (!samples) {
+            fprintf(stderr, "minifs_bench: out of memory\n");
+            exit(1);
+        }
+    }
+    samples[nsamples++] = us;
+}
+
+static int compare_doubles(const void* a, const void* b) {
+    double x = *(const double*)a;
+    double y = *(const double*)b;
+    return (x > y) - (x < y);
+}
+
+static double percentile(double p) {
+    size_t i = (size_t)(p * (double)(nsamples - 1) + 0.5);
+    return samples[i];
+}
+
+/*
+ * Phases are measured as `begin_phase`, one `timed` call per
+ * operation, then `end_phase`, which turns the samples into a result.
+ */
+static PhaseResult* begin_phase(const char* name) {
+    if (nresults == MAX_PHASES) {
+        fprintf(stderr, "minifs_bench: too many phases\n");
+        exit(1);
+    }
+    PhaseResult* r = &results[nresults++];
+    memset(r, 0, sizeof(*r));
+    snprintf(r->name, sizeof(r->name), "%s", name);
+    nsamples = 0;
+    return r;
+}
+
+static void end_phase(PhaseResult* r) {
+    r->count = nsamples;
+    if (nsamples == 0) {
+        return;
+    }
+    double sum = 0;
+    for (size_t i = 0; i < nsamples; ++i) {
+        sum += samples[i];
+    }
+    qsort(samples, nsamples, sizeof(double), compare_doubles);
+    r->total_s = sum / 1e6;
+    r->mean_us = sum / (double)nsamples;
+    r->p50_us = percentile(0.50);
+    r->p90_us = percentile(0.90);
+    r->p99_us = percentile(0.99);
+    r->max_us = samples[nsamples - 1];
+}
+
+// Records one operation; `ok` is false if it failed.
+static void timed(PhaseResult* r, double start, bool ok) {
+    add_sample((now_s() - start) * 1e6);
+    r->failures += !ok;
+}
+
+// Directory `index` among the `fanout^level` directories at depth `level`.
+static void dir_path(char* out, size_t level, size_t index) {
+    size_t digits[MAX_DEPTH];
+    for (size_t l = level; l-- > 0;) {
+        digits[l] = index % config.fanout;
+        index /= config.fanout;
+    }
+    size_t len = 0;
+    out[0] = '\0';
+    for (size_t l = 0; l < level; ++l) {
+        len += (size_t)snprintf(out + len, MAX_PATH_LEN - len, "/d%zu", digits[l]);
+    }
+}
+
+static size_t dirs_at(size_t level) {
+    size_t n = 1;
+    for (size_t l = 0; l < level; ++l) {
+        n *= config.fanout;
+    }
+    return n;
+}
+
+// Files are spread round-robin over the leaf directories.
+static void file_path(char* out, const char* prefix, size_t i) {
+    dir_path(out, config.depth, i % dirs_at(config.depth));
+    size_t len = strlen(out);
+    snprintf(out + len, MAX_PATH_LEN - len, "/%s%zu", prefix, i);
+}
+
+static char* make_payload(size_t size) {
+    char* data = (char*)malloc(size + 1);
+    if (!data) {
+        fprintf(stderr, "minifs_bench: out of memory\n");
+        exit(1);
+    }
+    for (size_t i = 0; i < size; ++i) {
+        data[i] = (char)('a' + i % 26);
+    }
+    data[size] = '\0';
+    return data;
+}
+
+// Sizes the image so that every phase fits with room to spare.
+static FsGeometry bench_geometry(size_t ndirs) {
+    size_t bs = BENCH_BLOCK_SIZE;
+    size_t small_blocks = (config.small_size + bs - 1) / bs;
+    size_t large_blocks = (config.large_size + bs - 1) / bs;
+    uint64_t blocks = 4 * (ndirs + config.files * (small_blocks + 1)) +
+                      2 * config.large_files * (large_blocks + 1) + 8192;
+    if (blocks > UINT32_MAX) {
+        blocks = UINT32_MAX;
+    }
+    FsGeometry g = {
+        .block_size = (uint32_t)bs,
+        .num_blocks = (uint32_t)blocks,
+        .max_inodes = (uint32_t)(ndirs + 2 * config.files + config.large_files + 16),
+        .journal_blocks = 0,
+    };
+    return g;
+}
+
+static void run_benchmarks(void) {
+    char path[MAX_PATH_LEN];
+    size_t ndirs = 0;
+    for (size_t l = 1; l <= config.depth; ++l) {
+        ndirs += dirs_at(l);
+    }
+    FsGeometry g = bench_geometry(ndirs);
+    set_disk_mode(config.mode);
+    set_cache_capacity(config.cache_blocks);
+    if (mkfs_with_geometry(config.image_fn, &g) != 0) {
+        fprintf(stderr, "minifs_bench: failed to format %s\n", config.image_fn);
+        exit(1);
+    }
+
+    PhaseResult* r = begin_phase("mkdir");
+    for (size_t l = 1; l <= config.depth; ++l) {
+        for (size_t i = 0; i < dirs_at(l); ++i) {
+            dir_path(path, l, i);
+            double t = now_s();
+            timed(r, t, mkdir_fs(path) == 0);
+        }
+    }
+    end_phase(r);
+
+    r = begin_phase("create");
+    for (size_t i = 0; i < config.files; ++i) {
+        file_path(path, "f", i);
+        double t = now_s();
+        timed(r, t, mkfile_fs(path) == 0);
+    }
+    end_phase(r);
+
+    // Directories at each depth, then the files below the deepest ones.
+    for (size_t l = 1; l <= config.depth + 1; ++l) {
+        char name[32];
+        snprintf(name, sizeof(name), "lookup_depth_%zu", l);
+        r = begin_phase(name);
+        size_t n = l <= config.depth ? dirs_at(l) : config.files;
+        for (size_t i = 0; i < n; ++i) {
+            if (l <= config.depth) {
+                dir_path(path, l, i);
+            } else {
+                file_path(path, "f", i);
+            }
+            int ino;
+            double t = now_s();
+            timed(r, t, get_inode_no_from_path(path, &ino) == 0);
+        }
+        end_phase(r);
+    }
+
+    char* small = make_payload(config.small_size);
+    r = begin_phase("write_small");
+    for (size_t i = 0; i < config.files; ++i) {
+        file_path(path, "s", i);
+        double t = now_s();
+        timed(r, t, write_fs(path, small) == (int)config.small_size);
+    }
+    r->bytes = config.files * config.small_size;
+    end_phase(r);
+
+    r = begin_phase("read_small");
+    for (size_t i = 0; i < config.files; ++i) {
+        file_path(path, "s", i);
+        double t = now_s();
+        timed(r, t, read_fs(path, small, config.small_size) == (int)config.small_size);
+    }
+    r->bytes = config.files * config.small_size;
+    end_phase(r);
+    free(small);
+
+    char* large = make_payload(config.large_size);
+    r = begin_phase("write_large");
+    for (size_t i = 0; i < config.large_files; ++i) {
+        snprintf(path, sizeof(path), "/large%zu", i);
+        double t = now_s();
+        timed(r, t, write_fs(path, large) == (int)config.large_size);
+    }
+    r->bytes = config.large_files * config.large_size;
+    end_phase(r);
+
+    r = begin_phase("read_large");
+    for (size_t i = 0; i < config.large_files; ++i) {
+        snprintf(path, sizeof(path), "/large%zu", i);
+        double t = now_s();
+        timed(r, t, read_fs(path, large, config.large_size) == (int)config.large_size);
+    }
+    r->bytes = config.large_files * config.large_size;
+    end_phase(r);
+    free(large);
+
+    size_t max_entries = 2 * config.files + ndirs + config.large_files + 1;
+    DirectoryEntry* entries = (DirectoryEntry*)malloc(max_entries * sizeof(DirectoryEntry));
+    if (!entries) {
+        fprintf(stderr, "minifs_bench: out of memory\n");
+        exit(1);
+    }
+    r = begin_phase("ls");
+    for (size_t i = 0; i < dirs_at(config.depth); ++i) {
+        dir_path(path, config.depth, i);
+        double t = now_s();
+        timed(r, t, ls_fs(path, entries, max_entries) >= 0);
+    }
+    end_phase(r);
+    free(entries);
+
+    r = begin_phase("delete");
+    for (size_t i = 0; i < config.files; ++i) {
+        file_path(path, "f", i);
+        double t = now_s();
+        timed(r, t, delete_fs(path) == 0);
+        file_path(path, "s", i);
+        t = now_s();
+        timed(r, t, delete_fs(path) == 0);
+    }
+    end_phase(r);
+
+    unmount_fs();
+    if (!config.keep) {
+        unlink(config.image_fn);
+    }
+}
+
+static const char* mode_name(DiskMode mode) {
+    return mode == DISK_MODE_MMAP ? "mmap" : mode == DISK_MODE_URING ? "uring" : "pread";
+}
+
+static void print_json(FILE* out) {
+    fprintf(
+        out,
+        "{\n  \"config\": {\"files\": %zu, \"fanout\": %zu, \"depth\": %zu, \"small_size\": %zu, "
+        "\"large_size\": %zu, \"large_files\": %zu, \"mode\": \"%s\", \"cache_blocks\": %zu},\n"
+        "  \"results\": [\n",
+        config.files,
+        config.fanout,
+        config.depth,
+        config.small_size,
+        config.large_size,
+        config.large_files,
+        mode_name(config.mode),
+        config.cache_blocks);
+    for (size_t i = 0; i < nresults; ++i) {
+        const PhaseResult* r = &results[i];
+        double ops = r->total_s > 0 ? (double)r->count / r->total_s : 0;
+        double mbps = r->total_s > 0 ? (double)r->bytes / r->total_s / 1e6 : 0;
+        fprintf(
+            out,
+            "    {\"op\": \"%s\", \"count\": %zu, \"failures\": %zu, \"total_s\": %.6f, "
+            "\"ops_per_s\": %.1f, \"mb_per_s\": %.2f, \"mean_us\": %.2f, \"p50_us\": %.2f, "
+            "\"p90_us\": %.2f, \"p99_us\": %.2f, \"max_us\": %.2f}%s\n",
+            r->name,
+            r->count,
+            r->failures,
+            r->total_s,
+            ops,
+            mbps,
+            r->mean_us,
+            r->p50_us,
+            r->p90_us,
+            r->p99_us,
+            r->max_us,
+            i + 1 < nresults ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+static void print_csv(FILE* out) {
+    fprintf(
+        out, "op,count,failures,total_s,ops_per_s,mb_per_s,mean_us,p50_us,p90_us,p99_us,max_us\n");
+    for (size_t i = 0; i < nresults; ++i) {
+        const PhaseResult* r = &results[i];
+        double ops = r->total_s > 0 ? (double)r->count / r->total_s : 0;
+        double mbps = r->total_s > 0 ? (double)r->bytes / r->total_s / 1e6 : 0;
+        fprintf(
+            out,
+            "%s,%zu,%zu,%.6f,%.1f,%.2f,%.2f,%.2f,%.2f,%.2f,%.2f\n",
+            r->name,
+            r->count,
+            r->failures,
+            r->total_s,
+            ops,
+            mbps,
+            r->mean_us,
+            r->p50_us,
+            r->p90_us,
+            r->p99_us,
+            r->max_us);
+    }
+}
+
+static void usage(const char* prog) {
+    fprintf(
+        stderr,
+        "usage: %s [--files N] [--fanout F] [--depth D] [--small BYTES] [--large BYTES]\n"
+        "          [--large-files N] [--mode pread|mmap|uring] [--cache BLOCKS]\n"
+        "          [--format json|csv] [--out FILE] [--image PATH] [--keep] [--stats]\n",
+        prog);
+    exit(2);
+}
+
+static size_t parse_size(const char* prog, const char* s) {
+    char* end;
+    unsigned long long v = strtoull(s, &end, 10);
+    if (*s == '\0' || *end != '\0') {
+        usage(prog);
+    }
+    return (size_t)v;
+}
+
+static void parse_args(int argc, char** argv) {
+    for (int i = 1; i < argc; ++i) {
+        const char* arg = argv[i];
+        if (strcmp(arg, "--keep") == 0) {
+            config.keep = true;
+            continue;
+        }
+        if (strcmp(arg, "--stats") == 0) {
+            config.stats = true;
+            continue;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+        }
+        const char* val = argv[++i];
+        if (strcmp(arg, "--files") == 0) {
+            config.files = parse_size(argv[0], val);
+        } else if (strcmp(arg, "--fanout") == 0) {
+            config.fanout = parse_size(argv[0], val);
+        } else if (strcmp(arg, "--depth") == 0) {
+            config.depth = parse_size(argv[0], val);
+        } else if (strcmp(arg, "--small") == 0) {
+            config.small_size = parse_size(argv[0], val);
+        } else if (strcmp(arg, "--large") == 0) {
+            config.large_size = parse_size(argv[0], val);
+        } else if (strcmp(arg, "--large-files") == 0) {
+            config.large_files = parse_size(argv[0], val);
+        } else if (strcmp(arg, "--cache") == 0) {
+            config.cache_blocks = parse_size(argv[0], val);
+        } else if (strcmp(arg, "--mode") == 0) {
+            if (strcmp(val, "pread") == 0) {
+                config.mode = DISK_MODE_PREAD;
+            } else if (strcmp(val, "mmap") == 0) {
+                config.mode = DISK_MODE_MMAP;
+            } else if (strcmp(val, "uring") == 0) {
+                config.mode = DISK_MODE_URING;
+            } else {
+                usage(argv[0]);
+            }
+        } else if (strcmp(arg, "--format") == 0) {
+            if (strcmp(val, "json") != 0 && strcmp(val, "csv") != 0) {
+                usage(argv[0]);
+            }
+            config.csv = strcmp(val, "csv") == 0;
+        } else if (strcmp(arg, "--out") == 0) {
+            config.out_fn = val;
+        } else if (strcmp(arg, "--image") == 0) {
+            config.image_fn = val;
+        } else {
+            usage(argv[0]);
+        }
+    }
+    if (config.fanout == 0 || config.depth == 0 || config.depth > MAX_DEPTH ||
+        config.small_size == 0 || config.large_size == 0) {
+        usage(argv[0]);
+    }
+}
+
+// -------------------------------------
+
+int main(int argc, char** argv) {
+    parse_args(argc, argv);
+    // Logging would dominate the timings; keep only errors.
+    set_print_logs(false);
+    set_log_level(ERROR_LOG);
+    minifs_stats_reset();
+    run_benchmarks();
+    if (config.stats) {
+        minifs_stats_print(stderr);
+    }
+    FILE* out = stdout;
+    if (config.out_fn && (out = fopen(config.out_fn, "w")) == NULL) {
+        perror("minifs_bench: failed to open the output file");
+        return 1;
+    }
+    if (config.csv) {
+        print_csv(out);
+    } else {
+        print_json(out);
+    }
+    if (out != stdout) {
+        fclose(out);
+    }
+    free(samples);
+    return 0;
+}
@@ -2,24 +2,55 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
 // Bitmap itself is encapsulated.
 
 void load_bitmap_from_disk();
+// Writes the bitmap only if it changed since it was last loaded or flushed.
+// Once the journal is loaded, this commits it instead.
 void flush_bitmap_to_disk();
-
-// Sets all bits to zero.
+// Adds the changed bitmap blocks to the journal transaction being committed.
+void flush_bitmap_to_journal();
+// Called once that transaction is durable; frees the blocks it released.
+void bitmap_committed();
+// Bitmap blocks the next commit will log.
+size_t bitmap_dirty_blocks();
+
+// Sets all bits to zero; an allocated bitmap counts as loaded from then on.
 //! Modifies RAM only. Call 'write' for changes to take effect.
 void clear_bitmap();
+// Leaves it unloaded until `clear_bitmap` or `load_bitmap_from_disk` fills it.
 void alloc_bitmap();
+// Releases the bitmap without writing it back; called on unmount.
+void free_bitmap();
 
+bool bitmap_is_loaded();
 // Throws an error if the requirement is not met.
 void require_bitmap_is_loaded();
 
 int alloc_block();
 void free_block(int block_no);
 
+/*
+ * Allocates up to `want` consecutive blocks: the first free run that
+ * is long enough, otherwise the longest one there is. Returns its
+ * first block and sets `got` to its length, or returns -1 if full.
+ */
+int alloc_block_run(size_t want, size_t* got);
+void free_block_run(int start, size_t len);
+
 bool block_is_free(int block_no);
+// Marks a free block taken without handing it out; for repairs.
+void claim_block(int block_no);
+// Copies the bitmap, a bit per block set when it is taken; the caller frees it.
+uint64_t* copy_bitmap(size_t* nwords);
 
 void read_data_block(int block_no, void* buf, size_t size);
+// Reads `n` whole blocks into consecutive BLOCK_SIZE slots of `bufs` with one batched submission.
+void read_data_blocks(const int* block_nos, size_t n, void* bufs);
 void write_data_block(int block_no, const void* data, size_t size);
+
+// Transfer `nbytes` over consecutive blocks starting at `start` with a single disk I/O.
+void read_data_run(int start, void* buf, size_t nbytes);
+void write_data_run(int start, const void* data, size_t nbytes);
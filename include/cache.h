@@ -0,0 +1,62 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Block cache itself is encapsulated.
+
+// Number of data blocks kept in memory by default.
+#define DEFAULT_CACHE_CAPACITY 64
+
+/*
+ * Write-back cache for data blocks with LRU eviction.
+ * Dirty blocks reach the disk through a journal commit or when
+ * `flush_cache_to_disk()` is called; until then only clean blocks
+ * are evicted. If every block is dirty, the cache grows past its
+ * capacity until the next commit, or, without a journal, writes
+ * the least recently used one back.
+ * Safe to use from several threads: blocks are spread over
+ * shards, each with its own lock and LRU list.
+ */
+
+// Capacity is measured in blocks; 0 disables caching.
+// Dirty blocks are written back before resizing.
+void set_cache_capacity(size_t nblocks);
+size_t cache_capacity();
+
+void cache_read_block(int block_no, void* buf, size_t size);
+void cache_write_block(int block_no, const void* data, size_t size);
+// Reads `n` whole blocks into consecutive BLOCK_SIZE slots of `bufs`; misses are read as one batch.
+void cache_read_blocks(const int* block_nos, size_t n, void* bufs);
+
+/*
+ * Keep the cache coherent with a transfer that went straight
+ * to disk over [start, start + nbytes) of consecutive blocks.
+ */
+// Caches `nblocks` blocks just read from disk, keeping any copy already cached: it may be newer.
+void cache_fill(int start, const void* data, size_t nblocks);
+// Copies the leading cached blocks into `buf`, up to the first one that is not. Returns the bytes.
+size_t cache_read_hits(int start, void* buf, size_t nbytes);
+// Copies cached blocks over `buf`, since they may be newer than the disk.
+void cache_overlay(int start, void* buf, size_t nbytes);
+// Refreshes cached copies with what was just written.
+void cache_update(int start, const void* data, size_t nbytes);
+
+/*
+ * Drops the cached copies of blocks that are being freed, without
+ * writing them back. Otherwise a stale dirty copy could be evicted
+ * on top of whatever the block is reused for.
+ */
+void cache_discard(int start, size_t nblocks);
+
+// Writes all dirty blocks to disk. Returns false if any write failed.
+// Once the journal is loaded, this commits it instead.
+bool flush_cache_to_disk();
+// Adds every dirty block to the journal transaction being committed.
+void flush_cache_to_journal();
+// Called once that transaction is durable; marks every block clean.
+void cache_committed();
+// Dirty blocks the next commit will log.
+size_t cache_dirty_blocks();
+// Drops every cached block, dirty or not. Call `flush_cache_to_disk()` first to keep the changes.
+void invalidate_cache();
@@ -0,0 +1,30 @@
+#pragma once
+
+#include <stddef.h>
+
+// Dentry cache itself is encapsulated.
+
+// Number of (parent, name) entries kept by default.
+#define DEFAULT_DCACHE_CAPACITY 1024
+
+/*
+ * Caches the result of looking a name up in a directory, keyed by
+ * (parent inode, name). Negative entries remember names that don't
+ * exist. Entries are evicted in LRU order.
+ */
+
+// 0 disables the cache. Resizing drops all entries.
+void set_dcache_capacity(size_t nentries);
+size_t dcache_capacity();
+
+/*
+ * Returns 1 and sets `inode_no` if `name` is cached as present,
+ * 0 if it is cached as absent, and -1 if it isn't cached.
+ */
+int dcache_lookup(int parent_inode_no, const char* name, int* inode_no);
+// `inode_no` of -1 records a negative entry.
+void dcache_insert(int parent_inode_no, const char* name, int inode_no);
+void dcache_remove(int parent_inode_no, const char* name);
+// Drops every entry of a directory; its inode number may be reused.
+void dcache_remove_children(int parent_inode_no);
+void invalidate_dcache();
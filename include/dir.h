@@ -1,13 +1,47 @@
 #pragma once
 
+#include <stdint.h>
+
 #include "fs.h"
 #include "on-disk/dirent.h"
+#include "on-disk/inode.h"
 
 #define DIRENTS_PER_BLOCK (BLOCK_SIZE / sizeof(DirectoryEntry))
+// Most blocks a linear directory may use; past that it is converted to the hashed index.
+#define LINEAR_DIR_MAX_BLOCKS 4
+#define DX_ENTRIES_PER_BLOCK ((BLOCK_SIZE - sizeof(DxHeader)) / sizeof(DxEntry))
+
+/*
+ * Small directories are a dense array of entries, scanned linearly.
+ * Larger ones are hashed: lookups, inserts and removals read the
+ * index root, at most one interior index block, and one leaf.
+ * Each call below takes the directory's inode lock itself.
+ */
+
+// Finds `name` in a directory. Returns 0 and sets `inode_no` if found, -1 otherwise.
+int lookup_dirent(int dir_inode_no, const char* name, int* inode_no);
 
 /*
  * Add a DirectoryEntry for a newly created
  * Inode (to the parent directory's data block.)
+ * Returns 0 on success, -1 on failure or if the name is taken.
+ */
+int add_dirent(int parent_inode_no, DirectoryEntry dirent);
+// Returns 0 on success, -1 if there is no such entry.
+int remove_dirent(int parent_inode_no, const char* name);
+
+/*
+ * Reads every entry of the directory `dir`, in no particular order,
+ * without taking its lock. Returns them as one array (the caller
+ * frees it) and sets `n`, or returns NULL if the directory is corrupt.
+ */
+DirectoryEntry* list_dirents(const Inode* dir, size_t* n);
+
+/*
+ * Copies up to `max` entries of a directory into `out`, starting at
+ * `*cookie` (0 for the first entry), and advances `*cookie` past them.
+ * Entries come in hash order; one present for the whole walk is returned
+ * exactly once, unless a name with the same hash is added meanwhile.
+ * Returns the count, 0 once the directory is exhausted, or -1.
  */
-void add_dirent(int parent_inode_no, DirectoryEntry dirent);
-void remove_dirent(int inode);
+long readdir_dirents(int dir_inode_no, uint64_t* cookie, DirectoryEntry* out, size_t max);
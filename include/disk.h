@@ -3,9 +3,30 @@
 #include <stdbool.h>
 #include <stddef.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 // Disk itself is encapsulated.
 
+typedef enum DISK_MODES {
+    DISK_MODE_PREAD,  // Positional pread/pwrite on a raw file descriptor (default).
+    DISK_MODE_MMAP,   // The whole image is mapped; I/O is a `memcpy` into the mapping.
+    DISK_MODE_URING,  // Batches go through io_uring; falls back to DISK_MODE_PREAD if unavailable.
+} DiskMode;
+
+typedef enum DISK_IO_OPS { DISK_IO_READ, DISK_IO_WRITE } DiskIoOp;
+
+typedef struct {
+    DiskIoOp op;
+    const struct iovec* iov;
+    int iovcnt;
+    off_t offset;
+    size_t result;  // Bytes transferred; set by `submit_disk_io`.
+} DiskIoReq;
+
+// Selects the I/O mode for the next `mount_fs`/`create_disk_fs`.
+void set_disk_mode(DiskMode mode);
+DiskMode disk_mode();
+
 int mount_fs(const char* disk_img_fn);
 void unmount_fs();
 int create_disk_fs(const char* disk_img_fn, size_t size);
@@ -18,16 +39,39 @@ bool disk_is_mounted();
 // Throws an error if the requirement is not met.
 void require_disk_is_mounted();
 
-//! Requires an offset.
+/*
+ * All I/O is positional; there is no current position to seek.
+ * These are safe to call from several threads at once.
+ */
+
+// Return the number of items transferred.
 size_t read_from_disk_at(void* buf, size_t size, size_t count, off_t offset);
 size_t write_to_disk_at(const void* buf, size_t size, size_t count, off_t offset);
 
-//! Uses current position.
-size_t read_from_disk(void* buf, size_t size, size_t count);
-size_t write_to_disk(const void* buf, size_t size, size_t count);
+// Scatter/gather versions. Return the number of bytes transferred.
+size_t readv_from_disk_at(const struct iovec* iov, int iovcnt, off_t offset);
+size_t writev_to_disk_at(const struct iovec* iov, int iovcnt, off_t offset);
+
+/*
+ * Issues a batch of independent requests and waits for all of them.
+ * With DISK_MODE_URING the batch costs a single submission.
+ * Returns the number of requests that transferred every byte.
+ */
+size_t submit_disk_io(DiskIoReq* reqs, size_t n);
+
+/*
+ * Between `plug_disk` and `unplug_disk`, writes made by the calling
+ * thread are held back and submitted together when the outermost
+ * plug is released (or before an overlapping read). Calls nest.
+ */
+void plug_disk();
+void unplug_disk();
 
-// A wrap function over the system call. Use it to ensure disk is not corrupt.
-int diskseek(off_t offset, int whence);
+// Bounds check for a byte range. Use it to ensure disk is not corrupt.
+bool check_disk_range(off_t offset, size_t nbytes);
 
+// Writes back everything held in memory, then syncs.
 bool flush_disk();
+// Waits until every write issued so far is durable; nothing held in memory is written back.
+bool sync_disk();
 bool disk_error_occurred();
@@ -0,0 +1,43 @@
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "fs.h"
+#include "on-disk/inode.h"
+
+#define EXTENTS_PER_BLOCK ((BLOCK_SIZE - sizeof(ExtentBlockHeader)) / sizeof(Extent))
+// Most runs a single file can be made of.
+#define MAX_EXTENTS (INODE_EXTENTS + EXTENTS_PER_BLOCK)
+
+// A file that keeps its data inline maps no blocks; `extent_free_all` drops that data.
+
+// Number of data blocks mapped by the inode.
+size_t inode_num_blocks(const Inode* inode);
+
+// Maps the `logical`-th block of the file to its block number. Returns -1 if it is not mapped.
+int extent_map_block(const Inode* inode, size_t logical);
+
+// Allocates room for MAX_EXTENTS runs, to pass to `extent_list`; release it with `free`.
+Extent* alloc_extent_list(void);
+// Copies every run of the file into `out` (room for MAX_EXTENTS). Returns the number of runs.
+size_t extent_list(const Inode* inode, Extent* out);
+
+/*
+ * Appends blocks [start, start + len) to the end of the file,
+ * merging with the last run when they are contiguous.
+ * Returns 0 on success, -1 if the file has no room for another run.
+ */
+int extent_append(Inode* inode, uint32_t start, uint32_t len);
+
+/*
+ * Makes `extents` the file's runs, as they are: the blocks they stop
+ * mapping are not freed. Returns 0, or -1 if they don't fit.
+ */
+int extent_replace(Inode* inode, const Extent* extents, size_t n);
+
+//! Changes only apply in-memory. Caller must flush for changes to persist.
+// Frees all data blocks and the extent block, leaving the inode with no blocks.
+void extent_free_all(Inode* inode);
+// Frees every data block past the first `nblocks`, and the extent block once it is not needed.
+void extent_truncate(Inode* inode, size_t nblocks);
@@ -0,0 +1,81 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+
+#include "on-disk/inode.h"
+
+// The open file table itself is encapsulated.
+
+// Descriptors handed out by `open_fs` range over [0, MAX_OPEN_FILES).
+#define MAX_OPEN_FILES 1024
+
+// Caps on the bytes written through descriptors that are held in memory, per file and in all.
+#define MAX_DELAYED_FILE_BYTES (1 << 20)
+#define MAX_DELAYED_BYTES (16 << 20)
+
+/*
+ * Byte-range I/O on a file's data. The caller holds the inode's lock
+ * (exclusive for the calls that change it) and writes the inode back.
+ * Whole blocks go straight to disk; a partial block is read first
+ * only if it holds file bytes that the write does not cover.
+ * Files of up to INODE_INLINE_SIZE bytes keep them in the inode and
+ * move to data blocks once they grow past it; shrinking moves them back.
+ *
+ * Writes past the end of a file may be delayed: the bytes are held in
+ * memory and get blocks only when they are flushed, all in one run.
+ * `inode.size` counts only the bytes on disk, so a commit never makes
+ * a size durable without its data; `file_size` counts both.
+ */
+// Reads up to `nbytes` from `offset`, stopping at the end of the file. Returns the bytes read.
+size_t file_read(int inode_no, const Inode* inode, size_t offset, void* buf, size_t nbytes);
+/*
+ * Writes `nbytes` of `data` at `offset`, allocating blocks as needed;
+ * a gap between the old end of the file and `offset` reads as zeros.
+ * Returns 0 on success, or -1 with the file unchanged if it can't grow.
+ */
+int file_write(int inode_no, Inode* inode, size_t offset, const void* data, size_t nbytes);
+// Like `file_write`, but holds bytes past the end of the file in memory. Returns 0 or -1.
+int file_write_delayed(int inode_no, Inode* inode, size_t offset, const void* data, size_t nbytes);
+// Writes out the bytes held for the file, growing `inode->size`. Returns 0 or -1.
+int file_flush(int inode_no, Inode* inode);
+// The file's size, counting the bytes held in memory.
+size_t file_size(int inode_no, const Inode* inode);
+// Shrinks the file, freeing the blocks past `size`, or zero-extends it. Returns 0 or -1.
+int file_truncate(int inode_no, Inode* inode, size_t size);
+/*
+ * Replaces the file's contents with `nbytes` of `data`. With compression
+ * on, a file of up to MAX_EXTENTS chunks of COMPRESS_CHUNK_BYTES is
+ * stored with each chunk compressed if that saves enough; if none does,
+ * it is stored raw. Reads and writes of a compressed file touch only
+ * the chunks in their range; writes rewrite them, and one that would
+ * make too many chunks rewrites the whole file raw first.
+ * Returns 0 on success, or -1.
+ */
+int file_replace(int inode_no, Inode* inode, const void* data, size_t nbytes);
+// Off by default; applies to later `file_replace` calls. Files stored either way stay readable.
+void set_file_compression(bool on);
+bool file_compression();
+// Forgets the bytes held for a file that is being deleted or rewritten.
+void file_drop_delayed(int inode_no);
+// Flushes every file, each under its own journal handle. Returns false if one failed.
+bool flush_delayed_files();
+// Forgets everything held; called on unmount, after `flush_delayed_files`.
+void free_delayed_files();
+
+// Returns the lowest free descriptor, now referring to `inode_no`, or -1 if all are taken.
+int open_file(int inode_no);
+// Returns 0, or -1 if `fd` is not open.
+int close_file(int fd);
+// Sets `inode_no` to the inode `fd` was opened on. Returns 0, or -1 if it is not open.
+int file_inode(int fd, int* inode_no);
+/*
+ * Called after a read of `nbytes` at `offset` through `fd`. Reads
+ * that pick up where the last one ended grow a readahead window that
+ * is prefetched in the background; any other read collapses it.
+ */
+void file_readahead(int fd, const Inode* inode, size_t offset, size_t nbytes);
+// Whether any descriptor refers to `inode_no`; such an inode can't be deleted.
+bool inode_is_open(int inode_no);
+// Forgets every descriptor; called on unmount.
+void close_all_files();
@@ -3,25 +3,61 @@
 #include <stdbool.h>
 #include <stdio.h>
 
+#include <stdint.h>
+
 #include "on-disk/dirent.h"
+#include "super.h"
 
-// Filesystem layout constants (compile-time configuration)
+// Filesystem layout of the mounted disk, read from its SuperBlock.
 // Shared across modules (allocator, inode, dir).
-// If you later add dynamic sizing, replace these with getters.
-#define BLOCK_SIZE 1024
-#define NUM_BLOCKS 1024
-#define DISK_SIZE (BLOCK_SIZE * NUM_BLOCKS)  // 1MB
-#define BITMAP_START 1
-#define INODE_START 2
-#define DATA_START 11
-#define MAX_INODES 128
+// Only valid while a disk is mounted.
+#define BLOCK_SIZE get_block_size()
+#define NUM_BLOCKS get_num_blocks()
+#define DISK_SIZE ((size_t)BLOCK_SIZE * NUM_BLOCKS)
+#define BITMAP_START get_bitmap_start()
+#define INODE_START get_inode_start()
+#define DATA_START get_data_start()
+#define MAX_INODES get_max_inodes()
+#define JOURNAL_START get_journal_start()
+#define JOURNAL_BLOCKS get_journal_blocks()
+
+#define MIN_BLOCK_SIZE 512
+#define MAX_BLOCK_SIZE 65536
+// Header plus room for a few small transactions.
+#define MIN_JOURNAL_BLOCKS 8
+
+/*
+ * Geometry chosen at format time. The region starts
+ * are derived from it and recorded in the SuperBlock.
+ */
+typedef struct {
+    uint32_t block_size;  // Power of two in [MIN_BLOCK_SIZE, MAX_BLOCK_SIZE].
+    uint32_t num_blocks;
+    uint32_t max_inodes;
+    uint32_t journal_blocks;  // 0 picks a size from `num_blocks`.
+} FsGeometry;
+
+// 1 MiB disk of 1 KiB blocks.
+#define DEFAULT_BLOCK_SIZE 1024
+#define DEFAULT_NUM_BLOCKS 1024
+#define DEFAULT_MAX_INODES 128
+// Unless the geometry says otherwise, 1/32 of the disk within these bounds.
+#define DEFAULT_JOURNAL_FRACTION 32
+#define MAX_DEFAULT_JOURNAL_BLOCKS 4096
 
 /*
  * Used by read/write functions since `disk`
  * will be opened once by `mount_fs` and later
  * closed by `unmount_fs`
+ *
+ * The calls below may be made from several threads at once; operations
+ * on different files, and lookups in the same directory, run in parallel.
+ * `mkfs`, `mount_fs`, `unmount_fs` and the `set_*` configuration calls
+ * must not overlap with any other call.
  */
 void mkfs(const char* disk_img_fn);  // make filesystem (formats the disk).
+// Formats the disk with the given geometry. Returns 0 on success, -1 if it is invalid.
+int mkfs_with_geometry(const char* disk_img_fn, const FsGeometry* geometry);
 int mkdir_fs(const char* path);
 int mkfile_fs(const char* path);
 int create_fs(const char* path, bool is_dir);
@@ -29,4 +65,73 @@ int read_fs(const char* path, char* buf, size_t bufsize);
 int write_fs(const char* path, const char* data);
 int delete_fs(const char* path);
 int rmdir_fs(const char* path);
+// Lists the first `max_entries` entries of the directory at `path`. Returns their count, or -1.
 int ls_fs(const char* path, DirectoryEntry* entries, size_t max_entries);
+
+// Flag for `readdir_fs`.
+#define READDIR_FS_PLUS 0x1  // Also fill in each entry's type and size.
+
+typedef struct {
+    DirectoryEntry dirent;
+    // Filled with READDIR_FS_PLUS, otherwise false and 0.
+    bool is_dir;
+    size_t size;  // Bytes in a file, entries in a directory.
+} ReaddirEntry;
+
+/*
+ * Lists a directory in batches. Start with `*cookie` at 0 and call
+ * again with the cookie it was left at to get the next `max_entries`
+ * entries; 0 is returned once they are all listed. A batch reads only
+ * the directory blocks its entries are in (plus an indexed directory's
+ * index), so a whole listing costs O(entries), and READDIR_FS_PLUS
+ * takes type and size from the in-memory inode table, saving a stat
+ * per entry. Returns the number of entries filled, or -1.
+ */
+int readdir_fs(
+    const char* path, uint64_t* cookie, ReaddirEntry* entries, size_t max_entries, int flags);
+
+// Flags for `open_fs`.
+#define OPEN_FS_CREATE 0x1  // Create the file if it does not exist.
+#define OPEN_FS_TRUNC 0x2   // Empty the file.
+
+/*
+ * File handles. `open_fs` resolves the path once and returns a
+ * descriptor for the calls below, so many small reads and writes
+ * of one file don't walk the path each time. There is no file
+ * position; offsets are explicit. Writing past the end grows the
+ * file, and a gap left before the written bytes reads as zeros.
+ * `pwrite_fs`, `append_fs` and `truncate_fs` return before their
+ * changes are durable; `fsync_fs` waits for them (and for every
+ * other change made so far), and so does `unmount_fs`. An open
+ * file can't be deleted.
+ * `open_fs` returns a descriptor, the I/O calls the bytes moved,
+ * and the rest 0; all of them return -1 on failure.
+ */
+int open_fs(const char* path, int flags);
+int close_fs(int fd);
+int pread_fs(int fd, char* buf, size_t nbytes, size_t offset);
+int pwrite_fs(int fd, const char* data, size_t nbytes, size_t offset);
+int append_fs(int fd, const char* data, size_t nbytes);
+// Sets the file's size, freeing the blocks past it or zero-filling up to it.
+int truncate_fs(int fd, size_t size);
+int fsync_fs(int fd);
+
+/*
+ * Groups the calls the calling thread makes until `commit_batch_fs`
+ * into a single journal transaction: every inode-table, bitmap and
+ * directory block they touch is written once, with one sync. Inside
+ * a batch, calls return before their changes are durable, and other
+ * threads' calls wait for the batch to commit before they return;
+ * `fsync_fs` gives the file its blocks but leaves the rest to the
+ * commit.
+ * Batches nest; only the outermost commit writes anything.
+ *
+ * A batch is atomic only while its changes fit in half the journal.
+ * Past that, the calls made so far are committed before the next
+ * one starts, and the batch goes on in a new transaction: after a
+ * crash, a prefix of its calls may have taken effect, but never
+ * part of a call.
+ * `commit_batch_fs` returns 0 on success, -1 if the commit failed.
+ */
+void begin_batch_fs();
+int commit_batch_fs();
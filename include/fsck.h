@@ -0,0 +1,41 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdio.h>
+
+// The checker's state itself is encapsulated.
+
+typedef struct {
+    // Worker threads for the scans; 0 means one per online CPU.
+    size_t nthreads;
+    // Fix what can be fixed; otherwise the image is only read (after journal replay).
+    bool repair;
+    // Each problem found is described here, a line each; NULL keeps quiet.
+    FILE* out;
+} FsckOptions;
+
+typedef struct {
+    size_t inodes;  // Valid inodes.
+    size_t dirs;
+    size_t blocks;  // Data blocks referenced by inodes.
+    size_t problems;
+    size_t repaired;
+} FsckReport;
+
+/*
+ * Checks the image at `disk_img_fn`, which must not be mounted:
+ * the bitmap against the blocks the inodes reference, directory
+ * entries against valid inodes, and each inode's size against
+ * its blocks and entries. The inode table, then the directories,
+ * then the bitmap are scanned by `nthreads` threads at once.
+ *
+ * With `repair`, stray bitmap bits are fixed, entries naming a
+ * missing inode are removed, sizes are corrected and inodes no
+ * entry names are linked into /lost+found. Blocks claimed twice,
+ * extents out of range and unreadable directories are only reported.
+ *
+ * Returns the number of problems left unrepaired, or -1 if the
+ * image could not be mounted. Fills `report` if it is not NULL.
+ */
+int fsck_fs(const char* disk_img_fn, const FsckOptions* opts, FsckReport* report);
@@ -9,27 +9,75 @@
 // TODO: implement permissions.
 #define IS_VALID_FLAG 0x01  // 0b00000001
 #define IS_DIR_FLAG 0x02    // 0b00000010
+#define IS_INDEXED_FLAG 0x04  // 0b00000100; directory uses the hashed index.
+#define IS_INLINE_FLAG 0x08   // 0b00001000; file contents live in `inline_data`.
+#define IS_COMPRESSED_FLAG 0x10  // 0b00010000; each extent holds one chunk, maybe LZ-compressed.
 
-#define MAX_INODE_DATA_BLOCKS 4
-
+// The inode table is kept in memory; these move it to and from the disk.
 void init_inode_table();
+int load_inode_table_from_disk();
+// Writes back only the table blocks that changed. Returns false if a write failed.
+// Once the journal is loaded, this commits it instead.
+bool flush_inode_table_to_disk();
+// Adds the changed table blocks to the journal transaction being committed.
+void flush_inode_table_to_journal();
+// Called once that transaction is durable.
+void inode_table_committed();
+// Table blocks the next commit will log.
+size_t inode_table_dirty_blocks();
+void free_inode_table();
+
 int alloc_inode();
 void free_inode(int inode_no);
 size_t read_inode(int inode_no, Inode* inode);
 size_t write_inode(int inode_no, Inode inode);
 
-static bool inode_is_valid(Inode inode) {
+/*
+ * Per-inode reader/writer locks. `read_inode` and `write_inode` are
+ * atomic on their own; hold one of these across a read-modify-write
+ * of the inode or its blocks. A lock on a directory may be taken
+ * while holding one on an entry below it, never the other way round.
+ */
+void inode_rdlock(int inode_no);
+void inode_wrlock(int inode_no);
+void inode_unlock(int inode_no);
+
+static inline bool inode_is_valid(Inode inode) {
     return inode.f & IS_VALID_FLAG;
 }
-static bool inode_is_dir(Inode inode) {
+static inline bool inode_is_dir(Inode inode) {
     return inode.f & IS_DIR_FLAG;
 }
-static void inode_set_valid(Inode* inode) {
+static inline void inode_set_valid(Inode* inode) {
     inode->f |= IS_VALID_FLAG;
 }
-static void inode_set_invalid(Inode* inode) {
+static inline void inode_set_invalid(Inode* inode) {
     inode->f &= ~IS_VALID_FLAG;
 }
-static void inode_set_dir(Inode* inode) {
+static inline void inode_set_dir(Inode* inode) {
     inode->f |= IS_DIR_FLAG;
 }
+static inline bool inode_is_indexed(Inode inode) {
+    return inode.f & IS_INDEXED_FLAG;
+}
+static inline void inode_set_indexed(Inode* inode) {
+    inode->f |= IS_INDEXED_FLAG;
+}
+static inline bool inode_is_inline(Inode inode) {
+    return inode.f & IS_INLINE_FLAG;
+}
+static inline void inode_set_inline(Inode* inode) {
+    inode->f |= IS_INLINE_FLAG;
+}
+static inline void inode_clear_inline(Inode* inode) {
+    inode->f &= ~IS_INLINE_FLAG;
+}
+static inline bool inode_is_compressed(Inode inode) {
+    return inode.f & IS_COMPRESSED_FLAG;
+}
+static inline void inode_set_compressed(Inode* inode) {
+    inode->f |= IS_COMPRESSED_FLAG;
+}
+static inline void inode_clear_compressed(Inode* inode) {
+    inode->f &= ~IS_COMPRESSED_FLAG;
+}
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+// Journal itself is encapsulated.
+
+/*
+ * Metadata (bitmap, inode table, and the directory and extent
+ * blocks held by the block cache) reaches its home blocks only
+ * through the journal: a commit writes every changed block to the
+ * journal region, syncs once, and only then writes them in place.
+ * `mount_fs` replays the transactions a crash cut short. File data
+ * is written in place before the commit that links it.
+ *
+ * Operations run as handles between `journal_begin` and `journal_end`.
+ * `journal_end` waits for a commit; handles that end together share
+ * it, so concurrent operations cost a single sync (group commit).
+ * With the block cache disabled, directory and extent blocks are
+ * written in place and are not journaled.
+ *
+ * A transaction that would not fit the log is not written at all:
+ * its commit fails and its blocks stay dirty in memory. New handles
+ * wait for a commit whenever the running transaction takes up half
+ * the log, so only a single operation larger than that can fail so.
+ */
+
+// Starts an empty journal on a freshly formatted disk.
+void init_journal();
+// Replays committed transactions and starts an empty log. Returns 0 on success, -1 on failure.
+int load_journal_from_disk();
+void free_journal();
+bool journal_is_loaded();
+
+// Handles nest; only the outermost pair counts.
+void journal_begin();
+// Returns once the handle's changes are durable, or false if their commit failed.
+bool journal_end();
+// Ends the handle without waiting; its changes go out with the next commit.
+void journal_end_nowait();
+// Whether the calling thread holds a handle, such as a batch.
+bool journal_in_handle();
+/*
+ * A batch is a handle held across several operations, so that they
+ * share one commit. A transaction is committed before it outgrows
+ * half the log; if a batch gets that large, its operations so far
+ * are committed at the start of the next one, and the batch goes on
+ * in a new transaction. A batch is atomic only while it fits, but
+ * each operation always is. Must not be begun inside another handle
+ * unless that is a batch too.
+ */
+void journal_begin_batch();
+// Returns once the batch's changes are durable, or false if their commit failed.
+bool journal_end_batch();
+// Commits everything changed so far. Must not be called from inside a handle.
+bool journal_commit();
+// Commits, then empties the log so that nothing is replayed at the next mount.
+bool checkpoint_journal();
+
+// Used by the metadata modules while a commit collects their
+// changed blocks: adds the image of `block_no` (zero-padded).
+void journal_add_block(uint32_t block_no, const void* data, size_t size);
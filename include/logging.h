@@ -6,10 +6,45 @@
 // Default configuration.
 #define LOGFILENAME ".log"
 #define LOGMODE O_WRONLY | O_APPEND | O_CREAT
+// How often buffered log lines are synced to disk. ERROR lines are synced right away.
+#define DEFAULT_LOG_FSYNC_INTERVAL_MS 1000
 
 typedef enum LOGTYPES { ERROR_LOG, WARN_LOG, INFO_LOG } Logtype;
 
+/*
+ * Messages less severe than this are compiled out.
+ * Release builds (NDEBUG) drop INFO; override with -DLOG_COMPILE_LEVEL=...
+ */
+#ifndef LOG_COMPILE_LEVEL
+#ifdef NDEBUG
+#define LOG_COMPILE_LEVEL WARN_LOG
+#else
+#define LOG_COMPILE_LEVEL INFO_LOG
+#endif
+#endif
+
+/*
+ * `logMsg` only formats the message into a lock-free ring buffer;
+ * a background thread started by `init_logs` timestamps it, writes
+ * it out and syncs the file. `end_logs` (or exit) drains the ring.
+ */
 void init_logs(const char* filename, int mode);
 void end_logs();
-void logMsg(Logtype log_type, const char* fmt, ...);
+/*
+ * A compiled-out level leaves the call in a branch that is never
+ * taken, so its arguments are still type-checked and count as used.
+ */
+#define logMsg(log_type, ...)                    \
+    do {                                         \
+        if ((log_type) <= LOG_COMPILE_LEVEL) {   \
+            _logMsg((log_type), __VA_ARGS__);    \
+        }                                        \
+    } while (0)
 void set_print_logs(bool toggle);
+// Messages less severe than `level` are dropped before they are formatted.
+void set_log_level(Logtype level);
+// 0 syncs only on ERROR and when logging ends.
+void set_log_fsync_interval(unsigned ms);
+
+// ! Use `logMsg`, which drops compiled-out levels before the call.
+void _logMsg(Logtype log_type, const char* fmt, ...);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stddef.h>
+
+/*
+ * A small LZ77 codec in the LZ4 block format: each sequence is a
+ * token byte (literal count, match length), its literals, then a
+ * two-byte offset back into the output. As LZ4 requires, the last
+ * five bytes are always literals and no match starts in the last
+ * twelve, so any LZ4 decoder reads what `lz_compress` writes; the
+ * decoder here is more lenient. No entropy coding, so both
+ * directions run at memory speed; it pays on repetitive data such
+ * as text. The format is part of the on-disk layout of compressed
+ * files, so it must never change.
+ */
+
+/*
+ * Compresses `n` bytes of `src` into `dst`, which has room for `cap`.
+ * Returns the compressed size, or 0 if it would not fit in `cap`.
+ */
+size_t lz_compress(const void* src, size_t n, void* dst, size_t cap);
+// Decompresses `n` bytes of `src` into `dst`, which has room for `cap`. Returns the size, or -1.
+long lz_decompress(const void* src, size_t n, void* dst, size_t cap);
@@ -1,5 +1,7 @@
 #pragma once
 
+#include <stdint.h>
+
 #define MAX_DIRNAME_LEN 27
 
 /*
@@ -11,3 +13,30 @@ typedef struct {
     int inode_number;
     char name[MAX_DIRNAME_LEN + 1];  // 27 ASCII chars + null terminator.
 } DirectoryEntry;
+
+/*
+ * Large directories are indexed by name hash. Their first block
+ * is the index root; it and any interior index blocks hold this
+ * header followed by `count` DxEntry records sorted by hash.
+ * All other blocks are leaves: arrays of DirectoryEntry where a
+ * slot with an empty name is free.
+ */
+#define DX_MAGIC 0xD1D1D1D1u
+
+typedef struct {
+    uint32_t magic;  // DX_MAGIC; never a valid inode number.
+    uint8_t levels;  // Interior index levels below the root (0 or 1).
+    uint8_t reserved[3];
+    uint32_t count;  // Entries in use.
+    uint32_t reserved2;
+} DxHeader;
+
+/*
+ * Names hashing to at least `hash` (and below the next
+ * entry's hash) live under the `block`-th directory block.
+ * The first entry's hash is ignored.
+ */
+typedef struct {
+    uint32_t hash;
+    uint32_t block;  // Logical block within the directory.
+} DxEntry;
@@ -3,6 +3,27 @@
 #include <stddef.h>
 #include <stdint.h>
 
+// Number of extents stored in the inode itself.
+#define INODE_EXTENTS 4
+// Bytes of one inode record; a power of two, so no record straddles two blocks.
+#define INODE_SIZE 128
+// Most bytes a file can keep in its inode instead of data blocks.
+#define INODE_INLINE_SIZE (INODE_SIZE - 16)
+// Bytes of a compressed file held by each of its extents; the last one may hold fewer.
+#define COMPRESS_CHUNK_BYTES (64 << 10)
+
+/*
+ * A run of `len` consecutive data blocks,
+ * starting at block `start`. In a compressed
+ * file, each run holds one chunk: raw if
+ * `csize` is 0, else as `csize` bytes of LZ data.
+ */
+typedef struct {
+    uint32_t start;
+    uint32_t len;
+    uint32_t csize;
+} Extent;
+
 /*
  * Stores metadata for file entries,
  * except doesn't store names. All Inodes
@@ -12,7 +33,26 @@
 typedef struct {
     uint8_t f;    // InodeFlags.
     size_t size;  // bytes (file) or entry count (directory)
-    // Stores indices of the data blocks on the
-    // disk where the file's contents are located.
-    int data_blocks[4];
+    union {
+        struct {
+            // Runs of data blocks holding the file's contents, in file order.
+            // The first INODE_EXTENTS runs live here; the rest spill into `extent_block`.
+            uint32_t nextents;
+            Extent extents[INODE_EXTENTS];
+            uint32_t extent_block;  // 0 when nothing has spilled.
+        };
+        // Contents of a small file, when IS_INLINE_FLAG is set; it has no data blocks then.
+        uint8_t inline_data[INODE_INLINE_SIZE];
+    };
 } Inode;
+
+_Static_assert(sizeof(Inode) == INODE_SIZE, "on-disk inode record size");
+
+/*
+ * Layout of an extent block: this header,
+ * followed by `count` extents.
+ */
+typedef struct {
+    uint32_t count;
+    uint32_t reserved;
+} ExtentBlockHeader;
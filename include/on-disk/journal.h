@@ -0,0 +1,48 @@
+#pragma once
+
+#include <stdint.h>
+
+#define JOURNAL_MAGIC 0x4A524E4C  // "JRNL"
+
+typedef enum JOURNAL_BLOCK_TYPES {
+    JOURNAL_HEADER = 1,
+    JOURNAL_DESCRIPTOR = 2,
+    JOURNAL_COMMIT = 3,
+} JournalBlockType;
+
+/*
+ * The journal is a redo log of whole metadata blocks. Its first
+ * block is a header; transactions follow it back to back:
+ *   descriptor, the images it lists, [descriptor, images, ...], commit.
+ * Descriptor and commit blocks carry the transaction's sequence
+ * number, so leftovers of an older round are never mistaken for
+ * them. Images are raw block contents; the commit's checksum covers
+ * them, so an image left over from an older round fails it.
+ */
+typedef struct {
+    uint32_t magic;
+    uint32_t type;  // JournalBlockType.
+    uint64_t seq;
+} JournalBlockHeader;
+
+// `seq` is the transaction expected right after the header.
+typedef struct {
+    JournalBlockHeader h;
+} JournalHeader;
+
+/*
+ * Followed by `count` block numbers: where each of the
+ * `count` images after this block belongs on disk.
+ */
+typedef struct {
+    JournalBlockHeader h;
+    uint32_t count;
+    uint32_t reserved;
+} JournalDescriptor;
+
+// A transaction counts only if its commit block is intact.
+typedef struct {
+    JournalBlockHeader h;
+    uint32_t nblocks;   // Images in the transaction.
+    uint32_t checksum;  // CRC-32 of its descriptors and images, in log order.
+} JournalCommit;
@@ -2,7 +2,7 @@
 
 #include <stdint.h>
 
-#define MAGIC 0x20240604
+#define MAGIC 0x20261026
 
 /*
  * There is only one single SuperBlock.
@@ -17,4 +17,9 @@ typedef struct {
     uint32_t bitmap_start;  // block index of bitmap
     uint32_t inode_start;   // block index of inode table
     uint32_t data_start;    // block index of first data block
+    // The metadata journal sits between the inode table and the data blocks.
+    uint32_t journal_start;
+    uint32_t journal_blocks;
+    // Inode-table blocks ever written; the ones past it hold only free inodes and are not read.
+    uint32_t itable_hwm;
 } SuperBlock;
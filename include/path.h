@@ -1,7 +1,13 @@
 #pragma once
 
+#include <stdbool.h>
+
 // Sets `inode_num` to the last inode in the path.
 // Returns 0 on success, -1 on failure.
 int get_inode_no_from_path(const char* path, int* inode_num);
 
+// Like `get_inode_no_from_path`, but returns with the inode locked
+// (shared or exclusive); release it with `inode_unlock`.
+int lock_inode_from_path(const char* path, bool exclusive, int* inode_num);
+
 char* get_parent_path(const char* full_path);
@@ -0,0 +1,20 @@
+#pragma once
+
+#include <stddef.h>
+
+// Readahead itself is encapsulated.
+
+// Window of a reader that just turned sequential; it doubles with each sequential read.
+#define MIN_READAHEAD_BLOCKS 4
+// Largest window, further capped at a quarter of the block cache.
+#define MAX_READAHEAD_BLOCKS 64
+
+/*
+ * Queues a background read of blocks [first, first + count) of file
+ * `inode_no` into the block cache, where `read_data_run` finds them.
+ * The thread is started on first use; requests that find the queue
+ * full are dropped.
+ */
+void queue_readahead(int inode_no, size_t first, size_t count);
+// Drops queued requests, waits for the one in progress and stops the thread.
+void stop_readahead();
@@ -0,0 +1,103 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+// Stats itself is encapsulated.
+
+/*
+ * Runtime counters and per-operation latency histograms. Updates
+ * are relaxed atomic adds, so they are cheap and safe from any
+ * thread; a snapshot taken while other threads run may mix values
+ * from slightly different moments. Build with -DMINIFS_NO_STATS to
+ * compile every update out.
+ */
+
+typedef enum STAT_COUNTERS {
+    STAT_DISK_READS,        // Read requests that reached the disk engine.
+    STAT_DISK_READ_BYTES,
+    STAT_DISK_WRITES,
+    STAT_DISK_WRITE_BYTES,
+    STAT_DISK_SEEKS,        // Requests that did not start where the previous one ended.
+    STAT_DISK_SYNCS,        // fsync / msync calls.
+    STAT_CACHE_HITS,
+    STAT_CACHE_MISSES,
+    STAT_CACHE_EVICTIONS,
+    STAT_ALLOC_SCANS,       // Allocator searches for a free block or run.
+    STAT_BITMAP_WORDS,      // Bitmap words (any level) examined by those searches.
+    STAT_INODE_READS,       // Inode-table reads (`read_inode`).
+    STAT_INODE_WRITES,
+    STAT_DCACHE_HITS,
+    STAT_DCACHE_MISSES,
+    STAT_DIRENT_LOOKUPS,    // Lookups that had to scan a directory.
+    STAT_DIRENT_BLOCKS,     // Directory blocks those scans and listings read.
+    STAT_JOURNAL_COMMITS,
+    STAT_JOURNAL_BLOCKS,    // Block images logged by those commits.
+    STAT_READAHEAD_BLOCKS,  // Blocks the readahead thread asked the cache for.
+    STAT_DELAYED_FLUSHES,   // Delayed writes given their blocks.
+    STAT_COMPRESSED_BYTES_SAVED,  // File bytes that compression kept off the disk.
+    NUM_STAT_COUNTERS
+} StatCounter;
+
+// One latency histogram per public fs.h operation.
+typedef enum STAT_OPS {
+    STAT_OP_MKFS,
+    STAT_OP_MKDIR,
+    STAT_OP_MKFILE,
+    STAT_OP_CREATE,
+    STAT_OP_READ,
+    STAT_OP_WRITE,
+    STAT_OP_DELETE,
+    STAT_OP_RMDIR,
+    STAT_OP_LS,
+    STAT_OP_READDIR,
+    STAT_OP_BATCH_COMMIT,
+    STAT_OP_OPEN,
+    STAT_OP_PREAD,
+    STAT_OP_PWRITE,
+    STAT_OP_APPEND,
+    STAT_OP_TRUNCATE,
+    STAT_OP_FSYNC,
+    NUM_STAT_OPS
+} StatOp;
+
+// Bucket i counts latencies in [2^i, 2^(i+1)) ns; the last one takes everything above.
+#define STAT_HIST_BUCKETS 40
+
+typedef struct {
+    uint64_t count;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t buckets[STAT_HIST_BUCKETS];
+} StatHistogram;
+
+typedef struct {
+    uint64_t counters[NUM_STAT_COUNTERS];
+    StatHistogram ops[NUM_STAT_OPS];
+} MinifsStats;
+
+// Copies the current values into `out`.
+void minifs_stats(MinifsStats* out);
+void minifs_stats_reset();
+// Writes every non-zero counter and histogram summary to `out`, one per line.
+void minifs_stats_print(FILE* out);
+
+const char* stat_counter_name(StatCounter counter);
+const char* stat_op_name(StatOp op);
+// Upper bound (ns) of the bucket holding the `p`-th fraction of the samples, p in [0, 1].
+uint64_t stat_histogram_percentile(const StatHistogram* h, double p);
+
+// ! Used by the filesystem modules; use the macros below.
+void _stats_add(StatCounter counter, uint64_t n);
+uint64_t _stats_now_ns();
+void _stats_record_op(StatOp op, uint64_t start_ns);
+
+#ifdef MINIFS_NO_STATS
+#define STAT_ADD(counter, n) ((void)0)
+#define STAT_START() ((uint64_t)0)
+#define STAT_RECORD_OP(op, start_ns) ((void)(start_ns))
+#else
+#define STAT_ADD(counter, n) _stats_add((counter), (uint64_t)(n))
+#define STAT_START() _stats_now_ns()
+#define STAT_RECORD_OP(op, start_ns) _stats_record_op((op), (start_ns))
+#endif
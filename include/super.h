@@ -1,5 +1,8 @@
 #pragma once
 
+#include <stdbool.h>
+#include <stdint.h>
+
 #include "on-disk/super.h"
 
 // For now, use the on-disk type. Later, SuperConfig could be further extended to include version
@@ -9,14 +12,30 @@ typedef SuperBlock SuperConfig;
 void set_super(const SuperConfig* cfg);
 int load_super_from_disk();
 void flush_super_to_disk();
+// Adds the superblock, if it changed, to the journal transaction being committed.
+void flush_super_to_journal();
+// Called once that transaction is durable.
+void super_committed();
+// Forgets the loaded superblock; called on unmount.
+void unload_super();
 
 int validate_super(const SuperConfig* s);
 
-// // Getters.
-// const SuperBlock* get_super();
-// uint32_t get_block_size(void);
-// uint32_t get_num_blocks(void);
-// uint32_t get_max_inodes(void);
-// uint32_t get_bitmap_start(void);
-// uint32_t get_inode_start(void);
-// uint32_t get_data_start(void);
+bool super_is_loaded();
+
+/*
+ * Getters for the geometry of the mounted filesystem.
+ * They exit with an error if no superblock is loaded.
+ */
+const SuperBlock* get_super();
+uint32_t get_block_size(void);
+uint32_t get_num_blocks(void);
+uint32_t get_max_inodes(void);
+uint32_t get_bitmap_start(void);
+uint32_t get_inode_start(void);
+uint32_t get_data_start(void);
+uint32_t get_journal_start(void);
+uint32_t get_journal_blocks(void);
+uint32_t get_itable_hwm(void);
+// Raises the inode-table high-water mark; it reaches the disk with the next flush or commit.
+void set_itable_hwm(uint32_t nblocks);
@@ -0,0 +1,56 @@
+#pragma once
+
+#include <stddef.h>
+
+#include "fs.h"
+
+/*
+ * Recursive operations on a directory tree. Each resolves its path
+ * once, then works from inode numbers: directories are listed a
+ * directory block at a time and handed out, one task each, to
+ * `nthreads` workers (0 means one per online CPU) that steal from
+ * each other when they run dry. Metadata changes go into journal
+ * handles that don't wait, and are committed once at the end.
+ * Inside a batch (`begin_batch_fs`), they run on the calling thread
+ * alone, as part of the batch.
+ *
+ * The trees must not be changed by other calls while an operation
+ * runs over them; entries added or removed meanwhile may or may not
+ * be seen.
+ */
+
+/*
+ * Called once for every entry below the directory walked, from any
+ * worker, so it must be thread-safe. `path` is the entry's full path;
+ * `entry` has its type and size filled in. A nonzero return stops the
+ * walk, which then returns that value.
+ */
+typedef int (*TreeVisitor)(const char* path, const ReaddirEntry* entry, void* arg);
+
+typedef struct {
+    size_t files;
+    size_t dirs;    // Below the directory measured.
+    size_t bytes;   // File contents.
+    size_t blocks;  // Data blocks mapped by files and directories, the top one included.
+} TreeUsage;
+
+// Visits every entry below the directory at `path`. Returns 0, a visitor's return value, or -1.
+int walk_tree_fs(const char* path, TreeVisitor visit, void* arg, size_t nthreads);
+
+// Adds up what the tree under the directory at `path` uses. Returns 0 on success, -1 on failure.
+int du_tree_fs(const char* path, TreeUsage* usage, size_t nthreads);
+
+/*
+ * Deletes the directory at `path` and everything below it; the root
+ * directory is only emptied. Directories are removed once their last
+ * entry is. Open files, and the directories above them, are left in
+ * place. Returns 0 if everything was removed, -1 otherwise.
+ */
+int rm_tree_fs(const char* path, size_t nthreads);
+
+/*
+ * Copies the directory at `src` and everything below it to `dst`,
+ * which must not exist and must not be inside `src`. Returns 0 on
+ * success, or -1; a copy that fails part way is left as it got.
+ */
+int copy_tree_fs(const char* src, const char* dst, size_t nthreads);
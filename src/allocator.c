@@ -1,55 +1,310 @@
 #include "allocator.h"
 
+#include <pthread.h>
 #include <stddef.h>
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "cache.h"
 #include "disk.h"
 #include "err.h"
 #include "fs.h"
+#include "journal.h"
 #include "logging.h"
+#include "stats.h"
 
-#define BMP_SZ ((NUM_BLOCKS + 7) / 8)  // bitmap size
+#define BMP_SZ ((NUM_BLOCKS + 7) / 8)  // bitmap size (on disk)
 
-// TODO Consider new algorithms for alloc. O(n) might be too slow.
+/*
+ * In memory, the bitmap is kept as 64-bit words (bit set = block taken)
+ * with two summary levels above it:
+ *   l1 - bit w is set if word w has at least one free block;
+ *   l2 - bit s is set if l1 word s has at least one bit set.
+ * A free block is then found with a few count-trailing-zeros
+ * operations instead of a bit-by-bit scan. Blocks outside
+ * [DATA_START, NUM_BLOCKS) are permanently marked taken.
+ */
+#define WORD_BITS 64
+#define WORDS_FOR(nbits) (((nbits) + WORD_BITS - 1) / WORD_BITS)
 
 //! All bitmap functions here only modify the bitmap array.
-//! Changes do not apply to disk, until `write_bitmap_to_disk()` is called.
+//! Changes do not apply to disk, until `flush_bitmap_to_disk()` is called
+//! or a journal commit collects them (`flush_bitmap_to_journal()`).
+//! While the journal is loaded, freed blocks stay taken in memory until
+//! the commit that frees them is durable, so they cannot be reused by
+//! data written before it.
+//! Allocation, freeing and queries are serialized by `bmp.lock`;
+//! loading and clearing happen only at mount and mkfs time.
 
 // --------------- LOCAL ---------------
 
 typedef enum BLOCK_STATES { BLOCK_FREE = 0, BLOCK_TAKEN = 1 } BlockState;
 
 typedef struct {
-    uint8_t* arr;
+    uint64_t* l0;
+    uint64_t* l1;
+    uint64_t* l2;
+    // Word counts of each level, sized for the mounted disk.
+    size_t nwords_l0, nwords_l1, nwords_l2;
+    // Next-fit: searches start where the previous allocation ended.
+    size_t hint;
     bool is_loaded;
+    bool is_dirty;
+    // One flag per on-disk bitmap block changed since the last commit, and how many are set.
+    bool* dirty_blocks;
+    size_t ndirty;
+    // Blocks freed since the last commit.
+    uint32_t* freed;
+    size_t nfreed, freed_cap;
+    // Words examined by the current search, reported to the stats once it ends.
+    size_t words_scanned;
+    pthread_mutex_t lock;
 } Bitmap;
 
-static Bitmap bmp = {NULL, false};
+static Bitmap bmp = {
+    NULL, NULL, NULL, 0, 0, 0, 0, false, false, NULL, 0, NULL, 0, 0, 0, PTHREAD_MUTEX_INITIALIZER};
+
+static inline size_t nbitmap_blocks(void) {
+    return (BMP_SZ + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static inline void mark_dirty(size_t block_no) {
+    bool* dirty = &bmp.dirty_blocks[block_no / 8 / BLOCK_SIZE];
+    bmp.ndirty += !*dirty;
+    *dirty = true;
+    bmp.is_dirty = true;
+}
 
 static inline bool block_num_is_valid(int block_no) {
-    return block_no >= DATA_START && block_no < NUM_BLOCKS;
+    return block_no >= 0 && (uint32_t)block_no >= DATA_START && (uint32_t)block_no < NUM_BLOCKS;
+}
+
+static inline uint64_t bits_from(size_t bit) {
+    return ~0ULL << (bit % WORD_BITS);
+}
+
+// Propagates a change of l0 word `w` to the summary levels.
+static void update_summary(size_t w) {
+    size_t s = w / WORD_BITS;
+    if (~bmp.l0[w] != 0) {
+        bmp.l1[s] |= 1ULL << (w % WORD_BITS);
+    } else {
+        bmp.l1[s] &= ~(1ULL << (w % WORD_BITS));
+    }
+    if (bmp.l1[s] != 0) {
+        bmp.l2[s / WORD_BITS] |= 1ULL << (s % WORD_BITS);
+    } else {
+        bmp.l2[s / WORD_BITS] &= ~(1ULL << (s % WORD_BITS));
+    }
+}
+
+static void rebuild_summary(void) {
+    memset(bmp.l1, 0, bmp.nwords_l1 * sizeof(uint64_t));
+    memset(bmp.l2, 0, bmp.nwords_l2 * sizeof(uint64_t));
+    for (size_t w = 0; w < bmp.nwords_l0; ++w) {
+        update_summary(w);
+    }
+}
+
+// Marks the blocks that can never be allocated as taken.
+static void reserve_blocks(void) {
+    for (size_t b = 0; b < DATA_START; ++b) {
+        bmp.l0[b / WORD_BITS] |= 1ULL << (b % WORD_BITS);
+    }
+    for (size_t b = NUM_BLOCKS; b < bmp.nwords_l0 * WORD_BITS; ++b) {
+        bmp.l0[b / WORD_BITS] |= 1ULL << (b % WORD_BITS);
+    }
+}
+
+// Returns the first l0 word at or after `w` that has a free block, or -1.
+static long next_free_word(size_t w) {
+    if (w >= bmp.nwords_l0) {
+        return -1;
+    }
+    size_t s = w / WORD_BITS;
+    uint64_t bits = bmp.l1[s] & bits_from(w);
+    bmp.words_scanned++;
+    if (bits == 0) {
+        size_t t = (s + 1) / WORD_BITS;
+        if (s + 1 >= bmp.nwords_l1) {
+            return -1;
+        }
+        uint64_t top = bmp.l2[t] & bits_from(s + 1);
+        bmp.words_scanned++;
+        while (top == 0) {
+            if (++t >= bmp.nwords_l2) {
+                return -1;
+            }
+            top = bmp.l2[t];
+            bmp.words_scanned++;
+        }
+        s = t * WORD_BITS + (size_t)__builtin_ctzll(top);
+        bits = bmp.l1[s];
+    }
+    return (long)(s * WORD_BITS + (size_t)__builtin_ctzll(bits));
+}
+
+// Returns the first free block at or after `from`, or -1.
+static long next_free_block(size_t from) {
+    if (from >= NUM_BLOCKS) {
+        return -1;
+    }
+    size_t w = from / WORD_BITS;
+    uint64_t free_bits = ~bmp.l0[w] & bits_from(from);
+    bmp.words_scanned++;
+    if (free_bits == 0) {
+        long nw = next_free_word(w + 1);
+        if (nw < 0) {
+            return -1;
+        }
+        w = (size_t)nw;
+        free_bits = ~bmp.l0[w];
+    }
+    return (long)(w * WORD_BITS + (size_t)__builtin_ctzll(free_bits));
+}
+
+// Length of the free run starting at free block `start`, counting at most `limit` blocks.
+static size_t free_run_length(size_t start, size_t limit) {
+    size_t len = 0;
+    size_t b = start;
+    while (len < limit) {
+        uint64_t taken = bmp.l0[b / WORD_BITS] >> (b % WORD_BITS);
+        bmp.words_scanned++;
+        size_t avail = WORD_BITS - b % WORD_BITS;
+        size_t n = taken == 0 ? avail : (size_t)__builtin_ctzll(taken);
+        if (n > avail) {
+            n = avail;
+        }
+        len += n;
+        b += n;
+        if (n < avail || b >= NUM_BLOCKS) {
+            break;
+        }
+    }
+    return len < limit ? len : limit;
 }
 
 static void set_block_state(int block_no, BlockState flag) {
-    require_bitmap_is_loaded();
     if (!block_num_is_valid(block_no)) {
         logMsg(ERROR_LOG, "set_block_state: invalid block number %d", block_no);
         return;
     }
-    uint8_t mask = (uint8_t)(1u << (block_no % 8));
+    size_t w = (size_t)block_no / WORD_BITS;
+    uint64_t mask = 1ULL << (block_no % WORD_BITS);
     if (flag == BLOCK_TAKEN) {
-        bmp.arr[block_no / 8] |= mask;
+        bmp.l0[w] |= mask;
     } else {
-        bmp.arr[block_no / 8] &= (uint8_t)~(mask);
+        bmp.l0[w] &= ~mask;
+    }
+    update_summary(w);
+    mark_dirty((size_t)block_no);
+}
+
+static void set_run_taken(size_t start, size_t len) {
+    for (size_t b = start; b < start + len;) {
+        size_t w = b / WORD_BITS;
+        size_t n = WORD_BITS - b % WORD_BITS;
+        if (n > start + len - b) {
+            n = start + len - b;
+        }
+        uint64_t mask = (n == WORD_BITS ? ~0ULL : ((1ULL << n) - 1)) << (b % WORD_BITS);
+        bmp.l0[w] |= mask;
+        update_summary(w);
+        mark_dirty(b);
+        b += n;
     }
 }
 
+// Caller holds `bmp.lock`.
+static void end_scan(void) {
+    STAT_ADD(STAT_ALLOC_SCANS, 1);
+    STAT_ADD(STAT_BITMAP_WORDS, bmp.words_scanned);
+    bmp.words_scanned = 0;
+}
+
+static bool bit_is_free(int block_no) {
+    return !(bmp.l0[block_no / WORD_BITS] & (1ULL << (block_no % WORD_BITS)));
+}
+
+// Caller holds `bmp.lock`.
+static void free_block_locked(int block_no) {
+    if (!block_num_is_valid(block_no)) {
+        logMsg(ERROR_LOG, "free_block: invalid block number %d", block_no);
+        return;
+    }
+    if (bit_is_free(block_no)) {
+        logMsg(WARN_LOG, "free_block: double free of block %d", block_no);
+        return;
+    }
+    if (!journal_is_loaded()) {
+        set_block_state(block_no, BLOCK_FREE);
+        return;
+    }
+    if (bmp.nfreed == bmp.freed_cap) {
+        size_t cap = bmp.freed_cap ? bmp.freed_cap * 2 : 64;
+        uint32_t* freed = (uint32_t*)realloc(bmp.freed, cap * sizeof(uint32_t));
+        if (!freed) {
+            err_exit("free_block: failed to allocate memory");
+        }
+        bmp.freed = freed;
+        bmp.freed_cap = cap;
+    }
+    bmp.freed[bmp.nfreed++] = (uint32_t)block_no;
+    mark_dirty((size_t)block_no);
+}
+
+// Makes the blocks freed since the last commit available. Caller holds `bmp.lock`.
+static void release_freed(void) {
+    for (size_t i = 0; i < bmp.nfreed; ++i) {
+        set_block_state((int)bmp.freed[i], BLOCK_FREE);
+    }
+    bmp.nfreed = 0;
+}
+
+static bool run_is_valid(int start, size_t nbytes) {
+    size_t nblocks = (nbytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    return block_num_is_valid(start) && (size_t)start + nblocks <= NUM_BLOCKS;
+}
+
+// Buffer for the on-disk form of the bitmap.
+static uint8_t* alloc_bytes(void) {
+    uint8_t* bytes = (uint8_t*)malloc(BMP_SZ);
+    if (!bytes) {
+        err_exit("alloc_bytes: failed to allocate memory for the bitmap");
+    }
+    return bytes;
+}
+
+// On-disk form of the bitmap: only data blocks have their bits set, and pending frees are free.
+static uint8_t* to_bytes(void) {
+    uint8_t* bytes = alloc_bytes();
+    for (size_t i = 0; i < BMP_SZ; ++i) {
+        bytes[i] = (uint8_t)(bmp.l0[i / 8] >> (8 * (i % 8)));
+    }
+    for (size_t b = 0; b < DATA_START; ++b) {
+        bytes[b / 8] &= (uint8_t)~(1u << (b % 8));
+    }
+    for (size_t i = 0; i < bmp.nfreed; ++i) {
+        bytes[bmp.freed[i] / 8] &= (uint8_t)~(1u << (bmp.freed[i] % 8));
+    }
+    return bytes;
+}
+
+static void clear_dirty(void) {
+    memset(bmp.dirty_blocks, 0, nbitmap_blocks() * sizeof(bool));
+    bmp.ndirty = 0;
+    bmp.is_dirty = false;
+}
+
 // -------------------------------------
 
+bool bitmap_is_loaded() {
+    return bmp.l0 != NULL && bmp.is_loaded;
+}
+
 void require_bitmap_is_loaded() {
-    if (bmp.arr == NULL || !bmp.is_loaded) {
+    if (bmp.l0 == NULL || !bmp.is_loaded) {
         err_exit("require_bitmap_is_loaded: bitmap is not loaded");
     }
 }
@@ -57,57 +312,217 @@ void require_bitmap_is_loaded() {
 void load_bitmap_from_disk() {
     require_disk_is_mounted();
     alloc_bitmap();
-    read_from_disk_at((void*)bmp.arr, BMP_SZ, 1, BITMAP_START * BLOCK_SIZE);
+    uint8_t* bytes = alloc_bytes();
+    read_from_disk_at((void*)bytes, BMP_SZ, 1, (off_t)BITMAP_START * BLOCK_SIZE);
+    memset(bmp.l0, 0, bmp.nwords_l0 * sizeof(uint64_t));
+    for (size_t i = 0; i < BMP_SZ; ++i) {
+        bmp.l0[i / 8] |= (uint64_t)bytes[i] << (8 * (i % 8));
+    }
+    free(bytes);
+    reserve_blocks();
+    rebuild_summary();
+    bmp.hint = DATA_START;
     bmp.is_loaded = true;
+    clear_dirty();
 }
 
 void flush_bitmap_to_disk() {
     require_bitmap_is_loaded();
     require_disk_is_mounted();
-    write_to_disk_at((void*)bmp.arr, BMP_SZ, 1, BITMAP_START * BLOCK_SIZE);
+    if (journal_is_loaded()) {
+        journal_commit();
+        return;
+    }
+    pthread_mutex_lock(&bmp.lock);
+    if (!bmp.is_dirty) {
+        pthread_mutex_unlock(&bmp.lock);
+        return;
+    }
+    uint8_t* bytes = to_bytes();
+    if (write_to_disk_at((void*)bytes, BMP_SZ, 1, (off_t)BITMAP_START * BLOCK_SIZE) == 1) {
+        clear_dirty();
+        release_freed();
+    }
+    pthread_mutex_unlock(&bmp.lock);
+    free(bytes);
 }
 
-void clear_bitmap() {
+void flush_bitmap_to_journal() {
     require_bitmap_is_loaded();
-    memset(bmp.arr, 0, BMP_SZ);
+    pthread_mutex_lock(&bmp.lock);
+    if (!bmp.is_dirty) {
+        pthread_mutex_unlock(&bmp.lock);
+        return;
+    }
+    uint8_t* bytes = to_bytes();
+    for (size_t i = 0; i < nbitmap_blocks(); ++i) {
+        if (bmp.dirty_blocks[i]) {
+            size_t off = i * BLOCK_SIZE;
+            size_t len = BMP_SZ - off < BLOCK_SIZE ? BMP_SZ - off : BLOCK_SIZE;
+            journal_add_block(BITMAP_START + (uint32_t)i, bytes + off, len);
+        }
+    }
+    pthread_mutex_unlock(&bmp.lock);
+    free(bytes);
+}
+
+size_t bitmap_dirty_blocks() {
+    if (!bitmap_is_loaded()) {
+        return 0;
+    }
+    pthread_mutex_lock(&bmp.lock);
+    size_t n = bmp.ndirty;
+    pthread_mutex_unlock(&bmp.lock);
+    return n;
+}
+
+void bitmap_committed() {
+    require_bitmap_is_loaded();
+    pthread_mutex_lock(&bmp.lock);
+    clear_dirty();
+    release_freed();
+    pthread_mutex_unlock(&bmp.lock);
+}
+
+void clear_bitmap() {
+    if (bmp.l0 == NULL) {
+        err_exit("clear_bitmap: bitmap is not allocated");
+    }
+    memset(bmp.l0, 0, bmp.nwords_l0 * sizeof(uint64_t));
+    reserve_blocks();
+    rebuild_summary();
+    bmp.hint = DATA_START;
+    bmp.nfreed = 0;
+    memset(bmp.dirty_blocks, 1, nbitmap_blocks() * sizeof(bool));
+    bmp.ndirty = nbitmap_blocks();
+    bmp.is_dirty = true;
+    bmp.is_loaded = true;
 }
 
 void alloc_bitmap() {
-    if (bmp.arr == NULL) {
-        bmp.arr = (uint8_t*)malloc(BMP_SZ);
-        bmp.is_loaded = true;
-        if (!bmp.arr) {
-            err_exit("alloc_bitmap: failed to allocate memory for bitmap array");
-        }
+    if (bmp.l0 != NULL) {
+        logMsg(WARN_LOG, "alloc_bitmap: bitmap already allocated");
+        return;
     }
-    logMsg(WARN_LOG, "alloc_bitmap: bitmap already allocated");
+    bmp.nwords_l0 = WORDS_FOR(NUM_BLOCKS);
+    bmp.nwords_l1 = WORDS_FOR(bmp.nwords_l0);
+    bmp.nwords_l2 = WORDS_FOR(bmp.nwords_l1);
+    bmp.l0 = (uint64_t*)calloc(bmp.nwords_l0, sizeof(uint64_t));
+    bmp.l1 = (uint64_t*)calloc(bmp.nwords_l1, sizeof(uint64_t));
+    bmp.l2 = (uint64_t*)calloc(bmp.nwords_l2, sizeof(uint64_t));
+    bmp.dirty_blocks = (bool*)calloc(nbitmap_blocks(), sizeof(bool));
+    if (!bmp.l0 || !bmp.l1 || !bmp.l2 || !bmp.dirty_blocks) {
+        err_exit("alloc_bitmap: failed to allocate memory for bitmap array");
+    }
+}
+
+void free_bitmap() {
+    free(bmp.l0);
+    free(bmp.l1);
+    free(bmp.l2);
+    free(bmp.dirty_blocks);
+    free(bmp.freed);
+    bmp.l0 = bmp.l1 = bmp.l2 = NULL;
+    bmp.dirty_blocks = NULL;
+    bmp.ndirty = 0;
+    bmp.freed = NULL;
+    bmp.nfreed = bmp.freed_cap = 0;
+    bmp.nwords_l0 = bmp.nwords_l1 = bmp.nwords_l2 = 0;
+    bmp.hint = 0;
+    bmp.is_loaded = false;
+    bmp.is_dirty = false;
 }
 
 //! Changes only apply in-memory. Caller must flush for changes to persist.
 int alloc_block() {
     require_bitmap_is_loaded();
-    for (int i = DATA_START; i < NUM_BLOCKS; ++i) {
-        if (!(bmp.arr[i / 8] & (uint8_t)(1u << (i % 8)))) {
-            set_block_state(i, BLOCK_TAKEN);  // Modify respectful bit for that data block.
-            return i;
+    pthread_mutex_lock(&bmp.lock);
+    long b = next_free_block(bmp.hint);
+    if (b < 0) {
+        b = next_free_block(DATA_START);  // Wrap around.
+    }
+    end_scan();
+    if (b < 0) {
+        pthread_mutex_unlock(&bmp.lock);
+        logMsg(WARN_LOG, "alloc_block: failed to allocate a free data block; disk is full");
+        return -1;
+    }
+    set_block_state((int)b, BLOCK_TAKEN);
+    bmp.hint = (size_t)b + 1;
+    pthread_mutex_unlock(&bmp.lock);
+    return (int)b;
+}
+
+//! Changes only apply in-memory. Caller must flush for changes to persist.
+int alloc_block_run(size_t want, size_t* got) {
+    require_bitmap_is_loaded();
+    *got = 0;
+    if (want == 0) {
+        return -1;
+    }
+    // Next fit over free runs, wrapping around once; remember the
+    // longest run in case none is long enough.
+    pthread_mutex_lock(&bmp.lock);
+    long best = -1;
+    size_t best_len = 0;
+    size_t from = bmp.hint;
+    bool wrapped = false;
+    for (;;) {
+        long b = next_free_block(from);
+        if (b < 0 || (wrapped && (size_t)b >= bmp.hint)) {
+            if (wrapped || bmp.hint <= DATA_START) {
+                break;
+            }
+            wrapped = true;
+            from = DATA_START;
+            continue;
+        }
+        size_t len = free_run_length((size_t)b, want);
+        if (len > best_len) {
+            best = b;
+            best_len = len;
         }
+        if (len == want) {
+            break;
+        }
+        from = (size_t)b + len;
+    }
+    end_scan();
+    if (best < 0) {
+        pthread_mutex_unlock(&bmp.lock);
+        logMsg(WARN_LOG, "alloc_block_run: failed to allocate a free data block; disk is full");
+        return -1;
     }
-    logMsg(WARN_LOG, "alloc_block: failed to allocate a free data block; disk is full");
-    return -1;
+    set_run_taken((size_t)best, best_len);
+    bmp.hint = (size_t)best + best_len;
+    pthread_mutex_unlock(&bmp.lock);
+    *got = best_len;
+    return (int)best;
 }
 
 //! Changes only apply in-memory. Caller must flush for changes to persist.
-void free_block(int block_no) {
+void free_block_run(int start, size_t len) {
     require_bitmap_is_loaded();
-    if (!block_num_is_valid(block_no)) {
-        logMsg(ERROR_LOG, "free_block: invalid block number %d", block_no);
-        return;
+    if (run_is_valid(start, len * BLOCK_SIZE)) {
+        cache_discard(start, len);
     }
-    if (block_is_free(block_no)) {
-        logMsg(WARN_LOG, "free_block: double free of block %d", block_no);
-        return;
+    pthread_mutex_lock(&bmp.lock);
+    for (size_t i = 0; i < len; ++i) {
+        free_block_locked(start + (int)i);
     }
-    set_block_state(block_no, BLOCK_FREE);
+    pthread_mutex_unlock(&bmp.lock);
+}
+
+//! Changes only apply in-memory. Caller must flush for changes to persist.
+void free_block(int block_no) {
+    require_bitmap_is_loaded();
+    // Before the block can be handed out again.
+    if (block_num_is_valid(block_no)) {
+        cache_discard(block_no, 1);
+    }
+    pthread_mutex_lock(&bmp.lock);
+    free_block_locked(block_no);
+    pthread_mutex_unlock(&bmp.lock);
 }
 
 void read_data_block(int block_no, void* buf, size_t size) {
@@ -120,7 +535,45 @@ void read_data_block(int block_no, void* buf, size_t size) {
         logMsg(ERROR_LOG, "read_data_block: size exceeds BLOCK_SIZE");
         return;
     }
-    read_from_disk_at(buf, size, 1, block_no * BLOCK_SIZE);
+    cache_read_block(block_no, buf, size);
+}
+
+void read_data_blocks(const int* block_nos, size_t n, void* bufs) {
+    require_disk_is_mounted();
+    for (size_t i = 0; i < n; ++i) {
+        if (!block_num_is_valid(block_nos[i])) {
+            logMsg(ERROR_LOG, "read_data_blocks: invalid block number %d", block_nos[i]);
+            return;
+        }
+    }
+    cache_read_blocks(block_nos, n, bufs);
+}
+
+void read_data_run(int start, void* buf, size_t nbytes) {
+    require_disk_is_mounted();
+    if (!run_is_valid(start, nbytes)) {
+        logMsg(ERROR_LOG, "read_data_run: invalid run at block %d (%zu bytes)", start, nbytes);
+        return;
+    }
+    // Blocks that were read ahead into the cache need no I/O.
+    size_t hit = cache_read_hits(start, buf, nbytes);
+    if (hit == nbytes) {
+        return;
+    }
+    int rest = start + (int)(hit / BLOCK_SIZE);
+    read_from_disk_at((uint8_t*)buf + hit, nbytes - hit, 1, (off_t)rest * BLOCK_SIZE);
+    // Cached copies may be newer than the disk.
+    cache_overlay(rest, (uint8_t*)buf + hit, nbytes - hit);
+}
+
+void write_data_run(int start, const void* data, size_t nbytes) {
+    require_disk_is_mounted();
+    if (!run_is_valid(start, nbytes)) {
+        logMsg(ERROR_LOG, "write_data_run: invalid run at block %d (%zu bytes)", start, nbytes);
+        return;
+    }
+    write_to_disk_at(data, nbytes, 1, (off_t)start * BLOCK_SIZE);
+    cache_update(start, data, nbytes);
 }
 
 void write_data_block(int block_no, const void* data, size_t size) {
@@ -133,7 +586,7 @@ void write_data_block(int block_no, const void* data, size_t size) {
         logMsg(ERROR_LOG, "write_data_block: size exceeds BLOCK_SIZE");
         return;
     }
-    write_to_disk_at(data, size, 1, block_no * BLOCK_SIZE);
+    cache_write_block(block_no, data, size);
 }
 
 bool block_is_free(int block_no) {
@@ -142,5 +595,30 @@ bool block_is_free(int block_no) {
         logMsg(ERROR_LOG, "block_is_free: invalid block number %d", block_no);
         return false;
     }
-    return !(bmp.arr[block_no / 8] & (uint8_t)(1u << (block_no % 8)));
+    pthread_mutex_lock(&bmp.lock);
+    bool is_free = bit_is_free(block_no);
+    pthread_mutex_unlock(&bmp.lock);
+    return is_free;
+}
+
+void claim_block(int block_no) {
+    require_bitmap_is_loaded();
+    pthread_mutex_lock(&bmp.lock);
+    if (block_num_is_valid(block_no) && bit_is_free(block_no)) {
+        set_block_state(block_no, BLOCK_TAKEN);
+    }
+    pthread_mutex_unlock(&bmp.lock);
+}
+
+uint64_t* copy_bitmap(size_t* nwords) {
+    require_bitmap_is_loaded();
+    pthread_mutex_lock(&bmp.lock);
+    uint64_t* words = (uint64_t*)malloc(bmp.nwords_l0 * sizeof(uint64_t));
+    if (!words) {
+        err_exit("copy_bitmap: failed to allocate memory");
+    }
+    memcpy(words, bmp.l0, bmp.nwords_l0 * sizeof(uint64_t));
+    *nwords = bmp.nwords_l0;
+    pthread_mutex_unlock(&bmp.lock);
+    return words;
 }
@@ -0,0 +1,653 @@
+#include "cache.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "disk.h"
+#include "err.h"
+#include "fs.h"
+#include "journal.h"
+#include "logging.h"
+#include "readahead.h"
+#include "stats.h"
+
+// --------------- LOCAL ---------------
+
+#define NIL (-1)
+// Longest run of consecutive dirty blocks written with one call.
+#define FLUSH_MAX_RUN 64
+// The cache is split into independently locked shards by block number,
+// so threads working on different blocks rarely contend.
+#define MAX_CACHE_SHARDS 16
+#define MIN_SHARD_SLOTS 16
+
+typedef struct {
+    int block_no;
+    bool dirty;
+    // LRU list links (indices into the shard's `slots`).
+    int prev, next;
+    // Hash chain link.
+    int hnext;
+    uint8_t* data;
+} CacheSlot;
+
+typedef struct {
+    pthread_mutex_t lock;
+    CacheSlot* slots;
+    uint8_t* mem;  // BLOCK_SIZE * base_capacity bytes backing the first slots.
+    int* buckets;
+    size_t nbuckets;  // Power of two.
+    size_t capacity;
+    // What `capacity` returns to once the shard is clean; see `grow_shard`.
+    size_t base_capacity;
+    size_t used;
+    // Most recently used at `head`, eviction candidate at `tail`.
+    int head, tail;
+} CacheShard;
+
+typedef struct {
+    CacheShard* shards;
+    size_t nshards;  // Power of two.
+    size_t capacity;
+    atomic_size_t ndirty;  // Over all shards.
+    // Set once the shards are allocated; `init_lock` serializes the allocation.
+    atomic_bool ready;
+    pthread_mutex_t init_lock;
+} BlockCache;
+
+static BlockCache cache = {NULL, 0, DEFAULT_CACHE_CAPACITY, 0, false, PTHREAD_MUTEX_INITIALIZER};
+
+static inline size_t bucket_of(const CacheShard* sh, int block_no) {
+    return ((uint32_t)block_no * 2654435761u) & (sh->nbuckets - 1);
+}
+
+static inline CacheShard* shard_of(int block_no) {
+    return &cache.shards[(uint32_t)block_no & (cache.nshards - 1)];
+}
+
+static void free_cache(void) {
+    for (size_t i = 0; i < cache.nshards; ++i) {
+        CacheShard* sh = &cache.shards[i];
+        // Slots a shard grew by own their blocks.
+        for (size_t j = sh->base_capacity; j < sh->capacity; ++j) {
+            free(sh->slots[j].data);
+        }
+        free(sh->slots);
+        free(sh->mem);
+        free(sh->buckets);
+        pthread_mutex_destroy(&sh->lock);
+    }
+    free(cache.shards);
+    cache.shards = NULL;
+    cache.nshards = 0;
+    atomic_store(&cache.ndirty, 0);
+    atomic_store(&cache.ready, false);
+}
+
+static void alloc_shard(CacheShard* sh, size_t capacity) {
+    pthread_mutex_init(&sh->lock, NULL);
+    sh->capacity = sh->base_capacity = capacity;
+    sh->nbuckets = 1;
+    while (sh->nbuckets < capacity * 2) {
+        sh->nbuckets <<= 1;
+    }
+    sh->slots = (CacheSlot*)malloc(capacity * sizeof(CacheSlot));
+    sh->mem = (uint8_t*)malloc(capacity * BLOCK_SIZE);
+    sh->buckets = (int*)malloc(sh->nbuckets * sizeof(int));
+    if (!sh->slots || !sh->mem || !sh->buckets) {
+        err_exit("alloc_cache: failed to allocate memory for %zu blocks", capacity);
+    }
+    for (size_t i = 0; i < sh->nbuckets; ++i) {
+        sh->buckets[i] = NIL;
+    }
+    for (size_t i = 0; i < capacity; ++i) {
+        sh->slots[i].data = sh->mem + i * BLOCK_SIZE;
+        sh->slots[i].dirty = false;
+    }
+    sh->used = 0;
+    sh->head = sh->tail = NIL;
+}
+
+static void alloc_cache(void) {
+    size_t nshards = 1;
+    while (nshards < MAX_CACHE_SHARDS && cache.capacity / (nshards * 2) >= MIN_SHARD_SLOTS) {
+        nshards <<= 1;
+    }
+    cache.shards = (CacheShard*)calloc(nshards, sizeof(CacheShard));
+    if (!cache.shards) {
+        err_exit("alloc_cache: failed to allocate memory for %zu shards", nshards);
+    }
+    cache.nshards = nshards;
+    // Spread the capacity evenly; the first shards take the remainder.
+    for (size_t i = 0; i < nshards; ++i) {
+        alloc_shard(&cache.shards[i], cache.capacity / nshards + (i < cache.capacity % nshards));
+    }
+}
+
+// Returns false if caching is disabled.
+static bool require_cache(void) {
+    if (cache.capacity == 0) {
+        return false;
+    }
+    if (!atomic_load_explicit(&cache.ready, memory_order_acquire)) {
+        pthread_mutex_lock(&cache.init_lock);
+        if (!atomic_load_explicit(&cache.ready, memory_order_relaxed)) {
+            alloc_cache();
+            atomic_store_explicit(&cache.ready, true, memory_order_release);
+        }
+        pthread_mutex_unlock(&cache.init_lock);
+    }
+    return true;
+}
+
+static void lru_unlink(CacheShard* sh, int i) {
+    CacheSlot* s = &sh->slots[i];
+    if (s->prev != NIL) {
+        sh->slots[s->prev].next = s->next;
+    } else {
+        sh->head = s->next;
+    }
+    if (s->next != NIL) {
+        sh->slots[s->next].prev = s->prev;
+    } else {
+        sh->tail = s->prev;
+    }
+}
+
+static void lru_push_front(CacheShard* sh, int i) {
+    CacheSlot* s = &sh->slots[i];
+    s->prev = NIL;
+    s->next = sh->head;
+    if (sh->head != NIL) {
+        sh->slots[sh->head].prev = i;
+    }
+    sh->head = i;
+    if (sh->tail == NIL) {
+        sh->tail = i;
+    }
+}
+
+static void lru_push_back(CacheShard* sh, int i) {
+    CacheSlot* s = &sh->slots[i];
+    s->prev = sh->tail;
+    s->next = NIL;
+    if (sh->tail != NIL) {
+        sh->slots[sh->tail].next = i;
+    }
+    sh->tail = i;
+    if (sh->head == NIL) {
+        sh->head = i;
+    }
+}
+
+static void hash_remove(CacheShard* sh, int i) {
+    int* link = &sh->buckets[bucket_of(sh, sh->slots[i].block_no)];
+    while (*link != NIL) {
+        if (*link == i) {
+            *link = sh->slots[i].hnext;
+            return;
+        }
+        link = &sh->slots[*link].hnext;
+    }
+}
+
+// Caller holds the slot's shard lock.
+static void set_dirty(CacheSlot* s, bool dirty) {
+    if (s->dirty == dirty) {
+        return;
+    }
+    if (dirty) {
+        atomic_fetch_add_explicit(&cache.ndirty, 1, memory_order_relaxed);
+    } else {
+        atomic_fetch_sub_explicit(&cache.ndirty, 1, memory_order_relaxed);
+    }
+    s->dirty = dirty;
+}
+
+/*
+ * Once the journal is loaded, a dirty block may only reach its home
+ * through a commit, and none can be forced from here: the caller may
+ * be inside a handle. So a shard whose every slot is dirty doubles
+ * instead, and `cache_committed` shrinks it back. The journal commits
+ * early once its running transaction gets large, which bounds this.
+ */
+static void grow_shard(CacheShard* sh) {
+    size_t capacity = sh->capacity * 2;
+    CacheSlot* slots = (CacheSlot*)realloc(sh->slots, capacity * sizeof(CacheSlot));
+    if (!slots) {
+        err_exit("cache: failed to allocate memory for %zu blocks", capacity);
+    }
+    sh->slots = slots;
+    for (size_t i = sh->capacity; i < capacity; ++i) {
+        slots[i].data = (uint8_t*)malloc(BLOCK_SIZE);
+        if (!slots[i].data) {
+            err_exit("cache: failed to allocate memory for %zu blocks", capacity);
+        }
+        slots[i].dirty = false;
+    }
+    logMsg(INFO_LOG, "cache: every block of a shard is dirty; growing it to %zu", capacity);
+    sh->capacity = capacity;
+}
+
+// Caller holds the shard's lock, and every slot is clean.
+static void shrink_shard(CacheShard* sh) {
+    for (size_t i = sh->base_capacity; i < sh->capacity; ++i) {
+        if (i < sh->used) {
+            if (sh->slots[i].block_no != NIL) {
+                hash_remove(sh, (int)i);
+            }
+            lru_unlink(sh, (int)i);
+        }
+        free(sh->slots[i].data);
+    }
+    sh->used = sh->used < sh->base_capacity ? sh->used : sh->base_capacity;
+    sh->capacity = sh->base_capacity;
+}
+
+static int lookup(CacheShard* sh, int block_no) {
+    for (int i = sh->buckets[bucket_of(sh, block_no)]; i != NIL; i = sh->slots[i].hnext) {
+        if (sh->slots[i].block_no == block_no) {
+            return i;
+        }
+    }
+    return NIL;
+}
+
+// Goes out right away even if the thread is plugged: once the slot is reused,
+// other threads read the block from disk and must not miss this write.
+static bool write_back_slot(CacheSlot* s) {
+    struct iovec iov = {s->data, BLOCK_SIZE};
+    DiskIoReq req = {
+        .op = DISK_IO_WRITE, .iov = &iov, .iovcnt = 1, .offset = (off_t)s->block_no * BLOCK_SIZE};
+    if (submit_disk_io(&req, 1) != 1) {
+        logMsg(ERROR_LOG, "cache: failed to write back block %d", s->block_no);
+        return false;
+    }
+    set_dirty(s, false);
+    return true;
+}
+
+/*
+ * Returns the slot caching `block_no`, loading it on a miss.
+ * If `fill` is false, the block is about to be overwritten
+ * entirely, so its old contents are not read from disk.
+ * Caller holds the shard's lock.
+ */
+static CacheSlot* get_slot(CacheShard* sh, int block_no, bool fill) {
+    int i = lookup(sh, block_no);
+    if (i != NIL) {
+        if (sh->head != i) {
+            lru_unlink(sh, i);
+            lru_push_front(sh, i);
+        }
+        STAT_ADD(STAT_CACHE_HITS, 1);
+        return &sh->slots[i];
+    }
+    STAT_ADD(STAT_CACHE_MISSES, 1);
+    // Dirty blocks wait for the journal; evict the least recently used clean one.
+    i = sh->used < sh->capacity ? NIL : sh->tail;
+    while (i != NIL && sh->slots[i].dirty) {
+        i = sh->slots[i].prev;
+    }
+    if (i == NIL && sh->used == sh->capacity) {
+        if (journal_is_loaded()) {
+            grow_shard(sh);
+        } else {
+            i = sh->tail;
+            write_back_slot(&sh->slots[i]);
+        }
+    }
+    if (i == NIL) {
+        i = (int)sh->used++;
+    } else {
+        STAT_ADD(STAT_CACHE_EVICTIONS, 1);
+        lru_unlink(sh, i);
+        // Discarded slots are already out of the hash.
+        if (sh->slots[i].block_no != NIL) {
+            hash_remove(sh, i);
+        }
+    }
+    CacheSlot* s = &sh->slots[i];
+    s->block_no = block_no;
+    set_dirty(s, false);
+    if (fill) {
+        if (read_from_disk_at(s->data, BLOCK_SIZE, 1, (off_t)block_no * BLOCK_SIZE) != 1) {
+            logMsg(ERROR_LOG, "cache: failed to read block %d", block_no);
+            memset(s->data, 0, BLOCK_SIZE);
+        }
+    }
+    size_t b = bucket_of(sh, block_no);
+    s->hnext = sh->buckets[b];
+    sh->buckets[b] = i;
+    lru_push_front(sh, i);
+    return s;
+}
+
+static int compare_slots_by_block(const void* a, const void* b) {
+    int x = (*(CacheSlot* const*)a)->block_no;
+    int y = (*(CacheSlot* const*)b)->block_no;
+    return (x > y) - (x < y);
+}
+
+// -------------------------------------
+
+void set_cache_capacity(size_t nblocks) {
+    // Its reads would land in the cache being freed.
+    stop_readahead();
+    if (atomic_load(&cache.ready)) {
+        flush_cache_to_disk();
+        free_cache();
+    }
+    cache.capacity = nblocks;
+    logMsg(INFO_LOG, "set_cache_capacity: capacity=%zu blocks", nblocks);
+}
+
+size_t cache_capacity() {
+    return cache.capacity;
+}
+
+void cache_read_block(int block_no, void* buf, size_t size) {
+    if (!require_cache()) {
+        read_from_disk_at(buf, size, 1, (off_t)block_no * BLOCK_SIZE);
+        return;
+    }
+    CacheShard* sh = shard_of(block_no);
+    pthread_mutex_lock(&sh->lock);
+    memcpy(buf, get_slot(sh, block_no, true)->data, size);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+void cache_write_block(int block_no, const void* data, size_t size) {
+    if (!require_cache()) {
+        write_to_disk_at(data, size, 1, (off_t)block_no * BLOCK_SIZE);
+        return;
+    }
+    CacheShard* sh = shard_of(block_no);
+    pthread_mutex_lock(&sh->lock);
+    // A partial write has to preserve the rest of the block.
+    CacheSlot* s = get_slot(sh, block_no, size < BLOCK_SIZE);
+    memcpy(s->data, data, size);
+    set_dirty(s, true);
+    pthread_mutex_unlock(&sh->lock);
+}
+
+void cache_read_blocks(const int* block_nos, size_t n, void* bufs) {
+    uint8_t* out = (uint8_t*)bufs;
+    bool cached = require_cache();
+    // Serve hits from memory; gather the misses into a single batch.
+    struct iovec* iov = (struct iovec*)malloc(n * sizeof(struct iovec));
+    DiskIoReq* reqs = (DiskIoReq*)malloc(n * sizeof(DiskIoReq));
+    if (!iov || !reqs) {
+        err_exit("cache_read_blocks: failed to allocate memory");
+    }
+    size_t nmiss = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (cached) {
+            CacheShard* sh = shard_of(block_nos[i]);
+            pthread_mutex_lock(&sh->lock);
+            int slot = lookup(sh, block_nos[i]);
+            if (slot != NIL) {
+                memcpy(out + i * BLOCK_SIZE, sh->slots[slot].data, BLOCK_SIZE);
+            }
+            pthread_mutex_unlock(&sh->lock);
+            STAT_ADD(slot != NIL ? STAT_CACHE_HITS : STAT_CACHE_MISSES, 1);
+            if (slot != NIL) {
+                continue;
+            }
+        }
+        iov[nmiss].iov_base = out + i * BLOCK_SIZE;
+        iov[nmiss].iov_len = BLOCK_SIZE;
+        reqs[nmiss] = (DiskIoReq){
+            .op = DISK_IO_READ,
+            .iov = &iov[nmiss],
+            .iovcnt = 1,
+            .offset = (off_t)block_nos[i] * BLOCK_SIZE,
+        };
+        nmiss++;
+    }
+    // No shard is locked during the I/O.
+    if (nmiss > 0 && submit_disk_io(reqs, nmiss) != nmiss) {
+        logMsg(ERROR_LOG, "cache_read_blocks: failed to read %zu blocks", nmiss);
+    }
+    for (size_t i = 0; i < nmiss && cached; ++i) {
+        if (reqs[i].result != BLOCK_SIZE) {
+            continue;
+        }
+        int b = (int)(reqs[i].offset / BLOCK_SIZE);
+        CacheShard* sh = shard_of(b);
+        pthread_mutex_lock(&sh->lock);
+        int slot = lookup(sh, b);
+        if (slot != NIL) {
+            // Cached while the read was in flight, so it may be newer than what was read.
+            memcpy(iov[i].iov_base, sh->slots[slot].data, BLOCK_SIZE);
+        } else {
+            memcpy(get_slot(sh, b, false)->data, iov[i].iov_base, BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+    free(reqs);
+    free(iov);
+}
+
+void cache_fill(int start, const void* data, size_t nblocks) {
+    if (!require_cache()) {
+        return;
+    }
+    const uint8_t* in = (const uint8_t*)data;
+    for (size_t k = 0; k < nblocks; ++k) {
+        int b = start + (int)k;
+        CacheShard* sh = shard_of(b);
+        pthread_mutex_lock(&sh->lock);
+        if (lookup(sh, b) == NIL) {
+            memcpy(get_slot(sh, b, false)->data, in + k * BLOCK_SIZE, BLOCK_SIZE);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+size_t cache_read_hits(int start, void* buf, size_t nbytes) {
+    if (!atomic_load_explicit(&cache.ready, memory_order_acquire)) {
+        return 0;
+    }
+    uint8_t* out = (uint8_t*)buf;
+    size_t off = 0;
+    while (off < nbytes) {
+        int b = start + (int)(off / BLOCK_SIZE);
+        size_t len = nbytes - off < BLOCK_SIZE ? nbytes - off : BLOCK_SIZE;
+        CacheShard* sh = shard_of(b);
+        pthread_mutex_lock(&sh->lock);
+        int i = lookup(sh, b);
+        if (i != NIL) {
+            memcpy(out + off, sh->slots[i].data, len);
+        }
+        pthread_mutex_unlock(&sh->lock);
+        if (i == NIL) {
+            break;
+        }
+        STAT_ADD(STAT_CACHE_HITS, 1);
+        off += len;
+    }
+    return off;
+}
+
+void cache_overlay(int start, void* buf, size_t nbytes) {
+    if (!atomic_load_explicit(&cache.ready, memory_order_acquire)) {
+        return;
+    }
+    uint8_t* out = (uint8_t*)buf;
+    for (size_t off = 0; off < nbytes; off += BLOCK_SIZE) {
+        int b = start + (int)(off / BLOCK_SIZE);
+        CacheShard* sh = shard_of(b);
+        pthread_mutex_lock(&sh->lock);
+        int i = lookup(sh, b);
+        if (i != NIL) {
+            size_t len = nbytes - off < BLOCK_SIZE ? nbytes - off : BLOCK_SIZE;
+            memcpy(out + off, sh->slots[i].data, len);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+void cache_update(int start, const void* data, size_t nbytes) {
+    if (!atomic_load_explicit(&cache.ready, memory_order_acquire)) {
+        return;
+    }
+    const uint8_t* in = (const uint8_t*)data;
+    for (size_t off = 0; off < nbytes; off += BLOCK_SIZE) {
+        int b = start + (int)(off / BLOCK_SIZE);
+        CacheShard* sh = shard_of(b);
+        pthread_mutex_lock(&sh->lock);
+        int i = lookup(sh, b);
+        if (i != NIL) {
+            size_t len = nbytes - off < BLOCK_SIZE ? nbytes - off : BLOCK_SIZE;
+            memcpy(sh->slots[i].data, in + off, len);
+            // A partially rewritten block may still hold unwritten changes past `len`.
+            if (len == BLOCK_SIZE) {
+                set_dirty(&sh->slots[i], false);
+            }
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+void cache_discard(int start, size_t nblocks) {
+    if (!atomic_load_explicit(&cache.ready, memory_order_acquire)) {
+        return;
+    }
+    for (size_t k = 0; k < nblocks; ++k) {
+        int b = start + (int)k;
+        CacheShard* sh = shard_of(b);
+        pthread_mutex_lock(&sh->lock);
+        int i = lookup(sh, b);
+        if (i != NIL) {
+            // Reused first, before any block that still holds data.
+            hash_remove(sh, i);
+            lru_unlink(sh, i);
+            sh->slots[i].block_no = NIL;
+            set_dirty(&sh->slots[i], false);
+            lru_push_back(sh, i);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+bool flush_cache_to_disk() {
+    if (!atomic_load_explicit(&cache.ready, memory_order_acquire)) {
+        return true;
+    }
+    if (journal_is_loaded()) {
+        return journal_commit();
+    }
+    // Every shard stays locked until its blocks are written, always taken in index order.
+    size_t used = 0;
+    for (size_t i = 0; i < cache.nshards; ++i) {
+        pthread_mutex_lock(&cache.shards[i].lock);
+        used += cache.shards[i].used;
+    }
+    // Write back in block order so the disk sees mostly sequential writes.
+    CacheSlot** dirty = (CacheSlot**)malloc((used + 1) * sizeof(CacheSlot*));
+    struct iovec* iov = (struct iovec*)malloc((used + 1) * sizeof(struct iovec));
+    DiskIoReq* reqs = (DiskIoReq*)malloc((used + 1) * sizeof(DiskIoReq));
+    if (!dirty || !iov || !reqs) {
+        err_exit("flush_cache_to_disk: failed to allocate memory");
+    }
+    size_t ndirty = 0;
+    for (size_t i = 0; i < cache.nshards; ++i) {
+        CacheShard* sh = &cache.shards[i];
+        for (size_t j = 0; j < sh->used; ++j) {
+            if (sh->slots[j].dirty) {
+                dirty[ndirty++] = &sh->slots[j];
+            }
+        }
+    }
+    qsort(dirty, ndirty, sizeof(CacheSlot*), compare_slots_by_block);
+    // Each run of consecutive blocks is one vectored write; all runs are submitted as one batch.
+    size_t nreqs = 0;
+    for (size_t i = 0; i < ndirty;) {
+        int first = dirty[i]->block_no;
+        size_t run = 0;
+        while (i + run < ndirty && run < FLUSH_MAX_RUN &&
+               dirty[i + run]->block_no == first + (int)run) {
+            iov[i + run].iov_base = dirty[i + run]->data;
+            iov[i + run].iov_len = BLOCK_SIZE;
+            run++;
+        }
+        reqs[nreqs++] = (DiskIoReq){
+            .op = DISK_IO_WRITE,
+            .iov = &iov[i],
+            .iovcnt = (int)run,
+            .offset = (off_t)first * BLOCK_SIZE,
+        };
+        i += run;
+    }
+    bool ok = submit_disk_io(reqs, nreqs) == nreqs;
+    for (size_t r = 0, i = 0; r < nreqs; ++r) {
+        bool written = reqs[r].result == (size_t)reqs[r].iovcnt * BLOCK_SIZE;
+        for (int j = 0; j < reqs[r].iovcnt; ++j, ++i) {
+            set_dirty(dirty[i], !written);
+        }
+        if (!written) {
+            logMsg(
+                ERROR_LOG,
+                "flush_cache_to_disk: failed to write blocks from %jd",
+                (intmax_t)(reqs[r].offset / BLOCK_SIZE));
+        }
+    }
+    for (size_t i = cache.nshards; i-- > 0;) {
+        pthread_mutex_unlock(&cache.shards[i].lock);
+    }
+    free(reqs);
+    free(iov);
+    free(dirty);
+    if (ndirty > 0) {
+        logMsg(INFO_LOG, "flush_cache_to_disk: wrote back %zu blocks", ndirty);
+    }
+    return ok;
+}
+
+void flush_cache_to_journal() {
+    if (!atomic_load_explicit(&cache.ready, memory_order_acquire)) {
+        return;
+    }
+    for (size_t i = 0; i < cache.nshards; ++i) {
+        CacheShard* sh = &cache.shards[i];
+        pthread_mutex_lock(&sh->lock);
+        for (size_t j = 0; j < sh->used; ++j) {
+            if (sh->slots[j].dirty) {
+                journal_add_block((uint32_t)sh->slots[j].block_no, sh->slots[j].data, BLOCK_SIZE);
+            }
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+void cache_committed() {
+    if (!atomic_load_explicit(&cache.ready, memory_order_acquire)) {
+        return;
+    }
+    for (size_t i = 0; i < cache.nshards; ++i) {
+        CacheShard* sh = &cache.shards[i];
+        pthread_mutex_lock(&sh->lock);
+        for (size_t j = 0; j < sh->used; ++j) {
+            set_dirty(&sh->slots[j], false);
+        }
+        if (sh->capacity > sh->base_capacity) {
+            shrink_shard(sh);
+        }
+        pthread_mutex_unlock(&sh->lock);
+    }
+}
+
+size_t cache_dirty_blocks() {
+    return atomic_load_explicit(&cache.ndirty, memory_order_relaxed);
+}
+
+void invalidate_cache() {
+    if (atomic_load(&cache.ready)) {
+        free_cache();
+    }
+}
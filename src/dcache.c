@@ -0,0 +1,244 @@
+#include "dcache.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "err.h"
+#include "logging.h"
+#include "stats.h"
+#include "on-disk/dirent.h"
+
+// --------------- LOCAL ---------------
+
+#define NIL (-1)
+#define NEGATIVE (-1)
+
+typedef struct {
+    int parent;
+    int inode_no;  // NEGATIVE if the name doesn't exist.
+    char name[MAX_DIRNAME_LEN + 1];
+    // LRU list links (indices into `dcache.entries`).
+    int prev, next;
+    // Hash chain link.
+    int hnext;
+} Dentry;
+
+typedef struct {
+    Dentry* entries;
+    int* buckets;
+    size_t nbuckets;  // Power of two.
+    size_t capacity;
+    size_t used;
+    // Most recently used at `head`, eviction candidate at `tail`.
+    int head, tail;
+    // Unlinked entries, chained through `next`.
+    int free_list;
+    // Guards everything above; lookups reorder the LRU list too.
+    pthread_mutex_t lock;
+} DentryCache;
+
+static DentryCache dcache = {
+    NULL, NULL, 0, DEFAULT_DCACHE_CAPACITY, 0, NIL, NIL, NIL, PTHREAD_MUTEX_INITIALIZER};
+
+// FNV-1a over the parent inode and the name.
+static size_t hash_key(int parent, const char* name) {
+    uint32_t h = 2166136261u;
+    for (int i = 0; i < 4; ++i) {
+        h = (h ^ (uint8_t)((uint32_t)parent >> (8 * i))) * 16777619u;
+    }
+    for (const char* c = name; *c; ++c) {
+        h = (h ^ (uint8_t)*c) * 16777619u;
+    }
+    return h & (dcache.nbuckets - 1);
+}
+
+static void free_dcache(void) {
+    free(dcache.entries);
+    free(dcache.buckets);
+    dcache.entries = NULL;
+    dcache.buckets = NULL;
+    dcache.nbuckets = 0;
+    dcache.used = 0;
+    dcache.head = dcache.tail = dcache.free_list = NIL;
+}
+
+static void alloc_dcache(void) {
+    dcache.nbuckets = 1;
+    while (dcache.nbuckets < dcache.capacity * 2) {
+        dcache.nbuckets <<= 1;
+    }
+    dcache.entries = (Dentry*)malloc(dcache.capacity * sizeof(Dentry));
+    dcache.buckets = (int*)malloc(dcache.nbuckets * sizeof(int));
+    if (!dcache.entries || !dcache.buckets) {
+        err_exit("alloc_dcache: failed to allocate memory for %zu entries", dcache.capacity);
+    }
+    for (size_t i = 0; i < dcache.nbuckets; ++i) {
+        dcache.buckets[i] = NIL;
+    }
+    dcache.used = 0;
+    dcache.head = dcache.tail = dcache.free_list = NIL;
+}
+
+static void lru_unlink(int i) {
+    Dentry* d = &dcache.entries[i];
+    if (d->prev != NIL) {
+        dcache.entries[d->prev].next = d->next;
+    } else {
+        dcache.head = d->next;
+    }
+    if (d->next != NIL) {
+        dcache.entries[d->next].prev = d->prev;
+    } else {
+        dcache.tail = d->prev;
+    }
+}
+
+static void lru_push_front(int i) {
+    Dentry* d = &dcache.entries[i];
+    d->prev = NIL;
+    d->next = dcache.head;
+    if (dcache.head != NIL) {
+        dcache.entries[dcache.head].prev = i;
+    }
+    dcache.head = i;
+    if (dcache.tail == NIL) {
+        dcache.tail = i;
+    }
+}
+
+static void hash_remove(int i) {
+    Dentry* d = &dcache.entries[i];
+    int* link = &dcache.buckets[hash_key(d->parent, d->name)];
+    while (*link != NIL) {
+        if (*link == i) {
+            *link = d->hnext;
+            return;
+        }
+        link = &dcache.entries[*link].hnext;
+    }
+}
+
+static int find(int parent, const char* name) {
+    for (int i = dcache.buckets[hash_key(parent, name)]; i != NIL; i = dcache.entries[i].hnext) {
+        if (dcache.entries[i].parent == parent && strcmp(dcache.entries[i].name, name) == 0) {
+            return i;
+        }
+    }
+    return NIL;
+}
+
+static void release(int i) {
+    hash_remove(i);
+    lru_unlink(i);
+    dcache.entries[i].next = dcache.free_list;
+    dcache.free_list = i;
+}
+
+// Names that can't be stored in a DirectoryEntry are never cached.
+static bool cacheable(const char* name) {
+    return dcache.capacity > 0 && strlen(name) <= MAX_DIRNAME_LEN;
+}
+
+// -------------------------------------
+
+void set_dcache_capacity(size_t nentries) {
+    pthread_mutex_lock(&dcache.lock);
+    free_dcache();
+    dcache.capacity = nentries;
+    pthread_mutex_unlock(&dcache.lock);
+    logMsg(INFO_LOG, "set_dcache_capacity: capacity=%zu entries", nentries);
+}
+
+size_t dcache_capacity() {
+    return dcache.capacity;
+}
+
+int dcache_lookup(int parent_inode_no, const char* name, int* inode_no) {
+    pthread_mutex_lock(&dcache.lock);
+    int i = dcache.entries != NULL && cacheable(name) ? find(parent_inode_no, name) : NIL;
+    int rc = -1;
+    if (i != NIL) {
+        if (dcache.head != i) {
+            lru_unlink(i);
+            lru_push_front(i);
+        }
+        rc = dcache.entries[i].inode_no == NEGATIVE ? 0 : 1;
+        if (rc == 1) {
+            *inode_no = dcache.entries[i].inode_no;
+        }
+    }
+    pthread_mutex_unlock(&dcache.lock);
+    STAT_ADD(rc < 0 ? STAT_DCACHE_MISSES : STAT_DCACHE_HITS, 1);
+    return rc;
+}
+
+void dcache_insert(int parent_inode_no, const char* name, int inode_no) {
+    pthread_mutex_lock(&dcache.lock);
+    if (!cacheable(name)) {
+        pthread_mutex_unlock(&dcache.lock);
+        return;
+    }
+    if (dcache.entries == NULL) {
+        alloc_dcache();
+    }
+    int i = find(parent_inode_no, name);
+    if (i != NIL) {
+        dcache.entries[i].inode_no = inode_no < 0 ? NEGATIVE : inode_no;
+        if (dcache.head != i) {
+            lru_unlink(i);
+            lru_push_front(i);
+        }
+        pthread_mutex_unlock(&dcache.lock);
+        return;
+    }
+    if (dcache.free_list != NIL) {
+        i = dcache.free_list;
+        dcache.free_list = dcache.entries[i].next;
+    } else if (dcache.used < dcache.capacity) {
+        i = (int)dcache.used++;
+    } else {
+        i = dcache.tail;
+        hash_remove(i);
+        lru_unlink(i);
+    }
+    Dentry* d = &dcache.entries[i];
+    d->parent = parent_inode_no;
+    d->inode_no = inode_no < 0 ? NEGATIVE : inode_no;
+    snprintf(d->name, sizeof(d->name), "%s", name);
+    size_t b = hash_key(parent_inode_no, name);
+    d->hnext = dcache.buckets[b];
+    dcache.buckets[b] = i;
+    lru_push_front(i);
+    pthread_mutex_unlock(&dcache.lock);
+}
+
+void dcache_remove(int parent_inode_no, const char* name) {
+    pthread_mutex_lock(&dcache.lock);
+    int i = dcache.entries != NULL && cacheable(name) ? find(parent_inode_no, name) : NIL;
+    if (i != NIL) {
+        release(i);
+    }
+    pthread_mutex_unlock(&dcache.lock);
+}
+
+void dcache_remove_children(int parent_inode_no) {
+    pthread_mutex_lock(&dcache.lock);
+    for (int i = dcache.entries != NULL ? dcache.head : NIL; i != NIL;) {
+        int next = dcache.entries[i].next;
+        if (dcache.entries[i].parent == parent_inode_no) {
+            release(i);
+        }
+        i = next;
+    }
+    pthread_mutex_unlock(&dcache.lock);
+}
+
+void invalidate_dcache() {
+    pthread_mutex_lock(&dcache.lock);
+    free_dcache();
+    pthread_mutex_unlock(&dcache.lock);
+}
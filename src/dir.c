@@ -1,60 +1,797 @@
 #include "dir.h"
 
 #include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "allocator.h"
+#include "dcache.h"
+#include "err.h"
+#include "extent.h"
 #include "fs.h"
 #include "inode.h"
 #include "logging.h"
+#include "stats.h"
+
+// --------------- LOCAL ---------------
+
+#define LINEAR_DIR_MAX_ENTRIES (LINEAR_DIR_MAX_BLOCKS * DIRENTS_PER_BLOCK)
+
+typedef struct {
+    DxHeader hdr;
+    DxEntry entries[];  // DX_ENTRIES_PER_BLOCK of them.
+} DxBlock;
+
+// Index blocks visited on the way from the root to a leaf.
+typedef struct {
+    DxBlock* root;
+    uint32_t root_pos;
+    DxBlock* node;  // Valid when `root->hdr.levels` is 1.
+    uint32_t node_pos;
+    size_t node_block;
+    size_t leaf_block;
+} DxPath;
+
+// Pairs an entry with its hash, for sorting.
+typedef struct {
+    uint32_t hash;
+    DirectoryEntry dirent;
+} HashedDirent;
+
+// FNV-1a; part of the on-disk format, so it must never change.
+static uint32_t name_hash(const char* name) {
+    uint32_t h = 2166136261u;
+    for (const unsigned char* p = (const unsigned char*)name; *p; ++p) {
+        h = (h ^ *p) * 16777619u;
+    }
+    return h;
+}
+
+static int compare_by_hash(const void* a, const void* b) {
+    uint32_t x = ((const HashedDirent*)a)->hash;
+    uint32_t y = ((const HashedDirent*)b)->hash;
+    return (x > y) - (x < y);
+}
+
+// Buffer of `nblocks` directory blocks; the caller frees it.
+static void* alloc_dir_buf(size_t nblocks) {
+    void* buf = malloc(nblocks * BLOCK_SIZE);
+    if (!buf) {
+        err_exit("alloc_dir_buf: failed to allocate memory");
+    }
+    return buf;
+}
+
+static bool dirent_is_free(const DirectoryEntry* d) {
+    return d->name[0] == '\0';
+}
+
+// Number of blocks that hold `nentries` directory entries.
+static size_t dir_blocks(size_t nentries) {
+    return (nentries * sizeof(DirectoryEntry) + BLOCK_SIZE - 1) / BLOCK_SIZE;
+}
+
+static int read_dir_block(const Inode* dir, size_t logical, void* buf) {
+    int block_no = extent_map_block(dir, logical);
+    if (block_no < 0) {
+        logMsg(ERROR_LOG, "read_dir_block: directory block %zu is not mapped", logical);
+        return -1;
+    }
+    read_data_block(block_no, buf, BLOCK_SIZE);
+    return 0;
+}
+
+static void write_dir_block(const Inode* dir, size_t logical, const void* buf) {
+    write_data_block(extent_map_block(dir, logical), buf, BLOCK_SIZE);
+}
+
+// Maps one more block at the end of the directory. Returns its logical index, or -1.
+static long grow_dir(Inode* dir) {
+    size_t logical = inode_num_blocks(dir);
+    int block_no = alloc_block();
+    if (block_no < 0) {
+        return -1;
+    }
+    if (extent_append(dir, (uint32_t)block_no, 1) != 0) {
+        free_block(block_no);
+        return -1;
+    }
+    return (long)logical;
+}
+
+/*
+ * Reads every block of a linear directory with one batched read.
+ * Returns them as one array (the caller frees it) and sets `n` to
+ * the number of entries, or returns NULL if the directory is corrupt.
+ */
+static DirectoryEntry* read_dirents(const Inode* dir, long* n) {
+    size_t nblocks = dir_blocks(dir->size);
+    if (nblocks > LINEAR_DIR_MAX_BLOCKS) {
+        logMsg(ERROR_LOG, "read_dirents: directory has too many entries: %zu", dir->size);
+        return NULL;
+    }
+    int block_nos[LINEAR_DIR_MAX_BLOCKS];
+    for (size_t b = 0; b < nblocks; ++b) {
+        block_nos[b] = extent_map_block(dir, b);
+    }
+    DirectoryEntry* dirents = (DirectoryEntry*)alloc_dir_buf(LINEAR_DIR_MAX_BLOCKS);
+    read_data_blocks(block_nos, nblocks, dirents);
+    *n = (long)dir->size;
+    return dirents;
+}
+
+static bool dx_block_is_valid(const DxBlock* b) {
+    return b->hdr.magic == DX_MAGIC && b->hdr.count >= 1 && b->hdr.count <= DX_ENTRIES_PER_BLOCK;
+}
+
+// Position of the last entry whose hash is <= `hash`; the first entry covers everything below.
+static uint32_t dx_find(const DxBlock* b, uint32_t hash) {
+    uint32_t lo = 1, hi = b->hdr.count;
+    while (lo < hi) {
+        uint32_t mid = lo + (hi - lo) / 2;
+        if (b->entries[mid].hash <= hash) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo - 1;
+}
+
+static void dx_insert_at(DxBlock* b, uint32_t pos, uint32_t hash, uint32_t block) {
+    memmove(&b->entries[pos + 1], &b->entries[pos], (b->hdr.count - pos) * sizeof(DxEntry));
+    b->entries[pos] = (DxEntry){hash, block};
+    b->hdr.count++;
+}
+
+static void dx_path_free(DxPath* p) {
+    free(p->root);
+    free(p->node);
+}
+
+// Walks the index down to the leaf that `hash` belongs in. Call `dx_path_free` afterwards.
+static int dx_probe(const Inode* dir, uint32_t hash, DxPath* p) {
+    p->root = (DxBlock*)alloc_dir_buf(1);
+    p->node = (DxBlock*)alloc_dir_buf(1);
+    if (read_dir_block(dir, 0, p->root) != 0 || !dx_block_is_valid(p->root) ||
+        p->root->hdr.levels > 1) {
+        logMsg(ERROR_LOG, "dx_probe: corrupt directory index root");
+        return -1;
+    }
+    p->root_pos = dx_find(p->root, hash);
+    p->leaf_block = p->root->entries[p->root_pos].block;
+    if (p->root->hdr.levels == 1) {
+        p->node_block = p->leaf_block;
+        if (read_dir_block(dir, p->node_block, p->node) != 0 || !dx_block_is_valid(p->node)) {
+            logMsg(ERROR_LOG, "dx_probe: corrupt directory index block %zu", p->node_block);
+            return -1;
+        }
+        p->node_pos = dx_find(p->node, hash);
+        p->leaf_block = p->node->entries[p->node_pos].block;
+    }
+    return 0;
+}
+
+/*
+ * Links a new leaf, holding names that hash to `hash` and above,
+ * right after the leaf `p` leads to. A full root moves its entries
+ * one level down; a full interior block is split in half.
+ */
+static int dx_link_leaf(Inode* dir, DxPath* p, uint32_t hash, uint32_t leaf) {
+    if (p->root->hdr.levels == 0) {
+        if (p->root->hdr.count < DX_ENTRIES_PER_BLOCK) {
+            dx_insert_at(p->root, p->root_pos + 1, hash, leaf);
+            write_dir_block(dir, 0, p->root);
+            return 0;
+        }
+        long node = grow_dir(dir);
+        if (node < 0) {
+            return -1;
+        }
+        memcpy(p->node, p->root, BLOCK_SIZE);
+        p->node_pos = p->root_pos;
+        p->node_block = (size_t)node;
+        p->root->hdr.levels = 1;
+        p->root->hdr.count = 1;
+        p->root->entries[0] = (DxEntry){0, (uint32_t)node};
+        p->root_pos = 0;
+        write_dir_block(dir, 0, p->root);
+    }
+    if (p->node->hdr.count < DX_ENTRIES_PER_BLOCK) {
+        dx_insert_at(p->node, p->node_pos + 1, hash, leaf);
+        write_dir_block(dir, p->node_block, p->node);
+        return 0;
+    }
+    long sibling_block = grow_dir(dir);
+    if (sibling_block < 0) {
+        return -1;
+    }
+    DxBlock* sibling = (DxBlock*)alloc_dir_buf(1);
+    memset(sibling, 0, BLOCK_SIZE);
+    uint32_t half = p->node->hdr.count / 2;
+    sibling->hdr.magic = DX_MAGIC;
+    sibling->hdr.count = p->node->hdr.count - half;
+    memcpy(sibling->entries, &p->node->entries[half], sibling->hdr.count * sizeof(DxEntry));
+    p->node->hdr.count = half;
+    if (p->node_pos + 1 <= half) {
+        dx_insert_at(p->node, p->node_pos + 1, hash, leaf);
+    } else {
+        dx_insert_at(sibling, p->node_pos + 1 - half, hash, leaf);
+    }
+    dx_insert_at(p->root, p->root_pos + 1, sibling->entries[0].hash, (uint32_t)sibling_block);
+    write_dir_block(dir, p->node_block, p->node);
+    write_dir_block(dir, (size_t)sibling_block, sibling);
+    write_dir_block(dir, 0, p->root);
+    free(sibling);
+    return 0;
+}
+
+/*
+ * Moves the upper half (by hash) of the full leaf `p` leads to into a
+ * new leaf. Names with equal hashes are never separated, so a lookup
+ * only ever has to search one leaf.
+ */
+static int dx_split_leaf(Inode* dir, DxPath* p, const DirectoryEntry* leaf) {
+    if (p->root->hdr.levels == 1 && p->node->hdr.count == DX_ENTRIES_PER_BLOCK &&
+        p->root->hdr.count == DX_ENTRIES_PER_BLOCK) {
+        logMsg(ERROR_LOG, "dx_split_leaf: directory index is full");
+        return -1;
+    }
+    HashedDirent* sorted = (HashedDirent*)malloc(DIRENTS_PER_BLOCK * sizeof(HashedDirent));
+    if (!sorted) {
+        err_exit("dx_split_leaf: failed to allocate memory");
+    }
+    size_t n = 0;
+    for (size_t i = 0; i < DIRENTS_PER_BLOCK; ++i) {
+        if (!dirent_is_free(&leaf[i])) {
+            sorted[n++] = (HashedDirent){name_hash(leaf[i].name), leaf[i]};
+        }
+    }
+    qsort(sorted, n, sizeof(HashedDirent), compare_by_hash);
+    size_t split = n / 2;
+    while (split < n && sorted[split].hash == sorted[split - 1].hash) {
+        split++;
+    }
+    if (split == n) {
+        split = n / 2;
+        while (split > 0 && sorted[split].hash == sorted[split - 1].hash) {
+            split--;
+        }
+    }
+    if (split == 0) {
+        logMsg(ERROR_LOG, "dx_split_leaf: too many names share one hash");
+        free(sorted);
+        return -1;
+    }
+    long new_leaf = grow_dir(dir);
+    if (new_leaf < 0 || dx_link_leaf(dir, p, sorted[split].hash, (uint32_t)new_leaf) != 0) {
+        free(sorted);
+        return -1;
+    }
+    // Lower half in the old leaf, upper half in the new one.
+    DirectoryEntry* halves = (DirectoryEntry*)alloc_dir_buf(2);
+    memset(halves, 0, 2 * BLOCK_SIZE);
+    for (size_t i = 0; i < n; ++i) {
+        halves[i < split ? i : DIRENTS_PER_BLOCK + i - split] = sorted[i].dirent;
+    }
+    write_dir_block(dir, p->leaf_block, halves);
+    write_dir_block(dir, (size_t)new_leaf, halves + DIRENTS_PER_BLOCK);
+    free(halves);
+    free(sorted);
+    return 0;
+}
+
+static int dx_lookup(const Inode* dir, const char* name, int* inode_no) {
+    DxPath p;
+    DirectoryEntry* leaf = (DirectoryEntry*)alloc_dir_buf(1);
+    int rc = -1;
+    if (dx_probe(dir, name_hash(name), &p) == 0 && read_dir_block(dir, p.leaf_block, leaf) == 0) {
+        STAT_ADD(STAT_DIRENT_BLOCKS, 2 + p.root->hdr.levels);
+        for (size_t i = 0; i < DIRENTS_PER_BLOCK; ++i) {
+            if (!dirent_is_free(&leaf[i]) && strcmp(leaf[i].name, name) == 0) {
+                *inode_no = leaf[i].inode_number;
+                rc = 0;
+                break;
+            }
+        }
+    }
+    dx_path_free(&p);
+    free(leaf);
+    return rc;
+}
+
+static int dx_add(Inode* dir, const DirectoryEntry* dirent) {
+    DxPath p;
+    DirectoryEntry* leaf = (DirectoryEntry*)alloc_dir_buf(1);
+    int rc = -1;
+    bool split = false;
+    if (dx_probe(dir, name_hash(dirent->name), &p) == 0 &&
+        read_dir_block(dir, p.leaf_block, leaf) == 0) {
+        size_t i = 0;
+        while (i < DIRENTS_PER_BLOCK && !dirent_is_free(&leaf[i])) {
+            i++;
+        }
+        if (i < DIRENTS_PER_BLOCK) {
+            leaf[i] = *dirent;
+            write_dir_block(dir, p.leaf_block, leaf);
+            rc = 0;
+        } else {
+            rc = dx_split_leaf(dir, &p, leaf);
+            split = rc == 0;
+        }
+    }
+    dx_path_free(&p);
+    free(leaf);
+    // Both halves of a split have room, so the retry cannot split again.
+    return split ? dx_add(dir, dirent) : rc;
+}
+
+static int dx_remove(const Inode* dir, const char* name) {
+    DxPath p;
+    DirectoryEntry* leaf = (DirectoryEntry*)alloc_dir_buf(1);
+    int rc = -1;
+    if (dx_probe(dir, name_hash(name), &p) == 0 && read_dir_block(dir, p.leaf_block, leaf) == 0) {
+        for (size_t i = 0; i < DIRENTS_PER_BLOCK; ++i) {
+            if (!dirent_is_free(&leaf[i]) && strcmp(leaf[i].name, name) == 0) {
+                memset(&leaf[i], 0, sizeof(DirectoryEntry));
+                write_dir_block(dir, p.leaf_block, leaf);
+                rc = 0;
+                break;
+            }
+        }
+    }
+    dx_path_free(&p);
+    free(leaf);
+    return rc;
+}
+
+/*
+ * Turns a full linear directory into an indexed one. Block 0
+ * becomes the index root and the entries are spread, in hash
+ * order, over half-full leaves so they can grow before splitting.
+ */
+static int dx_convert(Inode* dir) {
+    long n;
+    DirectoryEntry* dirents = read_dirents(dir, &n);
+    if (!dirents) {
+        return -1;
+    }
+    HashedDirent* sorted = (HashedDirent*)malloc((size_t)n * sizeof(HashedDirent));
+    DxBlock* root = (DxBlock*)alloc_dir_buf(1);
+    DirectoryEntry* leaf = (DirectoryEntry*)alloc_dir_buf(1);
+    if (!sorted) {
+        err_exit("dx_convert: failed to allocate memory");
+    }
+    for (long i = 0; i < n; ++i) {
+        sorted[i] = (HashedDirent){name_hash(dirents[i].name), dirents[i]};
+    }
+    free(dirents);
+    qsort(sorted, (size_t)n, sizeof(HashedDirent), compare_by_hash);
+    memset(root, 0, BLOCK_SIZE);
+    root->hdr.magic = DX_MAGIC;
+    size_t mapped = inode_num_blocks(dir);
+    size_t logical = 1;
+    int rc = 0;
+    for (long start = 0; start < n; ++logical) {
+        long half = (long)DIRENTS_PER_BLOCK / 2;
+        long end = start + half < n ? start + half : n;
+        while (end < n && sorted[end].hash == sorted[end - 1].hash) {
+            end++;
+        }
+        if (end - start > (long)DIRENTS_PER_BLOCK) {
+            logMsg(ERROR_LOG, "dx_convert: too many names share one hash");
+            rc = -1;
+            break;
+        }
+        if (logical >= mapped && grow_dir(dir) < 0) {
+            logMsg(ERROR_LOG, "dx_convert: failed to allocate a leaf");
+            rc = -1;
+            break;
+        }
+        memset(leaf, 0, BLOCK_SIZE);
+        for (long i = start; i < end; ++i) {
+            leaf[i - start] = sorted[i].dirent;
+        }
+        write_dir_block(dir, logical, leaf);
+        root->entries[root->hdr.count++] =
+            (DxEntry){start == 0 ? 0 : sorted[start].hash, (uint32_t)logical};
+        start = end;
+    }
+    if (rc == 0) {
+        write_dir_block(dir, 0, root);
+        inode_set_indexed(dir);
+        logMsg(INFO_LOG, "dx_convert: indexed a directory of %ld entries", n);
+    }
+    free(leaf);
+    free(root);
+    free(sorted);
+    return rc;
+}
+
+static int linear_add(Inode* dir, const DirectoryEntry* dirent) {
+    // Here, dir->size represents the number of directory entries used.
+    size_t slot = dir->size % DIRENTS_PER_BLOCK;
+    size_t logical = dir->size / DIRENTS_PER_BLOCK;
+    if (slot == 0 && logical > 0) {  // Need another block.
+        // Blocks emptied by `remove_dirent` stay mapped and are reused.
+        if (extent_map_block(dir, logical) < 0) {
+            logMsg(INFO_LOG, "Allocating data block.");
+            if (grow_dir(dir) < 0) {
+                return -1;
+            }
+        }
+        write_data_block(extent_map_block(dir, logical), dirent, sizeof(DirectoryEntry));
+    } else if (slot == 0) {
+        // Don't read current dirents, just write one entry.
+        // ! The first data block should be already
+        // ! allocated during directory creation.
+        write_data_block(extent_map_block(dir, 0), dirent, sizeof(DirectoryEntry));
+    } else {
+        DirectoryEntry* dirents = (DirectoryEntry*)alloc_dir_buf(1);
+        int block_no = extent_map_block(dir, logical);
+        read_data_block(block_no, dirents, BLOCK_SIZE);
+        dirents[slot] = *dirent;
+        write_data_block(block_no, dirents, BLOCK_SIZE);
+        free(dirents);
+    }
+    return 0;
+}
+
+// Moves the last entry into the removed one's slot to keep the array dense.
+static int linear_remove(const Inode* dir, const char* name) {
+    long n;
+    DirectoryEntry* dirents = read_dirents(dir, &n);
+    if (!dirents) {
+        return -1;
+    }
+    long idx = -1;
+    for (long i = 0; i < n; ++i) {
+        if (strcmp(dirents[i].name, name) == 0) {
+            idx = i;
+            break;
+        }
+    }
+    long last = n - 1;
+    if (idx >= 0 && idx != last) {
+        size_t b = (size_t)idx / DIRENTS_PER_BLOCK;
+        dirents[idx] = dirents[last];
+        write_dir_block(dir, b, &dirents[b * DIRENTS_PER_BLOCK]);
+    }
+    free(dirents);
+    return idx >= 0 ? 0 : -1;
+}
+
+static int find_dirent(const Inode* dir, const char* name, int* inode_no) {
+    STAT_ADD(STAT_DIRENT_LOOKUPS, 1);
+    if (inode_is_indexed(*dir)) {
+        return dx_lookup(dir, name, inode_no);
+    }
+    long n;
+    DirectoryEntry* dirents = read_dirents(dir, &n);
+    if (!dirents) {
+        return -1;
+    }
+    STAT_ADD(STAT_DIRENT_BLOCKS, dir_blocks(dir->size));
+    int rc = -1;
+    for (long i = 0; i < n; ++i) {
+        if (strcmp(dirents[i].name, name) == 0) {
+            *inode_no = dirents[i].inode_number;
+            rc = 0;
+            break;
+        }
+    }
+    free(dirents);
+    return rc;
+}
+
+// Appends the used slots of leaf `logical` to `out`, which has room for `cap` entries.
+static int dx_collect_leaf(
+    const Inode* dir, size_t logical, DirectoryEntry* out, size_t cap, size_t* n) {
+    DirectoryEntry* leaf = (DirectoryEntry*)alloc_dir_buf(1);
+    int rc = read_dir_block(dir, logical, leaf);
+    for (size_t i = 0; rc == 0 && i < DIRENTS_PER_BLOCK; ++i) {
+        if (dirent_is_free(&leaf[i])) {
+            continue;
+        }
+        if (*n == cap) {
+            rc = -1;
+            break;
+        }
+        out[(*n)++] = leaf[i];
+    }
+    free(leaf);
+    return rc;
+}
+
+// Walks the index, so blocks that no index entry leads to are not read.
+static DirectoryEntry* dx_list(const Inode* dir, size_t* n) {
+    size_t nblocks = inode_num_blocks(dir);
+    size_t cap = nblocks * DIRENTS_PER_BLOCK;
+    DirectoryEntry* dirents = (DirectoryEntry*)alloc_dir_buf(nblocks > 0 ? nblocks : 1);
+    DxBlock* root = (DxBlock*)alloc_dir_buf(1);
+    DxBlock* node = (DxBlock*)alloc_dir_buf(1);
+    *n = 0;
+    int rc = 0;
+    if (read_dir_block(dir, 0, root) != 0 || !dx_block_is_valid(root) || root->hdr.levels > 1) {
+        rc = -1;
+    }
+    for (uint32_t i = 0; rc == 0 && i < root->hdr.count; ++i) {
+        uint32_t block = root->entries[i].block;
+        if (root->hdr.levels == 0) {
+            rc = dx_collect_leaf(dir, block, dirents, cap, n);
+            continue;
+        }
+        if (read_dir_block(dir, block, node) != 0 || !dx_block_is_valid(node)) {
+            rc = -1;
+            break;
+        }
+        for (uint32_t j = 0; rc == 0 && j < node->hdr.count; ++j) {
+            rc = dx_collect_leaf(dir, node->entries[j].block, dirents, cap, n);
+        }
+    }
+    free(node);
+    free(root);
+    if (rc != 0) {
+        logMsg(ERROR_LOG, "dx_list: corrupt directory index");
+        free(dirents);
+        return NULL;
+    }
+    return dirents;
+}
+
+/*
+ * A readdir cookie is the position just past the last entry returned,
+ * in (hash, name) order: the hash in the high half, and in the low half
+ * how many entries with that hash have been returned. Positions survive
+ * entries being added and removed elsewhere in the directory, and in an
+ * indexed one they lead straight to the right leaf.
+ */
+static uint32_t cookie_hash(uint64_t cookie) {
+    return (uint32_t)(cookie >> 32);
+}
+
+static uint32_t cookie_rank(uint64_t cookie) {
+    return (uint32_t)cookie;
+}
+
+static int compare_by_hash_name(const void* a, const void* b) {
+    int c = compare_by_hash(a, b);
+    if (c != 0) {
+        return c;
+    }
+    return strcmp(((const HashedDirent*)a)->dirent.name, ((const HashedDirent*)b)->dirent.name);
+}
+
+/*
+ * Sorts the used slots among `dirents` and appends those past `*cookie`
+ * to `out`, until it holds `max` entries; `*cookie` follows the last one.
+ * Names with equal hashes share a leaf, so each group is sorted whole.
+ */
+static void take_past_cookie(
+    const DirectoryEntry* dirents,
+    size_t n,
+    uint64_t* cookie,
+    DirectoryEntry* out,
+    size_t max,
+    size_t* taken) {
+    HashedDirent* sorted = (HashedDirent*)malloc((n > 0 ? n : 1) * sizeof(HashedDirent));
+    if (!sorted) {
+        err_exit("take_past_cookie: failed to allocate memory");
+    }
+    size_t used = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (!dirent_is_free(&dirents[i])) {
+            sorted[used++] = (HashedDirent){name_hash(dirents[i].name), dirents[i]};
+        }
+    }
+    qsort(sorted, used, sizeof(HashedDirent), compare_by_hash_name);
+    uint32_t after_hash = cookie_hash(*cookie), after_rank = cookie_rank(*cookie);
+    uint32_t rank = 0;
+    for (size_t i = 0; i < used && *taken < max; ++i) {
+        rank = i > 0 && sorted[i].hash == sorted[i - 1].hash ? rank + 1 : 0;
+        if (sorted[i].hash < after_hash || (sorted[i].hash == after_hash && rank < after_rank)) {
+            continue;
+        }
+        out[(*taken)++] = sorted[i].dirent;
+        *cookie = ((uint64_t)sorted[i].hash << 32) | (rank + 1);
+    }
+    free(sorted);
+}
+
+static int dx_read_leaf_past_cookie(
+    const Inode* dir,
+    size_t logical,
+    uint64_t* cookie,
+    DirectoryEntry* out,
+    size_t max,
+    size_t* taken) {
+    DirectoryEntry* leaf = (DirectoryEntry*)alloc_dir_buf(1);
+    int rc = read_dir_block(dir, logical, leaf);
+    if (rc == 0) {
+        STAT_ADD(STAT_DIRENT_BLOCKS, 1);
+        take_past_cookie(leaf, DIRENTS_PER_BLOCK, cookie, out, max, taken);
+    }
+    free(leaf);
+    return rc;
+}
+
+/*
+ * Probes the index for the cookie's leaf, then reads leaves in index
+ * order until the batch is full. A batch costs one probe plus the
+ * leaves it returns entries from.
+ */
+static int dx_readdir(
+    const Inode* dir, uint64_t* cookie, DirectoryEntry* out, size_t max, size_t* taken) {
+    DxPath p;
+    int rc = dx_probe(dir, cookie_hash(*cookie), &p);
+    if (rc == 0) {
+        STAT_ADD(STAT_DIRENT_BLOCKS, 1 + p.root->hdr.levels);
+    }
+    for (uint32_t i = p.root_pos; rc == 0 && i < p.root->hdr.count && *taken < max; ++i) {
+        if (p.root->hdr.levels == 0) {
+            rc = dx_read_leaf_past_cookie(dir, p.root->entries[i].block, cookie, out, max, taken);
+            continue;
+        }
+        uint32_t j = 0;
+        if (i == p.root_pos) {
+            j = p.node_pos;
+        } else if (read_dir_block(dir, p.root->entries[i].block, p.node) != 0 ||
+                   !dx_block_is_valid(p.node)) {
+            rc = -1;
+            break;
+        } else {
+            STAT_ADD(STAT_DIRENT_BLOCKS, 1);
+        }
+        for (; rc == 0 && j < p.node->hdr.count && *taken < max; ++j) {
+            rc = dx_read_leaf_past_cookie(dir, p.node->entries[j].block, cookie, out, max, taken);
+        }
+    }
+    dx_path_free(&p);
+    if (rc != 0) {
+        logMsg(ERROR_LOG, "dx_readdir: corrupt directory index");
+    }
+    return rc;
+}
+
+// Reads the directory inode once its lock is held. A directory may
+// have been removed while the caller waited for the lock.
+static bool read_dir_inode(int dir_inode_no, Inode* dir) {
+    return read_inode(dir_inode_no, dir) == 1 && inode_is_valid(*dir) && inode_is_dir(*dir);
+}
+
+// -------------------------------------
+
+DirectoryEntry* list_dirents(const Inode* dir, size_t* n) {
+    if (inode_is_indexed(*dir)) {
+        return dx_list(dir, n);
+    }
+    if (dir_blocks(dir->size) > inode_num_blocks(dir)) {
+        logMsg(ERROR_LOG, "list_dirents: %zu entries do not fit the directory", dir->size);
+        return NULL;
+    }
+    long count;
+    DirectoryEntry* dirents = read_dirents(dir, &count);
+    *n = dirents ? (size_t)count : 0;
+    return dirents;
+}
+
+/*
+ * Lookups share the directory's lock, so lookups in one directory run
+ * in parallel. The dentry cache is filled under the same lock, which
+ * keeps it from caching a result that an add or remove just changed.
+ */
+int lookup_dirent(int dir_inode_no, const char* name, int* inode_no) {
+    inode_rdlock(dir_inode_no);
+    Inode dir;
+    if (!read_dir_inode(dir_inode_no, &dir)) {
+        inode_unlock(dir_inode_no);
+        return -1;
+    }
+    int hit = dcache_lookup(dir_inode_no, name, inode_no);
+    int rc = hit > 0 ? 0 : -1;
+    if (hit < 0) {
+        rc = find_dirent(&dir, name, inode_no);
+        dcache_insert(dir_inode_no, name, rc == 0 ? *inode_no : -1);
+    }
+    inode_unlock(dir_inode_no);
+    return rc;
+}
 
 /*
  * Adds a DirectoryEntry for inode to a given parent inode.
  * Allocates a new block if necessary.
  */
-void add_dirent(int parent_inode_no, DirectoryEntry dirent) {
+int add_dirent(int parent_inode_no, DirectoryEntry dirent) {
     logMsg(
         INFO_LOG,
         "Adding a directory entry. [parent_inode_no=%d\tname=%s]",
         parent_inode_no,
         dirent.name);
+    inode_wrlock(parent_inode_no);
     Inode inode;
-    read_inode(parent_inode_no, &inode);
-    // Here, inode.size represents the number of directory entries used.
-    switch (inode.size) {
-        case 0:
-            // Don't read current dirents, just write one entry.
-            // ! The first data block should be already
-            // ! allocated during directory creation.
-            logMsg(INFO_LOG, "Writing to the first data block.");
-            write_data_block(inode.data_blocks[0], (void*)&dirent, sizeof(DirectoryEntry));
-            inode.size = 1;
-            break;
-        default: {
-            // Number of blocks that are used based on the
-            // number of directory entries (inode.size).
-            size_t nblocks = (inode.size * sizeof(DirectoryEntry) + BLOCK_SIZE - 1) / BLOCK_SIZE;
-            if (inode.size % DIRENTS_PER_BLOCK == 0) {  // Need to allocate a new block.
-                if (nblocks >= MAX_INODE_DATA_BLOCKS) {
-                    logMsg(ERROR_LOG, "Maximum number of directory entries reached.");
-                    return;
-                }
-                logMsg(INFO_LOG, "Allocating data block.");
-                int block_no = alloc_block();
-                if (block_no < 0) {
-                    return;
-                }
-                inode.data_blocks[nblocks] = block_no;
-                write_data_block(block_no, (void*)&dirent, sizeof(DirectoryEntry));
-            } else {
-                DirectoryEntry dirents[DIRENTS_PER_BLOCK];
-                read_data_block(inode.data_blocks[nblocks - 1], dirents, BLOCK_SIZE);
-                dirents[inode.size % DIRENTS_PER_BLOCK] = dirent;
-                write_data_block(inode.data_blocks[nblocks - 1], dirents, BLOCK_SIZE);
-            }
-            inode.size += 1;
-            break;
-        }
+    if (!read_dir_inode(parent_inode_no, &inode)) {
+        inode_unlock(parent_inode_no);
+        return -1;
+    }
+    // Checked under the lock, so two racing creates of one name can't both succeed.
+    int existing;
+    if (find_dirent(&inode, dirent.name, &existing) == 0) {
+        logMsg(WARN_LOG, "add_dirent: %s already exists in inode %d", dirent.name, parent_inode_no);
+        inode_unlock(parent_inode_no);
+        return -1;
     }
-    // Write update inode back.
+    if (!inode_is_indexed(inode) && inode.size == LINEAR_DIR_MAX_ENTRIES &&
+        dx_convert(&inode) != 0) {
+        // Blocks mapped before the failure still belong to the directory.
+        write_inode(parent_inode_no, inode);
+        inode_unlock(parent_inode_no);
+        return -1;
+    }
+    int rc = inode_is_indexed(inode) ? dx_add(&inode, &dirent) : linear_add(&inode, &dirent);
+    if (rc == 0) {
+        inode.size += 1;
+    } else {
+        logMsg(ERROR_LOG, "add_dirent: failed to add %s", dirent.name);
+    }
+    // Write the updated inode back; blocks may have been mapped even on failure.
     write_inode(parent_inode_no, inode);
+    if (rc == 0) {
+        dcache_insert(parent_inode_no, dirent.name, dirent.inode_number);
+    }
+    inode_unlock(parent_inode_no);
+    return rc;
+}
+
+/*
+ * Removes the entry called `name` from a directory.
+ */
+int remove_dirent(int parent_inode_no, const char* name) {
+    inode_wrlock(parent_inode_no);
+    Inode inode;
+    if (!read_dir_inode(parent_inode_no, &inode)) {
+        inode_unlock(parent_inode_no);
+        return -1;
+    }
+    int rc = inode_is_indexed(inode) ? dx_remove(&inode, name) : linear_remove(&inode, name);
+    if (rc != 0) {
+        inode_unlock(parent_inode_no);
+        logMsg(WARN_LOG, "remove_dirent: no entry %s in inode %d", name, parent_inode_no);
+        return -1;
+    }
+    inode.size -= 1;
+    write_inode(parent_inode_no, inode);
+    dcache_insert(parent_inode_no, name, -1);
+    inode_unlock(parent_inode_no);
+    return 0;
+}
+
+/*
+ * Shares the directory's lock, like lookups. Linear directories hold
+ * at most LINEAR_DIR_MAX_BLOCKS blocks and are read whole each batch.
+ */
+long readdir_dirents(int dir_inode_no, uint64_t* cookie, DirectoryEntry* out, size_t max) {
+    inode_rdlock(dir_inode_no);
+    Inode dir;
+    if (!read_dir_inode(dir_inode_no, &dir)) {
+        inode_unlock(dir_inode_no);
+        return -1;
+    }
+    size_t taken = 0;
+    int rc = 0;
+    if (inode_is_indexed(dir)) {
+        rc = dx_readdir(&dir, cookie, out, max, &taken);
+    } else {
+        long n;
+        DirectoryEntry* dirents = read_dirents(&dir, &n);
+        if (dirents) {
+            STAT_ADD(STAT_DIRENT_BLOCKS, dir_blocks(dir.size));
+            take_past_cookie(dirents, (size_t)n, cookie, out, max, &taken);
+            free(dirents);
+        } else {
+            rc = -1;
+        }
+    }
+    inode_unlock(dir_inode_no);
+    return rc == 0 ? (long)taken : -1;
 }
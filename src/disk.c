@@ -1,46 +1,394 @@
 #include "disk.h"
 
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
+#if defined(__linux__) && defined(__has_include)
+#if __has_include(<linux/io_uring.h>)
+#include <linux/io_uring.h>
+#include <sys/syscall.h>
+#define HAVE_IO_URING 1
+#endif
+#endif
+
 #include "allocator.h"
+#include "cache.h"
+#include "dcache.h"
 #include "err.h"
+#include "file.h"
+#include "inode.h"
+#include "journal.h"
 #include "logging.h"
+#include "readahead.h"
+#include "stats.h"
 #include "super.h"
 
 // TODO Add multiple disk support.
 // TODO  - Possibly return an ID for each mounted disk.
-// TODO  - Possibly use multithreading.
+
+// Image permissions for `create_disk_fs`.
+#define DISKPERMS 0644
+// Submission queue depth of the io_uring engine.
+#define URING_ENTRIES 64
+// Writes a plug may hold before it is submitted anyway.
+#define PLUG_MAX_WRITES 64
 
 // --------------- LOCAL ---------------
 
+/*
+ * All I/O is positional (pread/pwrite or the mapping), so there
+ * is no shared file offset. Once mounted, the fields below are
+ * only read, and I/O may be issued from several threads at once.
+ */
 typedef struct {
-    FILE* fp;
+    int fd;
     char img_fn[64];
     size_t size;
-    // true - disk has been mounted (`fp` is an open file).
-    // false - hasn't been mounted yet (`fp` is NULL).
+    // true - disk has been mounted (`fd` is an open file).
+    // false - hasn't been mounted yet (`fd` is -1).
     bool is_mounted;
+    DiskMode mode;
+    // DISK_MODE_MMAP only: the whole image.
+    uint8_t* map;
+    // Sticky; set by the first failed read or write.
+    bool io_error;
 } Disk;
 
-static Disk disk = {NULL, {}, 0, false};
+static Disk disk = {-1, {}, 0, false, DISK_MODE_PREAD, NULL, false};
+// Mode used by the next `mount_fs`/`create_disk_fs`.
+static DiskMode requested_mode = DISK_MODE_PREAD;
+
+/*
+ * Writes issued between `plug_disk` and `unplug_disk` are held
+ * here (per thread) and go out together as one batch. Only the
+ * io_uring engine plugs; the other engines write immediately.
+ */
+typedef struct {
+    size_t depth;
+    size_t nwrites;
+    DiskIoReq reqs[PLUG_MAX_WRITES];
+    struct iovec iov[PLUG_MAX_WRITES];
+} Plug;
+
+static _Thread_local Plug plug = {0};
+
+#ifndef MINIFS_NO_STATS
+// Where the last request issued to the engine ended; a request starting elsewhere counts as a seek.
+static atomic_llong io_end = 0;
+
+static void count_io(DiskIoOp op, off_t offset, size_t nbytes) {
+    STAT_ADD(op == DISK_IO_READ ? STAT_DISK_READS : STAT_DISK_WRITES, 1);
+    STAT_ADD(op == DISK_IO_READ ? STAT_DISK_READ_BYTES : STAT_DISK_WRITE_BYTES, nbytes);
+    long long end = (long long)offset + (long long)nbytes;
+    if (atomic_exchange_explicit(&io_end, end, memory_order_relaxed) != (long long)offset) {
+        STAT_ADD(STAT_DISK_SEEKS, 1);
+    }
+}
+#else
+#define count_io(op, offset, nbytes) ((void)0)
+#endif
+
+static size_t submit_sync(DiskIoReq* reqs, size_t n);
+
+#ifdef HAVE_IO_URING
+
+typedef struct {
+    int fd;
+    unsigned *sq_head, *sq_tail, *sq_mask, *sq_array;
+    unsigned *cq_head, *cq_tail, *cq_mask;
+    struct io_uring_sqe* sqes;
+    struct io_uring_cqe* cqes;
+    void* sq_ring;
+    size_t sq_ring_sz;
+    void* cq_ring;
+    size_t cq_ring_sz;
+    size_t sqes_sz;
+    // One batch in flight at a time.
+    pthread_mutex_t lock;
+} Uring;
+
+static Uring ring = {.fd = -1, .lock = PTHREAD_MUTEX_INITIALIZER};
+
+static void uring_teardown(void) {
+    if (ring.fd < 0) {
+        return;
+    }
+    if (ring.sqes) {
+        munmap(ring.sqes, ring.sqes_sz);
+    }
+    if (ring.cq_ring && ring.cq_ring != ring.sq_ring) {
+        munmap(ring.cq_ring, ring.cq_ring_sz);
+    }
+    if (ring.sq_ring) {
+        munmap(ring.sq_ring, ring.sq_ring_sz);
+    }
+    close(ring.fd);
+    ring.fd = -1;
+    ring.sqes = NULL;
+    ring.sq_ring = ring.cq_ring = NULL;
+}
+
+static int uring_setup(void) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    ring.fd = (int)syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+    if (ring.fd < 0) {
+        return -1;
+    }
+    ring.sq_ring_sz = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    ring.cq_ring_sz = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (ring.cq_ring_sz > ring.sq_ring_sz) {
+            ring.sq_ring_sz = ring.cq_ring_sz;
+        }
+        ring.cq_ring_sz = ring.sq_ring_sz;
+    }
+    ring.sq_ring = mmap(
+        NULL,
+        ring.sq_ring_sz,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        ring.fd,
+        IORING_OFF_SQ_RING);
+    if (ring.sq_ring == MAP_FAILED) {
+        ring.sq_ring = NULL;
+        uring_teardown();
+        return -1;
+    }
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring.cq_ring = ring.sq_ring;
+    } else {
+        ring.cq_ring = mmap(
+            NULL,
+            ring.cq_ring_sz,
+            PROT_READ | PROT_WRITE,
+            MAP_SHARED | MAP_POPULATE,
+            ring.fd,
+            IORING_OFF_CQ_RING);
+        if (ring.cq_ring == MAP_FAILED) {
+            ring.cq_ring = NULL;
+            uring_teardown();
+            return -1;
+        }
+    }
+    ring.sqes_sz = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring.sqes = mmap(
+        NULL,
+        ring.sqes_sz,
+        PROT_READ | PROT_WRITE,
+        MAP_SHARED | MAP_POPULATE,
+        ring.fd,
+        IORING_OFF_SQES);
+    if (ring.sqes == MAP_FAILED) {
+        ring.sqes = NULL;
+        uring_teardown();
+        return -1;
+    }
+    uint8_t* sq = (uint8_t*)ring.sq_ring;
+    uint8_t* cq = (uint8_t*)ring.cq_ring;
+    ring.sq_head = (unsigned*)(sq + p.sq_off.head);
+    ring.sq_tail = (unsigned*)(sq + p.sq_off.tail);
+    ring.sq_mask = (unsigned*)(sq + p.sq_off.ring_mask);
+    ring.sq_array = (unsigned*)(sq + p.sq_off.array);
+    ring.cq_head = (unsigned*)(cq + p.cq_off.head);
+    ring.cq_tail = (unsigned*)(cq + p.cq_off.tail);
+    ring.cq_mask = (unsigned*)(cq + p.cq_off.ring_mask);
+    ring.cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    return 0;
+}
+
+// Moves every completion posted so far into its request. Returns how many there were.
+static unsigned uring_reap(DiskIoReq* reqs) {
+    unsigned head = *ring.cq_head;
+    unsigned cq_tail = __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE);
+    unsigned reaped = 0;
+    while (head != cq_tail) {
+        struct io_uring_cqe* cqe = &ring.cqes[head & *ring.cq_mask];
+        if (cqe->res > 0) {
+            reqs[cqe->user_data].result = (size_t)cqe->res;
+        }
+        head++;
+        reaped++;
+    }
+    __atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+    return reaped;
+}
+
+/*
+ * After `io_uring_enter` fails, no completion may be left to land in a
+ * later batch, whose `user_data` indexes different requests. SQEs the
+ * kernel never consumed are withdrawn and the rest are waited for.
+ * Requests without a completion keep a result of 0, which marks them
+ * failed. Returns false if the wait failed too.
+ */
+static bool uring_drain(DiskIoReq* reqs, unsigned tail, unsigned reaped) {
+    // Without SQPOLL the kernel only consumes SQEs inside `io_uring_enter`, and we hold the lock.
+    unsigned submitted = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE) - tail;
+    __atomic_store_n(ring.sq_tail, tail + submitted, __ATOMIC_RELEASE);
+    while (reaped < submitted) {
+        int rc = (int)syscall(
+            __NR_io_uring_enter, ring.fd, 0, submitted - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0 && errno != EINTR && errno != EAGAIN && errno != EBUSY) {
+            return false;
+        }
+        reaped += uring_reap(reqs);
+    }
+    return true;
+}
+
+// Queues up to URING_ENTRIES requests, submits them with one syscall and reaps all completions.
+static void uring_submit_chunk(DiskIoReq* reqs, unsigned n) {
+    unsigned tail = *ring.sq_tail;
+    unsigned mask = *ring.sq_mask;
+    for (unsigned i = 0; i < n; ++i) {
+        unsigned idx = (tail + i) & mask;
+        struct io_uring_sqe* sqe = &ring.sqes[idx];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = reqs[i].op == DISK_IO_READ ? IORING_OP_READV : IORING_OP_WRITEV;
+        sqe->fd = disk.fd;
+        sqe->addr = (uint64_t)(uintptr_t)reqs[i].iov;
+        sqe->len = (uint32_t)reqs[i].iovcnt;
+        sqe->off = (uint64_t)reqs[i].offset;
+        sqe->user_data = i;
+        ring.sq_array[idx] = idx;
+        reqs[i].result = 0;
+    }
+    __atomic_store_n(ring.sq_tail, tail + n, __ATOMIC_RELEASE);
+
+    unsigned to_submit = n;
+    unsigned reaped = 0;
+    while (reaped < n) {
+        int rc = (int)syscall(
+            __NR_io_uring_enter, ring.fd, to_submit, n - reaped, IORING_ENTER_GETEVENTS, NULL, 0);
+        if (rc < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            logMsg(ERROR_LOG, "uring_submit_chunk: `io_uring_enter` failed");
+            if (!uring_drain(reqs, tail, reaped)) {
+                // Completions may still arrive; the ring can't be reused.
+                logMsg(ERROR_LOG, "uring_submit_chunk: cannot drain the ring; using pread/pwrite");
+                uring_teardown();
+            }
+            return;
+        }
+        to_submit -= (unsigned)rc < to_submit ? (unsigned)rc : to_submit;
+        reaped += uring_reap(reqs);
+    }
+}
+
+static size_t uring_submit(DiskIoReq* reqs, size_t n) {
+    for (size_t i = 0; i < n; ++i) {
+        size_t total = 0;
+        for (int j = 0; j < reqs[i].iovcnt; ++j) {
+            total += reqs[i].iov[j].iov_len;
+        }
+        count_io(reqs[i].op, reqs[i].offset, total);
+    }
+    pthread_mutex_lock(&ring.lock);
+    for (size_t done = 0; done < n;) {
+        unsigned chunk = n - done > URING_ENTRIES ? URING_ENTRIES : (unsigned)(n - done);
+        if (ring.fd < 0) {
+            // Torn down after a failure; everything left goes the synchronous way.
+            for (size_t i = done; i < n; ++i) {
+                reqs[i].result = 0;
+            }
+            break;
+        }
+        uring_submit_chunk(reqs + done, chunk);
+        done += chunk;
+    }
+    pthread_mutex_unlock(&ring.lock);
+    // Failed or short requests are retried synchronously.
+    size_t ncomplete = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t total = 0;
+        for (int j = 0; j < reqs[i].iovcnt; ++j) {
+            total += reqs[i].iov[j].iov_len;
+        }
+        if (reqs[i].result != total) {
+            submit_sync(&reqs[i], 1);
+        }
+        ncomplete += reqs[i].result == total;
+    }
+    return ncomplete;
+}
+
+#endif  // HAVE_IO_URING
+
+static void stop_engine(void) {
+    if (disk.map != NULL) {
+        munmap(disk.map, disk.size);
+    }
+    disk.map = NULL;
+#ifdef HAVE_IO_URING
+    uring_teardown();
+#endif
+}
+
+static int start_engine(void) {
+    disk.mode = requested_mode;
+    if (disk.mode == DISK_MODE_URING) {
+#ifdef HAVE_IO_URING
+        if (uring_setup() == 0) {
+            return 0;
+        }
+#endif
+        logMsg(WARN_LOG, "start_engine: io_uring is unavailable; using pread/pwrite");
+        disk.mode = DISK_MODE_PREAD;
+        return 0;
+    }
+    if (disk.mode != DISK_MODE_MMAP) {
+        return 0;
+    }
+    if (disk.size == 0) {
+        logMsg(ERROR_LOG, "start_engine: cannot map an empty disk image");
+        return -1;
+    }
+    void* map = mmap(NULL, disk.size, PROT_READ | PROT_WRITE, MAP_SHARED, disk.fd, 0);
+    if (map == MAP_FAILED) {
+        logMsg(ERROR_LOG, "start_engine: `mmap` failed");
+        return -1;
+    }
+    disk.map = (uint8_t*)map;
+    return 0;
+}
 
 static void free_disk(void) {
-    if (disk.fp) {
-        fclose(disk.fp);
+    stop_readahead();
+    stop_engine();
+    if (disk.fd >= 0) {
+        close(disk.fd);
     }
-    disk.fp = NULL;
+    disk.fd = -1;
     disk.img_fn[0] = '\0';
     disk.size = 0;
     disk.is_mounted = false;
+    disk.io_error = false;
+    invalidate_cache();
+    invalidate_dcache();
+    close_all_files();
+    free_delayed_files();
+    free_inode_table();
+    free_bitmap();
+    free_journal();
+    unload_super();
 }
 
-static int open_disk(const char* disk_img_fn, const char* filemode) {
+static int open_disk(const char* disk_img_fn, int flags) {
     if (disk.is_mounted) {
         logMsg(
             ERROR_LOG, "open_disk: there is a mounted disk at %s; unmount it first", disk.img_fn);
@@ -59,8 +407,8 @@ static int open_disk(const char* disk_img_fn, const char* filemode) {
     }
     snprintf(disk.img_fn, sizeof(disk.img_fn), "%s", disk_img_fn);
     logMsg(INFO_LOG, "open_disk: mounting disk at %s", disk_img_fn);
-    disk.fp = fopen(disk_img_fn, filemode);
-    if (disk.fp == NULL) {
+    disk.fd = open(disk_img_fn, flags | O_CLOEXEC, DISKPERMS);
+    if (disk.fd < 0) {
         logMsg(ERROR_LOG, "open_disk: failed to open the disk image");
         free_disk();
         return -1;
@@ -68,25 +416,191 @@ static int open_disk(const char* disk_img_fn, const char* filemode) {
     return 0;
 }
 
+/*
+ * pread/pwrite may transfer fewer bytes than requested;
+ * these loop until everything is done or an error occurs.
+ * Return the number of bytes transferred.
+ */
+static size_t pread_full(void* buf, size_t nbytes, off_t offset) {
+    size_t done = 0;
+    while (done < nbytes) {
+        ssize_t n = pread(disk.fd, (uint8_t*)buf + done, nbytes - done, offset + (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            disk.io_error = true;
+            break;
+        }
+        done += (size_t)n;
+    }
+    return done;
+}
+
+static size_t pwrite_full(const void* buf, size_t nbytes, off_t offset) {
+    size_t done = 0;
+    while (done < nbytes) {
+        ssize_t n =
+            pwrite(disk.fd, (const uint8_t*)buf + done, nbytes - done, offset + (off_t)done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            disk.io_error = true;
+            break;
+        }
+        done += (size_t)n;
+    }
+    return done;
+}
+
+static size_t iov_total(const struct iovec* iov, int iovcnt) {
+    size_t total = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        total += iov[i].iov_len;
+    }
+    return total;
+}
+
+static size_t submit_sync(DiskIoReq* reqs, size_t n) {
+    size_t ncomplete = 0;
+    for (size_t i = 0; i < n; ++i) {
+        size_t total = iov_total(reqs[i].iov, reqs[i].iovcnt);
+        if (reqs[i].op == DISK_IO_READ) {
+            reqs[i].result = readv_from_disk_at(reqs[i].iov, reqs[i].iovcnt, reqs[i].offset);
+        } else {
+            reqs[i].result = writev_to_disk_at(reqs[i].iov, reqs[i].iovcnt, reqs[i].offset);
+        }
+        ncomplete += reqs[i].result == total;
+    }
+    return ncomplete;
+}
+
+static bool ranges_overlap(off_t a, size_t alen, off_t b, size_t blen) {
+    return a < b + (off_t)blen && b < a + (off_t)alen;
+}
+
+// Submits and releases every write held by this thread's plug.
+static void submit_plug(void) {
+    if (plug.nwrites == 0) {
+        return;
+    }
+    size_t n = plug.nwrites;
+    plug.nwrites = 0;
+#ifdef HAVE_IO_URING
+    size_t ncomplete =
+        disk.mode == DISK_MODE_URING ? uring_submit(plug.reqs, n) : submit_sync(plug.reqs, n);
+#else
+    size_t ncomplete = submit_sync(plug.reqs, n);
+#endif
+    if (ncomplete != n) {
+        logMsg(ERROR_LOG, "submit_plug: %zu of %zu writes failed", n - ncomplete, n);
+    }
+    for (size_t i = 0; i < n; ++i) {
+        free(plug.iov[i].iov_base);
+    }
+}
+
+// Writes held by the plug must reach the disk before anything that overlaps them.
+static void submit_plug_if_overlaps(off_t offset, size_t nbytes) {
+    for (size_t i = 0; i < plug.nwrites; ++i) {
+        if (ranges_overlap(offset, nbytes, plug.reqs[i].offset, plug.iov[i].iov_len)) {
+            submit_plug();
+            return;
+        }
+    }
+}
+
+static bool plug_write(const void* buf, size_t nbytes, off_t offset) {
+    // Rewriting the exact same range just replaces the held data.
+    for (size_t i = 0; i < plug.nwrites; ++i) {
+        if (plug.reqs[i].offset == offset && plug.iov[i].iov_len == nbytes) {
+            memcpy(plug.iov[i].iov_base, buf, nbytes);
+            return true;
+        }
+    }
+    submit_plug_if_overlaps(offset, nbytes);
+    if (plug.nwrites == PLUG_MAX_WRITES) {
+        submit_plug();
+    }
+    void* copy = malloc(nbytes);
+    if (!copy) {
+        return false;
+    }
+    memcpy(copy, buf, nbytes);
+    size_t i = plug.nwrites++;
+    plug.iov[i].iov_base = copy;
+    plug.iov[i].iov_len = nbytes;
+    plug.reqs[i].op = DISK_IO_WRITE;
+    plug.reqs[i].iov = &plug.iov[i];
+    plug.reqs[i].iovcnt = 1;
+    plug.reqs[i].offset = offset;
+    plug.reqs[i].result = 0;
+    return true;
+}
+
+// Writes everything held in memory (bitmap, inode table, cached blocks) back to the disk.
+static bool write_back_metadata(void) {
+    if (journal_is_loaded()) {
+        return journal_commit();
+    }
+    if (bitmap_is_loaded()) {
+        flush_bitmap_to_disk();
+    }
+    bool ok = flush_inode_table_to_disk();
+    return flush_cache_to_disk() && ok;
+}
+
 // -------------------------------------
 
 int mount_fs(const char* disk_img_fn) {
     logMsg(INFO_LOG, "mount_fs: mounting disk %s", disk_img_fn);
-    if (open_disk(disk_img_fn, "rb+") != 0) {
+    if (open_disk(disk_img_fn, O_RDWR) != 0) {
         logMsg(ERROR_LOG, "mount_fs: failed to open disk at %s", disk_img_fn);
         return -1;
     }
+    struct stat st;
+    if (fstat(disk.fd, &st) != 0) {
+        logMsg(ERROR_LOG, "mount_fs: `fstat` failed for %s", disk_img_fn);
+        free_disk();
+        return -1;
+    }
+    disk.size = (size_t)st.st_size;
+    if (start_engine() != 0) {
+        logMsg(ERROR_LOG, "mount_fs: failed to start the I/O engine for %s", disk_img_fn);
+        free_disk();
+        return -1;
+    }
     disk.is_mounted = true;
-    // Use 'fseeko' in case the disk image is too large (>2GB).
-    if (fseeko(disk.fp, 0, SEEK_END) == 0) {
-        off_t sz = ftello(disk.fp);
-        if (sz >= 0) {
-            disk.size = (size_t)sz;
-        }
-        fseeko(disk.fp, 0, SEEK_SET);
+    if (load_super_from_disk() != 0) {
+        logMsg(ERROR_LOG, "mount_fs: no valid superblock on %s", disk_img_fn);
+        free_disk();
+        return -1;
+    }
+    // fs.h is not included here: <linux/io_uring.h> defines its own BLOCK_SIZE.
+    if ((size_t)get_block_size() * get_num_blocks() > disk.size) {
+        logMsg(ERROR_LOG, "mount_fs: %s is smaller than its superblock says", disk_img_fn);
+        free_disk();
+        return -1;
+    }
+    // Replay first: the bitmap and the inode table are read from their home blocks.
+    if (load_journal_from_disk() != 0) {
+        logMsg(ERROR_LOG, "mount_fs: failed to recover the journal of %s", disk_img_fn);
+        free_disk();
+        return -1;
+    }
+    // Replay may have raised the inode-table high-water mark.
+    if (load_super_from_disk() != 0) {
+        logMsg(ERROR_LOG, "mount_fs: no valid superblock on %s after replay", disk_img_fn);
+        free_disk();
+        return -1;
     }
-    load_super_from_disk();
     load_bitmap_from_disk();
+    if (load_inode_table_from_disk() != 0) {
+        logMsg(ERROR_LOG, "mount_fs: failed to load the inode table from %s", disk_img_fn);
+        free_disk();
+        return -1;
+    }
     return 0;
 }
 
@@ -94,29 +608,52 @@ void unmount_fs() {
     if (!disk.is_mounted) {
         err_exit("unmount_fs: disk is not mounted");
     }
-    if (disk.fp == NULL) {
-        err_exit("unmount_fs: disk file pointer is NULL");
+    if (disk.fd < 0) {
+        err_exit("unmount_fs: disk file descriptor is invalid");
     }
     logMsg(INFO_LOG, "unmount_fs: unmounting disk %s", disk_img_fn());
+    if (!flush_delayed_files()) {
+        logMsg(ERROR_LOG, "unmount_fs: failed to flush delayed writes");
+    }
+    submit_plug();
+    if (journal_is_loaded() ? !checkpoint_journal() : !write_back_metadata()) {
+        logMsg(ERROR_LOG, "unmount_fs: failed to write back cached blocks");
+    }
     free_disk();
 }
 
 int create_disk_fs(const char* disk_img_fn, size_t size) {
     logMsg(INFO_LOG, "create_disk_fs: creating disk at %s", disk_img_fn);
-    if (open_disk(disk_img_fn, "wb+") != 0) {
+    if (open_disk(disk_img_fn, O_RDWR | O_CREAT | O_TRUNC) != 0) {
         logMsg(ERROR_LOG, "create_disk_fs: failed to open disk at %s", disk_img_fn);
         return -1;
     }
-    if (ftruncate(fileno(disk.fp), (off_t)size) != 0) {
+    if (ftruncate(disk.fd, (off_t)size) != 0) {
         logMsg(ERROR_LOG, "create_disk_fs: `ftruncate` failed");
         free_disk();
         return 1;
     }
     disk.size = size;
+    if (start_engine() != 0) {
+        logMsg(ERROR_LOG, "create_disk_fs: failed to start the I/O engine for %s", disk_img_fn);
+        free_disk();
+        return -1;
+    }
     disk.is_mounted = true;
     return 0;
 }
 
+void set_disk_mode(DiskMode mode) {
+    if (disk.is_mounted) {
+        logMsg(WARN_LOG, "set_disk_mode: takes effect on the next mount");
+    }
+    requested_mode = mode;
+}
+
+DiskMode disk_mode() {
+    return disk.is_mounted ? disk.mode : requested_mode;
+}
+
 const char* disk_img_fn() {
     return disk.img_fn;
 }
@@ -130,79 +667,200 @@ bool disk_is_mounted() {
 }
 
 void require_disk_is_mounted() {
-    if (!disk.is_mounted || disk.fp == NULL) {
+    if (!disk.is_mounted || disk.fd < 0) {
         err_exit("require_disk_is_mounted: disk hasn't been mounted yet");
     }
 }
 
 size_t read_from_disk_at(void* buf, size_t size, size_t count, off_t offset) {
-    diskseek(offset, SEEK_SET);
-    return fread(buf, size, count, disk.fp);
+    require_disk_is_mounted();
+    if (size == 0 || !check_disk_range(offset, size * count)) {
+        return 0;
+    }
+    submit_plug_if_overlaps(offset, size * count);
+    count_io(DISK_IO_READ, offset, size * count);
+    if (disk.mode == DISK_MODE_MMAP) {
+        memcpy(buf, disk.map + offset, size * count);
+        return count;
+    }
+    return pread_full(buf, size * count, offset) / size;
 }
 
 size_t write_to_disk_at(const void* buf, size_t size, size_t count, off_t offset) {
-    diskseek(offset, SEEK_SET);
-    return fwrite(buf, size, count, disk.fp);
+    require_disk_is_mounted();
+    if (size == 0 || !check_disk_range(offset, size * count)) {
+        return 0;
+    }
+    if (plug.depth > 0 && disk.mode == DISK_MODE_URING && plug_write(buf, size * count, offset)) {
+        return count;
+    }
+    count_io(DISK_IO_WRITE, offset, size * count);
+    if (disk.mode == DISK_MODE_MMAP) {
+        memcpy(disk.map + offset, buf, size * count);
+        return count;
+    }
+    return pwrite_full(buf, size * count, offset) / size;
 }
 
-size_t read_from_disk(void* buf, size_t size, size_t count) {
+size_t readv_from_disk_at(const struct iovec* iov, int iovcnt, off_t offset) {
     require_disk_is_mounted();
-    return fread(buf, size, count, disk.fp);
+    size_t total = iov_total(iov, iovcnt);
+    if (!check_disk_range(offset, total)) {
+        return 0;
+    }
+    submit_plug_if_overlaps(offset, total);
+    count_io(DISK_IO_READ, offset, total);
+    if (disk.mode == DISK_MODE_MMAP) {
+        for (int i = 0; i < iovcnt; ++i) {
+            memcpy(iov[i].iov_base, disk.map + offset, iov[i].iov_len);
+            offset += (off_t)iov[i].iov_len;
+        }
+        return total;
+    }
+    ssize_t n;
+    do {
+        n = preadv(disk.fd, iov, iovcnt, offset);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        disk.io_error = true;
+        return 0;
+    }
+    if ((size_t)n == total) {
+        return total;
+    }
+    // Short transfer; finish the remaining segments one by one.
+    size_t done = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        size_t len = iov[i].iov_len;
+        if (done + len > (size_t)n) {
+            size_t skip = (size_t)n > done ? (size_t)n - done : 0;
+            size_t got = pread_full(
+                (uint8_t*)iov[i].iov_base + skip, len - skip, offset + (off_t)done + (off_t)skip);
+            if (got != len - skip) {
+                return done + skip + got;
+            }
+        }
+        done += len;
+    }
+    return done;
 }
 
-size_t write_to_disk(const void* buf, size_t size, size_t count) {
+size_t writev_to_disk_at(const struct iovec* iov, int iovcnt, off_t offset) {
     require_disk_is_mounted();
-    return fwrite(buf, size, count, disk.fp);
+    size_t total = iov_total(iov, iovcnt);
+    if (!check_disk_range(offset, total)) {
+        return 0;
+    }
+    submit_plug_if_overlaps(offset, total);
+    count_io(DISK_IO_WRITE, offset, total);
+    if (disk.mode == DISK_MODE_MMAP) {
+        for (int i = 0; i < iovcnt; ++i) {
+            memcpy(disk.map + offset, iov[i].iov_base, iov[i].iov_len);
+            offset += (off_t)iov[i].iov_len;
+        }
+        return total;
+    }
+    ssize_t n;
+    do {
+        n = pwritev(disk.fd, iov, iovcnt, offset);
+    } while (n < 0 && errno == EINTR);
+    if (n < 0) {
+        disk.io_error = true;
+        return 0;
+    }
+    if ((size_t)n == total) {
+        return total;
+    }
+    size_t done = 0;
+    for (int i = 0; i < iovcnt; ++i) {
+        size_t len = iov[i].iov_len;
+        if (done + len > (size_t)n) {
+            size_t skip = (size_t)n > done ? (size_t)n - done : 0;
+            size_t put = pwrite_full(
+                (const uint8_t*)iov[i].iov_base + skip,
+                len - skip,
+                offset + (off_t)done + (off_t)skip);
+            if (put != len - skip) {
+                return done + skip + put;
+            }
+        }
+        done += len;
+    }
+    return done;
 }
 
-// A wrap function over fseeko. Validates arguments; warns if seeking beyond current disk size.
-int diskseek(off_t offset, int whence) {
+size_t submit_disk_io(DiskIoReq* reqs, size_t n) {
     require_disk_is_mounted();
-    off_t base, target;
-    char whence_macro_name[10];
-    switch (whence) {
-        case SEEK_SET:
-            base = 0;
-            strcpy(whence_macro_name, "SEEK_SET");
-            break;
-        case SEEK_CUR:
-            base = ftello(disk.fp);
-            if (base < 0) {
-                err_exit("diskseek: `ftello` failed");
-            }
-            strcpy(whence_macro_name, "SEEK_CUR");
-            break;
-        case SEEK_END:
-            base = (off_t)disk.size;
-            strcpy(whence_macro_name, "SEEK_END");
-            break;
-        default:
-            logMsg(ERROR_LOG, "diskseek: invalid `whence` value: %d", whence);
-            return -1;
+    for (size_t i = 0; i < n; ++i) {
+        size_t total = iov_total(reqs[i].iov, reqs[i].iovcnt);
+        if (!check_disk_range(reqs[i].offset, total)) {
+            return 0;
+        }
+        submit_plug_if_overlaps(reqs[i].offset, total);
+    }
+#ifdef HAVE_IO_URING
+    if (disk.mode == DISK_MODE_URING) {
+        return uring_submit(reqs, n);
     }
-    target = base + offset;
-    if (target < 0 || target > (off_t)disk.size) {
+#endif
+    return submit_sync(reqs, n);
+}
+
+void plug_disk() {
+    plug.depth++;
+}
+
+void unplug_disk() {
+    if (plug.depth == 0) {
+        logMsg(WARN_LOG, "unplug_disk: disk is not plugged");
+        return;
+    }
+    if (--plug.depth == 0) {
+        submit_plug();
+    }
+}
+
+// Validates that [offset, offset + nbytes) lies within the disk; logs an error if it doesn't.
+bool check_disk_range(off_t offset, size_t nbytes) {
+    if (offset < 0 || (size_t)offset > disk.size || nbytes > disk.size - (size_t)offset) {
         logMsg(
             ERROR_LOG,
-            "diskseek: position out of range: offset=%d\twhence=%s",
-            offset,
-            whence_macro_name);
-        return -1;
-    }
-    if (fseeko(disk.fp, offset, whence) != 0) {
-        logMsg(ERROR_LOG, "fseeko(%d, %s) failed.", offset, whence_macro_name);
+            "check_disk_range: range out of disk bounds: offset=%jd\tnbytes=%zu",
+            (intmax_t)offset,
+            nbytes);
+        return false;
     }
+    return true;
 }
 
 bool flush_disk() {
     require_disk_is_mounted();
     logMsg(INFO_LOG, "flush_disk: flushing the disk");
-    if (fflush(disk.fp) != 0) {
-        logMsg(ERROR_LOG, "flush_disk: `fflush` failed");
+    if (!flush_delayed_files()) {
+        logMsg(ERROR_LOG, "flush_disk: failed to flush delayed writes");
+        return false;
+    }
+    submit_plug();
+    if (!write_back_metadata()) {
+        logMsg(ERROR_LOG, "flush_disk: failed to write back cached blocks");
         return false;
     }
-    if (fsync(fileno(disk.fp)) != 0) {
-        logMsg(ERROR_LOG, "flush_disk: `fsync` failed");
+    return sync_disk();
+}
+
+bool sync_disk() {
+    require_disk_is_mounted();
+    submit_plug();
+    STAT_ADD(STAT_DISK_SYNCS, 1);
+    if (disk.mode == DISK_MODE_MMAP) {
+        if (msync(disk.map, disk.size, MS_SYNC) != 0) {
+            logMsg(ERROR_LOG, "sync_disk: `msync` failed");
+            return false;
+        }
+        return true;
+    }
+    if (fsync(disk.fd) != 0) {
+        logMsg(ERROR_LOG, "sync_disk: `fsync` failed");
         return false;
     }
     return true;
@@ -210,5 +868,5 @@ bool flush_disk() {
 
 bool disk_error_occurred() {
     require_disk_is_mounted();
-    return ferror(disk.fp) != 0;
+    return disk.io_error;
 }
@@ -0,0 +1,253 @@
+#include "extent.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "err.h"
+#include "inode.h"
+#include "logging.h"
+
+// --------------- LOCAL ---------------
+
+typedef struct {
+    ExtentBlockHeader hdr;
+    Extent extents[];  // EXTENTS_PER_BLOCK of them.
+} ExtentBlock;
+
+// Reads the inode's extent block into a new BLOCK_SIZE buffer; the caller frees it.
+static ExtentBlock* read_extent_block(const Inode* inode) {
+    ExtentBlock* eb = (ExtentBlock*)malloc(BLOCK_SIZE);
+    if (!eb) {
+        err_exit("read_extent_block: failed to allocate memory");
+    }
+    read_data_block(inode->extent_block, eb, BLOCK_SIZE);
+    if (eb->hdr.count > EXTENTS_PER_BLOCK) {
+        logMsg(ERROR_LOG, "read_extent_block: corrupt extent block %u", inode->extent_block);
+        eb->hdr.count = 0;
+    }
+    return eb;
+}
+
+/*
+ * Makes `extents` the inode's runs, writing the extent block if they
+ * spill into it and freeing it if they don't. Returns 0, or -1 if the
+ * extent block can't be allocated.
+ */
+static int store_extents(Inode* inode, const Extent* extents, size_t n) {
+    if (n > INODE_EXTENTS && inode->extent_block == 0) {
+        int block_no = alloc_block();
+        if (block_no < 0) {
+            logMsg(ERROR_LOG, "store_extents: failed to allocate an extent block");
+            return -1;
+        }
+        inode->extent_block = (uint32_t)block_no;
+    }
+    size_t ninline = n < INODE_EXTENTS ? n : INODE_EXTENTS;
+    memset(inode->extents, 0, sizeof(inode->extents));
+    memcpy(inode->extents, extents, ninline * sizeof(Extent));
+    inode->nextents = (uint32_t)n;
+    if (n <= INODE_EXTENTS) {
+        if (inode->extent_block != 0) {
+            free_block((int)inode->extent_block);
+            inode->extent_block = 0;
+        }
+        return 0;
+    }
+    ExtentBlock* eb = (ExtentBlock*)calloc(1, BLOCK_SIZE);
+    if (!eb) {
+        err_exit("store_extents: failed to allocate memory");
+    }
+    eb->hdr.count = (uint32_t)(n - INODE_EXTENTS);
+    memcpy(eb->extents, extents + INODE_EXTENTS, eb->hdr.count * sizeof(Extent));
+    write_data_block(inode->extent_block, eb, BLOCK_SIZE);
+    free(eb);
+    return 0;
+}
+
+// -------------------------------------
+
+size_t inode_num_blocks(const Inode* inode) {
+    if (inode_is_inline(*inode)) {
+        return 0;
+    }
+    size_t ninline = inode->nextents < INODE_EXTENTS ? inode->nextents : INODE_EXTENTS;
+    size_t total = 0;
+    for (size_t i = 0; i < ninline; ++i) {
+        total += inode->extents[i].len;
+    }
+    if (inode->nextents <= INODE_EXTENTS || inode->extent_block == 0) {
+        return total;
+    }
+    ExtentBlock* eb = read_extent_block(inode);
+    for (size_t i = 0; i < eb->hdr.count; ++i) {
+        total += eb->extents[i].len;
+    }
+    free(eb);
+    return total;
+}
+
+int extent_map_block(const Inode* inode, size_t logical) {
+    if (inode_is_inline(*inode)) {
+        return -1;
+    }
+    size_t ninline = inode->nextents < INODE_EXTENTS ? inode->nextents : INODE_EXTENTS;
+    for (size_t i = 0; i < ninline; ++i) {
+        if (logical < inode->extents[i].len) {
+            return (int)(inode->extents[i].start + logical);
+        }
+        logical -= inode->extents[i].len;
+    }
+    if (inode->nextents <= INODE_EXTENTS || inode->extent_block == 0) {
+        return -1;
+    }
+    ExtentBlock* eb = read_extent_block(inode);
+    int block_no = -1;
+    for (size_t i = 0; i < eb->hdr.count; ++i) {
+        if (logical < eb->extents[i].len) {
+            block_no = (int)(eb->extents[i].start + logical);
+            break;
+        }
+        logical -= eb->extents[i].len;
+    }
+    free(eb);
+    return block_no;
+}
+
+Extent* alloc_extent_list(void) {
+    Extent* extents = (Extent*)malloc(MAX_EXTENTS * sizeof(Extent));
+    if (!extents) {
+        err_exit("alloc_extent_list: failed to allocate memory");
+    }
+    return extents;
+}
+
+size_t extent_list(const Inode* inode, Extent* out) {
+    if (inode_is_inline(*inode)) {
+        return 0;
+    }
+    size_t ninline = inode->nextents < INODE_EXTENTS ? inode->nextents : INODE_EXTENTS;
+    memcpy(out, inode->extents, ninline * sizeof(Extent));
+    if (inode->nextents <= INODE_EXTENTS || inode->extent_block == 0) {
+        return ninline;
+    }
+    ExtentBlock* eb = read_extent_block(inode);
+    size_t n = eb->hdr.count;
+    memcpy(out + ninline, eb->extents, n * sizeof(Extent));
+    free(eb);
+    return ninline + n;
+}
+
+int extent_append(Inode* inode, uint32_t start, uint32_t len) {
+    if (len == 0) {
+        return 0;
+    }
+    if (inode_is_inline(*inode)) {
+        logMsg(ERROR_LOG, "extent_append: the file keeps its data inline");
+        return -1;
+    }
+    if (inode_is_compressed(*inode)) {
+        logMsg(ERROR_LOG, "extent_append: the runs of a compressed file are its chunks");
+        return -1;
+    }
+    if (inode->nextents < INODE_EXTENTS) {
+        Extent* last = inode->nextents > 0 ? &inode->extents[inode->nextents - 1] : NULL;
+        if (last && last->start + last->len == start) {
+            last->len += len;
+        } else {
+            inode->extents[inode->nextents++] = (Extent){start, len, 0};
+        }
+        return 0;
+    }
+    if (inode->nextents == INODE_EXTENTS) {
+        Extent* last = &inode->extents[INODE_EXTENTS - 1];
+        if (last->start + last->len == start) {
+            last->len += len;
+            return 0;
+        }
+    }
+    // Spill into the extent block, allocating it on first use.
+    ExtentBlock* eb;
+    if (inode->extent_block == 0) {
+        int block_no = alloc_block();
+        if (block_no < 0) {
+            logMsg(ERROR_LOG, "extent_append: failed to allocate an extent block");
+            return -1;
+        }
+        inode->extent_block = (uint32_t)block_no;
+        eb = (ExtentBlock*)calloc(1, BLOCK_SIZE);
+        if (!eb) {
+            err_exit("extent_append: failed to allocate memory");
+        }
+    } else {
+        eb = read_extent_block(inode);
+    }
+    Extent* last = eb->hdr.count > 0 ? &eb->extents[eb->hdr.count - 1] : NULL;
+    if (last && last->start + last->len == start) {
+        last->len += len;
+    } else if (eb->hdr.count < EXTENTS_PER_BLOCK) {
+        eb->extents[eb->hdr.count++] = (Extent){start, len, 0};
+        inode->nextents++;
+    } else {
+        logMsg(ERROR_LOG, "extent_append: file is too fragmented; no room for another extent");
+        free(eb);
+        return -1;
+    }
+    write_data_block(inode->extent_block, eb, BLOCK_SIZE);
+    free(eb);
+    return 0;
+}
+
+void extent_free_all(Inode* inode) {
+    if (inode_is_inline(*inode)) {
+        inode_clear_inline(inode);
+        memset(inode->inline_data, 0, sizeof(inode->inline_data));
+        return;
+    }
+    Extent* extents = alloc_extent_list();
+    size_t n = extent_list(inode, extents);
+    for (size_t i = 0; i < n; ++i) {
+        free_block_run((int)extents[i].start, extents[i].len);
+    }
+    free(extents);
+    if (inode->extent_block != 0) {
+        free_block((int)inode->extent_block);
+    }
+    inode->nextents = 0;
+    inode->extent_block = 0;
+    memset(inode->extents, 0, sizeof(inode->extents));
+}
+
+void extent_truncate(Inode* inode, size_t nblocks) {
+    if (inode_is_inline(*inode)) {
+        return;
+    }
+    Extent* extents = alloc_extent_list();
+    size_t n = extent_list(inode, extents);
+    size_t kept = 0;  // Runs that keep at least one block.
+    size_t total = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (total >= nblocks) {
+            free_block_run((int)extents[i].start, extents[i].len);
+            continue;
+        }
+        size_t keep = nblocks - total < extents[i].len ? nblocks - total : extents[i].len;
+        if (keep < extents[i].len) {
+            free_block_run((int)(extents[i].start + keep), extents[i].len - keep);
+            extents[i].len = (uint32_t)keep;
+        }
+        total += extents[i].len;
+        kept++;
+    }
+    // No more runs than before, so the extent block, if needed, is already there.
+    store_extents(inode, extents, kept);
+    free(extents);
+}
+
+int extent_replace(Inode* inode, const Extent* extents, size_t n) {
+    if (inode_is_inline(*inode) || n > MAX_EXTENTS) {
+        logMsg(ERROR_LOG, "extent_replace: no room for %zu extents", n);
+        return -1;
+    }
+    return store_extents(inode, extents, n);
+}
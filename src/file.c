@@ -0,0 +1,948 @@
+#include "file.h"
+
+#include <pthread.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "allocator.h"
+#include "cache.h"
+#include "disk.h"
+#include "err.h"
+#include "extent.h"
+#include "fs.h"
+#include "inode.h"
+#include "journal.h"
+#include "logging.h"
+#include "lz.h"
+#include "readahead.h"
+#include "stats.h"
+
+// Most zeros written with one I/O while filling a gap.
+#define ZERO_FILL_BLOCKS 64
+
+// --------------- LOCAL ---------------
+
+typedef struct {
+    int inode_no;  // -1 if the descriptor is free.
+    // Sequential read detection: where the last read ended, the
+    // readahead window (0 after a random read) and the first block
+    // not yet read ahead.
+    size_t next;
+    size_t window;
+    size_t ahead;
+} OpenFile;
+
+typedef struct {
+    pthread_mutex_t lock;
+    OpenFile open[MAX_OPEN_FILES];
+    size_t nopen;
+    bool is_initialized;
+} FileTable;
+
+static FileTable files = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+/*
+ * Bytes written past a file's size on disk, held in memory until
+ * they are flushed. Its inode's lock guards a DelayedWrite; the
+ * table lock guards the list and the total.
+ */
+typedef struct {
+    int inode_no;
+    uint8_t* data;  // Bytes [size, size + len) of the file.
+    size_t len;
+    size_t cap;
+} DelayedWrite;
+
+typedef struct {
+    pthread_mutex_t lock;
+    DelayedWrite** writes;
+    size_t n;
+    size_t cap;
+    size_t total;  // Bytes held for all files.
+} DelayedTable;
+
+static DelayedTable delayed = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+static bool compress_files = false;
+
+// Called with `files.lock` held.
+static void init_file_table(void) {
+    if (files.is_initialized) {
+        return;
+    }
+    for (size_t i = 0; i < MAX_OPEN_FILES; ++i) {
+        files.open[i].inode_no = -1;
+    }
+    files.nopen = 0;
+    files.is_initialized = true;
+}
+
+static size_t min_size(size_t a, size_t b) {
+    return a < b ? a : b;
+}
+
+static uint8_t* alloc_block_buf(void) {
+    uint8_t* block = (uint8_t*)malloc(BLOCK_SIZE);
+    if (!block) {
+        err_exit("file: failed to allocate memory");
+    }
+    return block;
+}
+
+// Maps blocks until the file has room for `size` bytes. On failure, maps none of them.
+static int grow(Inode* inode, size_t size) {
+    size_t need = (size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t had = inode_num_blocks(inode);
+    size_t have = had;
+    while (have < need) {
+        size_t got;
+        int start = alloc_block_run(need - have, &got);
+        if (start < 0 || extent_append(inode, (uint32_t)start, (uint32_t)got) != 0) {
+            logMsg(ERROR_LOG, "file: failed to allocate %zu data blocks", need - have);
+            if (start >= 0) {
+                free_block_run(start, got);
+            }
+            extent_truncate(inode, had);
+            return -1;
+        }
+        have += got;
+    }
+    return 0;
+}
+
+// Whether the file can keep its first `end` bytes in the inode: it is inline or has no blocks.
+static bool fits_inline(const Inode* inode, size_t end) {
+    return end <= INODE_INLINE_SIZE && (inode_is_inline(*inode) || inode->nextents == 0);
+}
+
+static void write_inline(Inode* inode, size_t offset, const uint8_t* data, size_t nbytes) {
+    if (!inode_is_inline(*inode)) {
+        memset(inode->inline_data, 0, sizeof(inode->inline_data));
+        inode_set_inline(inode);
+    }
+    // Bytes past the end are kept zero, so a gap needs no filling.
+    if (data) {
+        memcpy(inode->inline_data + offset, data, nbytes);
+    } else {
+        memset(inode->inline_data + offset, 0, nbytes);
+    }
+    if (offset + nbytes > inode->size) {
+        inode->size = offset + nbytes;
+    }
+}
+
+// Moves inline contents out to data blocks with room for `size` bytes. On failure, moves nothing.
+static int promote(Inode* inode, size_t size) {
+    Inode was = *inode;
+    memset(inode->inline_data, 0, sizeof(inode->inline_data));
+    inode_clear_inline(inode);
+    if (grow(inode, size) != 0) {
+        *inode = was;
+        return -1;
+    }
+    if (was.size > 0) {
+        write_data_run((int)inode->extents[0].start, was.inline_data, was.size);
+    }
+    return 0;
+}
+
+// Writes `nbytes` of `data`, or of zeros if it is NULL, from the start of block `block_no` on.
+static void write_span(int block_no, const uint8_t* data, size_t nbytes) {
+    if (data) {
+        write_data_run(block_no, data, nbytes);
+        return;
+    }
+    size_t chunk = min_size(nbytes, (size_t)ZERO_FILL_BLOCKS * BLOCK_SIZE);
+    uint8_t* zeros = (uint8_t*)calloc(1, chunk);
+    if (!zeros) {
+        err_exit("write_span: failed to allocate memory");
+    }
+    for (size_t off = 0; off < nbytes; off += chunk) {
+        write_data_run(block_no + (int)(off / BLOCK_SIZE), zeros, min_size(chunk, nbytes - off));
+    }
+    free(zeros);
+}
+
+/*
+ * Writes [pos, pos + len) of the file, mapped by `extents`, from
+ * `data` (zeros if it is NULL). Bytes in [0, live_end) outside that
+ * range are file contents that partial blocks must keep.
+ */
+static void write_range(
+    const Extent* extents,
+    size_t n,
+    size_t pos,
+    const uint8_t* data,
+    size_t len,
+    size_t live_end) {
+    size_t end = pos + len;
+    size_t base = 0;  // File offset of the current extent.
+    uint8_t* block = NULL;
+    for (size_t i = 0; i < n && pos < end; ++i) {
+        size_t ext_end = base + (size_t)extents[i].len * BLOCK_SIZE;
+        while (pos < end && pos < ext_end) {
+            int block_no = (int)(extents[i].start + (pos - base) / BLOCK_SIZE);
+            const uint8_t* src = data ? data + (len - (end - pos)) : NULL;
+            size_t skip = pos % BLOCK_SIZE;
+            size_t stop = min_size(end, ext_end);
+            if (skip == 0 && stop - pos >= BLOCK_SIZE) {
+                size_t nbytes = (stop - pos) / BLOCK_SIZE * BLOCK_SIZE;
+                write_span(block_no, src, nbytes);
+                pos += nbytes;
+                continue;
+            }
+            size_t take = min_size(BLOCK_SIZE - skip, stop - pos);
+            size_t block_end = pos - skip + BLOCK_SIZE;
+            if (skip == 0 && pos + take >= min_size(live_end, block_end)) {
+                // Nothing after the write is file data, so the rest of the block can be left.
+                write_span(block_no, src, take);
+            } else {
+                // Read-modify-write: the block holds file bytes on either side of the write.
+                if (!block) {
+                    block = alloc_block_buf();
+                }
+                read_data_run(block_no, block, BLOCK_SIZE);
+                if (src) {
+                    memcpy(block + skip, src, take);
+                } else {
+                    memset(block + skip, 0, take);
+                }
+                write_data_run(block_no, block, BLOCK_SIZE);
+            }
+            pos += take;
+        }
+        base = ext_end;
+    }
+    free(block);
+}
+
+static int write_now(Inode* inode, size_t offset, const void* data, size_t nbytes);
+
+// Bytes of chunk `c` in a compressed file of `size` bytes.
+static size_t chunk_len(size_t size, size_t c) {
+    return min_size(COMPRESS_CHUNK_BYTES, size - c * COMPRESS_CHUNK_BYTES);
+}
+
+static size_t num_chunks(size_t size) {
+    return (size + COMPRESS_CHUNK_BYTES - 1) / COMPRESS_CHUNK_BYTES;
+}
+
+static uint8_t* alloc_chunk_buf(void) {
+    uint8_t* buf = (uint8_t*)malloc(COMPRESS_CHUNK_BYTES);
+    if (!buf) {
+        err_exit("file: failed to allocate memory");
+    }
+    return buf;
+}
+
+// Reads the `len` bytes of the chunk in `e` into `buf`, with `lz` for its LZ data. Returns 0 or -1.
+static int load_chunk(const Extent* e, size_t len, uint8_t* buf, uint8_t* lz) {
+    size_t room = (size_t)e->len * BLOCK_SIZE;
+    if (e->csize == 0 ? len > room : e->csize > room || e->csize > COMPRESS_CHUNK_BYTES) {
+        logMsg(ERROR_LOG, "load_chunk: chunk at block %u does not fit its blocks", e->start);
+        return -1;
+    }
+    if (e->csize == 0) {
+        read_data_run((int)e->start, buf, len);
+        return 0;
+    }
+    read_data_run((int)e->start, lz, e->csize);
+    if (lz_decompress(lz, e->csize, buf, len) != (long)len) {
+        logMsg(ERROR_LOG, "load_chunk: compressed chunk at block %u is corrupt", e->start);
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Writes a chunk of `len` bytes to new blocks, compressed if that moves
+ * at least an eighth fewer bytes, and sets `e` to its run. Returns 0,
+ * or -1 if there is no free run long enough.
+ */
+static int store_chunk(const uint8_t* buf, size_t len, uint8_t* lz, Extent* e) {
+    size_t csize = lz_compress(buf, len, lz, len - len / 8);
+    size_t stored = csize > 0 ? csize : len;
+    size_t need = (stored + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    size_t got = 0;
+    int start = alloc_block_run(need, &got);
+    if (start < 0 || got < need) {
+        logMsg(ERROR_LOG, "store_chunk: no run of %zu free blocks", need);
+        if (start >= 0) {
+            free_block_run(start, got);
+        }
+        return -1;
+    }
+    write_data_run(start, csize > 0 ? lz : buf, stored);
+    *e = (Extent){(uint32_t)start, (uint32_t)need, (uint32_t)csize};
+    STAT_ADD(STAT_COMPRESSED_BYTES_SAVED, len - stored);
+    return 0;
+}
+
+/*
+ * Reads from a compressed file chunk by chunk. A raw chunk's blocks
+ * hold its bytes in order, so only the blocks asked for are read;
+ * a compressed one is read and decompressed whole.
+ */
+static size_t read_compressed(const Inode* inode, size_t offset, void* buf, size_t nbytes) {
+    Extent* extents = alloc_extent_list();
+    size_t n = extent_list(inode, extents);
+    uint8_t* chunk = alloc_chunk_buf();
+    uint8_t* lz = NULL;
+    uint8_t* out = (uint8_t*)buf;
+    size_t pos = offset;
+    size_t end = offset + nbytes;
+    while (pos < end) {
+        size_t c = pos / COMPRESS_CHUNK_BYTES;
+        if (c >= n) {
+            logMsg(ERROR_LOG, "read_compressed: no extent for chunk %zu", c);
+            break;
+        }
+        size_t len = chunk_len(inode->size, c);
+        size_t within = pos - c * COMPRESS_CHUNK_BYTES;
+        size_t take = min_size(len - within, end - pos);
+        if (extents[c].csize == 0) {
+            size_t skip = within % BLOCK_SIZE;
+            if (within + take > (size_t)extents[c].len * BLOCK_SIZE) {
+                logMsg(ERROR_LOG, "read_compressed: chunk %zu does not fit its blocks", c);
+                break;
+            }
+            read_data_run((int)(extents[c].start + within / BLOCK_SIZE), chunk, skip + take);
+            memcpy(out + (pos - offset), chunk + skip, take);
+        } else {
+            if (!lz) {
+                lz = alloc_chunk_buf();
+            }
+            if (load_chunk(&extents[c], len, chunk, lz) != 0) {
+                break;
+            }
+            memcpy(out + (pos - offset), chunk + within, take);
+        }
+        pos += take;
+    }
+    free(lz);
+    free(chunk);
+    free(extents);
+    return pos - offset;
+}
+
+/*
+ * Gives a compressed file a size of `size` bytes, with `nbytes` of
+ * `data` (zeros if it is NULL) at `offset` and zeros between its old
+ * end and `offset`. Only the chunks that change are rewritten, each
+ * to new blocks that replace its old ones once all are written; on
+ * failure the file is left as it was.
+ */
+static int rewrite_chunks(
+    Inode* inode,
+    size_t size,
+    size_t offset,
+    const uint8_t* data,
+    size_t nbytes) {
+    Extent* old = alloc_extent_list();
+    size_t n = extent_list(inode, old);
+    if (n != num_chunks(inode->size)) {
+        logMsg(ERROR_LOG, "rewrite_chunks: %zu extents for %zu chunks", n, num_chunks(inode->size));
+        free(old);
+        return -1;
+    }
+    size_t count = num_chunks(size);
+    Extent* fresh = alloc_extent_list();
+    memcpy(fresh, old, min_size(n, count) * sizeof(Extent));
+    uint8_t* buf = alloc_chunk_buf();
+    uint8_t* lz = alloc_chunk_buf();
+    // A change of size changes the chunks between the old end and the new one.
+    size_t end = offset + nbytes;
+    size_t far_end = size > inode->size ? size : inode->size;
+    if (size != inode->size && end < far_end) {
+        end = far_end;
+    }
+    size_t first = min_size(min_size(offset, inode->size), size) / COMPRESS_CHUNK_BYTES;
+    size_t last = min_size(num_chunks(end), count);
+    size_t c = first;
+    int rc = 0;
+    plug_disk();
+    for (; c < last; ++c) {
+        size_t base = c * COMPRESS_CHUNK_BYTES;
+        size_t len = chunk_len(size, c);
+        size_t lo = offset > base ? offset : base;
+        size_t hi = min_size(offset + nbytes, base + len);
+        memset(buf, 0, COMPRESS_CHUNK_BYTES);
+        // The old bytes are needed unless the write covers the whole chunk.
+        if (c < n && (lo > base || hi < base + len)) {
+            rc = load_chunk(&old[c], chunk_len(inode->size, c), buf, lz);
+        }
+        if (rc == 0 && lo < hi) {
+            if (data) {
+                memcpy(buf + (lo - base), data + (lo - offset), hi - lo);
+            } else {
+                memset(buf + (lo - base), 0, hi - lo);
+            }
+        }
+        if (rc != 0 || store_chunk(buf, len, lz, &fresh[c]) != 0) {
+            rc = -1;
+            break;
+        }
+    }
+    unplug_disk();
+    if (rc == 0 && extent_replace(inode, fresh, count) != 0) {
+        rc = -1;
+    }
+    // The runs that were replaced or cut off go; on failure, the ones written for nothing.
+    if (rc == 0) {
+        for (size_t i = first; i < n; ++i) {
+            if (i < last || i >= count) {
+                free_block_run((int)old[i].start, old[i].len);
+            }
+        }
+        inode->size = size;
+    } else {
+        for (size_t i = first; i < c; ++i) {
+            free_block_run((int)fresh[i].start, fresh[i].len);
+        }
+    }
+    free(lz);
+    free(buf);
+    free(fresh);
+    free(old);
+    return rc;
+}
+
+/*
+ * Rewrites a compressed file raw, for a change that would give it more
+ * chunks than it can have runs. The new blocks are written before the
+ * old ones are freed; on failure the file is left as it was.
+ */
+static int expand(Inode* inode) {
+    uint8_t* data = (uint8_t*)malloc(inode->size);
+    if (!data) {
+        err_exit("expand: failed to allocate memory");
+    }
+    if (read_compressed(inode, 0, data, inode->size) != inode->size) {
+        free(data);
+        return -1;
+    }
+    Inode raw = (Inode){0};
+    raw.f = inode->f & ~IS_COMPRESSED_FLAG;
+    int rc = write_now(&raw, 0, data, inode->size);
+    free(data);
+    if (rc != 0) {
+        return -1;
+    }
+    extent_free_all(inode);
+    *inode = raw;
+    return 0;
+}
+
+// Reads the file's bytes that are on disk (or inline).
+static size_t read_now(const Inode* inode, size_t offset, void* buf, size_t nbytes) {
+    if (offset >= inode->size) {
+        return 0;
+    }
+    nbytes = min_size(nbytes, inode->size - offset);
+    if (inode_is_inline(*inode)) {
+        memcpy(buf, inode->inline_data + offset, nbytes);
+        return nbytes;
+    }
+    if (inode_is_compressed(*inode)) {
+        return read_compressed(inode, offset, buf, nbytes);
+    }
+    size_t pos = offset;
+    size_t end = offset + nbytes;
+    uint8_t* out = (uint8_t*)buf;
+    uint8_t* block = NULL;
+    Extent* extents = alloc_extent_list();
+    size_t n = extent_list(inode, extents);
+    size_t base = 0;
+    for (size_t i = 0; i < n && pos < end; ++i) {
+        size_t ext_end = base + (size_t)extents[i].len * BLOCK_SIZE;
+        while (pos < end && pos < ext_end) {
+            int block_no = (int)(extents[i].start + (pos - base) / BLOCK_SIZE);
+            size_t skip = pos % BLOCK_SIZE;
+            size_t stop = min_size(end, ext_end);
+            if (skip == 0) {
+                // Straight into the caller's buffer, the rest of the extent in one I/O.
+                read_data_run(block_no, out + (pos - offset), stop - pos);
+                pos = stop;
+                continue;
+            }
+            if (!block) {
+                block = alloc_block_buf();
+            }
+            size_t take = min_size(BLOCK_SIZE - skip, stop - pos);
+            read_data_run(block_no, block, skip + take);
+            memcpy(out + (pos - offset), block + skip, take);
+            pos += take;
+        }
+        base = ext_end;
+    }
+    free(block);
+    free(extents);
+    return pos - offset;
+}
+
+// Writes through to the file's blocks, allocating them now.
+static int write_now(Inode* inode, size_t offset, const void* data, size_t nbytes) {
+    if (nbytes == 0) {
+        return 0;
+    }
+    if (offset + nbytes < offset) {
+        logMsg(ERROR_LOG, "write_now: range at %zu overflows", offset);
+        return -1;
+    }
+    if (inode_is_compressed(*inode)) {
+        size_t size = offset + nbytes > inode->size ? offset + nbytes : inode->size;
+        if (num_chunks(size) <= MAX_EXTENTS) {
+            return rewrite_chunks(inode, size, offset, (const uint8_t*)data, nbytes);
+        }
+        if (expand(inode) != 0) {
+            return -1;
+        }
+    }
+    if (fits_inline(inode, offset + nbytes)) {
+        write_inline(inode, offset, (const uint8_t*)data, nbytes);
+        return 0;
+    }
+    size_t old_size = inode->size;
+    if (inode_is_inline(*inode) ? promote(inode, offset + nbytes) : grow(inode, offset + nbytes)) {
+        return -1;
+    }
+    Extent* extents = alloc_extent_list();
+    size_t n = extent_list(inode, extents);
+    // Held back so that the file's block writes are submitted together.
+    plug_disk();
+    if (offset > old_size) {
+        // Stale bytes past the old end may still be on disk.
+        write_range(extents, n, old_size, NULL, offset - old_size, old_size);
+    }
+    size_t live_end = offset > old_size ? offset : old_size;
+    write_range(extents, n, offset, (const uint8_t*)data, nbytes, live_end);
+    unplug_disk();
+    free(extents);
+    if (offset + nbytes > inode->size) {
+        inode->size = offset + nbytes;
+    }
+    return 0;
+}
+
+static int truncate_now(Inode* inode, size_t size) {
+    if (size > inode->size) {
+        return write_now(inode, inode->size, NULL, size - inode->size);
+    }
+    if (inode_is_inline(*inode)) {
+        memset(inode->inline_data + size, 0, inode->size - size);
+    } else if (size <= INODE_INLINE_SIZE) {
+        // Small enough to move back into the inode and give up its blocks.
+        uint8_t head[INODE_INLINE_SIZE];
+        if (read_now(inode, 0, head, size) != size) {
+            return -1;
+        }
+        extent_free_all(inode);
+        inode_clear_compressed(inode);
+        inode->size = 0;
+        write_inline(inode, 0, head, size);
+    } else if (inode_is_compressed(*inode)) {
+        // Drops the chunks past the end and rewrites the one it now falls in.
+        return rewrite_chunks(inode, size, size, NULL, 0);
+    } else {
+        extent_truncate(inode, (size + BLOCK_SIZE - 1) / BLOCK_SIZE);
+    }
+    inode->size = size;
+    return 0;
+}
+
+// Returns the delayed write of `inode_no`, or NULL.
+static DelayedWrite* find_delayed(int inode_no) {
+    DelayedWrite* dw = NULL;
+    pthread_mutex_lock(&delayed.lock);
+    for (size_t i = 0; i < delayed.n && !dw; ++i) {
+        if (delayed.writes[i]->inode_no == inode_no) {
+            dw = delayed.writes[i];
+        }
+    }
+    pthread_mutex_unlock(&delayed.lock);
+    return dw;
+}
+
+static DelayedWrite* add_delayed(int inode_no) {
+    DelayedWrite* dw = (DelayedWrite*)calloc(1, sizeof(DelayedWrite));
+    if (!dw) {
+        err_exit("add_delayed: failed to allocate memory");
+    }
+    dw->inode_no = inode_no;
+    pthread_mutex_lock(&delayed.lock);
+    if (delayed.n == delayed.cap) {
+        delayed.cap = delayed.cap ? delayed.cap * 2 : 16;
+        delayed.writes =
+            (DelayedWrite**)realloc(delayed.writes, delayed.cap * sizeof(DelayedWrite*));
+        if (!delayed.writes) {
+            err_exit("add_delayed: failed to allocate memory");
+        }
+    }
+    delayed.writes[delayed.n++] = dw;
+    pthread_mutex_unlock(&delayed.lock);
+    return dw;
+}
+
+// Sets how many bytes `dw` holds, keeping the total in step.
+static void set_delayed_len(DelayedWrite* dw, size_t len) {
+    pthread_mutex_lock(&delayed.lock);
+    delayed.total = delayed.total - dw->len + len;
+    pthread_mutex_unlock(&delayed.lock);
+    dw->len = len;
+}
+
+static void remove_delayed(DelayedWrite* dw) {
+    pthread_mutex_lock(&delayed.lock);
+    delayed.total -= dw->len;
+    for (size_t i = 0; i < delayed.n; ++i) {
+        if (delayed.writes[i] == dw) {
+            delayed.writes[i] = delayed.writes[--delayed.n];
+            break;
+        }
+    }
+    pthread_mutex_unlock(&delayed.lock);
+    free(dw->data);
+    free(dw);
+}
+
+static size_t delayed_total(void) {
+    pthread_mutex_lock(&delayed.lock);
+    size_t total = delayed.total;
+    pthread_mutex_unlock(&delayed.lock);
+    return total;
+}
+
+// -------------------------------------
+
+size_t file_size(int inode_no, const Inode* inode) {
+    DelayedWrite* dw = find_delayed(inode_no);
+    return inode->size + (dw ? dw->len : 0);
+}
+
+size_t file_read(int inode_no, const Inode* inode, size_t offset, void* buf, size_t nbytes) {
+    DelayedWrite* dw = find_delayed(inode_no);
+    size_t size = inode->size + (dw ? dw->len : 0);
+    if (offset >= size) {
+        return 0;
+    }
+    nbytes = min_size(nbytes, size - offset);
+    size_t ondisk = offset < inode->size ? min_size(nbytes, inode->size - offset) : 0;
+    size_t nread = read_now(inode, offset, buf, ondisk);
+    if (nread == ondisk && nbytes > ondisk) {
+        memcpy((uint8_t*)buf + ondisk, dw->data + (offset + ondisk - inode->size), nbytes - ondisk);
+        nread = nbytes;
+    }
+    return nread;
+}
+
+int file_write(int inode_no, Inode* inode, size_t offset, const void* data, size_t nbytes) {
+    if (file_flush(inode_no, inode) != 0) {
+        return -1;
+    }
+    return write_now(inode, offset, data, nbytes);
+}
+
+int file_write_delayed(int inode_no, Inode* inode, size_t offset, const void* data, size_t nbytes) {
+    if (nbytes == 0) {
+        return 0;
+    }
+    if (offset + nbytes < offset) {
+        logMsg(ERROR_LOG, "file_write_delayed: range at %zu overflows", offset);
+        return -1;
+    }
+    DelayedWrite* dw = find_delayed(inode_no);
+    size_t end = offset + nbytes - inode->size;  // Relative to the size on disk.
+    // Rewriting bytes on disk, or a file that stays inline, needs no new blocks.
+    if (offset < inode->size || (!dw && fits_inline(inode, offset + nbytes)) ||
+        end > MAX_DELAYED_FILE_BYTES) {
+        return file_write(inode_no, inode, offset, data, nbytes);
+    }
+    if (!dw) {
+        dw = add_delayed(inode_no);
+    }
+    if (end > dw->cap) {
+        size_t cap = dw->cap ? dw->cap : BLOCK_SIZE;
+        while (cap < end) {
+            cap *= 2;
+        }
+        uint8_t* grown = (uint8_t*)realloc(dw->data, cap);
+        if (!grown) {
+            err_exit("file_write_delayed: failed to allocate memory");
+        }
+        dw->data = grown;
+        dw->cap = cap;
+    }
+    size_t start = offset - inode->size;
+    if (start > dw->len) {
+        memset(dw->data + dw->len, 0, start - dw->len);
+    }
+    if (data) {
+        memcpy(dw->data + start, data, nbytes);
+    } else {
+        memset(dw->data + start, 0, nbytes);
+    }
+    if (end > dw->len) {
+        set_delayed_len(dw, end);
+    }
+    // Over the limit, the writer pays for the blocks of its own file.
+    if (delayed_total() > MAX_DELAYED_BYTES) {
+        return file_flush(inode_no, inode);
+    }
+    return 0;
+}
+
+int file_flush(int inode_no, Inode* inode) {
+    DelayedWrite* dw = find_delayed(inode_no);
+    if (!dw) {
+        return 0;
+    }
+    // All of it past the size on disk, so the allocator can give it one run.
+    if (dw->len > 0 && write_now(inode, inode->size, dw->data, dw->len) != 0) {
+        logMsg(ERROR_LOG, "file_flush: failed to allocate blocks for inode %d", inode_no);
+        return -1;
+    }
+    STAT_ADD(STAT_DELAYED_FLUSHES, 1);
+    remove_delayed(dw);
+    return 0;
+}
+
+// Merges the runs of a file that has no compressed chunk left, so that it can be stored raw.
+static void store_raw(Inode* inode) {
+    Extent* extents = alloc_extent_list();
+    size_t n = extent_list(inode, extents);
+    size_t m = 0;
+    for (size_t i = 0; i < n; ++i) {
+        if (m > 0 && extents[m - 1].start + extents[m - 1].len == extents[i].start) {
+            extents[m - 1].len += extents[i].len;
+        } else {
+            extents[m++] = (Extent){extents[i].start, extents[i].len, 0};
+        }
+    }
+    // No more runs than before, so this can't fail.
+    extent_replace(inode, extents, m);
+    free(extents);
+    inode_clear_compressed(inode);
+}
+
+/*
+ * A file stored compressed is cut into chunks of COMPRESS_CHUNK_BYTES,
+ * each in a run of its own, compressed if that moves at least an
+ * eighth fewer bytes. A raw chunk fills its blocks in order, so if none
+ * of them compresses, the runs already map the file as a raw one.
+ */
+int file_replace(int inode_no, Inode* inode, const void* data, size_t nbytes) {
+    file_drop_delayed(inode_no);
+    if (!compress_files || nbytes <= INODE_INLINE_SIZE || num_chunks(nbytes) > MAX_EXTENTS) {
+        // Raw: blocks the file already has are overwritten in place.
+        if (inode_is_compressed(*inode)) {
+            extent_free_all(inode);
+            inode_clear_compressed(inode);
+            inode->size = 0;
+        } else if (nbytes < inode->size) {
+            truncate_now(inode, nbytes);
+        }
+        return write_now(inode, 0, data, nbytes);
+    }
+    Inode packed = (Inode){0};
+    packed.f = inode->f & ~IS_INLINE_FLAG;
+    inode_set_compressed(&packed);
+    if (rewrite_chunks(&packed, nbytes, 0, (const uint8_t*)data, nbytes) != 0) {
+        return -1;
+    }
+    Extent* extents = alloc_extent_list();
+    size_t n = extent_list(&packed, extents);
+    bool saved = false;
+    for (size_t i = 0; i < n && !saved; ++i) {
+        saved = extents[i].csize > 0;
+    }
+    free(extents);
+    if (!saved) {
+        store_raw(&packed);
+    }
+    extent_free_all(inode);
+    *inode = packed;
+    return 0;
+}
+
+void set_file_compression(bool on) {
+    compress_files = on;
+}
+
+bool file_compression() {
+    return compress_files;
+}
+
+void file_drop_delayed(int inode_no) {
+    DelayedWrite* dw = find_delayed(inode_no);
+    if (dw) {
+        remove_delayed(dw);
+    }
+}
+
+int file_truncate(int inode_no, Inode* inode, size_t size) {
+    DelayedWrite* dw = find_delayed(inode_no);
+    if (dw && size >= inode->size) {
+        if (size > inode->size + dw->len) {
+            return file_write_delayed(
+                inode_no, inode, inode->size + dw->len, NULL, size - inode->size - dw->len);
+        }
+        set_delayed_len(dw, size - inode->size);
+        return 0;
+    }
+    // Whatever was held is past the new end.
+    if (dw) {
+        remove_delayed(dw);
+    }
+    return truncate_now(inode, size);
+}
+
+bool flush_delayed_files() {
+    pthread_mutex_lock(&delayed.lock);
+    size_t n = delayed.n;
+    int* inode_nos = (int*)malloc((n + 1) * sizeof(int));
+    if (!inode_nos) {
+        err_exit("flush_delayed_files: failed to allocate memory");
+    }
+    for (size_t i = 0; i < n; ++i) {
+        inode_nos[i] = delayed.writes[i]->inode_no;
+    }
+    pthread_mutex_unlock(&delayed.lock);
+    bool ok = true;
+    for (size_t i = 0; i < n; ++i) {
+        journal_begin();
+        inode_wrlock(inode_nos[i]);
+        Inode inode;
+        if (read_inode(inode_nos[i], &inode) == 1 && file_flush(inode_nos[i], &inode) == 0) {
+            write_inode(inode_nos[i], inode);
+        } else {
+            ok = false;
+        }
+        inode_unlock(inode_nos[i]);
+        journal_end_nowait();
+    }
+    free(inode_nos);
+    return ok;
+}
+
+void free_delayed_files() {
+    pthread_mutex_lock(&delayed.lock);
+    for (size_t i = 0; i < delayed.n; ++i) {
+        free(delayed.writes[i]->data);
+        free(delayed.writes[i]);
+    }
+    free(delayed.writes);
+    delayed.writes = NULL;
+    delayed.n = delayed.cap = 0;
+    delayed.total = 0;
+    pthread_mutex_unlock(&delayed.lock);
+}
+
+int open_file(int inode_no) {
+    pthread_mutex_lock(&files.lock);
+    init_file_table();
+    int fd = -1;
+    for (int i = 0; i < MAX_OPEN_FILES; ++i) {
+        if (files.open[i].inode_no < 0) {
+            fd = i;
+            break;
+        }
+    }
+    if (fd >= 0) {
+        files.open[fd] = (OpenFile){.inode_no = inode_no};
+        files.nopen++;
+    }
+    pthread_mutex_unlock(&files.lock);
+    if (fd < 0) {
+        logMsg(ERROR_LOG, "open_file: all %d descriptors are in use", MAX_OPEN_FILES);
+    }
+    return fd;
+}
+
+int close_file(int fd) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return -1;
+    }
+    int rc = -1;
+    pthread_mutex_lock(&files.lock);
+    init_file_table();
+    if (files.open[fd].inode_no >= 0) {
+        files.open[fd].inode_no = -1;
+        files.nopen--;
+        rc = 0;
+    }
+    pthread_mutex_unlock(&files.lock);
+    return rc;
+}
+
+int file_inode(int fd, int* inode_no) {
+    if (fd < 0 || fd >= MAX_OPEN_FILES) {
+        return -1;
+    }
+    pthread_mutex_lock(&files.lock);
+    init_file_table();
+    *inode_no = files.open[fd].inode_no;
+    pthread_mutex_unlock(&files.lock);
+    return *inode_no >= 0 ? 0 : -1;
+}
+
+void file_readahead(int fd, const Inode* inode, size_t offset, size_t nbytes) {
+    // A compressed file's blocks don't map its bytes one to one, so they are never read ahead.
+    if (nbytes == 0 || inode_is_inline(*inode) || inode_is_compressed(*inode) || fd < 0 ||
+        fd >= MAX_OPEN_FILES) {
+        return;
+    }
+    // Up to two windows are ahead of the reader; keep them within half the cache.
+    size_t max_window = cache_capacity() / 4;
+    if (max_window > MAX_READAHEAD_BLOCKS) {
+        max_window = MAX_READAHEAD_BLOCKS;
+    }
+    size_t nblocks = (inode->size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    pthread_mutex_lock(&files.lock);
+    OpenFile* f = &files.open[fd];
+    if (!files.is_initialized || f->inode_no < 0) {
+        pthread_mutex_unlock(&files.lock);
+        return;
+    }
+    if (offset != f->next) {
+        f->window = 0;
+        f->ahead = 0;
+    } else if (f->window == 0) {
+        f->window = min_size(MIN_READAHEAD_BLOCKS, max_window);
+    } else {
+        f->window = min_size(2 * f->window, max_window);
+    }
+    f->next = offset + nbytes;
+    size_t cur = f->next / BLOCK_SIZE;
+    if (f->ahead < cur) {
+        f->ahead = cur;
+    }
+    // Queue the next window once less than a window is left ahead of the reader.
+    size_t first = f->ahead;
+    size_t count = 0;
+    if (f->window > 0 && f->ahead - cur <= f->window && first < nblocks) {
+        count = min_size(f->window, nblocks - first);
+        f->ahead = first + count;
+    }
+    int inode_no = f->inode_no;
+    pthread_mutex_unlock(&files.lock);
+    queue_readahead(inode_no, first, count);
+}
+
+bool inode_is_open(int inode_no) {
+    bool is_open = false;
+    pthread_mutex_lock(&files.lock);
+    init_file_table();
+    for (size_t i = 0; i < MAX_OPEN_FILES && files.nopen > 0 && !is_open; ++i) {
+        is_open = files.open[i].inode_no == inode_no;
+    }
+    pthread_mutex_unlock(&files.lock);
+    return is_open;
+}
+
+void close_all_files() {
+    pthread_mutex_lock(&files.lock);
+    files.is_initialized = false;
+    init_file_table();
+    pthread_mutex_unlock(&files.lock);
+}
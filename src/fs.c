@@ -5,49 +5,89 @@
 #include <string.h>
 
 #include "allocator.h"
+#include "dcache.h"
 #include "dir.h"
 #include "disk.h"
 #include "err.h"
+#include "extent.h"
+#include "file.h"
 #include "inode.h"
+#include "journal.h"
 #include "logging.h"
 #include "on-disk/super.h"
 #include "path.h"
+#include "stats.h"
 #include "super.h"
 
 void mkfs(const char* disk_img_fn) {
+    FsGeometry geometry = {
+        .block_size = DEFAULT_BLOCK_SIZE,
+        .num_blocks = DEFAULT_NUM_BLOCKS,
+        .max_inodes = DEFAULT_MAX_INODES,
+        .journal_blocks = 0,
+    };
+    if (mkfs_with_geometry(disk_img_fn, &geometry) != 0) {
+        err_exit("mkfs: invalid default geometry");
+    }
+}
+
+static int _mkfs_with_geometry(const char* disk_img_fn, const FsGeometry* geometry) {
     if (!disk_img_fn) {
         err_exit("mkfs: `disk_img_fn` should contain the path to the disk image.");
     }
-    logMsg(INFO_LOG, "mkfs: Opening disk file. path=%s.", disk_img_fn);
-    size_t disk_size = (size_t)BLOCK_SIZE * (size_t)NUM_BLOCKS;
-    if (create_disk_fs(disk_img_fn, disk_size) != 0) {
-        err_exit("mkfs: failed to create disk image");
+    if (!geometry || geometry->block_size == 0) {
+        logMsg(ERROR_LOG, "mkfs: invalid geometry");
+        return -1;
+    }
+    // Regions follow the superblock back to back: bitmap, inode table, journal, data.
+    uint64_t bs = geometry->block_size;
+    uint64_t bitmap_blocks = ((uint64_t)geometry->num_blocks + 8 * bs - 1) / (8 * bs);
+    uint64_t itable_blocks = ((uint64_t)geometry->max_inodes * sizeof(Inode) + bs - 1) / bs;
+    uint64_t journal_blocks = geometry->journal_blocks;
+    if (journal_blocks == 0) {
+        journal_blocks = geometry->num_blocks / DEFAULT_JOURNAL_FRACTION;
+        if (journal_blocks < MIN_JOURNAL_BLOCKS) {
+            journal_blocks = MIN_JOURNAL_BLOCKS;
+        }
+        if (journal_blocks > MAX_DEFAULT_JOURNAL_BLOCKS) {
+            journal_blocks = MAX_DEFAULT_JOURNAL_BLOCKS;
+        }
     }
-    logMsg(INFO_LOG, "mkfs: zeroing disk");
-    uint8_t zeros[1024] = {0};
-    for (uint32_t i = 0; i < NUM_BLOCKS; i++) {
-        write_to_disk((void*)zeros, BLOCK_SIZE, 1);
+    if (1 + bitmap_blocks + itable_blocks + journal_blocks >= geometry->num_blocks) {
+        logMsg(ERROR_LOG, "mkfs: %u blocks leave no room for data", geometry->num_blocks);
+        return -1;
     }
-    // Write superblock to LBA 0
     SuperConfig sb = {
         .magic_number = MAGIC,
-        .block_size = BLOCK_SIZE,
-        .num_blocks = NUM_BLOCKS,
-        .max_inodes = MAX_INODES,
-        .bitmap_start = BITMAP_START,
-        .inode_start = INODE_START,
-        .data_start = DATA_START};
-    logMsg(INFO_LOG, "mkfs: writing superblock");
+        .block_size = geometry->block_size,
+        .num_blocks = geometry->num_blocks,
+        .max_inodes = geometry->max_inodes,
+        .bitmap_start = 1,
+        .inode_start = (uint32_t)(1 + bitmap_blocks),
+        .journal_start = (uint32_t)(1 + bitmap_blocks + itable_blocks),
+        .journal_blocks = (uint32_t)journal_blocks,
+        .data_start = (uint32_t)(1 + bitmap_blocks + itable_blocks + journal_blocks)};
+    if (validate_super(&sb) != 0) {
+        logMsg(ERROR_LOG, "mkfs: invalid geometry");
+        return -1;
+    }
+    logMsg(INFO_LOG, "mkfs: Opening disk file. path=%s.", disk_img_fn);
+    if (create_disk_fs(disk_img_fn, (size_t)bs * geometry->num_blocks) != 0) {
+        err_exit("mkfs: failed to create disk image");
+    }
+    // The image is created empty and extended, so it already reads as zeros without a
+    // block written; only the metadata below goes out.
     set_super(&sb);
+    // Write superblock to LBA 0
+    logMsg(INFO_LOG, "mkfs: writing superblock");
     flush_super_to_disk();
 
-    // Initialize bitmap (RAM) then persist
+    // Initialize bitmap (RAM); it is persisted, in one write, once the root has its block.
     logMsg(INFO_LOG, "mkfs: initializing bitmap");
     alloc_bitmap();
     clear_bitmap();
-    flush_bitmap_to_disk();
 
-    // Initialize inode table
+    // Initialize inode table; only the block holding the root gets written.
     logMsg(INFO_LOG, "mkfs: initializing inode table");
     init_inode_table();
 
@@ -65,12 +105,24 @@ void mkfs(const char* disk_img_fn) {
     if (blk < 0) {
         err_exit("mkfs: failed to allocate root data block");
     }
-    root.data_blocks[0] = blk;
+    extent_append(&root, (uint32_t)blk, 1);
     write_inode(root_ino, root);
     flush_bitmap_to_disk();
+    flush_inode_table_to_disk();
+    // From here on, metadata changes go through the journal.
+    init_journal();
+    return 0;
+}
+
+int mkfs_with_geometry(const char* disk_img_fn, const FsGeometry* geometry) {
+    uint64_t start = STAT_START();
+    int rc = _mkfs_with_geometry(disk_img_fn, geometry);
+    STAT_RECORD_OP(STAT_OP_MKFS, start);
+    return rc;
 }
 
 int mkdir_fs(const char* path) {
+    uint64_t start = STAT_START();
     logMsg(INFO_LOG, "mkdir_fs: path=%s", path ? path : "(null)");
     int rc = create_fs(path, true);
     if (rc != 0) {
@@ -78,10 +130,12 @@ int mkdir_fs(const char* path) {
     } else {
         logMsg(INFO_LOG, "mkdir_fs succeeded: path=%s", path ? path : "(null)");
     }
+    STAT_RECORD_OP(STAT_OP_MKDIR, start);
     return rc;
 }
 
 int mkfile_fs(const char* path) {
+    uint64_t start = STAT_START();
     logMsg(INFO_LOG, "mkfile_fs: path=%s", path ? path : "(null)");
     int rc = create_fs(path, false);
     if (rc != 0) {
@@ -89,17 +143,50 @@ int mkfile_fs(const char* path) {
     } else {
         logMsg(INFO_LOG, "mkfile_fs succeeded: path=%s", path ? path : "(null)");
     }
+    STAT_RECORD_OP(STAT_OP_MKFILE, start);
     return rc;
 }
 
-int create_fs(const char* path, bool is_dir) {
-    // TODO: bug
-    require_disk_is_mounted();
+/*
+ * Operations that change metadata run as one journal handle each
+ * and return only once their changes are durable.
+ */
+static int end_handle(int rc) {
+    if (!journal_end() && rc >= 0) {
+        return -1;
+    }
+    return rc;
+}
+
+static int _create_fs(const char* path, bool is_dir) {
     logMsg(INFO_LOG, "create_fs: path=%s is_dir=%d", path ? path : "(null)", is_dir);
+    if (!path) {
+        logMsg(ERROR_LOG, "create_fs: path is null");
+        return -1;
+    }
+    char* name = strrchr(path, '/');
+    if (!name || *(name + 1) == '\0') {
+        logMsg(ERROR_LOG, "create_fs: invalid name in path: %s", path);
+        return -1;
+    }
+    name++;
+    int p_inode_no;  // Parent inode num.
+    char* parent_path = get_parent_path(path);
+    if (get_inode_no_from_path(parent_path, &p_inode_no) != 0) {
+        logMsg(ERROR_LOG, "create_fs: invalid parent path for %s", path);
+        free(parent_path);
+        return -1;
+    }
+    free(parent_path);
+    int existing;
+    if (get_inode_no_from_path(path, &existing) == 0) {
+        logMsg(ERROR_LOG, "create_fs: %s already exists", path);
+        return -1;
+    }
     Inode file = (Inode){0};
     int inode_no = alloc_inode();
     if (inode_no == -1) {
-        logMsg(ERROR_LOG, "create_fs: alloc_inode failed for path=%s", path ? path : "(null)");
+        logMsg(ERROR_LOG, "create_fs: alloc_inode failed for path=%s", path);
         return -1;
     }
     // Preemptively allocate data blocks for directories.
@@ -107,31 +194,43 @@ int create_fs(const char* path, bool is_dir) {
     if (is_dir) {
         int block_no = alloc_block();
         if (block_no < 0) {
-            logMsg(
-                ERROR_LOG, "create_fs: alloc_block failed for dir path=%s", path ? path : "(null)");
+            logMsg(ERROR_LOG, "create_fs: alloc_block failed for dir path=%s", path);
+            free_inode(inode_no);
             return -1;
         }
-        file.data_blocks[0] = block_no;
+        extent_append(&file, (uint32_t)block_no, 1);
     }
     inode_set_valid(&file);
     if (is_dir) inode_set_dir(&file);
     file.size = 0;
     write_inode(inode_no, file);
-    logMsg(
-        INFO_LOG,
-        "create_fs: created inode=%d path=%s is_dir=%d",
-        inode_no,
-        path ? path : "(null)",
-        is_dir);
+    DirectoryEntry dirent;
+    dirent.inode_number = inode_no;
+    strncpy(dirent.name, name, MAX_DIRNAME_LEN);
+    dirent.name[MAX_DIRNAME_LEN] = '\0';
+    if (add_dirent(p_inode_no, dirent) != 0) {
+        logMsg(ERROR_LOG, "create_fs: failed to link %s into its parent", path);
+        extent_free_all(&file);
+        free_inode(inode_no);
+        return -1;
+    }
+    logMsg(INFO_LOG, "create_fs: created inode=%d path=%s is_dir=%d", inode_no, path, is_dir);
     return 0;
 }
 
-// ! CONCERNING read_fs and write_fs
-// ! As of now, these function assume there is only one block per inode
-// ! and if the data is greater than BLOCK_SIZE, it will truncate it.
-// * Return the number of bytes operated on.
-int read_fs(const char* path, char* buf, size_t bufsize) {
+int create_fs(const char* path, bool is_dir) {
     require_disk_is_mounted();
+    uint64_t start = STAT_START();
+    journal_begin();
+    int rc = end_handle(_create_fs(path, is_dir));
+    STAT_RECORD_OP(STAT_OP_CREATE, start);
+    return rc;
+}
+
+// * read_fs and write_fs move each extent with a single disk I/O.
+// * write_fs replaces the contents of an existing file in place.
+// * Return the number of bytes operated on.
+static int _read_fs(const char* path, char* buf, size_t bufsize) {
     logMsg(INFO_LOG, "read_fs: path=%s bufsize=%zu", path ? path : "(null)", bufsize);
     if (!path) {
         logMsg(ERROR_LOG, "read_fs: path is null");
@@ -142,23 +241,47 @@ int read_fs(const char* path, char* buf, size_t bufsize) {
         return -1;
     }
     int inode_no;
-    if (get_inode_no_from_path(path, &inode_no) != 0) {
+    if (lock_inode_from_path(path, false, &inode_no) != 0) {
         logMsg(ERROR_LOG, "read_fs: invalid path=%s", path);
         return -1;
     }
     Inode inode;
-    if (read_inode(inode_no, &inode) != 0) {
+    if (read_inode(inode_no, &inode) != 1) {
         logMsg(ERROR_LOG, "read_fs: error reading inode no %d", inode_no);
+        inode_unlock(inode_no);
         return -1;
     }
-    size_t nbytes_to_read = bufsize < inode.size ? bufsize : inode.size;
-    read_data_block(inode.data_blocks[0], buf, nbytes_to_read);
-    logMsg(INFO_LOG, "read_fs: read bytes=%d from inode=%d", inode.size, inode_no);
-    return nbytes_to_read;
+    size_t off = file_read(inode_no, &inode, 0, buf, bufsize);
+    inode_unlock(inode_no);
+    logMsg(INFO_LOG, "read_fs: read bytes=%zu from inode=%d", off, inode_no);
+    return off;
 }
 
-int write_fs(const char* path, const char* data) {
+int read_fs(const char* path, char* buf, size_t bufsize) {
     require_disk_is_mounted();
+    uint64_t start = STAT_START();
+    int rc = _read_fs(path, buf, bufsize);
+    STAT_RECORD_OP(STAT_OP_READ, start);
+    return rc;
+}
+
+// Replaces the contents of the file at `path`, which the caller holds locked.
+static int overwrite_file(const char* path, int inode_no, const char* data, size_t nbytes) {
+    Inode inode;
+    if (read_inode(inode_no, &inode) != 1 || inode_is_dir(inode)) {
+        logMsg(ERROR_LOG, "write_fs: %s is not a file", path);
+        return -1;
+    }
+    if (file_replace(inode_no, &inode, data, nbytes) != 0) {
+        logMsg(ERROR_LOG, "write_fs: failed to allocate data blocks for %s", path);
+        return -1;
+    }
+    write_inode(inode_no, inode);
+    logMsg(INFO_LOG, "write_fs: rewrote inode=%d path=%s size=%zu", inode_no, path, nbytes);
+    return nbytes;
+}
+
+static int _write_fs(const char* path, const char* data) {
     if (!path) {
         logMsg(ERROR_LOG, "write_fs: path is null");
         return -1;
@@ -169,6 +292,12 @@ int write_fs(const char* path, const char* data) {
     }
     logMsg(INFO_LOG, "write_fs: path=%s bytes=%zu", path, strlen(data));
     size_t nbytes = strlen(data);
+    int inode_no;
+    if (lock_inode_from_path(path, true, &inode_no) == 0) {
+        int rc = overwrite_file(path, inode_no, data, nbytes);
+        inode_unlock(inode_no);
+        return rc;
+    }
     char* name = strrchr(path, '/');
     if (!name || *(name + 1) == '\0') {
         logMsg(ERROR_LOG, "write_fs: invalid file name in path: %s", path);
@@ -184,67 +313,115 @@ int write_fs(const char* path, const char* data) {
         return -1;
     }
     free(parent_path);
-    int inode_no = alloc_inode();
+    inode_no = alloc_inode();
     if (inode_no == -1) {
         logMsg(ERROR_LOG, "write_fs: alloc_inode failed for %s", path);
         return -1;
     }
     Inode finode = (Inode){0};
     inode_set_valid(&finode);
-    int block_no = alloc_block();
-    if (block_no == -1) {
-        logMsg(ERROR_LOG, "write_fs: alloc_block failed for %s", path);
+    // The data is written, as few runs as possible, before the file is linked.
+    if (file_replace(inode_no, &finode, data, nbytes) != 0) {
+        logMsg(ERROR_LOG, "write_fs: failed to allocate data blocks for %s", path);
+        free_inode(inode_no);
         return -1;
     }
-    finode.data_blocks[0] = block_no;
-    size_t nbytes_to_write = nbytes > BLOCK_SIZE ? BLOCK_SIZE : nbytes;
-    write_data_block(block_no, (void*)data, nbytes_to_write);
-    finode.size = nbytes_to_write;
     write_inode(inode_no, finode);
     DirectoryEntry dirent;
     dirent.inode_number = inode_no;
     strncpy(dirent.name, name, MAX_DIRNAME_LEN);
     dirent.name[MAX_DIRNAME_LEN] = '\0';
-    add_dirent(p_inode_no, dirent);
+    if (add_dirent(p_inode_no, dirent) != 0) {
+        logMsg(ERROR_LOG, "write_fs: failed to link %s into its parent", path);
+        extent_free_all(&finode);
+        free_inode(inode_no);
+        return -1;
+    }
     logMsg(
         INFO_LOG,
         "write_fs: wrote file name=%s inode=%d parent_inode=%d size=%zu",
         name,
         inode_no,
         p_inode_no,
-        nbytes_to_write);
-    return nbytes_to_write;
+        nbytes);
+    return nbytes;
 }
 
-int delete_fs(const char* path) {
+int write_fs(const char* path, const char* data) {
     require_disk_is_mounted();
+    uint64_t start = STAT_START();
+    journal_begin();
+    int rc = end_handle(_write_fs(path, data));
+    STAT_RECORD_OP(STAT_OP_WRITE, start);
+    return rc;
+}
+
+static int _delete_fs(const char* path) {
     logMsg(INFO_LOG, "delete_fs: path=%s", path ? path : "(null)");
     if (!path) {
         logMsg(ERROR_LOG, "delete_fs: path is null");
         return -1;
     }
+    // Held until the inode is freed: readers of the file finish first, and
+    // a directory can't gain an entry between the emptiness check and the unlink.
     int inode_no;
-    if (get_inode_no_from_path(path, &inode_no) != 0) {
+    if (lock_inode_from_path(path, true, &inode_no) != 0) {
         logMsg(ERROR_LOG, "delete_fs: invalid path=%s", path);
         return -1;
     }
     Inode inode;
-    if (read_inode(inode_no, &inode) != 0) {
+    if (read_inode(inode_no, &inode) != 1) {
         logMsg(ERROR_LOG, "delete_fs: error reading inode no %d", inode_no);
+        inode_unlock(inode_no);
         return -1;
     }
-    for (int i = 0; i < MAX_INODE_DATA_BLOCKS; ++i) {
-        if (inode.data_blocks[i] > 0) {
-            free_block(inode.data_blocks[i]);
-        }
+    if (inode_no == 0) {
+        logMsg(ERROR_LOG, "delete_fs: cannot delete the root directory");
+        inode_unlock(inode_no);
+        return -1;
     }
+    if (inode_is_dir(inode) && inode.size > 0) {
+        logMsg(ERROR_LOG, "delete_fs: directory %s is not empty", path);
+        inode_unlock(inode_no);
+        return -1;
+    }
+    if (inode_is_open(inode_no)) {
+        logMsg(ERROR_LOG, "delete_fs: %s is open", path);
+        inode_unlock(inode_no);
+        return -1;
+    }
+    int p_inode_no;
+    char* parent_path = get_parent_path(path);
+    int rc = get_inode_no_from_path(parent_path, &p_inode_no);
+    free(parent_path);
+    if (rc != 0 || remove_dirent(p_inode_no, strrchr(path, '/') + 1) != 0) {
+        logMsg(ERROR_LOG, "delete_fs: failed to unlink %s from its parent", path);
+        inode_unlock(inode_no);
+        return -1;
+    }
+    // The inode number may be reused, so forget what was cached under it.
+    dcache_remove_children(inode_no);
+    // Bytes never flushed are never written.
+    file_drop_delayed(inode_no);
+    extent_free_all(&inode);
     inode_set_invalid(&inode);
     write_inode(inode_no, inode);
+    inode_unlock(inode_no);
     logMsg(INFO_LOG, "delete_fs: cleared inode=%d", inode_no);
     return 0;
 }
 
+int delete_fs(const char* path) {
+    require_disk_is_mounted();
+    uint64_t start = STAT_START();
+    journal_begin();
+    int rc = end_handle(_delete_fs(path));
+    STAT_RECORD_OP(STAT_OP_DELETE, start);
+    return rc;
+}
+
 int rmdir_fs(const char* path) {
+    uint64_t start = STAT_START();
     logMsg(INFO_LOG, "rmdir_fs: path=%s", path ? path : "(null)");
     int rc = delete_fs(path);  // same as delete_fs for now
     if (rc != 0) {
@@ -252,22 +429,304 @@ int rmdir_fs(const char* path) {
     } else {
         logMsg(INFO_LOG, "rmdir_fs succeeded: path=%s", path ? path : "(null)");
     }
+    STAT_RECORD_OP(STAT_OP_RMDIR, start);
+    return rc;
+}
+
+static int _readdir_fs(
+    const char* path, uint64_t* cookie, ReaddirEntry* entries, size_t max_entries, int flags) {
+    if (!path || !cookie || (!entries && max_entries > 0)) {
+        logMsg(ERROR_LOG, "readdir_fs: path, cookie or entries is null");
+        return -1;
+    }
+    int dir_inode_no;
+    if (get_inode_no_from_path(path, &dir_inode_no) != 0) {
+        logMsg(ERROR_LOG, "readdir_fs: invalid path=%s", path);
+        return -1;
+    }
+    DirectoryEntry* batch = (DirectoryEntry*)malloc((max_entries > 0 ? max_entries : 1) *
+                                                    sizeof(DirectoryEntry));
+    if (!batch) {
+        err_exit("readdir_fs: failed to allocate memory");
+    }
+    long n = readdir_dirents(dir_inode_no, cookie, batch, max_entries);
+    for (long i = 0; i < n; ++i) {
+        ReaddirEntry* e = &entries[i];
+        e->dirent = batch[i];
+        e->is_dir = false;
+        e->size = 0;
+        if (!(flags & READDIR_FS_PLUS)) {
+            continue;
+        }
+        // Taken after the directory's lock is dropped, as the lock order requires. An
+        // entry removed since then is still returned, with the type and size zeroed.
+        int inode_no = e->dirent.inode_number;
+        Inode inode;
+        inode_rdlock(inode_no);
+        if (read_inode(inode_no, &inode) == 1 && inode_is_valid(inode)) {
+            e->is_dir = inode_is_dir(inode);
+            e->size = e->is_dir ? inode.size : file_size(inode_no, &inode);
+        }
+        inode_unlock(inode_no);
+    }
+    free(batch);
+    logMsg(INFO_LOG, "readdir_fs: path=%s entries=%ld", path, n);
+    return (int)n;
+}
+
+int readdir_fs(
+    const char* path, uint64_t* cookie, ReaddirEntry* entries, size_t max_entries, int flags) {
+    require_disk_is_mounted();
+    uint64_t start = STAT_START();
+    int rc = _readdir_fs(path, cookie, entries, max_entries, flags);
+    STAT_RECORD_OP(STAT_OP_READDIR, start);
     return rc;
 }
 
 int ls_fs(const char* path, DirectoryEntry* entries, size_t max_entries) {
     require_disk_is_mounted();
+    uint64_t start = STAT_START();
     logMsg(INFO_LOG, "ls_fs: path=%s max_entries=%zu", path ? path : "(null)", max_entries);
-    int count = 0;
-    Inode inode;
-    for (uint32_t i = 0; i < MAX_INODES && count < (int)max_entries; ++i) {
-        read_inode(i, &inode);
-        if (inode.f & IS_VALID_FLAG) {
-            entries[count].inode_number = i;
-            snprintf(entries[count].name, sizeof(entries[count].name), "inode%d", i);
-            count++;
-        }
+    int count = -1;
+    int dir_inode_no;
+    if (!path || (!entries && max_entries > 0)) {
+        logMsg(ERROR_LOG, "ls_fs: path or entries is null");
+    } else if (get_inode_no_from_path(path, &dir_inode_no) != 0) {
+        logMsg(ERROR_LOG, "ls_fs: invalid path=%s", path);
+    } else {
+        uint64_t cookie = 0;
+        count = (int)readdir_dirents(dir_inode_no, &cookie, entries, max_entries);
+        logMsg(INFO_LOG, "ls_fs: entries_found=%d", count);
     }
-    logMsg(INFO_LOG, "ls_fs: entries_found=%d", count);
+    STAT_RECORD_OP(STAT_OP_LS, start);
     return count;
 }
+
+static int _open_fs(const char* path, int flags) {
+    logMsg(INFO_LOG, "open_fs: path=%s flags=%d", path ? path : "(null)", flags);
+    if (!path) {
+        logMsg(ERROR_LOG, "open_fs: path is null");
+        return -1;
+    }
+    int inode_no;
+    if ((flags & OPEN_FS_CREATE) && get_inode_no_from_path(path, &inode_no) != 0) {
+        // Another thread may create it first; the lookup below settles it.
+        _create_fs(path, false);
+    }
+    bool truncate = flags & OPEN_FS_TRUNC;
+    if (lock_inode_from_path(path, truncate, &inode_no) != 0) {
+        logMsg(ERROR_LOG, "open_fs: invalid path=%s", path);
+        return -1;
+    }
+    Inode inode;
+    if (read_inode(inode_no, &inode) != 1 || inode_is_dir(inode)) {
+        logMsg(ERROR_LOG, "open_fs: %s is not a file", path);
+        inode_unlock(inode_no);
+        return -1;
+    }
+    if (truncate && file_size(inode_no, &inode) > 0) {
+        file_truncate(inode_no, &inode, 0);
+        write_inode(inode_no, inode);
+    }
+    // Registered under the inode lock, so `delete_fs` sees it.
+    int fd = open_file(inode_no);
+    inode_unlock(inode_no);
+    logMsg(INFO_LOG, "open_fs: fd=%d inode=%d", fd, inode_no);
+    return fd;
+}
+
+int open_fs(const char* path, int flags) {
+    require_disk_is_mounted();
+    uint64_t start = STAT_START();
+    int fd;
+    if (flags & (OPEN_FS_CREATE | OPEN_FS_TRUNC)) {
+        journal_begin();
+        fd = end_handle(_open_fs(path, flags));
+    } else {
+        fd = _open_fs(path, flags);
+    }
+    STAT_RECORD_OP(STAT_OP_OPEN, start);
+    return fd;
+}
+
+int close_fs(int fd) {
+    logMsg(INFO_LOG, "close_fs: fd=%d", fd);
+    if (close_file(fd) != 0) {
+        logMsg(ERROR_LOG, "close_fs: bad descriptor %d", fd);
+        return -1;
+    }
+    return 0;
+}
+
+// Locks the inode `fd` refers to and reads it. Returns its number, or -1.
+static int lock_open_file(const char* op, int fd, bool exclusive, Inode* inode) {
+    int inode_no;
+    if (file_inode(fd, &inode_no) != 0) {
+        logMsg(ERROR_LOG, "%s: bad descriptor %d", op, fd);
+        return -1;
+    }
+    if (exclusive) {
+        inode_wrlock(inode_no);
+    } else {
+        inode_rdlock(inode_no);
+    }
+    if (read_inode(inode_no, inode) != 1) {
+        logMsg(ERROR_LOG, "%s: error reading inode no %d", op, inode_no);
+        inode_unlock(inode_no);
+        return -1;
+    }
+    return inode_no;
+}
+
+static int _pread_fs(int fd, char* buf, size_t nbytes, size_t offset) {
+    if (!buf) {
+        logMsg(ERROR_LOG, "pread_fs: buf is null");
+        return -1;
+    }
+    Inode inode;
+    int inode_no = lock_open_file("pread_fs", fd, false, &inode);
+    if (inode_no < 0) {
+        return -1;
+    }
+    size_t nread = file_read(inode_no, &inode, offset, buf, nbytes);
+    file_readahead(fd, &inode, offset, nread);
+    inode_unlock(inode_no);
+    return nread;
+}
+
+int pread_fs(int fd, char* buf, size_t nbytes, size_t offset) {
+    require_disk_is_mounted();
+    uint64_t start = STAT_START();
+    int rc = _pread_fs(fd, buf, nbytes, offset);
+    STAT_RECORD_OP(STAT_OP_PREAD, start);
+    return rc;
+}
+
+// With `append`, `offset` is ignored and the data goes at the end of the file.
+static int _pwrite_fs(int fd, const char* data, size_t nbytes, size_t offset, bool append) {
+    if (!data) {
+        logMsg(ERROR_LOG, "pwrite_fs: data is null");
+        return -1;
+    }
+    Inode inode;
+    int inode_no = lock_open_file("pwrite_fs", fd, true, &inode);
+    if (inode_no < 0) {
+        return -1;
+    }
+    Inode before = inode;
+    if (append) {
+        offset = file_size(inode_no, &inode);
+    }
+    if (file_write_delayed(inode_no, &inode, offset, data, nbytes) != 0) {
+        logMsg(ERROR_LOG, "pwrite_fs: failed to write %zu bytes at %zu", nbytes, offset);
+        inode_unlock(inode_no);
+        return -1;
+    }
+    // An overwrite inside the file, or a delayed write, leaves its inode as it was.
+    if (memcmp(&before, &inode, sizeof(Inode)) != 0) {
+        write_inode(inode_no, inode);
+    }
+    inode_unlock(inode_no);
+    return nbytes;
+}
+
+/*
+ * Handle I/O runs as journal handles that don't wait for their
+ * commit; `fsync_fs` does.
+ */
+int pwrite_fs(int fd, const char* data, size_t nbytes, size_t offset) {
+    require_disk_is_mounted();
+    uint64_t start = STAT_START();
+    journal_begin();
+    int rc = _pwrite_fs(fd, data, nbytes, offset, false);
+    journal_end_nowait();
+    STAT_RECORD_OP(STAT_OP_PWRITE, start);
+    return rc;
+}
+
+int append_fs(int fd, const char* data, size_t nbytes) {
+    require_disk_is_mounted();
+    uint64_t start = STAT_START();
+    journal_begin();
+    int rc = _pwrite_fs(fd, data, nbytes, 0, true);
+    journal_end_nowait();
+    STAT_RECORD_OP(STAT_OP_APPEND, start);
+    return rc;
+}
+
+static int _truncate_fs(int fd, size_t size) {
+    Inode inode;
+    int inode_no = lock_open_file("truncate_fs", fd, true, &inode);
+    if (inode_no < 0) {
+        return -1;
+    }
+    if (file_truncate(inode_no, &inode, size) != 0) {
+        logMsg(ERROR_LOG, "truncate_fs: failed to extend inode=%d to %zu bytes", inode_no, size);
+        inode_unlock(inode_no);
+        return -1;
+    }
+    write_inode(inode_no, inode);
+    inode_unlock(inode_no);
+    return 0;
+}
+
+int truncate_fs(int fd, size_t size) {
+    require_disk_is_mounted();
+    uint64_t start = STAT_START();
+    journal_begin();
+    int rc = _truncate_fs(fd, size);
+    journal_end_nowait();
+    STAT_RECORD_OP(STAT_OP_TRUNCATE, start);
+    return rc;
+}
+
+// Gives the delayed bytes of the file their blocks.
+static int _fsync_fs(int fd) {
+    Inode inode;
+    int inode_no = lock_open_file("fsync_fs", fd, true, &inode);
+    if (inode_no < 0) {
+        return -1;
+    }
+    int rc = file_flush(inode_no, &inode);
+    if (rc == 0) {
+        write_inode(inode_no, inode);
+    } else {
+        logMsg(ERROR_LOG, "fsync_fs: failed to flush inode=%d", inode_no);
+    }
+    inode_unlock(inode_no);
+    return rc;
+}
+
+int fsync_fs(int fd) {
+    require_disk_is_mounted();
+    uint64_t start = STAT_START();
+    journal_begin();
+    int rc = _fsync_fs(fd);
+    journal_end_nowait();
+    // Inside a batch, the batch's own commit makes the flush durable.
+    if (rc == 0 && !journal_in_handle() && !journal_commit()) {
+        logMsg(ERROR_LOG, "fsync_fs: failed to commit the journal");
+        rc = -1;
+    }
+    STAT_RECORD_OP(STAT_OP_FSYNC, start);
+    return rc;
+}
+
+void begin_batch_fs() {
+    require_disk_is_mounted();
+    logMsg(INFO_LOG, "begin_batch_fs");
+    journal_begin_batch();
+}
+
+int commit_batch_fs() {
+    require_disk_is_mounted();
+    logMsg(INFO_LOG, "commit_batch_fs");
+    uint64_t start = STAT_START();
+    bool ok = journal_end_batch();
+    STAT_RECORD_OP(STAT_OP_BATCH_COMMIT, start);
+    if (!ok) {
+        logMsg(ERROR_LOG, "commit_batch_fs: failed to commit the batch");
+        return -1;
+    }
+    return 0;
+}
@@ -0,0 +1,546 @@
+#include "fsck.h"
+
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "dir.h"
+#include "disk.h"
+#include "err.h"
+#include "extent.h"
+#include "fs.h"
+#include "inode.h"
+#include "journal.h"
+#include "logging.h"
+#include "path.h"
+
+#define LOST_FOUND "/lost+found"
+// Inodes, or bitmap words, a worker takes from the shared cursor at a time.
+#define FSCK_CHUNK 64
+
+//! The inode table is copied once and scanned in passes, each split
+//! over the worker threads: inodes and their extents, then directory
+//! entries, then link counts, then reachability from the root, and
+//! last the bitmap against the blocks the inodes claimed. Workers
+//! only record problems; repairs run afterwards, one at a time.
+
+// --------------- LOCAL ---------------
+
+// In the order repairs are applied: sizes before the entries that change
+// them, and the bitmap before /lost+found is given an inode and a block.
+typedef enum FSCK_FIXES {
+    FIX_NONE,            // Reported only.
+    FIX_DIR_SIZE,        // Set the directory's entry count to `value`.
+    FIX_FILE_SIZE,       // Cut the file's size to `value` bytes.
+    FIX_DIRENT,          // Remove the entry `name` from directory `inode_no`.
+    FIX_UNMARKED_BLOCK,  // Mark block `value` taken.
+    FIX_LEAKED_BLOCK,    // Free block `value`.
+    FIX_ORPHAN,          // Link `inode_no` into LOST_FOUND.
+    NUM_FIXES
+} FixKind;
+
+typedef struct {
+    FixKind kind;
+    int inode_no;
+    size_t value;
+    char name[MAX_DIRNAME_LEN + 1];
+} Problem;
+
+typedef struct {
+    FILE* out;
+    int ninodes;
+    size_t nblocks;
+    size_t data_start;
+    Inode* inodes;  // Copy of the table, filled by the first pass.
+    bool* bad;      // Per inode: its extents are not to be trusted.
+    _Atomic uint64_t* refs;  // A bit per block some inode references.
+    size_t nwords;
+    atomic_int* links;   // Per inode: entries that name it.
+    atomic_int* parent;  // Per inode: a directory with such an entry.
+    atomic_bool* reachable;
+    uint64_t* bitmap;
+    atomic_size_t cursor;
+    atomic_size_t nvalid, ndirs, nused;
+    Problem* problems;
+    size_t nproblems, cap;
+    int lost_found;
+    pthread_mutex_t lock;
+} Checker;
+
+static Checker chk = {.lock = PTHREAD_MUTEX_INITIALIZER};
+
+typedef void (*ItemFn)(size_t i);
+
+typedef struct {
+    ItemFn fn;
+    size_t n;
+} Pass;
+
+static void* run_pass(void* arg) {
+    const Pass* pass = (const Pass*)arg;
+    for (;;) {
+        size_t first = atomic_fetch_add(&chk.cursor, FSCK_CHUNK);
+        if (first >= pass->n) {
+            return NULL;
+        }
+        size_t last = first + FSCK_CHUNK < pass->n ? first + FSCK_CHUNK : pass->n;
+        for (size_t i = first; i < last; ++i) {
+            pass->fn(i);
+        }
+    }
+}
+
+// Calls `fn` on each of [0, n) from `nthreads` threads, the caller's among them.
+static void parallel_for(size_t nthreads, ItemFn fn, size_t n) {
+    Pass pass = {fn, n};
+    atomic_store(&chk.cursor, 0);
+    pthread_t* threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+    if (!threads) {
+        err_exit("parallel_for: failed to allocate memory");
+    }
+    size_t started = 0;
+    while (started + 1 < nthreads &&
+           pthread_create(&threads[started], NULL, run_pass, &pass) == 0) {
+        started++;
+    }
+    run_pass(&pass);
+    for (size_t t = 0; t < started; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    free(threads);
+}
+
+static void problem(
+    FixKind kind, int inode_no, size_t value, const char* name, const char* fmt, ...) {
+    pthread_mutex_lock(&chk.lock);
+    if (chk.nproblems == chk.cap) {
+        chk.cap = chk.cap ? chk.cap * 2 : 64;
+        chk.problems = (Problem*)realloc(chk.problems, chk.cap * sizeof(Problem));
+        if (!chk.problems) {
+            err_exit("fsck: failed to allocate memory");
+        }
+    }
+    Problem* p = &chk.problems[chk.nproblems++];
+    *p = (Problem){kind, inode_no, value, {0}};
+    if (name) {
+        strncpy(p->name, name, MAX_DIRNAME_LEN);
+    }
+    if (chk.out) {
+        va_list args;
+        va_start(args, fmt);
+        vfprintf(chk.out, fmt, args);
+        va_end(args);
+        fputc('\n', chk.out);
+    }
+    pthread_mutex_unlock(&chk.lock);
+}
+
+static bool run_in_range(size_t start, size_t len) {
+    return len > 0 && start >= chk.data_start && start < chk.nblocks &&
+           len <= chk.nblocks - start;
+}
+
+// Claims [start, start + len) for `inode_no`, reporting blocks another inode got first.
+static void mark_run(int inode_no, size_t start, size_t len) {
+    for (size_t b = start; b < start + len;) {
+        size_t w = b / 64;
+        size_t n = 64 - b % 64 < start + len - b ? 64 - b % 64 : start + len - b;
+        uint64_t mask = (n == 64 ? ~0ULL : ((1ULL << n) - 1)) << (b % 64);
+        uint64_t twice = atomic_fetch_or(&chk.refs[w], mask) & mask;
+        if (twice) {
+            size_t first = w * 64 + (size_t)__builtin_ctzll(twice);
+            problem(
+                FIX_NONE,
+                inode_no,
+                first,
+                NULL,
+                "inode %d: block %zu is used twice",
+                inode_no,
+                first);
+        }
+        b += n;
+    }
+}
+
+// Whether a compressed file has a run for each of its chunks, long enough to hold it.
+static bool chunks_fit(const Inode* inode, const Extent* extents, size_t n) {
+    if (n != (inode->size + COMPRESS_CHUNK_BYTES - 1) / COMPRESS_CHUNK_BYTES) {
+        return false;
+    }
+    for (size_t c = 0; c < n; ++c) {
+        size_t len = inode->size - c * COMPRESS_CHUNK_BYTES;
+        if (len > COMPRESS_CHUNK_BYTES) {
+            len = COMPRESS_CHUNK_BYTES;
+        }
+        size_t stored = extents[c].csize > 0 ? extents[c].csize : len;
+        if (stored > len || stored > (size_t)extents[c].len * BLOCK_SIZE) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void check_extents(int inode_no, const Inode* inode) {
+    if (inode->nextents > INODE_EXTENTS) {
+        if (!run_in_range(inode->extent_block, 1)) {
+            problem(
+                FIX_NONE,
+                inode_no,
+                0,
+                NULL,
+                "inode %d: extent block %u is out of range",
+                inode_no,
+                inode->extent_block);
+            chk.bad[inode_no] = true;
+            return;
+        }
+        mark_run(inode_no, inode->extent_block, 1);
+    }
+    Extent* extents = alloc_extent_list();
+    size_t n = extent_list(inode, extents);
+    if (n != inode->nextents) {
+        problem(
+            FIX_NONE,
+            inode_no,
+            0,
+            NULL,
+            "inode %d: %u extents recorded, %zu found",
+            inode_no,
+            inode->nextents,
+            n);
+        chk.bad[inode_no] = true;
+    }
+    size_t nblocks = 0;
+    for (size_t e = 0; e < n; ++e) {
+        if (!run_in_range(extents[e].start, extents[e].len)) {
+            problem(
+                FIX_NONE,
+                inode_no,
+                0,
+                NULL,
+                "inode %d: extent (%u, %u) is out of range",
+                inode_no,
+                extents[e].start,
+                extents[e].len);
+            chk.bad[inode_no] = true;
+            continue;
+        }
+        mark_run(inode_no, extents[e].start, extents[e].len);
+        nblocks += extents[e].len;
+    }
+    if (inode_is_compressed(*inode)) {
+        // Its size counts bytes before compression, so it can't be cut to fit.
+        if (inode_is_dir(*inode) || (!chk.bad[inode_no] && !chunks_fit(inode, extents, n))) {
+            problem(
+                FIX_NONE,
+                inode_no,
+                0,
+                NULL,
+                "inode %d: its %zu runs do not hold its %zu bytes in chunks",
+                inode_no,
+                n,
+                inode->size);
+        }
+    } else if (!inode_is_dir(*inode) && !chk.bad[inode_no] &&
+               inode->size > nblocks * BLOCK_SIZE) {
+        problem(
+            FIX_FILE_SIZE,
+            inode_no,
+            nblocks * BLOCK_SIZE,
+            NULL,
+            "inode %d: size %zu is past its %zu blocks",
+            inode_no,
+            inode->size,
+            nblocks);
+    }
+    free(extents);
+}
+
+static void scan_inode(size_t i) {
+    int inode_no = (int)i;
+    Inode* inode = &chk.inodes[i];
+    if (read_inode(inode_no, inode) != 1 || !inode_is_valid(*inode)) {
+        return;
+    }
+    atomic_fetch_add(&chk.nvalid, 1);
+    if (inode_is_dir(*inode)) {
+        atomic_fetch_add(&chk.ndirs, 1);
+    }
+    if (!inode_is_inline(*inode)) {
+        check_extents(inode_no, inode);
+    } else if (inode_is_dir(*inode)) {
+        problem(FIX_NONE, inode_no, 0, NULL, "inode %d: directory marked inline", inode_no);
+        chk.bad[i] = true;
+    } else if (inode->size > INODE_INLINE_SIZE) {
+        problem(
+            FIX_FILE_SIZE,
+            inode_no,
+            INODE_INLINE_SIZE,
+            NULL,
+            "inode %d: inline size %zu is past %d",
+            inode_no,
+            inode->size,
+            INODE_INLINE_SIZE);
+    }
+}
+
+static bool names_valid_inode(int inode_no) {
+    // The root is never named by an entry.
+    return inode_no > 0 && inode_no < chk.ninodes && inode_is_valid(chk.inodes[inode_no]);
+}
+
+static void scan_dir(size_t i) {
+    int inode_no = (int)i;
+    const Inode* dir = &chk.inodes[i];
+    if (!inode_is_valid(*dir) || !inode_is_dir(*dir) || chk.bad[i]) {
+        return;
+    }
+    size_t n;
+    DirectoryEntry* dirents = list_dirents(dir, &n);
+    if (!dirents) {
+        problem(FIX_NONE, inode_no, 0, NULL, "directory %d: unreadable", inode_no);
+        return;
+    }
+    for (size_t e = 0; e < n; ++e) {
+        const DirectoryEntry* d = &dirents[e];
+        if (d->name[0] == '\0') {
+            problem(FIX_NONE, inode_no, 0, NULL, "directory %d: entry with no name", inode_no);
+        } else if (!names_valid_inode(d->inode_number)) {
+            problem(
+                FIX_DIRENT,
+                inode_no,
+                0,
+                d->name,
+                "directory %d: %s names missing inode %d",
+                inode_no,
+                d->name,
+                d->inode_number);
+        } else {
+            atomic_fetch_add(&chk.links[d->inode_number], 1);
+            atomic_store(&chk.parent[d->inode_number], inode_no);
+        }
+    }
+    free(dirents);
+    if (n != dir->size) {
+        problem(
+            FIX_DIR_SIZE,
+            inode_no,
+            n,
+            NULL,
+            "directory %d: size %zu, but %zu entries",
+            inode_no,
+            dir->size,
+            n);
+    }
+}
+
+static void scan_links(size_t i) {
+    int inode_no = (int)i;
+    if (inode_no == 0 || !inode_is_valid(chk.inodes[i])) {
+        return;
+    }
+    int links = atomic_load(&chk.links[i]);
+    if (links == 0) {
+        problem(FIX_ORPHAN, inode_no, 0, NULL, "inode %d: in no directory", inode_no);
+    } else if (links > 1) {
+        problem(FIX_NONE, inode_no, 0, NULL, "inode %d: named by %d entries", inode_no, links);
+    }
+}
+
+// A directory cycle has one entry per member, but no path from the root.
+static void scan_reach(size_t i) {
+    if (i == 0 || !inode_is_valid(chk.inodes[i]) || !inode_is_dir(chk.inodes[i])) {
+        return;
+    }
+    int j = (int)i;
+    for (int steps = 0; j != 0 && !atomic_load(&chk.reachable[j]); ++steps) {
+        // Orphans and directories named twice are already reported.
+        if (atomic_load(&chk.links[j]) != 1) {
+            return;
+        }
+        if (steps > chk.ninodes) {
+            problem(FIX_NONE, (int)i, 0, NULL, "directory %zu: cut off from the root", i);
+            return;
+        }
+        j = atomic_load(&chk.parent[j]);
+    }
+    for (j = (int)i; j != 0 && !atomic_load(&chk.reachable[j]); j = atomic_load(&chk.parent[j])) {
+        atomic_store(&chk.reachable[j], true);
+    }
+}
+
+static void scan_bitmap(size_t w) {
+    uint64_t mask = ~0ULL;
+    if (w * 64 < chk.data_start) {
+        mask = chk.data_start - w * 64 >= 64 ? 0 : ~0ULL << (chk.data_start - w * 64);
+    }
+    if ((w + 1) * 64 > chk.nblocks) {
+        mask &= chk.nblocks <= w * 64 ? 0 : ~0ULL >> ((w + 1) * 64 - chk.nblocks);
+    }
+    uint64_t used = atomic_load(&chk.refs[w]) & mask;
+    uint64_t taken = chk.bitmap[w] & mask;
+    atomic_fetch_add(&chk.nused, (size_t)__builtin_popcountll(used));
+    for (uint64_t bits = taken & ~used; bits; bits &= bits - 1) {
+        size_t b = w * 64 + (size_t)__builtin_ctzll(bits);
+        problem(FIX_LEAKED_BLOCK, -1, b, NULL, "block %zu: marked taken, but unused", b);
+    }
+    for (uint64_t bits = used & ~taken; bits; bits &= bits - 1) {
+        size_t b = w * 64 + (size_t)__builtin_ctzll(bits);
+        problem(FIX_UNMARKED_BLOCK, -1, b, NULL, "block %zu: in use, but marked free", b);
+    }
+}
+
+static bool set_size(int inode_no, size_t size) {
+    inode_wrlock(inode_no);
+    Inode inode;
+    bool ok = read_inode(inode_no, &inode) == 1;
+    if (ok) {
+        inode.size = size;
+        write_inode(inode_no, inode);
+    }
+    inode_unlock(inode_no);
+    return ok;
+}
+
+static bool link_lost_found(int inode_no) {
+    if (chk.lost_found < 0 && get_inode_no_from_path(LOST_FOUND, &chk.lost_found) != 0 &&
+        (mkdir_fs(LOST_FOUND) != 0 || get_inode_no_from_path(LOST_FOUND, &chk.lost_found) != 0)) {
+        logMsg(ERROR_LOG, "fsck: failed to create %s", LOST_FOUND);
+        chk.lost_found = -1;
+        return false;
+    }
+    DirectoryEntry dirent = {.inode_number = inode_no};
+    snprintf(dirent.name, sizeof dirent.name, "#%d", inode_no);
+    return add_dirent(chk.lost_found, dirent) == 0;
+}
+
+static bool repair(const Problem* p) {
+    switch (p->kind) {
+        case FIX_DIR_SIZE:
+        case FIX_FILE_SIZE:
+            return set_size(p->inode_no, p->value);
+        case FIX_DIRENT:
+            return remove_dirent(p->inode_no, p->name) == 0;
+        case FIX_UNMARKED_BLOCK:
+            claim_block((int)p->value);
+            return true;
+        case FIX_LEAKED_BLOCK:
+            free_block((int)p->value);
+            return true;
+        case FIX_ORPHAN:
+            return link_lost_found(p->inode_no);
+        default:
+            return false;
+    }
+}
+
+// All repairs are one journal transaction.
+static size_t repair_all(void) {
+    size_t repaired = 0;
+    journal_begin();
+    for (int kind = FIX_NONE + 1; kind < NUM_FIXES; ++kind) {
+        for (size_t i = 0; i < chk.nproblems; ++i) {
+            if (chk.problems[i].kind == (FixKind)kind && repair(&chk.problems[i])) {
+                repaired++;
+            }
+        }
+    }
+    if (!journal_end()) {
+        logMsg(ERROR_LOG, "fsck: failed to commit the repairs");
+        return 0;
+    }
+    return repaired;
+}
+
+static void* alloc_zeroed(size_t n, size_t size) {
+    void* p = calloc(n > 0 ? n : 1, size);
+    if (!p) {
+        err_exit("fsck: failed to allocate memory");
+    }
+    return p;
+}
+
+static void init_checker(FILE* out) {
+    chk.out = out;
+    chk.ninodes = (int)MAX_INODES;
+    chk.nblocks = NUM_BLOCKS;
+    chk.data_start = DATA_START;
+    chk.nwords = (chk.nblocks + 63) / 64;
+    chk.inodes = (Inode*)alloc_zeroed(chk.ninodes, sizeof(Inode));
+    chk.bad = (bool*)alloc_zeroed(chk.ninodes, sizeof(bool));
+    chk.refs = (_Atomic uint64_t*)alloc_zeroed(chk.nwords, sizeof(uint64_t));
+    chk.links = (atomic_int*)alloc_zeroed(chk.ninodes, sizeof(atomic_int));
+    chk.parent = (atomic_int*)alloc_zeroed(chk.ninodes, sizeof(atomic_int));
+    chk.reachable = (atomic_bool*)alloc_zeroed(chk.ninodes, sizeof(atomic_bool));
+    chk.bitmap = NULL;
+    atomic_store(&chk.nvalid, 0);
+    atomic_store(&chk.ndirs, 0);
+    atomic_store(&chk.nused, 0);
+    chk.problems = NULL;
+    chk.nproblems = chk.cap = 0;
+    chk.lost_found = -1;
+}
+
+static void free_checker(void) {
+    free(chk.inodes);
+    free(chk.bad);
+    free(chk.refs);
+    free(chk.links);
+    free(chk.parent);
+    free(chk.reachable);
+    free(chk.bitmap);
+    free(chk.problems);
+}
+
+// -------------------------------------
+
+int fsck_fs(const char* disk_img_fn, const FsckOptions* opts, FsckReport* report) {
+    FsckOptions defaults = {0};
+    opts = opts ? opts : &defaults;
+    // Mounting replays the journal, so what is checked is what the next mount sees.
+    if (mount_fs(disk_img_fn) != 0) {
+        logMsg(ERROR_LOG, "fsck: failed to mount %s", disk_img_fn);
+        return -1;
+    }
+    size_t nthreads = opts->nthreads;
+    if (nthreads == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? (size_t)ncpus : 1;
+    }
+    init_checker(opts->out);
+    Inode root;
+    if (read_inode(0, &root) != 1 || !inode_is_valid(root) || !inode_is_dir(root)) {
+        problem(FIX_NONE, 0, 0, NULL, "inode 0: the root directory is missing");
+    }
+    parallel_for(nthreads, scan_inode, (size_t)chk.ninodes);
+    parallel_for(nthreads, scan_dir, (size_t)chk.ninodes);
+    parallel_for(nthreads, scan_links, (size_t)chk.ninodes);
+    parallel_for(nthreads, scan_reach, (size_t)chk.ninodes);
+    size_t nbitmap_words;
+    chk.bitmap = copy_bitmap(&nbitmap_words);
+    parallel_for(nthreads, scan_bitmap, nbitmap_words < chk.nwords ? nbitmap_words : chk.nwords);
+    size_t repaired = opts->repair && chk.nproblems > 0 ? repair_all() : 0;
+    logMsg(
+        INFO_LOG,
+        "fsck: %s: %zu problems, %zu repaired",
+        disk_img_fn,
+        chk.nproblems,
+        repaired);
+    if (report) {
+        *report = (FsckReport){
+            atomic_load(&chk.nvalid),
+            atomic_load(&chk.ndirs),
+            atomic_load(&chk.nused),
+            chk.nproblems,
+            repaired};
+    }
+    int unrepaired = (int)(chk.nproblems - repaired);
+    free_checker();
+    unmount_fs();
+    return unrepaired;
+}
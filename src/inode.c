@@ -1,67 +1,322 @@
 #include "inode.h"
 
+#include <pthread.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
 
 #include "disk.h"
+#include "err.h"
 #include "fs.h"
+#include "journal.h"
 #include "logging.h"
+#include "stats.h"
+#include "super.h"
 
 // TODO Incorporate owner_id.
 
+#define ITABLE_SZ ((size_t)MAX_INODES * sizeof(Inode))  // inode table size (bytes)
+#define ITABLE_BLOCKS ((ITABLE_SZ + BLOCK_SIZE - 1) / BLOCK_SIZE)
+#define FREE_WORDS(ninodes) (((size_t)(ninodes) + 63) / 64)
+
+//! The inode table lives in memory while the disk is mounted.
+//! Changes do not apply to disk, until `flush_inode_table_to_disk()` is called
+//! or a journal commit collects them (`flush_inode_table_to_journal()`).
+//! `itable.lock` guards the table itself; it is held only for the copy
+//! in or out, while `inode_rdlock` / `inode_wrlock` serialize whole
+//! read-modify-write sequences on one inode.
+//! Table blocks from the superblock's high-water mark on have never been
+//! written: mkfs leaves them alone and mount does not read them.
+
+// --------------- LOCAL ---------------
+
+typedef struct {
+    Inode* inodes;
+    // Bit i is set if inode i is free.
+    uint64_t* free_bits;
+    // Per inode-table block; only dirty blocks are written back.
+    bool* dirty;
+    // Dirty blocks below the high-water mark and from it on, and one past the last dirty block.
+    size_t ndirty_below, ndirty_above, dirty_top;
+    // Sizes of the arrays above, fixed when the table is allocated.
+    int ninodes;
+    size_t nblocks;
+    bool is_loaded;
+    // One per inode, taken by callers around their own operations.
+    pthread_rwlock_t* rwlocks;
+    pthread_mutex_t lock;
+} InodeTable;
+
+static InodeTable itable = {
+    NULL, NULL, NULL, 0, 0, 0, 0, 0, false, NULL, PTHREAD_MUTEX_INITIALIZER};
+
 static bool check_inode_no_bounds(int inode_no) {
-    if (inode_no < 0 || inode_no >= MAX_INODES) {
+    if (inode_no < 0 || inode_no >= itable.ninodes) {
         logMsg(ERROR_LOG, "Invalid inode number: %d", inode_no);
         return false;
     }
     return true;
 }
 
+static void require_inode_table_is_loaded(void) {
+    if (!itable.is_loaded) {
+        err_exit("require_inode_table_is_loaded: inode table is not loaded");
+    }
+}
+
+static void alloc_inode_table(void) {
+    if (itable.inodes == NULL) {
+        itable.ninodes = (int)MAX_INODES;
+        itable.nblocks = ITABLE_BLOCKS;
+        // Zeroed, so the blocks that are not read hold free inodes.
+        itable.inodes = (Inode*)calloc(itable.ninodes, sizeof(Inode));
+        itable.free_bits = (uint64_t*)calloc(FREE_WORDS(itable.ninodes), sizeof(uint64_t));
+        itable.dirty = (bool*)calloc(itable.nblocks, sizeof(bool));
+        itable.rwlocks = (pthread_rwlock_t*)malloc(itable.ninodes * sizeof(pthread_rwlock_t));
+        if (!itable.inodes || !itable.free_bits || !itable.dirty || !itable.rwlocks) {
+            err_exit("alloc_inode_table: failed to allocate memory for the inode table");
+        }
+        for (int i = 0; i < itable.ninodes; ++i) {
+            pthread_rwlock_init(&itable.rwlocks[i], NULL);
+        }
+    }
+}
+
+static void mark_dirty(int inode_no) {
+    size_t b = (size_t)inode_no * sizeof(Inode) / BLOCK_SIZE;
+    if (itable.dirty[b]) {
+        return;
+    }
+    itable.dirty[b] = true;
+    if (b < get_itable_hwm()) {
+        itable.ndirty_below++;
+    } else {
+        itable.ndirty_above++;
+    }
+    if (b + 1 > itable.dirty_top) {
+        itable.dirty_top = b + 1;
+    }
+}
+
+static void clear_dirty(void) {
+    memset(itable.dirty, 0, itable.nblocks * sizeof(bool));
+    itable.ndirty_below = itable.ndirty_above = itable.dirty_top = 0;
+}
+
+static void set_free(int inode_no, bool is_free) {
+    uint64_t mask = 1ULL << (inode_no % 64);
+    if (is_free) {
+        itable.free_bits[inode_no / 64] |= mask;
+    } else {
+        itable.free_bits[inode_no / 64] &= ~mask;
+    }
+}
+
+// Caller holds `itable.lock`.
+static void store_inode(int inode_no, Inode inode) {
+    itable.inodes[inode_no] = inode;
+    set_free(inode_no, !inode_is_valid(inode));
+    mark_dirty(inode_no);
+}
+
+// Inodes from `nloaded` on are free without looking.
+static void rebuild_free_bits(int nloaded) {
+    memset(itable.free_bits, 0, FREE_WORDS(itable.ninodes) * sizeof(uint64_t));
+    for (int i = 0; i < nloaded; ++i) {
+        set_free(i, !inode_is_valid(itable.inodes[i]));
+    }
+    for (int i = nloaded; i < itable.ninodes;) {
+        if (i % 64 == 0 && i + 64 <= itable.ninodes) {
+            itable.free_bits[i / 64] = ~0ULL;
+            i += 64;
+        } else {
+            set_free(i++, true);
+        }
+    }
+}
+
+/*
+ * Caller holds `itable.lock`. Before the dirty blocks are written,
+ * raises the high-water mark past them, and marks the blocks it skips
+ * dirty too: whatever the image held there must not be read as inodes.
+ */
+static void raise_hwm(void) {
+    size_t hwm = get_itable_hwm();
+    size_t top = itable.nblocks;
+    while (top > hwm && !itable.dirty[top - 1]) {
+        top--;
+    }
+    if (top > hwm) {
+        memset(&itable.dirty[hwm], 1, (top - hwm) * sizeof(bool));
+        set_itable_hwm((uint32_t)top);
+    }
+}
+
+// -------------------------------------
+
 void init_inode_table() {
     require_disk_is_mounted();
-    Inode inode = {0};
-    diskseek(INODE_START * BLOCK_SIZE, SEEK_SET);
-    for (int i = 0; i < MAX_INODES; ++i) {
-        write_to_disk((void*)&inode, sizeof(Inode), 1);
+    alloc_inode_table();
+    // Only the blocks that inodes are written to ever reach the disk.
+    rebuild_free_bits(0);
+    itable.is_loaded = true;
+}
+
+int load_inode_table_from_disk() {
+    require_disk_is_mounted();
+    alloc_inode_table();
+    size_t len = (size_t)get_itable_hwm() * BLOCK_SIZE;
+    len = len < ITABLE_SZ ? len : ITABLE_SZ;
+    if (len > 0 &&
+        read_from_disk_at(itable.inodes, len, 1, (off_t)INODE_START * BLOCK_SIZE) != 1) {
+        logMsg(ERROR_LOG, "load_inode_table_from_disk: failed to read the inode table");
+        return -1;
+    }
+    rebuild_free_bits((int)(len / sizeof(Inode)));
+    clear_dirty();
+    itable.is_loaded = true;
+    return 0;
+}
+
+bool flush_inode_table_to_disk() {
+    if (!itable.is_loaded) {
+        return true;
+    }
+    require_disk_is_mounted();
+    if (journal_is_loaded()) {
+        return journal_commit();
+    }
+    pthread_mutex_lock(&itable.lock);
+    raise_hwm();
+    bool ok = true;
+    // Write each run of consecutive dirty blocks at once.
+    for (size_t b = 0; b < itable.nblocks;) {
+        if (!itable.dirty[b]) {
+            b++;
+            continue;
+        }
+        size_t first = b;
+        while (b < itable.nblocks && itable.dirty[b]) {
+            b++;
+        }
+        size_t off = first * BLOCK_SIZE;
+        size_t len = (b * BLOCK_SIZE < ITABLE_SZ ? b * BLOCK_SIZE : ITABLE_SZ) - off;
+        uint8_t* src = (uint8_t*)itable.inodes + off;
+        if (write_to_disk_at(src, len, 1, (off_t)INODE_START * BLOCK_SIZE + (off_t)off) != 1) {
+            logMsg(ERROR_LOG, "flush_inode_table_to_disk: failed to write table blocks");
+            ok = false;
+            continue;
+        }
+        memset(&itable.dirty[first], 0, (b - first) * sizeof(bool));
+    }
+    if (ok) {
+        clear_dirty();
+    }
+    pthread_mutex_unlock(&itable.lock);
+    // The mark goes out after the blocks it covers.
+    if (ok) {
+        flush_super_to_disk();
+    }
+    return ok;
+}
+
+void flush_inode_table_to_journal() {
+    if (!itable.is_loaded) {
+        return;
+    }
+    pthread_mutex_lock(&itable.lock);
+    raise_hwm();
+    for (size_t b = 0; b < itable.nblocks; ++b) {
+        if (itable.dirty[b]) {
+            size_t off = b * BLOCK_SIZE;
+            size_t len = ITABLE_SZ - off < BLOCK_SIZE ? ITABLE_SZ - off : BLOCK_SIZE;
+            journal_add_block(INODE_START + (uint32_t)b, (uint8_t*)itable.inodes + off, len);
+        }
+    }
+    pthread_mutex_unlock(&itable.lock);
+}
+
+size_t inode_table_dirty_blocks() {
+    if (!itable.is_loaded) {
+        return 0;
     }
+    pthread_mutex_lock(&itable.lock);
+    // Everything up to the last dirty block goes out once the high-water mark is raised past it.
+    size_t hwm = get_itable_hwm();
+    size_t n = itable.ndirty_below +
+               (itable.dirty_top > hwm ? itable.dirty_top - hwm : itable.ndirty_above);
+    pthread_mutex_unlock(&itable.lock);
+    return n;
+}
+
+void inode_table_committed() {
+    if (!itable.is_loaded) {
+        return;
+    }
+    pthread_mutex_lock(&itable.lock);
+    clear_dirty();
+    pthread_mutex_unlock(&itable.lock);
+}
+
+void free_inode_table() {
+    for (int i = 0; itable.rwlocks != NULL && i < itable.ninodes; ++i) {
+        pthread_rwlock_destroy(&itable.rwlocks[i]);
+    }
+    free(itable.rwlocks);
+    itable.rwlocks = NULL;
+    free(itable.inodes);
+    free(itable.free_bits);
+    free(itable.dirty);
+    itable.inodes = NULL;
+    itable.free_bits = NULL;
+    itable.dirty = NULL;
+    itable.ndirty_below = itable.ndirty_above = itable.dirty_top = 0;
+    itable.ninodes = 0;
+    itable.nblocks = 0;
+    itable.is_loaded = false;
 }
 
 size_t read_inode(int inode_no, Inode* inode) {
     if (!check_inode_no_bounds(inode_no)) {
         return -1;
     }
-    require_disk_is_mounted();
-    logMsg(INFO_LOG, "Reading Inode # %d", inode_no);
-    return read_from_disk_at(
-        inode, sizeof(Inode), 1, INODE_START * BLOCK_SIZE + sizeof(Inode) * inode_no);
+    require_inode_table_is_loaded();
+    pthread_mutex_lock(&itable.lock);
+    *inode = itable.inodes[inode_no];
+    pthread_mutex_unlock(&itable.lock);
+    STAT_ADD(STAT_INODE_READS, 1);
+    return 1;
 }
 
 size_t write_inode(int inode_no, Inode inode) {
     if (!check_inode_no_bounds(inode_no)) {
         return -1;
     }
-    require_disk_is_mounted();
-    logMsg(INFO_LOG, "Writing to Inode # %d", inode_no);
-    return write_to_disk_at(
-        &inode, sizeof(Inode), 1, INODE_START * BLOCK_SIZE + sizeof(Inode) * inode_no);
+    require_inode_table_is_loaded();
+    pthread_mutex_lock(&itable.lock);
+    store_inode(inode_no, inode);
+    pthread_mutex_unlock(&itable.lock);
+    STAT_ADD(STAT_INODE_WRITES, 1);
+    return 1;
 }
 
 int alloc_inode() {
-    require_disk_is_mounted();
-    logMsg(INFO_LOG, "Allocating an Inode");
-    Inode inode = {0};
-    // In `alloc_inode()`, skip using `read_inode()` to prevent repeated `diskseek` operations.
-    diskseek(INODE_START * BLOCK_SIZE, SEEK_SET);
-    // Go over each pre-allocated Inode and find one that's free to use.
-    for (int i = 0; i < MAX_INODES; ++i) {
-        read_from_disk((void*)&inode, sizeof(Inode), 1);
-        if (!inode_is_valid(inode)) {
-            logMsg(INFO_LOG, "Found available inode: #%d", i);
-            inode_set_valid(&inode);
-            write_inode(i, inode);
-            return i;
+    require_inode_table_is_loaded();
+    pthread_mutex_lock(&itable.lock);
+    for (size_t w = 0; w < FREE_WORDS(itable.ninodes); ++w) {
+        if (itable.free_bits[w] == 0) {
+            continue;
         }
+        int i = (int)w * 64 + __builtin_ctzll(itable.free_bits[w]);
+        Inode inode = {0};
+        inode_set_valid(&inode);
+        store_inode(i, inode);
+        pthread_mutex_unlock(&itable.lock);
+        return i;
     }
-    logMsg(INFO_LOG, "Failed to allocate a free inode.");
+    pthread_mutex_unlock(&itable.lock);
+    logMsg(WARN_LOG, "alloc_inode: failed to allocate a free inode");
     return -1;
 }
 
@@ -69,10 +324,30 @@ void free_inode(int inode_no) {
     if (!check_inode_no_bounds(inode_no)) {
         return;
     }
-    require_disk_is_mounted();
-    logMsg(INFO_LOG, "Freeing Inode # %d", inode_no);
-    Inode inode;
-    read_inode(inode_no, &inode);
+    require_inode_table_is_loaded();
+    pthread_mutex_lock(&itable.lock);
+    Inode inode = itable.inodes[inode_no];
     inode_set_invalid(&inode);
-    write_inode(inode_no, inode);
+    store_inode(inode_no, inode);
+    pthread_mutex_unlock(&itable.lock);
+}
+
+void inode_rdlock(int inode_no) {
+    if (check_inode_no_bounds(inode_no)) {
+        require_inode_table_is_loaded();
+        pthread_rwlock_rdlock(&itable.rwlocks[inode_no]);
+    }
+}
+
+void inode_wrlock(int inode_no) {
+    if (check_inode_no_bounds(inode_no)) {
+        require_inode_table_is_loaded();
+        pthread_rwlock_wrlock(&itable.rwlocks[inode_no]);
+    }
+}
+
+void inode_unlock(int inode_no) {
+    if (check_inode_no_bounds(inode_no)) {
+        pthread_rwlock_unlock(&itable.rwlocks[inode_no]);
+    }
 }
@@ -0,0 +1,501 @@
+#include "journal.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/uio.h>
+
+#include "allocator.h"
+#include "cache.h"
+#include "disk.h"
+#include "err.h"
+#include "fs.h"
+#include "inode.h"
+#include "logging.h"
+#include "on-disk/journal.h"
+#include "stats.h"
+#include "super.h"
+
+// Block numbers listed by one descriptor block.
+#define PER_DESCRIPTOR ((BLOCK_SIZE - sizeof(JournalDescriptor)) / sizeof(uint32_t))
+
+// --------------- LOCAL ---------------
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    // Handles in the running transaction.
+    int active;
+    // Set while a commit waits for `active` to drain and while it is written;
+    // new handles wait until it is cleared.
+    bool committing;
+    bool commit_ok;  // Result of the last commit.
+    // Handle batches: the one accepting handles, and the last one that is durable.
+    uint64_t running;
+    uint64_t committed;
+    // Sequence number of the next transaction written to the log.
+    uint64_t seq;
+    // Next free log block, relative to the journal start (block 0 is the header).
+    uint32_t head;
+    // The transaction being committed, laid out exactly as it goes to the log.
+    uint8_t* log;
+    size_t log_cap;  // In blocks.
+    size_t nimages;
+    bool is_loaded;
+} Journal;
+
+static Journal journal = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .commit_ok = true,
+    .running = 1,
+    .seq = 1,
+    .head = 1};
+
+// Handle nesting depth of the calling thread.
+static _Thread_local int op_depth = 0;
+// How many of those handles are batches; they are always the outermost ones.
+static _Thread_local int batch_depth = 0;
+
+static uint32_t crc_table[256];
+
+static void init_crc_table(void) {
+    for (uint32_t i = 0; i < 256; ++i) {
+        uint32_t c = i;
+        for (int k = 0; k < 8; ++k) {
+            c = (c & 1) ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+        }
+        crc_table[i] = c;
+    }
+}
+
+static uint32_t crc32(const uint8_t* p, size_t n) {
+    uint32_t c = ~0u;
+    while (n--) {
+        c = crc_table[(c ^ *p++) & 0xFF] ^ (c >> 8);
+    }
+    return ~c;
+}
+
+/*
+ * Every PER_DESCRIPTOR images are preceded by a descriptor, so
+ * image `i` sits at this log block of its transaction.
+ */
+static size_t image_pos(size_t i) {
+    return (i / PER_DESCRIPTOR) * (PER_DESCRIPTOR + 1) + 1 + i % PER_DESCRIPTOR;
+}
+
+// Log blocks taken by a transaction of `nimages` images, commit block included.
+static size_t txn_blocks(size_t nimages) {
+    return nimages == 0 ? 0 : image_pos(nimages - 1) + 2;
+}
+
+static uint8_t* log_block(size_t pos) {
+    return journal.log + pos * BLOCK_SIZE;
+}
+
+static void reserve_log(size_t nblocks) {
+    if (nblocks <= journal.log_cap) {
+        return;
+    }
+    size_t cap = journal.log_cap ? journal.log_cap : 16;
+    while (cap < nblocks) {
+        cap *= 2;
+    }
+    uint8_t* log = (uint8_t*)realloc(journal.log, cap * BLOCK_SIZE);
+    if (!log) {
+        err_exit("reserve_log: failed to allocate memory for %zu journal blocks", cap);
+    }
+    journal.log = log;
+    journal.log_cap = cap;
+}
+
+static uint32_t* descriptor_blocks(uint8_t* desc) {
+    return (uint32_t*)(desc + sizeof(JournalDescriptor));
+}
+
+static off_t journal_offset(uint32_t pos) {
+    return ((off_t)JOURNAL_START + pos) * BLOCK_SIZE;
+}
+
+// Goes out right away even if the thread is plugged; it is synced next.
+static bool write_log(const void* buf, size_t nbytes, off_t offset) {
+    struct iovec iov = {(void*)buf, nbytes};
+    DiskIoReq req = {.op = DISK_IO_WRITE, .iov = &iov, .iovcnt = 1, .offset = offset};
+    return submit_disk_io(&req, 1) == 1;
+}
+
+static bool write_header(uint64_t seq) {
+    uint8_t* block = (uint8_t*)calloc(1, BLOCK_SIZE);
+    if (!block) {
+        err_exit("write_header: failed to allocate memory");
+    }
+    JournalHeader* hdr = (JournalHeader*)block;
+    hdr->h = (JournalBlockHeader){JOURNAL_MAGIC, JOURNAL_HEADER, seq};
+    bool ok = write_log(block, BLOCK_SIZE, journal_offset(0));
+    free(block);
+    return ok;
+}
+
+// Writes every image of the transaction in `journal.log` to its home block.
+static bool write_home(void) {
+    if (journal.nimages == 0) {
+        return true;
+    }
+    struct iovec* iov = (struct iovec*)malloc(journal.nimages * sizeof(struct iovec));
+    DiskIoReq* reqs = (DiskIoReq*)malloc(journal.nimages * sizeof(DiskIoReq));
+    if (!iov || !reqs) {
+        err_exit("write_home: failed to allocate memory");
+    }
+    for (size_t i = 0; i < journal.nimages; ++i) {
+        uint8_t* desc = log_block(image_pos(i - i % PER_DESCRIPTOR) - 1);
+        uint32_t block_no = descriptor_blocks(desc)[i % PER_DESCRIPTOR];
+        iov[i] = (struct iovec){log_block(image_pos(i)), BLOCK_SIZE};
+        reqs[i] = (DiskIoReq){
+            .op = DISK_IO_WRITE,
+            .iov = &iov[i],
+            .iovcnt = 1,
+            .offset = (off_t)block_no * BLOCK_SIZE,
+        };
+    }
+    bool ok = submit_disk_io(reqs, journal.nimages) == journal.nimages;
+    free(reqs);
+    free(iov);
+    return ok;
+}
+
+/*
+ * Once everything logged so far is home and synced, the log can
+ * start over at block 1.
+ */
+static bool reset_log(void) {
+    if (!sync_disk() || !write_header(journal.seq) || !sync_disk()) {
+        logMsg(ERROR_LOG, "reset_log: failed to reset the journal");
+        return false;
+    }
+    journal.head = 1;
+    return true;
+}
+
+// Seals the collected transaction, logs it, syncs, then writes it home.
+static bool write_transaction(void) {
+    size_t n = journal.nimages;
+    if (n == 0) {
+        return sync_disk();  // Nothing changed, but file data may still need to be durable.
+    }
+    size_t len = txn_blocks(n);
+    reserve_log(len);
+    uint8_t* commit = log_block(len - 1);
+    memset(commit, 0, BLOCK_SIZE);
+    JournalCommit* c = (JournalCommit*)commit;
+    c->h = (JournalBlockHeader){JOURNAL_MAGIC, JOURNAL_COMMIT, journal.seq};
+    c->nblocks = (uint32_t)n;
+    c->checksum = crc32(journal.log, (len - 1) * BLOCK_SIZE);
+    if (len > JOURNAL_BLOCKS - 1) {
+        // Written in place, it could be torn; it stays dirty in memory instead.
+        logMsg(ERROR_LOG, "journal: %zu blocks do not fit the journal", n);
+        return false;
+    }
+    if (journal.head + len > JOURNAL_BLOCKS && !reset_log()) {
+        return false;
+    }
+    if (!write_log(journal.log, len * BLOCK_SIZE, journal_offset(journal.head)) || !sync_disk()) {
+        logMsg(ERROR_LOG, "journal: failed to write transaction %ju", (uintmax_t)journal.seq);
+        return false;
+    }
+    journal.head += (uint32_t)len;
+    journal.seq++;
+    STAT_ADD(STAT_JOURNAL_COMMITS, 1);
+    STAT_ADD(STAT_JOURNAL_BLOCKS, n);
+    // Committed; a crash from here on is repaired by replay.
+    if (!write_home()) {
+        logMsg(
+            ERROR_LOG,
+            "journal: failed to write back transaction %ju",
+            (uintmax_t)(journal.seq - 1));
+        return false;
+    }
+    return true;
+}
+
+static bool commit_transaction(void) {
+    journal.nimages = 0;
+    flush_bitmap_to_journal();
+    flush_inode_table_to_journal();
+    // After the inode table, which may raise its high-water mark.
+    flush_super_to_journal();
+    flush_cache_to_journal();
+    if (!write_transaction()) {
+        return false;  // Still dirty; the next commit retries.
+    }
+    bitmap_committed();
+    inode_table_committed();
+    super_committed();
+    cache_committed();
+    return true;
+}
+
+/*
+ * Commits the running batch of handles. Called and returns with
+ * `journal.lock` held; drops it for the I/O.
+ */
+static void lead_commit(void) {
+    journal.committing = true;
+    while (journal.active > 0) {
+        pthread_cond_wait(&journal.cond, &journal.lock);
+    }
+    uint64_t id = journal.running;
+    pthread_mutex_unlock(&journal.lock);
+    bool ok = commit_transaction();
+    pthread_mutex_lock(&journal.lock);
+    journal.commit_ok = ok;
+    journal.committed = id;
+    journal.running = id + 1;
+    journal.committing = false;
+    pthread_cond_broadcast(&journal.cond);
+}
+
+/*
+ * Whether the running transaction has taken up half the log. It is
+ * then committed before another operation joins it: those already
+ * running may still add to it, and must not make it outgrow the log.
+ */
+static bool running_is_full(void) {
+    size_t nimages = bitmap_dirty_blocks() + inode_table_dirty_blocks() + cache_dirty_blocks();
+    // The superblock may come along too.
+    return txn_blocks(nimages + 1) > (JOURNAL_BLOCKS - 1) / 2;
+}
+
+// Called with `journal.lock` held.
+static bool wait_for_commit(uint64_t id) {
+    while (journal.committed < id) {
+        if (journal.committing) {
+            pthread_cond_wait(&journal.cond, &journal.lock);
+        } else {
+            lead_commit();
+        }
+    }
+    return journal.commit_ok;
+}
+
+/*
+ * Reads the transaction `seq` starting at log block `pos` into
+ * `journal.log`. Returns its length in blocks, or 0 if it is
+ * missing, torn or was never committed.
+ */
+static size_t read_transaction(uint32_t pos, uint64_t seq) {
+    size_t k = 0;
+    journal.nimages = 0;
+    for (;;) {
+        if (pos + k >= JOURNAL_BLOCKS) {
+            return 0;
+        }
+        reserve_log(k + 1);
+        if (read_from_disk_at(log_block(k), BLOCK_SIZE, 1, journal_offset(pos + k)) != 1) {
+            return 0;
+        }
+        const JournalBlockHeader* h = (const JournalBlockHeader*)log_block(k);
+        if (h->magic != JOURNAL_MAGIC || h->seq != seq) {
+            return 0;
+        }
+        if (h->type == JOURNAL_COMMIT) {
+            const JournalCommit* c = (const JournalCommit*)h;
+            bool ok = journal.nimages > 0 && c->nblocks == journal.nimages &&
+                      c->checksum == crc32(journal.log, k * BLOCK_SIZE);
+            return ok ? k + 1 : 0;
+        }
+        uint32_t count = ((const JournalDescriptor*)h)->count;
+        if (h->type != JOURNAL_DESCRIPTOR || journal.nimages % PER_DESCRIPTOR != 0 || count == 0 ||
+            count > PER_DESCRIPTOR || pos + k + 1 + count > JOURNAL_BLOCKS) {
+            return 0;
+        }
+        reserve_log(k + 1 + count);
+        size_t nbytes = (size_t)count * BLOCK_SIZE;
+        if (read_from_disk_at(log_block(k + 1), nbytes, 1, journal_offset(pos + k + 1)) != 1) {
+            return 0;
+        }
+        journal.nimages += count;
+        k += 1 + count;
+    }
+}
+
+// -------------------------------------
+
+void init_journal() {
+    require_disk_is_mounted();
+    init_crc_table();
+    journal.seq = 1;
+    if (!write_header(journal.seq)) {
+        err_exit("init_journal: failed to write the journal header");
+    }
+    journal.head = 1;
+    journal.is_loaded = true;
+}
+
+int load_journal_from_disk() {
+    require_disk_is_mounted();
+    init_crc_table();
+    JournalHeader hdr;
+    if (read_from_disk_at(&hdr, sizeof(hdr), 1, journal_offset(0)) != 1 ||
+        hdr.h.magic != JOURNAL_MAGIC || hdr.h.type != JOURNAL_HEADER) {
+        logMsg(ERROR_LOG, "load_journal_from_disk: no journal header");
+        return -1;
+    }
+    journal.seq = hdr.h.seq;
+    uint32_t pos = 1;
+    size_t replayed = 0;
+    size_t len;
+    while ((len = read_transaction(pos, journal.seq)) > 0) {
+        if (!write_home()) {
+            logMsg(
+                ERROR_LOG,
+                "load_journal_from_disk: failed to replay transaction %ju",
+                (uintmax_t)journal.seq);
+            return -1;
+        }
+        pos += (uint32_t)len;
+        journal.seq++;
+        replayed++;
+    }
+    journal.nimages = 0;
+    journal.head = 1;
+    if (replayed > 0) {
+        logMsg(WARN_LOG, "load_journal_from_disk: replayed %zu transactions", replayed);
+        if (!reset_log()) {
+            return -1;
+        }
+    }
+    journal.is_loaded = true;
+    return 0;
+}
+
+void free_journal() {
+    free(journal.log);
+    journal.log = NULL;
+    journal.log_cap = 0;
+    journal.nimages = 0;
+    journal.is_loaded = false;
+}
+
+bool journal_is_loaded() {
+    return journal.is_loaded;
+}
+
+void journal_begin() {
+    if (!journal.is_loaded) {
+        return;
+    }
+    if (op_depth++ > 0) {
+        // Between two operations of a batch, its handle may let a commit through.
+        if (op_depth - 1 == batch_depth && running_is_full()) {
+            pthread_mutex_lock(&journal.lock);
+            journal.active--;
+            if (journal.active == 0) {
+                pthread_cond_broadcast(&journal.cond);
+            }
+            wait_for_commit(journal.running);
+            while (journal.committing) {
+                pthread_cond_wait(&journal.cond, &journal.lock);
+            }
+            journal.active++;
+            pthread_mutex_unlock(&journal.lock);
+        }
+        return;
+    }
+    pthread_mutex_lock(&journal.lock);
+    while (journal.committing) {
+        pthread_cond_wait(&journal.cond, &journal.lock);
+    }
+    if (running_is_full()) {
+        lead_commit();
+    }
+    journal.active++;
+    pthread_mutex_unlock(&journal.lock);
+}
+
+bool journal_end() {
+    if (!journal.is_loaded || --op_depth > 0) {
+        return true;
+    }
+    pthread_mutex_lock(&journal.lock);
+    journal.active--;
+    uint64_t id = journal.running;
+    if (journal.active == 0) {
+        pthread_cond_broadcast(&journal.cond);
+    }
+    bool ok = wait_for_commit(id);
+    pthread_mutex_unlock(&journal.lock);
+    return ok;
+}
+
+void journal_end_nowait() {
+    if (!journal.is_loaded || --op_depth > 0) {
+        return;
+    }
+    pthread_mutex_lock(&journal.lock);
+    journal.active--;
+    if (journal.active == 0) {
+        pthread_cond_broadcast(&journal.cond);
+    }
+    pthread_mutex_unlock(&journal.lock);
+}
+
+bool journal_in_handle() {
+    return op_depth > 0;
+}
+
+void journal_begin_batch() {
+    journal_begin();
+    if (journal.is_loaded) {
+        batch_depth++;
+    }
+}
+
+bool journal_end_batch() {
+    if (journal.is_loaded) {
+        batch_depth--;
+    }
+    return journal_end();
+}
+
+bool journal_commit() {
+    if (!journal.is_loaded) {
+        return true;
+    }
+    if (op_depth > 0) {
+        logMsg(ERROR_LOG, "journal_commit: called from inside a handle");
+        return false;
+    }
+    pthread_mutex_lock(&journal.lock);
+    bool ok = wait_for_commit(journal.running);
+    pthread_mutex_unlock(&journal.lock);
+    return ok;
+}
+
+bool checkpoint_journal() {
+    if (!journal_commit()) {
+        return false;
+    }
+    pthread_mutex_lock(&journal.lock);
+    bool ok = reset_log();
+    pthread_mutex_unlock(&journal.lock);
+    return ok;
+}
+
+void journal_add_block(uint32_t block_no, const void* data, size_t size) {
+    size_t i = journal.nimages++;
+    size_t pos = image_pos(i);
+    reserve_log(pos + 1);
+    if (i % PER_DESCRIPTOR == 0) {
+        uint8_t* desc = log_block(pos - 1);
+        memset(desc, 0, BLOCK_SIZE);
+        ((JournalDescriptor*)desc)->h =
+            (JournalBlockHeader){JOURNAL_MAGIC, JOURNAL_DESCRIPTOR, journal.seq};
+    }
+    uint8_t* desc = log_block(image_pos(i - i % PER_DESCRIPTOR) - 1);
+    descriptor_blocks(desc)[((JournalDescriptor*)desc)->count++] = block_no;
+    memcpy(log_block(pos), data, size);
+    memset(log_block(pos) + size, 0, BLOCK_SIZE - size);
+}
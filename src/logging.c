@@ -1,7 +1,12 @@
 #include "logging.h"
 
+#include <errno.h>
 #include <fcntl.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdarg.h>
+#include <stdatomic.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -12,66 +17,326 @@
 // Group & others: r
 #define LOGPERMS 0644
 
+// Ring capacity (power of two) and the longest message kept per slot.
+#define LOG_RING_SLOTS 2048
+#define LOG_TEXT_MAX 512
+// Bytes written out with one `write` by the drainer.
+#define LOG_BATCH_SZ (64 * 1024)
+// "[dd-mm-yyyy hh:mm:ss] [ERROR] " + text + "\n"
+#define LOG_LINE_MAX (LOG_TEXT_MAX + 32)
+
+// --------------- LOCAL ---------------
+
+/*
+ * Bounded multi-producer, single-consumer queue: a slot whose `seq`
+ * equals the enqueue position is free, and `seq == pos + 1` means it
+ * holds a message for the drainer.
+ */
+typedef struct {
+    atomic_size_t seq;
+    Logtype type;
+    time_t time;
+    char text[LOG_TEXT_MAX];
+} LogSlot;
+
 // Supposed to be inaccessible
 // anywhere else.
-static int logfd;
-static bool print_logs = true;  // Print logs to the stdout by default.
+static int logfd = -1;
+static atomic_bool print_logs = true;  // Print logs to the stdout by default.
+static atomic_int log_level = INFO_LOG;
+static atomic_uint fsync_interval_ms = DEFAULT_LOG_FSYNC_INTERVAL_MS;
+
+static LogSlot ring[LOG_RING_SLOTS];
+static atomic_size_t ring_head;  // Next position to enqueue at.
+static size_t ring_tail;         // Next position to drain; drainer only.
+static atomic_size_t dropped;    // INFO messages lost to a full ring.
+
+static pthread_t drainer;
+static bool is_started = false;
+static atomic_bool stop_requested = false;
+static atomic_bool drainer_sleeping = false;
+static pthread_mutex_t wake_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wake_cond = PTHREAD_COND_INITIALIZER;
+
+static const char* type_name(Logtype log_type) {
+    return (log_type == ERROR_LOG) ? "ERROR" : (log_type == WARN_LOG) ? "WARN" : "INFO";
+}
+
+static void wake_drainer(void) {
+    // Sequentially consistent, as are the store that published the message and the drainer's
+    // side in `wait_for_messages`, so a wakeup is never missed.
+    if (atomic_load(&drainer_sleeping)) {
+        pthread_mutex_lock(&wake_lock);
+        pthread_cond_signal(&wake_cond);
+        pthread_mutex_unlock(&wake_lock);
+    }
+}
+
+// Claims a free slot, or returns NULL if the ring is full.
+static LogSlot* ring_claim(void) {
+    size_t pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+    for (;;) {
+        LogSlot* s = &ring[pos & (LOG_RING_SLOTS - 1)];
+        size_t seq = atomic_load_explicit(&s->seq, memory_order_acquire);
+        intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+        if (diff == 0) {
+            if (atomic_compare_exchange_weak_explicit(
+                    &ring_head, &pos, pos + 1, memory_order_relaxed, memory_order_relaxed)) {
+                return s;
+            }
+        } else if (diff < 0) {
+            return NULL;
+        } else {
+            pos = atomic_load_explicit(&ring_head, memory_order_relaxed);
+        }
+    }
+}
+
+// Returns the oldest published message, or NULL if there is none.
+static LogSlot* ring_peek(void) {
+    LogSlot* s = &ring[ring_tail & (LOG_RING_SLOTS - 1)];
+    // Sequentially consistent for `wait_for_messages`.
+    size_t seq = atomic_load(&s->seq);
+    return seq == ring_tail + 1 ? s : NULL;
+}
+
+static void ring_release(LogSlot* s) {
+    atomic_store_explicit(&s->seq, ring_tail + LOG_RING_SLOTS, memory_order_release);
+    ring_tail++;
+}
+
+// ! This is a helper function.
+// ! It is not supposed to be used
+// ! outside of the logging implementation.
+// Formats `t`, reusing the last result within the same second. Drainer only.
+static const char* _get_timestamp(time_t t) {
+    static time_t last = (time_t)-1;
+    static char timestamp[80];
+    if (t != last) {
+        struct tm local;
+        localtime_r(&t, &local);
+        snprintf(
+            timestamp,
+            sizeof(timestamp),
+            "%02d-%02d-%04d %02d:%02d:%02d",
+            local.tm_mday,
+            local.tm_mon + 1,
+            local.tm_year + 1900,
+            local.tm_hour,
+            local.tm_min,
+            local.tm_sec);
+        last = t;
+    }
+    return timestamp;
+}
+
+static size_t format_line(char* out, Logtype type, time_t t, const char* text) {
+    int n = snprintf(out, LOG_LINE_MAX, "[%s] [%s] %s\n", _get_timestamp(t), type_name(type), text);
+    return n < 0 ? 0 : (n < LOG_LINE_MAX ? (size_t)n : LOG_LINE_MAX - 1);
+}
+
+static void write_all(const char* buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(logfd, buf, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return;
+        }
+        buf += n;
+        len -= (size_t)n;
+    }
+}
+
+static uint64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+}
+
+// Sleeps until a message arrives, a stop is requested, or `timeout_ms` passes.
+static void wait_for_messages(uint64_t timeout_ms) {
+    pthread_mutex_lock(&wake_lock);
+    atomic_store(&drainer_sleeping, true);
+    if (ring_peek() == NULL && !atomic_load(&stop_requested)) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_sec += (time_t)(timeout_ms / 1000);
+        deadline.tv_nsec += (long)(timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000) {
+            deadline.tv_sec++;
+            deadline.tv_nsec -= 1000000000;
+        }
+        pthread_cond_timedwait(&wake_cond, &wake_lock, &deadline);
+    }
+    atomic_store_explicit(&drainer_sleeping, false, memory_order_relaxed);
+    pthread_mutex_unlock(&wake_lock);
+}
+
+/*
+ * Background thread: moves messages from the ring to the log file
+ * in batches, and syncs the file after an ERROR or once the sync
+ * interval has passed since unsynced lines were written.
+ */
+static void* drain_logs(void* arg) {
+    (void)arg;
+    char* batch = (char*)malloc(LOG_BATCH_SZ);
+    if (batch == NULL) {
+        perror("Failed to allocate the log buffer.");
+        exit(1);
+    }
+    uint64_t last_sync = now_ms();
+    bool unsynced = false;
+    for (;;) {
+        size_t len = 0;
+        bool urgent = false;
+        LogSlot* s;
+        while (len + LOG_LINE_MAX <= LOG_BATCH_SZ && (s = ring_peek()) != NULL) {
+            size_t n = format_line(batch + len, s->type, s->time, s->text);
+            urgent |= s->type == ERROR_LOG;
+            ring_release(s);
+            if (atomic_load_explicit(&print_logs, memory_order_relaxed)) {
+                fwrite(batch + len, 1, n, stdout);
+            }
+            len += n;
+        }
+        size_t ndropped = atomic_exchange(&dropped, 0);
+        if (ndropped > 0 && len + LOG_LINE_MAX <= LOG_BATCH_SZ) {
+            char text[64];
+            snprintf(text, sizeof(text), "logging: dropped %zu messages", ndropped);
+            len += format_line(batch + len, WARN_LOG, time(NULL), text);
+        } else if (ndropped > 0) {
+            atomic_fetch_add(&dropped, ndropped);
+        }
+        if (len > 0) {
+            write_all(batch, len);
+            unsynced = true;
+        }
+        unsigned interval = atomic_load_explicit(&fsync_interval_ms, memory_order_relaxed);
+        uint64_t now = now_ms();
+        if (unsynced && (urgent || (interval > 0 && now - last_sync >= interval))) {
+            fsync(logfd);  // Ensure the log messages are written to disk.
+            last_sync = now;
+            unsynced = false;
+        }
+        if (len + LOG_LINE_MAX > LOG_BATCH_SZ) {
+            continue;  // The batch filled up; more may be waiting.
+        }
+        if (atomic_load(&stop_requested) && ring_peek() == NULL) {
+            break;
+        }
+        uint64_t timeout = interval > 0 ? interval : 1000;
+        if (unsynced && interval > 0) {
+            timeout = last_sync + interval > now ? last_sync + interval - now : 1;
+        }
+        wait_for_messages(timeout);
+    }
+    if (unsynced) {
+        fsync(logfd);
+    }
+    free(batch);
+    return NULL;
+}
+
+static void stop_drainer(void) {
+    if (!is_started) {
+        return;
+    }
+    atomic_store(&stop_requested, true);
+    pthread_mutex_lock(&wake_lock);
+    pthread_cond_signal(&wake_cond);
+    pthread_mutex_unlock(&wake_lock);
+    pthread_join(drainer, NULL);
+    is_started = false;
+    fflush(stdout);
+}
+
+// -------------------------------------
 
 void set_print_logs(bool toggle) {
-    print_logs = toggle;
+    atomic_store(&print_logs, toggle);
+}
+
+void set_log_level(Logtype level) {
+    atomic_store(&log_level, (int)level);
+}
+
+void set_log_fsync_interval(unsigned ms) {
+    atomic_store(&fsync_interval_ms, ms);
 }
 
 void init_logs(const char *filename, int mode) {
+    static bool exit_hook_set = false;
+    if (is_started) {
+        end_logs();
+    }
     logfd = open(filename, mode, LOGPERMS);
     if (logfd == -1) {
         perror("Failed to open the log file.");
         exit(1);
     }
-    logMsg(INFO_LOG, "Started logging");
-}
-
-// ! This is a helper function.
-// ! It is not supposed to be used
-// ! outside of the logging implementation.
-char *_get_timestamp() {
-    time_t now;
-    time(&now);
-    struct tm *local = localtime(&now);
-    char *timestamp = (char *)malloc(20);
-    if (timestamp == NULL) {
-        logMsg(ERROR_LOG, "Failed to allocate memory for timestamp");
-        perror("Failed to allocate memory for timestamp.");
+    for (size_t i = 0; i < LOG_RING_SLOTS; ++i) {
+        atomic_init(&ring[i].seq, i);
+    }
+    atomic_store(&ring_head, 0);
+    ring_tail = 0;
+    atomic_store(&stop_requested, false);
+    if (pthread_create(&drainer, NULL, drain_logs, NULL) != 0) {
+        perror("Failed to start the logging thread.");
         exit(1);
     }
-    sprintf(
-        timestamp,
-        "%02d-%02d-%04d %02d:%02d:%02d",
-        local->tm_mday,
-        local->tm_mon + 1,
-        local->tm_year + 1900,
-        local->tm_hour,
-        local->tm_min,
-        local->tm_sec);
-    return timestamp;
+    is_started = true;
+    // Messages still in the ring are written out even if the program exits early.
+    if (!exit_hook_set) {
+        atexit(stop_drainer);
+        exit_hook_set = true;
+    }
+    logMsg(INFO_LOG, "Started logging");
 }
 
 void end_logs() {
     logMsg(INFO_LOG, "Finished logging");
-    close(logfd);
+    stop_drainer();
+    if (logfd != -1) {
+        close(logfd);
+        logfd = -1;
+    }
 }
 
-void logMsg(Logtype log_type, const char *fmt, ...) {
+void _logMsg(Logtype log_type, const char *fmt, ...) {
+    if ((int)log_type > atomic_load_explicit(&log_level, memory_order_relaxed)) {
+        return;
+    }
+    if (!is_started) {
+        // No log file yet; only echo.
+        if (atomic_load(&print_logs)) {
+            char tmp[LOG_TEXT_MAX];
+            va_list args;
+            va_start(args, fmt);
+            vsnprintf(tmp, sizeof(tmp), fmt, args);
+            va_end(args);
+            printf("[%s] %s\n", type_name(log_type), tmp);
+        }
+        return;
+    }
+    LogSlot* s;
+    while ((s = ring_claim()) == NULL) {
+        // Full: drop INFO rather than stall, but never lose a WARN or ERROR.
+        if (log_type == INFO_LOG) {
+            atomic_fetch_add(&dropped, 1);
+            return;
+        }
+        wake_drainer();
+        sched_yield();
+    }
     va_list args;
     va_start(args, fmt);
-    char tmp[1024];
-    char *type_msg = (log_type == ERROR_LOG) ? "ERROR" : (log_type == WARN_LOG) ? "WARN" : "INFO";
-    vsnprintf(tmp, sizeof(tmp), fmt, args);
+    vsnprintf(s->text, sizeof(s->text), fmt, args);
     va_end(args);
-    char msg[1024];
-    sprintf(msg, "[%s] [%s] %s\n", _get_timestamp(), type_msg, tmp);
-    write(logfd, msg, strlen(msg));
-    if (print_logs) {
-        puts(msg);
-    }
-    fsync(logfd);  // Ensure the log message is written to disk.
+    s->type = log_type;
+    s->time = time(NULL);
+    // Sequentially consistent, not just a release, for `wake_drainer`.
+    atomic_store(&s->seq, atomic_load_explicit(&s->seq, memory_order_relaxed) + 1);
+    wake_drainer();
 }
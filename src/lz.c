@@ -0,0 +1,166 @@
+#include "lz.h"
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+
+#define LZ_MIN_MATCH 4
+// LZ4 decoders copy ahead in wide words, so a block must end in literals:
+// no match starts within this many bytes of the end...
+#define LZ_MATCH_LIMIT 12
+// ...and none runs into the last this many.
+#define LZ_LAST_LITERALS 5
+#define LZ_MAX_OFFSET 65535
+// Sized so the match table stays in L1.
+#define LZ_HASH_BITS 12
+// A nibble of this value is followed by bytes that extend the length.
+#define LZ_NIBBLE_MAX 15
+
+// --------------- LOCAL ---------------
+
+static uint32_t read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof v);
+    return v;
+}
+
+static uint32_t hash4(uint32_t v) {
+    return (v * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes what a nibble could not hold of a length: bytes of 255, then the rest.
+static bool put_len(uint8_t** op, const uint8_t* end, size_t len) {
+    for (; len >= 255; len -= 255) {
+        if (*op == end) {
+            return false;
+        }
+        *(*op)++ = 255;
+    }
+    if (*op == end) {
+        return false;
+    }
+    *(*op)++ = (uint8_t)len;
+    return true;
+}
+
+// Writes one sequence; the last has no match (`mlen` 0).
+static bool put_sequence(
+    uint8_t** op, const uint8_t* end, const uint8_t* lit, size_t nlit, size_t off, size_t mlen) {
+    if (*op == end) {
+        return false;
+    }
+    uint8_t* token = (*op)++;
+    *token = (uint8_t)((nlit < LZ_NIBBLE_MAX ? nlit : LZ_NIBBLE_MAX) << 4);
+    if (nlit >= LZ_NIBBLE_MAX && !put_len(op, end, nlit - LZ_NIBBLE_MAX)) {
+        return false;
+    }
+    if ((size_t)(end - *op) < nlit) {
+        return false;
+    }
+    memcpy(*op, lit, nlit);
+    *op += nlit;
+    if (mlen == 0) {
+        return true;
+    }
+    if (end - *op < 2) {
+        return false;
+    }
+    *(*op)++ = (uint8_t)(off & 0xFF);
+    *(*op)++ = (uint8_t)(off >> 8);
+    size_t m = mlen - LZ_MIN_MATCH;
+    *token |= (uint8_t)(m < LZ_NIBBLE_MAX ? m : LZ_NIBBLE_MAX);
+    return m < LZ_NIBBLE_MAX || put_len(op, end, m - LZ_NIBBLE_MAX);
+}
+
+// Reads the extension of a length whose nibble was full. Returns false past the end.
+static bool get_len(const uint8_t** ip, const uint8_t* end, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip == end) {
+            return false;
+        }
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+// -------------------------------------
+
+/*
+ * Greedy: each position is looked up, by its first four bytes, in a
+ * table of where those bytes were last seen, and a match found there
+ * is extended as far as it goes, short of the literals at the end.
+ */
+size_t lz_compress(const void* src, size_t n, void* dst, size_t cap) {
+    const uint8_t* in = (const uint8_t*)src;
+    uint8_t* op = (uint8_t*)dst;
+    const uint8_t* end = op + cap;
+    uint32_t table[1 << LZ_HASH_BITS] = {0};
+    size_t anchor = 0;  // Start of the literals not yet written.
+    size_t pos = 0;
+    while (pos + LZ_MATCH_LIMIT <= n) {
+        uint32_t v = read32(in + pos);
+        uint32_t h = hash4(v);
+        size_t cand = table[h];
+        table[h] = (uint32_t)pos;
+        if (cand >= pos || pos - cand > LZ_MAX_OFFSET || read32(in + cand) != v) {
+            pos++;
+            continue;
+        }
+        size_t len = LZ_MIN_MATCH;
+        while (pos + len + LZ_LAST_LITERALS < n && in[cand + len] == in[pos + len]) {
+            len++;
+        }
+        if (!put_sequence(&op, end, in + anchor, pos - anchor, pos - cand, len)) {
+            return 0;
+        }
+        pos += len;
+        anchor = pos;
+    }
+    if (!put_sequence(&op, end, in + anchor, n - anchor, 0, 0)) {
+        return 0;
+    }
+    return (size_t)(op - (uint8_t*)dst);
+}
+
+long lz_decompress(const void* src, size_t n, void* dst, size_t cap) {
+    const uint8_t* ip = (const uint8_t*)src;
+    const uint8_t* in_end = ip + n;
+    uint8_t* out = (uint8_t*)dst;
+    size_t len = 0;  // Bytes written so far.
+    while (ip < in_end) {
+        uint8_t token = *ip++;
+        size_t nlit = token >> 4;
+        if (nlit == LZ_NIBBLE_MAX && !get_len(&ip, in_end, &nlit)) {
+            return -1;
+        }
+        if ((size_t)(in_end - ip) < nlit || cap - len < nlit) {
+            return -1;
+        }
+        memcpy(out + len, ip, nlit);
+        ip += nlit;
+        len += nlit;
+        if (ip == in_end) {
+            break;  // The last sequence has no match.
+        }
+        if (in_end - ip < 2) {
+            return -1;
+        }
+        size_t off = (size_t)ip[0] | (size_t)ip[1] << 8;
+        ip += 2;
+        size_t mlen = token & LZ_NIBBLE_MAX;
+        if (mlen == LZ_NIBBLE_MAX && !get_len(&ip, in_end, &mlen)) {
+            return -1;
+        }
+        mlen += LZ_MIN_MATCH;
+        if (off == 0 || off > len || cap - len < mlen) {
+            return -1;
+        }
+        // Byte by byte: a match may overlap the bytes it produces.
+        for (size_t i = 0; i < mlen; ++i, ++len) {
+            out[len] = out[len - off];
+        }
+    }
+    return (long)len;
+}
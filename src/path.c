@@ -3,7 +3,6 @@
 #include <stdlib.h>
 #include <string.h>
 
-#include "allocator.h"
 #include "dir.h"
 #include "disk.h"
 #include "inode.h"
@@ -19,33 +18,49 @@ int get_inode_no_from_path(const char* path, int* inode_no) {
     // you'll need to modify it.
     char path_cp[256];
     strncpy(path_cp, path, 256);
-    char* token = strtok(path_cp, "/");
+    path_cp[255] = '\0';
+    char* save;
+    char* token = strtok_r(path_cp, "/", &save);
     int cur_inode_no = 0;  // Start from root.
-    Inode cur_inode;
-    read_inode(cur_inode_no, &cur_inode);
-    DirectoryEntry dirents[DIRENTS_PER_BLOCK];
     while (token != NULL) {
-        bool found = false;
-        for (int i = 0; i < cur_inode.size; ++i) {
-            int entry_index = i % DIRENTS_PER_BLOCK;
-            if (i % DIRENTS_PER_BLOCK == 0) {
-                int block_index = i / DIRENTS_PER_BLOCK;
-                read_data_block(cur_inode.data_blocks[block_index], dirents, sizeof(dirents));
-            }
-            if (strcmp(dirents[entry_index].name, token) == 0) {
-                cur_inode_no = dirents[entry_index].inode_number;
-                read_inode(cur_inode_no, &cur_inode);
-                found = true;
-                break;
-            }
+        // `lookup_dirent` consults the dentry cache before scanning the directory's blocks.
+        int next_inode_no;
+        if (lookup_dirent(cur_inode_no, token, &next_inode_no) != 0) {
+            return -1;
         }
-        if (!found) return -1;
-        token = strtok(NULL, "/");
+        cur_inode_no = next_inode_no;
+        token = strtok_r(NULL, "/", &save);
     }
     *inode_no = cur_inode_no;
     return 0;
 }
 
+int lock_inode_from_path(const char* path, bool exclusive, int* inode_no) {
+    int cur;
+    if (get_inode_no_from_path(path, &cur) != 0) {
+        return -1;
+    }
+    for (;;) {
+        if (exclusive) {
+            inode_wrlock(cur);
+        } else {
+            inode_rdlock(cur);
+        }
+        // The entry may have been removed or replaced before the lock was taken.
+        int again;
+        if (get_inode_no_from_path(path, &again) != 0) {
+            inode_unlock(cur);
+            return -1;
+        }
+        if (again == cur) {
+            *inode_no = cur;
+            return 0;
+        }
+        inode_unlock(cur);
+        cur = again;
+    }
+}
+
 char* get_parent_path(const char* full_path) {
     char* parent_path;
     size_t len;
@@ -0,0 +1,142 @@
+#include "readahead.h"
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "allocator.h"
+#include "cache.h"
+#include "err.h"
+#include "extent.h"
+#include "fs.h"
+#include "inode.h"
+#include "logging.h"
+#include "stats.h"
+
+// Requests waiting for the thread; more are dropped.
+#define READAHEAD_QUEUE 64
+
+// --------------- LOCAL ---------------
+
+typedef struct {
+    int inode_no;
+    size_t first;
+    size_t count;
+} ReadaheadReq;
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    ReadaheadReq queue[READAHEAD_QUEUE];  // Ring of `len` requests from `head`.
+    size_t head;
+    size_t len;
+    pthread_t thread;
+    bool is_started;
+    bool stop_requested;
+} Readahead;
+
+static Readahead ra = {.lock = PTHREAD_MUTEX_INITIALIZER, .cond = PTHREAD_COND_INITIALIZER};
+
+/*
+ * The inode's read lock keeps its blocks from being freed or
+ * rewritten in place while they are read, so nothing stale is
+ * cached; later writes refresh the cached copies.
+ */
+static void read_ahead(const ReadaheadReq* req) {
+    inode_rdlock(req->inode_no);
+    Inode inode;
+    if (read_inode(req->inode_no, &inode) != 1 || !inode_is_valid(inode) || inode_is_dir(inode)) {
+        inode_unlock(req->inode_no);
+        return;
+    }
+    Extent* extents = alloc_extent_list();
+    size_t nextents = extent_list(&inode, extents);
+    uint8_t* scratch = NULL;
+    size_t base = 0;  // Logical block at the start of extent `i`.
+    size_t end = req->first + req->count;
+    for (size_t i = 0; i < nextents && base < end; ++i) {
+        size_t from = req->first > base ? req->first - base : 0;
+        size_t to = end - base < extents[i].len ? end - base : extents[i].len;
+        base += extents[i].len;
+        if (from >= to) {
+            continue;
+        }
+        // Each extent's share is one I/O.
+        if (!scratch) {
+            scratch = (uint8_t*)malloc(req->count * BLOCK_SIZE);
+            if (!scratch) {
+                err_exit("read_ahead: failed to allocate memory");
+            }
+        }
+        int start = (int)(extents[i].start + from);
+        read_data_run(start, scratch, (to - from) * BLOCK_SIZE);
+        cache_fill(start, scratch, to - from);
+        STAT_ADD(STAT_READAHEAD_BLOCKS, to - from);
+    }
+    free(scratch);
+    free(extents);
+    inode_unlock(req->inode_no);
+}
+
+static void* run_readahead(void* arg) {
+    (void)arg;
+    pthread_mutex_lock(&ra.lock);
+    for (;;) {
+        while (ra.len == 0 && !ra.stop_requested) {
+            pthread_cond_wait(&ra.cond, &ra.lock);
+        }
+        if (ra.stop_requested) {
+            break;
+        }
+        ReadaheadReq req = ra.queue[ra.head];
+        ra.head = (ra.head + 1) % READAHEAD_QUEUE;
+        ra.len--;
+        pthread_mutex_unlock(&ra.lock);
+        read_ahead(&req);
+        pthread_mutex_lock(&ra.lock);
+    }
+    pthread_mutex_unlock(&ra.lock);
+    return NULL;
+}
+
+// -------------------------------------
+
+void queue_readahead(int inode_no, size_t first, size_t count) {
+    if (count == 0) {
+        return;
+    }
+    pthread_mutex_lock(&ra.lock);
+    if (!ra.is_started) {
+        ra.stop_requested = false;
+        if (pthread_create(&ra.thread, NULL, run_readahead, NULL) != 0) {
+            logMsg(ERROR_LOG, "queue_readahead: failed to start the readahead thread");
+            pthread_mutex_unlock(&ra.lock);
+            return;
+        }
+        ra.is_started = true;
+    }
+    if (ra.len < READAHEAD_QUEUE) {
+        ra.queue[(ra.head + ra.len) % READAHEAD_QUEUE] = (ReadaheadReq){inode_no, first, count};
+        ra.len++;
+        pthread_cond_signal(&ra.cond);
+    }
+    pthread_mutex_unlock(&ra.lock);
+}
+
+void stop_readahead() {
+    pthread_mutex_lock(&ra.lock);
+    if (!ra.is_started) {
+        pthread_mutex_unlock(&ra.lock);
+        return;
+    }
+    ra.stop_requested = true;
+    ra.len = 0;
+    pthread_cond_signal(&ra.cond);
+    pthread_mutex_unlock(&ra.lock);
+    pthread_join(ra.thread, NULL);
+    pthread_mutex_lock(&ra.lock);
+    ra.is_started = false;
+    ra.stop_requested = false;
+    pthread_mutex_unlock(&ra.lock);
+}
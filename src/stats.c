@@ -0,0 +1,180 @@
+#include "stats.h"
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+
+// --------------- LOCAL ---------------
+
+typedef struct {
+    atomic_uint_fast64_t count;
+    atomic_uint_fast64_t total_ns;
+    atomic_uint_fast64_t max_ns;
+    atomic_uint_fast64_t buckets[STAT_HIST_BUCKETS];
+} AtomicHistogram;
+
+// Zero-initialized; every access is relaxed.
+static atomic_uint_fast64_t counters[NUM_STAT_COUNTERS];
+static AtomicHistogram ops[NUM_STAT_OPS];
+
+static const char* counter_names[NUM_STAT_COUNTERS] = {
+    "disk_reads",
+    "disk_read_bytes",
+    "disk_writes",
+    "disk_write_bytes",
+    "disk_seeks",
+    "disk_syncs",
+    "cache_hits",
+    "cache_misses",
+    "cache_evictions",
+    "alloc_scans",
+    "bitmap_words",
+    "inode_reads",
+    "inode_writes",
+    "dcache_hits",
+    "dcache_misses",
+    "dirent_lookups",
+    "dirent_blocks",
+    "journal_commits",
+    "journal_blocks",
+    "readahead_blocks",
+    "delayed_flushes",
+    "compressed_bytes_saved",
+};
+
+static const char* op_names[NUM_STAT_OPS] = {
+    "mkfs",
+    "mkdir",
+    "mkfile",
+    "create",
+    "read",
+    "write",
+    "delete",
+    "rmdir",
+    "ls",
+    "readdir",
+    "batch_commit",
+    "open",
+    "pread",
+    "pwrite",
+    "append",
+    "truncate",
+    "fsync",
+};
+
+static size_t bucket_of(uint64_t ns) {
+    size_t b = ns == 0 ? 0 : (size_t)(63 - __builtin_clzll(ns));
+    return b < STAT_HIST_BUCKETS ? b : STAT_HIST_BUCKETS - 1;
+}
+
+static uint64_t load(atomic_uint_fast64_t* v) {
+    return atomic_load_explicit(v, memory_order_relaxed);
+}
+
+static void store_zero(atomic_uint_fast64_t* v) {
+    atomic_store_explicit(v, 0, memory_order_relaxed);
+}
+
+// -------------------------------------
+
+void _stats_add(StatCounter counter, uint64_t n) {
+    atomic_fetch_add_explicit(&counters[counter], n, memory_order_relaxed);
+}
+
+uint64_t _stats_now_ns() {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+void _stats_record_op(StatOp op, uint64_t start_ns) {
+    uint64_t ns = _stats_now_ns() - start_ns;
+    AtomicHistogram* h = &ops[op];
+    atomic_fetch_add_explicit(&h->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->total_ns, ns, memory_order_relaxed);
+    atomic_fetch_add_explicit(&h->buckets[bucket_of(ns)], 1, memory_order_relaxed);
+    uint64_t max = load(&h->max_ns);
+    while (ns > max && !atomic_compare_exchange_weak_explicit(
+                           &h->max_ns, &max, ns, memory_order_relaxed, memory_order_relaxed)) {
+    }
+}
+
+void minifs_stats(MinifsStats* out) {
+    for (size_t i = 0; i < NUM_STAT_COUNTERS; ++i) {
+        out->counters[i] = load(&counters[i]);
+    }
+    for (size_t i = 0; i < NUM_STAT_OPS; ++i) {
+        out->ops[i].count = load(&ops[i].count);
+        out->ops[i].total_ns = load(&ops[i].total_ns);
+        out->ops[i].max_ns = load(&ops[i].max_ns);
+        for (size_t b = 0; b < STAT_HIST_BUCKETS; ++b) {
+            out->ops[i].buckets[b] = load(&ops[i].buckets[b]);
+        }
+    }
+}
+
+void minifs_stats_reset() {
+    for (size_t i = 0; i < NUM_STAT_COUNTERS; ++i) {
+        store_zero(&counters[i]);
+    }
+    for (size_t i = 0; i < NUM_STAT_OPS; ++i) {
+        store_zero(&ops[i].count);
+        store_zero(&ops[i].total_ns);
+        store_zero(&ops[i].max_ns);
+        for (size_t b = 0; b < STAT_HIST_BUCKETS; ++b) {
+            store_zero(&ops[i].buckets[b]);
+        }
+    }
+}
+
+void minifs_stats_print(FILE* out) {
+    MinifsStats s;
+    minifs_stats(&s);
+    for (size_t i = 0; i < NUM_STAT_COUNTERS; ++i) {
+        if (s.counters[i] != 0) {
+            fprintf(out, "%s %ju\n", counter_names[i], (uintmax_t)s.counters[i]);
+        }
+    }
+    for (size_t i = 0; i < NUM_STAT_OPS; ++i) {
+        const StatHistogram* h = &s.ops[i];
+        if (h->count == 0) {
+            continue;
+        }
+        fprintf(
+            out,
+            "op %s count=%ju mean_ns=%ju p50_ns<=%ju p99_ns<=%ju max_ns=%ju\n",
+            op_names[i],
+            (uintmax_t)h->count,
+            (uintmax_t)(h->total_ns / h->count),
+            (uintmax_t)stat_histogram_percentile(h, 0.50),
+            (uintmax_t)stat_histogram_percentile(h, 0.99),
+            (uintmax_t)h->max_ns);
+    }
+}
+
+const char* stat_counter_name(StatCounter counter) {
+    return (unsigned)counter < NUM_STAT_COUNTERS ? counter_names[counter] : "unknown";
+}
+
+const char* stat_op_name(StatOp op) {
+    return (unsigned)op < NUM_STAT_OPS ? op_names[op] : "unknown";
+}
+
+uint64_t stat_histogram_percentile(const StatHistogram* h, double p) {
+    if (h->count == 0) {
+        return 0;
+    }
+    // Nearest rank: the smallest sample with at least `p` of them at or below it.
+    uint64_t rank = (uint64_t)(p * (double)h->count + 0.999999);
+    rank = rank == 0 ? 1 : rank;
+    uint64_t seen = 0;
+    for (size_t b = 0; b < STAT_HIST_BUCKETS - 1; ++b) {
+        seen += h->buckets[b];
+        if (seen >= rank) {
+            uint64_t upper = (2ULL << b) - 1;
+            return upper < h->max_ns ? upper : h->max_ns;
+        }
+    }
+    return h->max_ns;
+}
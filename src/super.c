@@ -1,5 +1,6 @@
 #include "super.h"
 
+#include <limits.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -7,17 +8,33 @@
 #include "disk.h"
 #include "err.h"
 #include "fs.h"
+#include "journal.h"
 #include "logging.h"
+#include "on-disk/inode.h"
 #include "on-disk/super.h"
 
 static SuperBlock sb = {0};
 static bool is_loaded = false;
 static bool is_dirty = false;
 
+// --------------- LOCAL ---------------
+
+static void require_super_is_loaded(void) {
+    if (!is_loaded) {
+        err_exit("require_super_is_loaded: no superblock is loaded");
+    }
+}
+
+static uint64_t div_round_up(uint64_t a, uint64_t b) {
+    return (a + b - 1) / b;
+}
+
+// -------------------------------------
+
 int load_super_from_disk() {
     require_disk_is_mounted();
-    read_from_disk_at((void*)&sb, sizeof(SuperBlock), 1, 0);
-    if (validate_super(&sb) != 0) {
+    if (read_from_disk_at((void*)&sb, sizeof(SuperBlock), 1, 0) != 1 ||
+        validate_super(&sb) != 0) {
         return -1;
     }
     is_loaded = true;
@@ -43,6 +60,23 @@ void flush_super_to_disk() {
     is_dirty = false;
 }
 
+void flush_super_to_journal() {
+    if (!is_loaded || !is_dirty) {
+        return;
+    }
+    journal_add_block(0, &sb, sizeof(SuperBlock));
+}
+
+void super_committed() {
+    is_dirty = false;
+}
+
+void unload_super() {
+    memset(&sb, 0, sizeof sb);
+    is_loaded = false;
+    is_dirty = false;
+}
+
 void set_super(const SuperConfig* cfg) {
     require_disk_is_mounted();
     if (!cfg) {
@@ -60,6 +94,9 @@ void set_super(const SuperConfig* cfg) {
     sb.bitmap_start = cfg->bitmap_start;
     sb.inode_start = cfg->inode_start;
     sb.data_start = cfg->data_start;
+    sb.journal_start = cfg->journal_start;
+    sb.journal_blocks = cfg->journal_blocks;
+    sb.itable_hwm = cfg->itable_hwm;
 
     is_loaded = true;
     is_dirty = true;
@@ -81,13 +118,108 @@ int validate_super(const SuperConfig* sb) {
         logMsg(ERROR_LOG, "super_validate: block_size must be a power of two");
         return -1;
     }
-    if (!(sb->bitmap_start < sb->inode_start && sb->inode_start < sb->data_start)) {
+    if (sb->block_size < MIN_BLOCK_SIZE || sb->block_size > MAX_BLOCK_SIZE) {
+        logMsg(
+            ERROR_LOG,
+            "super_validate: block_size must be between %d and %d",
+            MIN_BLOCK_SIZE,
+            MAX_BLOCK_SIZE);
+        return -1;
+    }
+    // Block and inode numbers are handled as `int`.
+    if (sb->num_blocks > INT_MAX || sb->max_inodes == 0 || sb->max_inodes > INT_MAX) {
+        logMsg(ERROR_LOG, "super_validate: num_blocks or max_inodes out of range");
+        return -1;
+    }
+    if (!(sb->bitmap_start < sb->inode_start && sb->inode_start < sb->journal_start &&
+          sb->journal_start < sb->data_start)) {
         logMsg(ERROR_LOG, "super_validate: region ordering invalid");
         return -1;
     }
+    if (sb->bitmap_start == 0 ||
+        sb->inode_start - sb->bitmap_start < div_round_up(sb->num_blocks, 8 * sb->block_size)) {
+        logMsg(ERROR_LOG, "super_validate: bitmap region is too small");
+        return -1;
+    }
+    if (sb->journal_start - sb->inode_start <
+        div_round_up((uint64_t)sb->max_inodes * sizeof(Inode), sb->block_size)) {
+        logMsg(ERROR_LOG, "super_validate: inode table region is too small");
+        return -1;
+    }
+    if (sb->itable_hwm > sb->journal_start - sb->inode_start) {
+        logMsg(ERROR_LOG, "super_validate: inode table high-water mark out of range");
+        return -1;
+    }
+    if (sb->journal_blocks < MIN_JOURNAL_BLOCKS ||
+        sb->data_start - sb->journal_start < sb->journal_blocks) {
+        logMsg(ERROR_LOG, "super_validate: journal region is too small");
+        return -1;
+    }
     if (sb->data_start >= sb->num_blocks) {
         logMsg(ERROR_LOG, "super_validate: data_start out of range");
         return -1;
     }
     return 0;
 }
+
+bool super_is_loaded() {
+    return is_loaded;
+}
+
+const SuperBlock* get_super() {
+    require_super_is_loaded();
+    return &sb;
+}
+
+uint32_t get_block_size(void) {
+    require_super_is_loaded();
+    return sb.block_size;
+}
+
+uint32_t get_num_blocks(void) {
+    require_super_is_loaded();
+    return sb.num_blocks;
+}
+
+uint32_t get_max_inodes(void) {
+    require_super_is_loaded();
+    return sb.max_inodes;
+}
+
+uint32_t get_bitmap_start(void) {
+    require_super_is_loaded();
+    return sb.bitmap_start;
+}
+
+uint32_t get_inode_start(void) {
+    require_super_is_loaded();
+    return sb.inode_start;
+}
+
+uint32_t get_data_start(void) {
+    require_super_is_loaded();
+    return sb.data_start;
+}
+
+uint32_t get_journal_start(void) {
+    require_super_is_loaded();
+    return sb.journal_start;
+}
+
+uint32_t get_journal_blocks(void) {
+    require_super_is_loaded();
+    return sb.journal_blocks;
+}
+
+uint32_t get_itable_hwm(void) {
+    require_super_is_loaded();
+    return sb.itable_hwm;
+}
+
+void set_itable_hwm(uint32_t nblocks) {
+    require_super_is_loaded();
+    if (nblocks > sb.itable_hwm) {
+        sb.itable_hwm = nblocks;
+        is_dirty = true;
+    }
+}
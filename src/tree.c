@@ -0,0 +1,568 @@
+#include "tree.h"
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "dcache.h"
+#include "dir.h"
+#include "disk.h"
+#include "err.h"
+#include "extent.h"
+#include "file.h"
+#include "inode.h"
+#include "journal.h"
+#include "logging.h"
+#include "path.h"
+
+// Bytes a file copy moves with each read and write.
+#define COPY_CHUNK (1 << 20)
+
+//! Every directory is a task. A worker lists its directory one block
+//! of entries at a time, handles the files in place and queues each
+//! subdirectory as a new task on its own deque, newest last. It runs
+//! its newest task next, so it goes depth first and keeps what it
+//! reads warm; an idle worker steals the oldest task of another, which
+//! tends to be a whole subtree. A removal only takes a directory out
+//! of its parent once every task below it is done.
+
+// --------------- LOCAL ---------------
+
+typedef enum TREE_OPS {
+    TREE_WALK,
+    TREE_DU,
+    TREE_RM,
+    TREE_COPY,
+} TreeOp;
+
+typedef struct DirTask {
+    struct DirTask* parent;  // NULL for the top directory.
+    int inode_no;
+    int parent_inode_no;
+    char name[MAX_DIRNAME_LEN + 1];  // In the parent directory.
+    char* path;
+    int copy_inode_no;  // TREE_COPY: the copy being filled.
+    // TREE_RM: subdirectories not yet removed, plus one until the listing ends.
+    atomic_size_t pending;
+} DirTask;
+
+// A worker's tasks. The worker takes from the back, thieves from the front.
+typedef struct {
+    pthread_mutex_t lock;
+    DirTask** tasks;
+    size_t head, tail, cap;
+} Deque;
+
+typedef struct {
+    TreeOp op;
+    TreeVisitor visit;
+    void* arg;
+    Deque* deques;
+    size_t nworkers;
+    // Tasks waiting in some deque, and tasks waiting or running; workers exit once that is 0.
+    atomic_size_t queued;
+    atomic_size_t outstanding;
+    pthread_mutex_t idle_lock;
+    pthread_cond_t idle;
+    atomic_int rc;  // The first failure, or what a visitor returned.
+    atomic_size_t files, dirs, bytes, blocks;
+} Tree;
+
+typedef struct {
+    Tree* t;
+    size_t id;
+} Worker;
+
+static void fail(Tree* t, int rc) {
+    int none = 0;
+    atomic_compare_exchange_strong(&t->rc, &none, rc);
+}
+
+// A removal carries on past what it can't remove; the other operations stop at the first failure.
+static bool stopping(Tree* t) {
+    return t->op != TREE_RM && atomic_load(&t->rc) != 0;
+}
+
+static char* join_path(const char* dir, const char* name) {
+    size_t len = strlen(dir) + 1 + strlen(name) + 1;
+    char* path = (char*)malloc(len);
+    if (!path) {
+        err_exit("join_path: failed to allocate memory");
+    }
+    snprintf(path, len, "%s%s%s", dir, strcmp(dir, "/") == 0 ? "" : "/", name);
+    return path;
+}
+
+// Takes over `path`.
+static DirTask* new_task(
+    DirTask* parent, int inode_no, int parent_inode_no, const char* name, char* path) {
+    DirTask* task = (DirTask*)calloc(1, sizeof(DirTask));
+    if (!task) {
+        err_exit("new_task: failed to allocate memory");
+    }
+    task->parent = parent;
+    task->inode_no = inode_no;
+    task->parent_inode_no = parent_inode_no;
+    strncpy(task->name, name, MAX_DIRNAME_LEN);
+    task->path = path;
+    task->copy_inode_no = -1;
+    atomic_init(&task->pending, 1);
+    return task;
+}
+
+static void free_task(DirTask* task) {
+    free(task->path);
+    free(task);
+}
+
+static void push_task(Tree* t, size_t id, DirTask* task) {
+    // Counted first, so a thief can't take it before it is.
+    atomic_fetch_add(&t->outstanding, 1);
+    atomic_fetch_add(&t->queued, 1);
+    Deque* d = &t->deques[id];
+    pthread_mutex_lock(&d->lock);
+    if (d->tail == d->cap) {
+        if (d->head > 0) {
+            memmove(d->tasks, d->tasks + d->head, (d->tail - d->head) * sizeof(DirTask*));
+            d->tail -= d->head;
+            d->head = 0;
+        } else {
+            d->cap = d->cap ? d->cap * 2 : 16;
+            d->tasks = (DirTask**)realloc(d->tasks, d->cap * sizeof(DirTask*));
+            if (!d->tasks) {
+                err_exit("push_task: failed to allocate memory");
+            }
+        }
+    }
+    d->tasks[d->tail++] = task;
+    pthread_mutex_unlock(&d->lock);
+    pthread_mutex_lock(&t->idle_lock);
+    pthread_cond_signal(&t->idle);
+    pthread_mutex_unlock(&t->idle_lock);
+}
+
+// The newest task of worker `id`, or else the oldest one of the next worker that has any.
+static DirTask* take_task(Tree* t, size_t id) {
+    for (size_t k = 0; k < t->nworkers; ++k) {
+        Deque* d = &t->deques[(id + k) % t->nworkers];
+        DirTask* task = NULL;
+        pthread_mutex_lock(&d->lock);
+        if (d->head < d->tail) {
+            task = k == 0 ? d->tasks[--d->tail] : d->tasks[d->head++];
+        }
+        pthread_mutex_unlock(&d->lock);
+        if (task) {
+            atomic_fetch_sub(&t->queued, 1);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+static int link_entry(int dir_inode_no, const char* name, int inode_no) {
+    DirectoryEntry dirent;
+    dirent.inode_number = inode_no;
+    strncpy(dirent.name, name, MAX_DIRNAME_LEN);
+    dirent.name[MAX_DIRNAME_LEN] = '\0';
+    return add_dirent(dir_inode_no, dirent);
+}
+
+/*
+ * Deletes the entry `name` of a directory, which was listed as naming
+ * `inode_no`, and frees that inode. Fails if the entry changed since,
+ * or the inode is an open file or a directory that is not empty.
+ */
+static int unlink_entry(int parent_inode_no, const char* name, int inode_no) {
+    inode_wrlock(inode_no);
+    Inode inode;
+    int named;
+    if (read_inode(inode_no, &inode) != 1 || !inode_is_valid(inode) ||
+        (inode_is_dir(inode) && inode.size > 0) || inode_is_open(inode_no) ||
+        lookup_dirent(parent_inode_no, name, &named) != 0 || named != inode_no ||
+        remove_dirent(parent_inode_no, name) != 0) {
+        inode_unlock(inode_no);
+        logMsg(WARN_LOG, "rm_tree_fs: cannot remove %s from inode %d", name, parent_inode_no);
+        return -1;
+    }
+    dcache_remove_children(inode_no);
+    file_drop_delayed(inode_no);
+    extent_free_all(&inode);
+    inode_set_invalid(&inode);
+    write_inode(inode_no, inode);
+    inode_unlock(inode_no);
+    return 0;
+}
+
+// Creates an empty directory `name` in a directory. Returns its inode number, or -1.
+static int make_dir(int parent_inode_no, const char* name) {
+    int inode_no = alloc_inode();
+    if (inode_no < 0) {
+        return -1;
+    }
+    int block_no = alloc_block();
+    if (block_no < 0) {
+        free_inode(inode_no);
+        return -1;
+    }
+    Inode dir = (Inode){0};
+    extent_append(&dir, (uint32_t)block_no, 1);
+    inode_set_valid(&dir);
+    inode_set_dir(&dir);
+    write_inode(inode_no, dir);
+    if (link_entry(parent_inode_no, name, inode_no) != 0) {
+        extent_free_all(&dir);
+        free_inode(inode_no);
+        return -1;
+    }
+    return inode_no;
+}
+
+// Copies file `src_inode_no` into a directory as `name`. The copy is linked once it is written.
+static int copy_file(int src_inode_no, int dir_inode_no, const char* name) {
+    int inode_no = alloc_inode();
+    if (inode_no < 0) {
+        return -1;
+    }
+    char* buf = (char*)malloc(COPY_CHUNK);
+    if (!buf) {
+        err_exit("copy_file: failed to allocate memory");
+    }
+    Inode copy = (Inode){0};
+    inode_set_valid(&copy);
+    Inode src;
+    inode_rdlock(src_inode_no);
+    int rc = read_inode(src_inode_no, &src) == 1 && inode_is_valid(src) ? 0 : -1;
+    size_t size = rc == 0 ? file_size(src_inode_no, &src) : 0;
+    for (size_t off = 0; rc == 0 && off < size; off += COPY_CHUNK) {
+        size_t n = size - off < COPY_CHUNK ? size - off : COPY_CHUNK;
+        if (file_read(src_inode_no, &src, off, buf, n) != n) {
+            rc = -1;
+        } else if (off == 0) {
+            // Stored compressed if it pays; the pieces after it then append whole chunks.
+            rc = file_replace(inode_no, &copy, buf, n);
+        } else {
+            rc = file_write(inode_no, &copy, off, buf, n);
+        }
+    }
+    inode_unlock(src_inode_no);
+    free(buf);
+    if (rc == 0) {
+        write_inode(inode_no, copy);
+        rc = link_entry(dir_inode_no, name, inode_no);
+    }
+    if (rc != 0) {
+        extent_free_all(&copy);
+        free_inode(inode_no);
+    }
+    return rc;
+}
+
+/*
+ * Called once the listing of `task` ends, and once each subdirectory
+ * of it is removed. The last call removes the directory itself, unless
+ * it is the root, and passes that on to its parent.
+ */
+static void release_removal(Tree* t, DirTask* task) {
+    while (task && atomic_fetch_sub(&task->pending, 1) == 1) {
+        DirTask* parent = task->parent;
+        if (task->inode_no != 0 &&
+            unlink_entry(task->parent_inode_no, task->name, task->inode_no) != 0) {
+            fail(t, -1);
+        }
+        free_task(task);
+        task = parent;
+    }
+}
+
+static void visit_entry(Tree* t, size_t id, DirTask* task, const DirectoryEntry* d) {
+    int inode_no = d->inode_number;
+    ReaddirEntry e = {*d, false, 0};
+    size_t nblocks = 0;
+    Inode inode;
+    inode_rdlock(inode_no);
+    bool valid = read_inode(inode_no, &inode) == 1 && inode_is_valid(inode);
+    if (valid) {
+        e.is_dir = inode_is_dir(inode);
+        e.size = e.is_dir ? inode.size : file_size(inode_no, &inode);
+        nblocks = inode_num_blocks(&inode);
+    }
+    inode_unlock(inode_no);
+    if (!valid) {
+        return;  // Removed since it was listed.
+    }
+    char* path = join_path(task->path, d->name);
+    int rc = 0;
+    DirTask* child = NULL;
+    switch (t->op) {
+        case TREE_WALK:
+            rc = t->visit(path, &e, t->arg);
+            break;
+        case TREE_DU:
+            atomic_fetch_add(e.is_dir ? &t->dirs : &t->files, 1);
+            atomic_fetch_add(&t->bytes, e.is_dir ? 0 : e.size);
+            atomic_fetch_add(&t->blocks, nblocks);
+            break;
+        case TREE_RM:
+            if (!e.is_dir) {
+                rc = unlink_entry(task->inode_no, d->name, inode_no);
+            }
+            break;
+        case TREE_COPY:
+            if (!e.is_dir) {
+                rc = copy_file(inode_no, task->copy_inode_no, d->name);
+            }
+            break;
+    }
+    if (rc != 0) {
+        fail(t, rc);
+    } else if (e.is_dir) {
+        child = new_task(task, inode_no, task->inode_no, d->name, path);
+        path = NULL;
+        if (t->op == TREE_COPY &&
+            (child->copy_inode_no = make_dir(task->copy_inode_no, d->name)) < 0) {
+            fail(t, -1);
+            free_task(child);
+            child = NULL;
+        }
+    }
+    free(path);
+    if (!child) {
+        return;
+    }
+    if (t->op == TREE_RM) {
+        atomic_fetch_add(&task->pending, 1);
+    }
+    push_task(t, id, child);
+}
+
+// Lists the task's directory a block of entries at a time.
+static void run_task(Tree* t, size_t id, DirTask* task) {
+    size_t max = DIRENTS_PER_BLOCK;
+    DirectoryEntry* batch = (DirectoryEntry*)malloc(max * sizeof(DirectoryEntry));
+    if (!batch) {
+        err_exit("run_task: failed to allocate memory");
+    }
+    uint64_t cookie = 0;
+    long n = 0;
+    while (!stopping(t) && (n = readdir_dirents(task->inode_no, &cookie, batch, max)) > 0) {
+        for (long i = 0; i < n && !stopping(t); ++i) {
+            visit_entry(t, id, task, &batch[i]);
+        }
+    }
+    free(batch);
+    if (n < 0) {
+        logMsg(ERROR_LOG, "tree: cannot list %s", task->path);
+        fail(t, -1);
+    }
+    if (t->op == TREE_RM) {
+        release_removal(t, task);
+    } else {
+        free_task(task);
+    }
+}
+
+static void* run_worker(void* arg) {
+    const Worker* w = (const Worker*)arg;
+    Tree* t = w->t;
+    for (;;) {
+        DirTask* task = take_task(t, w->id);
+        if (!task) {
+            pthread_mutex_lock(&t->idle_lock);
+            while (atomic_load(&t->queued) == 0 && atomic_load(&t->outstanding) > 0) {
+                pthread_cond_wait(&t->idle, &t->idle_lock);
+            }
+            bool done = atomic_load(&t->outstanding) == 0;
+            pthread_mutex_unlock(&t->idle_lock);
+            if (done) {
+                return NULL;
+            }
+            continue;
+        }
+        // Each task is a handle of its own; nothing waits for a commit until the end.
+        journal_begin();
+        run_task(t, w->id, task);
+        journal_end_nowait();
+        if (atomic_fetch_sub(&t->outstanding, 1) == 1) {
+            pthread_mutex_lock(&t->idle_lock);
+            pthread_cond_broadcast(&t->idle);
+            pthread_mutex_unlock(&t->idle_lock);
+        }
+    }
+}
+
+/*
+ * Runs `top` and every task it leads to on `nthreads` workers, the
+ * caller's thread among them, then commits what they changed.
+ * Returns 0, or the first failure.
+ */
+static int run_tree(Tree* t, DirTask* top, size_t nthreads) {
+    if (journal_in_handle()) {
+        /*
+         * Inside a batch, a commit another thread starts waits for the
+         * batch to end, and workers of our own would wait for that
+         * commit in `journal_begin`. The caller's tasks join the batch.
+         */
+        nthreads = 1;
+    } else if (nthreads == 0) {
+        long ncpus = sysconf(_SC_NPROCESSORS_ONLN);
+        nthreads = ncpus > 0 ? (size_t)ncpus : 1;
+    }
+    t->nworkers = nthreads;
+    t->deques = (Deque*)calloc(nthreads, sizeof(Deque));
+    Worker* workers = (Worker*)malloc(nthreads * sizeof(Worker));
+    pthread_t* threads = (pthread_t*)malloc(nthreads * sizeof(pthread_t));
+    if (!t->deques || !workers || !threads) {
+        err_exit("run_tree: failed to allocate memory");
+    }
+    pthread_mutex_init(&t->idle_lock, NULL);
+    pthread_cond_init(&t->idle, NULL);
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_mutex_init(&t->deques[i].lock, NULL);
+        workers[i] = (Worker){t, i};
+    }
+    push_task(t, 0, top);
+    size_t started = 0;
+    while (started + 1 < nthreads &&
+           pthread_create(&threads[started], NULL, run_worker, &workers[started + 1]) == 0) {
+        started++;
+    }
+    run_worker(&workers[0]);
+    for (size_t i = 0; i < started; ++i) {
+        pthread_join(threads[i], NULL);
+    }
+    // A single commit for the whole tree; inside a batch, the batch's commit covers it.
+    journal_begin();
+    if (!journal_end()) {
+        logMsg(ERROR_LOG, "tree: failed to commit the journal");
+        fail(t, -1);
+    }
+    for (size_t i = 0; i < nthreads; ++i) {
+        pthread_mutex_destroy(&t->deques[i].lock);
+        free(t->deques[i].tasks);
+    }
+    pthread_cond_destroy(&t->idle);
+    pthread_mutex_destroy(&t->idle_lock);
+    free(threads);
+    free(workers);
+    free(t->deques);
+    return atomic_load(&t->rc);
+}
+
+// Resolves `path`, which must name a directory, and reads its inode.
+static int resolve_dir(const char* op, const char* path, int* inode_no, Inode* dir) {
+    if (!path || get_inode_no_from_path(path, inode_no) != 0) {
+        logMsg(ERROR_LOG, "%s: invalid path=%s", op, path ? path : "(null)");
+        return -1;
+    }
+    inode_rdlock(*inode_no);
+    bool ok = read_inode(*inode_no, dir) == 1 && inode_is_valid(*dir) && inode_is_dir(*dir);
+    inode_unlock(*inode_no);
+    if (!ok) {
+        logMsg(ERROR_LOG, "%s: %s is not a directory", op, path);
+        return -1;
+    }
+    return 0;
+}
+
+static char* copy_path(const char* path) {
+    char* copy = strdup(path);
+    if (!copy) {
+        err_exit("copy_path: failed to allocate memory");
+    }
+    return copy;
+}
+
+// -------------------------------------
+
+int walk_tree_fs(const char* path, TreeVisitor visit, void* arg, size_t nthreads) {
+    require_disk_is_mounted();
+    int inode_no;
+    Inode dir;
+    if (!visit || resolve_dir("walk_tree_fs", path, &inode_no, &dir) != 0) {
+        return -1;
+    }
+    Tree t = {.op = TREE_WALK, .visit = visit, .arg = arg};
+    return run_tree(&t, new_task(NULL, inode_no, -1, "", copy_path(path)), nthreads);
+}
+
+int du_tree_fs(const char* path, TreeUsage* usage, size_t nthreads) {
+    require_disk_is_mounted();
+    int inode_no;
+    Inode dir;
+    if (!usage || resolve_dir("du_tree_fs", path, &inode_no, &dir) != 0) {
+        return -1;
+    }
+    Tree t = {.op = TREE_DU};
+    atomic_init(&t.blocks, inode_num_blocks(&dir));
+    int rc = run_tree(&t, new_task(NULL, inode_no, -1, "", copy_path(path)), nthreads);
+    *usage = (TreeUsage){
+        atomic_load(&t.files), atomic_load(&t.dirs), atomic_load(&t.bytes), atomic_load(&t.blocks)};
+    return rc;
+}
+
+int rm_tree_fs(const char* path, size_t nthreads) {
+    require_disk_is_mounted();
+    int inode_no;
+    Inode dir;
+    if (resolve_dir("rm_tree_fs", path, &inode_no, &dir) != 0) {
+        return -1;
+    }
+    int parent_inode_no = -1;
+    if (inode_no != 0) {
+        char* parent_path = get_parent_path(path);
+        int rc = get_inode_no_from_path(parent_path, &parent_inode_no);
+        free(parent_path);
+        if (rc != 0) {
+            logMsg(ERROR_LOG, "rm_tree_fs: invalid parent path for %s", path);
+            return -1;
+        }
+    }
+    const char* name = strrchr(path, '/') + 1;
+    Tree t = {.op = TREE_RM};
+    DirTask* top = new_task(NULL, inode_no, parent_inode_no, name, copy_path(path));
+    int rc = run_tree(&t, top, nthreads);
+    logMsg(INFO_LOG, "rm_tree_fs: path=%s rc=%d", path, rc);
+    return rc;
+}
+
+int copy_tree_fs(const char* src, const char* dst, size_t nthreads) {
+    require_disk_is_mounted();
+    int inode_no;
+    Inode dir;
+    if (resolve_dir("copy_tree_fs", src, &inode_no, &dir) != 0 || !dst) {
+        return -1;
+    }
+    size_t len = strcmp(src, "/") == 0 ? 0 : strlen(src);
+    if (strncmp(dst, src, len) == 0 && (dst[len] == '/' || dst[len] == '\0')) {
+        logMsg(ERROR_LOG, "copy_tree_fs: %s is inside %s", dst, src);
+        return -1;
+    }
+    const char* name = strrchr(dst, '/');
+    int parent_inode_no, existing;
+    char* parent_path = get_parent_path(dst);
+    int rc = get_inode_no_from_path(parent_path, &parent_inode_no);
+    free(parent_path);
+    if (!name || name[1] == '\0' || rc != 0 || get_inode_no_from_path(dst, &existing) == 0) {
+        logMsg(ERROR_LOG, "copy_tree_fs: cannot create %s", dst);
+        return -1;
+    }
+    journal_begin();
+    int copy_inode_no = make_dir(parent_inode_no, name + 1);
+    journal_end_nowait();
+    if (copy_inode_no < 0) {
+        logMsg(ERROR_LOG, "copy_tree_fs: cannot create %s", dst);
+        return -1;
+    }
+    Tree t = {.op = TREE_COPY};
+    DirTask* top = new_task(NULL, inode_no, -1, "", copy_path(src));
+    top->copy_inode_no = copy_inode_no;
+    rc = run_tree(&t, top, nthreads);
+    logMsg(INFO_LOG, "copy_tree_fs: src=%s dst=%s rc=%d", src, dst, rc);
+    return rc;
+}
@@ -0,0 +1,61 @@
+#pragma once
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "inode.h"
+#include "logging.h"
+#include "path.h"
+
+/*
+ * Each test is a program of its own: it formats a scratch image in
+ * the working directory, runs its checks and exits nonzero if any of
+ * them failed. `make test` and `ctest` run them all.
+ */
+
+#define TEST_IMAGE "minifs_test.img"
+#define TEST_LOG "minifs_test.log"
+
+static int test_failures = 0;
+
+// Reports a failed check and goes on.
+#define CHECK(cond)                                                                           \
+    do {                                                                                      \
+        if (!(cond)) {                                                                        \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond);          \
+            test_failures++;                                                                  \
+        }                                                                                     \
+    } while (0)
+
+// Reports a failed check and stops: what follows depends on it.
+#define REQUIRE(cond)                                                                         \
+    do {                                                                                      \
+        if (!(cond)) {                                                                        \
+            fprintf(stderr, "%s:%d: requirement failed: %s\n", __FILE__, __LINE__, #cond);    \
+            exit(1);                                                                          \
+        }                                                                                     \
+    } while (0)
+
+static inline void test_init(void) {
+    set_print_logs(false);
+    init_logs(TEST_LOG, LOGMODE);
+}
+
+// The inode at `path`, which must exist.
+static inline Inode inode_at(const char* path) {
+    int inode_no;
+    Inode inode;
+    REQUIRE(get_inode_no_from_path(path, &inode_no) == 0);
+    REQUIRE(read_inode(inode_no, &inode) == 1);
+    return inode;
+}
+
+// Returns the test's exit status.
+static inline int test_done(const char* name) {
+    if (test_failures > 0) {
+        fprintf(stderr, "%s: %d checks failed\n", name, test_failures);
+        return 1;
+    }
+    printf("%s: ok\n", name);
+    return 0;
+}
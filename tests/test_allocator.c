@@ -0,0 +1,114 @@
+#include <string.h>
+
+#include "allocator.h"
+#include "disk.h"
+#include "fs.h"
+#include "journal.h"
+#include "test.h"
+
+#define NUM_TEST_BLOCKS 8192
+
+// What the bitmap should say; a block is set when taken.
+static bool model[NUM_TEST_BLOCKS];
+
+static bool matches_model(void) {
+    for (uint32_t b = DATA_START; b < NUM_BLOCKS; ++b) {
+        if (model[b] == block_is_free((int)b)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static size_t longest_free_run(void) {
+    size_t longest = 0, run = 0;
+    for (uint32_t b = DATA_START; b < NUM_BLOCKS; ++b) {
+        run = model[b] ? 0 : run + 1;
+        longest = run > longest ? run : longest;
+    }
+    return longest;
+}
+
+// Random allocations, runs and frees agree with a plain array.
+static void test_against_model(void) {
+    srand(1);
+    for (int it = 0; it < 20000; ++it) {
+        int op = rand() % 3;
+        if (op == 0) {
+            int b = alloc_block();
+            if (b < 0) {
+                CHECK(longest_free_run() == 0);
+                continue;
+            }
+            CHECK(!model[b]);
+            model[b] = true;
+        } else if (op == 1) {
+            size_t want = 1 + rand() % 40, got;
+            // A shorter run is handed out only if no run of `want` is left.
+            bool fits = longest_free_run() >= want;
+            int b = alloc_block_run(want, &got);
+            if (b < 0) {
+                CHECK(longest_free_run() == 0);
+                continue;
+            }
+            CHECK(got >= 1 && got <= want && (got == want || !fits));
+            for (size_t i = 0; i < got; ++i) {
+                CHECK(!model[b + i]);
+                model[b + i] = true;
+            }
+        } else {
+            int b = (int)DATA_START + rand() % (int)(NUM_BLOCKS - DATA_START);
+            for (int i = b; i < b + 1 + rand() % 10 && i < (int)NUM_BLOCKS; ++i) {
+                if (model[i]) {
+                    free_block(i);
+                    model[i] = false;
+                }
+            }
+            CHECK(journal_commit());
+        }
+        if (it % 1000 == 0) {
+            CHECK(matches_model());
+        }
+    }
+    CHECK(matches_model());
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    CHECK(matches_model());
+}
+
+// A freed block is not handed out again before the commit that frees it.
+static void test_free_waits_for_commit(void) {
+    int b = alloc_block();
+    REQUIRE(b >= 0);
+    free_block(b);
+    CHECK(!block_is_free(b));
+    bool reused = false;
+    int taken[64];
+    for (int i = 0; i < 64; ++i) {
+        taken[i] = alloc_block();
+        reused |= taken[i] == b;
+    }
+    CHECK(!reused);
+    CHECK(journal_commit());
+    CHECK(block_is_free(b));
+    for (int i = 0; i < 64; ++i) {
+        if (taken[i] >= 0) {
+            free_block(taken[i]);
+        }
+    }
+    CHECK(journal_commit());
+}
+
+int main(void) {
+    test_init();
+    FsGeometry geometry = {
+        .block_size = 512, .num_blocks = NUM_TEST_BLOCKS, .max_inodes = 128, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    test_free_waits_for_commit();
+    for (uint32_t b = DATA_START; b < NUM_BLOCKS; ++b) {
+        model[b] = !block_is_free((int)b);
+    }
+    test_against_model();
+    unmount_fs();
+    return test_done("allocator");
+}
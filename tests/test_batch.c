@@ -0,0 +1,172 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "stats.h"
+#include "test.h"
+
+#define NFILES 1200
+
+static void format(uint32_t journal_blocks) {
+    FsGeometry geometry = {
+        .block_size = 1024,
+        .num_blocks = 16384,
+        .max_inodes = 2048,
+        .journal_blocks = journal_blocks,
+    };
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    REQUIRE(mkdir_fs("/b") == 0);
+}
+
+static void name_of(char* name, int i) {
+    snprintf(name, 32, "/b/f%d", i);
+}
+
+static bool exists(int i) {
+    char name[32];
+    name_of(name, i);
+    char c;
+    return read_fs(name, &c, 1) == 0;
+}
+
+// The whole image, as the disk holds it; the caller frees it.
+static uint8_t* read_image(size_t* size) {
+    int fd = open(TEST_IMAGE, O_RDONLY);
+    REQUIRE(fd >= 0);
+    struct stat st;
+    REQUIRE(fstat(fd, &st) == 0);
+    uint8_t* image = (uint8_t*)malloc((size_t)st.st_size);
+    REQUIRE(image != NULL);
+    REQUIRE(pread(fd, image, (size_t)st.st_size, 0) == st.st_size);
+    close(fd);
+    *size = (size_t)st.st_size;
+    return image;
+}
+
+static uint64_t counter(StatCounter c) {
+    MinifsStats stats;
+    minifs_stats(&stats);
+    return stats.counters[c];
+}
+
+/*
+ * A batch that fits in half the journal leaves the image alone until
+ * it commits, then goes out as one transaction: one log write and one
+ * sync, and a write per block it changed.
+ */
+static void test_batch_is_one_transaction(void) {
+    format(1024);
+    size_t size_before, size_after;
+    uint8_t* before = read_image(&size_before);
+    minifs_stats_reset();
+    begin_batch_fs();
+    char name[32];
+    for (int i = 0; i < NFILES; ++i) {
+        name_of(name, i);
+        CHECK(mkfile_fs(name) == 0);
+    }
+    uint8_t* after = read_image(&size_after);
+    CHECK(size_before == size_after && memcmp(before, after, size_before) == 0);
+    CHECK(counter(STAT_DISK_WRITES) == 0);
+    CHECK(counter(STAT_DISK_SYNCS) == 0);
+    CHECK(commit_batch_fs() == 0);
+    CHECK(counter(STAT_JOURNAL_COMMITS) == 1);
+    CHECK(counter(STAT_DISK_SYNCS) == 1);
+    CHECK(counter(STAT_DISK_WRITES) == 1 + counter(STAT_JOURNAL_BLOCKS));
+    free(before);
+    free(after);
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    for (int i = 0; i < NFILES; ++i) {
+        CHECK(exists(i));
+    }
+    unmount_fs();
+}
+
+// A batch too large for the journal is committed in parts, each made of whole calls.
+static void test_large_batch_commits_in_parts(void) {
+    format(64);
+    minifs_stats_reset();
+    begin_batch_fs();
+    char name[32];
+    for (int i = 0; i < NFILES; ++i) {
+        name_of(name, i);
+        CHECK(mkfile_fs(name) == 0);
+    }
+    CHECK(commit_batch_fs() == 0);
+    CHECK(counter(STAT_JOURNAL_COMMITS) > 1);
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    for (int i = 0; i < NFILES; ++i) {
+        CHECK(exists(i));
+    }
+    unmount_fs();
+}
+
+// After a crash in the middle of such a batch, a prefix of its calls has taken effect.
+static void test_crash_leaves_a_prefix(void) {
+    format(64);
+    unmount_fs();
+    pid_t pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0) {
+        if (mount_fs(TEST_IMAGE) != 0) {
+            _exit(1);
+        }
+        begin_batch_fs();
+        char name[32];
+        for (int i = 0; i < NFILES; ++i) {
+            name_of(name, i);
+            if (mkfile_fs(name) != 0) {
+                _exit(1);
+            }
+        }
+        _exit(0);
+    }
+    int status;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    int n = 0;
+    while (n < NFILES && exists(n)) {
+        n++;
+    }
+    CHECK(n > 0 && n < NFILES);
+    for (int i = n; i < NFILES; ++i) {
+        CHECK(!exists(i));
+    }
+    unmount_fs();
+}
+
+// Inside a batch, `fsync_fs` gives the file its blocks and leaves the commit to the batch.
+static void test_fsync_in_batch(void) {
+    format(1024);
+    begin_batch_fs();
+    int fd = open_fs("/b/s", OPEN_FS_CREATE);
+    REQUIRE(fd >= 0);
+    CHECK(append_fs(fd, "synced", 6) == 6);
+    minifs_stats_reset();
+    CHECK(fsync_fs(fd) == 0);
+    CHECK(counter(STAT_JOURNAL_COMMITS) == 0);
+    CHECK(close_fs(fd) == 0);
+    CHECK(commit_batch_fs() == 0);
+    CHECK(counter(STAT_JOURNAL_COMMITS) == 1);
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    char buf[16];
+    CHECK(read_fs("/b/s", buf, sizeof(buf)) == 6 && memcmp(buf, "synced", 6) == 0);
+    unmount_fs();
+}
+
+int main(void) {
+    test_init();
+    test_batch_is_one_transaction();
+    test_large_batch_commits_in_parts();
+    test_crash_leaves_a_prefix();
+    test_fsync_in_batch();
+    return test_done("batch");
+}
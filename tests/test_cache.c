@@ -0,0 +1,87 @@
+#include <string.h>
+
+#include "allocator.h"
+#include "cache.h"
+#include "disk.h"
+#include "fs.h"
+#include "journal.h"
+#include "stats.h"
+#include "test.h"
+
+#define CAPACITY 4
+#define NBLOCKS (5 * CAPACITY)
+
+static void fill(uint8_t* block, int i) {
+    memset(block, i + 1, BLOCK_SIZE);
+}
+
+static bool holds(int block_no, int i) {
+    uint8_t want[MAX_BLOCK_SIZE], got[MAX_BLOCK_SIZE];
+    fill(want, i);
+    read_data_block(block_no, got, BLOCK_SIZE);
+    return memcmp(want, got, BLOCK_SIZE) == 0;
+}
+
+// More blocks than the cache holds come back intact, through eviction and a remount.
+static void test_eviction(void) {
+    uint8_t block[MAX_BLOCK_SIZE];
+    for (int i = 0; i < NBLOCKS; ++i) {
+        fill(block, i);
+        write_data_block(DATA_START + i, block, BLOCK_SIZE);
+    }
+    for (int i = 0; i < NBLOCKS; ++i) {
+        CHECK(holds(DATA_START + i, i));
+    }
+    REQUIRE(flush_disk());
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    for (int i = 0; i < NBLOCKS; ++i) {
+        CHECK(holds(DATA_START + i, i));
+    }
+}
+
+// A partial write keeps the rest of the block, even once it was evicted.
+static void test_partial_write(void) {
+    int b = DATA_START + 3;
+    write_data_block(b, "ab", 2);
+    for (int i = 0; i < NBLOCKS; ++i) {
+        uint8_t block[MAX_BLOCK_SIZE];
+        read_data_block(DATA_START + i, block, BLOCK_SIZE);
+    }
+    uint8_t got[MAX_BLOCK_SIZE];
+    read_data_block(b, got, BLOCK_SIZE);
+    CHECK(got[0] == 'a' && got[1] == 'b' && got[2] == 4 && got[BLOCK_SIZE - 1] == 4);
+}
+
+// Dirty blocks reach their home only through a commit, however many there are.
+static void test_dirty_blocks_wait_for_commit(void) {
+    journal_begin();
+    minifs_stats_reset();
+    uint8_t block[MAX_BLOCK_SIZE];
+    for (int i = 0; i < NBLOCKS; ++i) {
+        fill(block, NBLOCKS - i);
+        write_data_block(DATA_START + i, block, BLOCK_SIZE);
+    }
+    MinifsStats stats;
+    minifs_stats(&stats);
+    CHECK(stats.counters[STAT_DISK_WRITES] == 0);
+    CHECK(cache_dirty_blocks() == NBLOCKS);
+    CHECK(journal_end());
+    CHECK(cache_dirty_blocks() == 0);
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    for (int i = 0; i < NBLOCKS; ++i) {
+        CHECK(holds(DATA_START + i, NBLOCKS - i));
+    }
+}
+
+int main(void) {
+    test_init();
+    set_cache_capacity(CAPACITY);
+    mkfs(TEST_IMAGE);
+    test_eviction();
+    test_partial_write();
+    test_dirty_blocks_wait_for_commit();
+    unmount_fs();
+    return test_done("cache");
+}
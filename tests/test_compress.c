@@ -0,0 +1,194 @@
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "extent.h"
+#include "file.h"
+#include "fs.h"
+#include "fsck.h"
+#include "inode.h"
+#include "path.h"
+#include "test.h"
+
+#define CHUNK COMPRESS_CHUNK_BYTES
+// Five whole chunks and a partial one.
+#define TEXT_BYTES (5 * CHUNK + 1000)
+
+static char text[TEXT_BYTES + 1];
+static char noise[2 * CHUNK + 1];
+// What the file under test should hold, with room for it to grow.
+static char model[8 * CHUNK];
+static char buf[8 * CHUNK];
+
+// Compresses well, and has no zero byte, so `write_fs` takes it whole.
+static void fill_text(char* s, size_t n) {
+    static const char* words[] = {"alpha ", "beta ", "gamma ", "delta\n", "epsilon "};
+    for (size_t k = 0; k < n;) {
+        const char* w = words[(k / 7) % 5];
+        for (size_t j = 0; w[j] && k < n; ++j) {
+            s[k++] = w[j];
+        }
+    }
+    s[n] = '\0';
+}
+
+// Doesn't compress.
+static void fill_noise(char* s, size_t n) {
+    uint32_t x = 12345;
+    for (size_t k = 0; k < n; ++k) {
+        x = x * 1103515245 + 12345;
+        s[k] = (char)(1 + (x >> 16) % 255);
+    }
+    s[n] = '\0';
+}
+
+static size_t runs_of(const char* path, Extent* extents) {
+    Inode inode = inode_at(path);
+    return extent_list(&inode, extents);
+}
+
+static bool reads_back(const char* path, const char* want, size_t n) {
+    return read_fs(path, buf, sizeof(buf)) == (int)n && memcmp(buf, want, n) == 0;
+}
+
+// Each chunk of compressible data gets a run of its own, compressed.
+static void test_chunks(Extent* extents) {
+    REQUIRE(write_fs("/c", text) == TEXT_BYTES);
+    Inode inode = inode_at("/c");
+    CHECK(inode_is_compressed(inode));
+    size_t n = extent_list(&inode, extents);
+    CHECK(n == 6);
+    for (size_t c = 0; c < n; ++c) {
+        CHECK(extents[c].csize > 0 && extents[c].csize < CHUNK / 2);
+        CHECK((size_t)extents[c].len * BLOCK_SIZE < CHUNK / 2);
+    }
+    CHECK(reads_back("/c", text, TEXT_BYTES));
+}
+
+// Chunks that don't compress are kept raw, beside those that do.
+static void test_mixed(Extent* extents) {
+    memcpy(model, text, 2 * CHUNK);
+    memcpy(model + 2 * CHUNK, noise, 2 * CHUNK);
+    model[4 * CHUNK] = '\0';
+    REQUIRE(write_fs("/m", model) == 4 * CHUNK);
+    Inode inode = inode_at("/m");
+    CHECK(inode_is_compressed(inode));
+    CHECK(extent_list(&inode, extents) == 4);
+    CHECK(extents[0].csize > 0 && extents[1].csize > 0);
+    CHECK(extents[2].csize == 0 && extents[3].csize == 0);
+    int fd = open_fs("/m", 0);
+    REQUIRE(fd >= 0);
+    // Across the boundaries between chunks stored either way.
+    size_t offsets[] = {CHUNK - 7, 2 * CHUNK - 300, 3 * CHUNK - 1, 3 * CHUNK + 513};
+    for (size_t i = 0; i < sizeof(offsets) / sizeof(offsets[0]); ++i) {
+        size_t n = 1500;
+        if (offsets[i] + n > 4 * CHUNK) {
+            n = 4 * CHUNK - offsets[i];
+        }
+        CHECK(pread_fs(fd, buf, n, offsets[i]) == (int)n);
+        CHECK(memcmp(buf, model + offsets[i], n) == 0);
+    }
+    close_fs(fd);
+
+    // A file where no chunk compresses is stored raw.
+    REQUIRE(write_fs("/r", noise) == 2 * CHUNK);
+    inode = inode_at("/r");
+    CHECK(!inode_is_compressed(inode));
+    CHECK(reads_back("/r", noise, 2 * CHUNK));
+}
+
+// A read decompresses only the chunks it touches: one damaged chunk spoils no other.
+static void test_damaged_chunk(Extent* extents) {
+    REQUIRE(write_fs("/p", text) == TEXT_BYTES);
+    REQUIRE(runs_of("/p", extents) == 6);
+    uint32_t block_size = BLOCK_SIZE;
+    unmount_fs();
+    int fd = open(TEST_IMAGE, O_RDWR);
+    REQUIRE(fd >= 0);
+    char junk[16];
+    memset(junk, 0xFF, sizeof(junk));
+    REQUIRE(pwrite(fd, junk, sizeof(junk), (off_t)extents[0].start * block_size) == sizeof(junk));
+    close(fd);
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    fd = open_fs("/p", 0);
+    REQUIRE(fd >= 0);
+    CHECK(pread_fs(fd, buf, 4000, 3 * CHUNK + 100) == 4000);
+    CHECK(memcmp(buf, text + 3 * CHUNK + 100, 4000) == 0);
+    CHECK(pread_fs(fd, buf, 100, 100) == 0);
+    close_fs(fd);
+    CHECK(delete_fs("/p") == 0);
+}
+
+// Writes through a handle rewrite only the chunks they change, and the file stays compressed.
+static void test_writes(Extent* extents) {
+    Extent before[8];
+    REQUIRE(runs_of("/c", before) == 6);
+    memcpy(model, text, TEXT_BYTES);
+    size_t size = TEXT_BYTES;
+    int fd = open_fs("/c", 0);
+    REQUIRE(fd >= 0);
+
+    CHECK(pwrite_fs(fd, "0123456789", 10, 2 * CHUNK + 5) == 10);
+    memcpy(model + 2 * CHUNK + 5, "0123456789", 10);
+    CHECK(runs_of("/c", extents) == 6);
+    for (size_t c = 0; c < 6; ++c) {
+        CHECK((extents[c].start == before[c].start) == (c != 2));
+    }
+
+    // Appends are held, then flushed into the last chunk and a new one.
+    fill_text(model + size, CHUNK);
+    CHECK(append_fs(fd, model + size, CHUNK) == CHUNK);
+    size += CHUNK;
+    CHECK(fsync_fs(fd) == 0);
+    Inode inode = inode_at("/c");
+    CHECK(inode_is_compressed(inode) && inode.size == size);
+    CHECK(runs_of("/c", extents) == 7);
+    CHECK(pread_fs(fd, buf, sizeof(buf), 0) == (int)size && memcmp(buf, model, size) == 0);
+
+    // Shrinking rewrites the chunk the end falls in; growing adds zeros.
+    CHECK(truncate_fs(fd, 2 * CHUNK + 100) == 0);
+    CHECK(runs_of("/c", extents) == 3);
+    CHECK(truncate_fs(fd, 3 * CHUNK + 10) == 0);
+    memset(model + 2 * CHUNK + 100, 0, CHUNK - 90);
+    size = 3 * CHUNK + 10;
+    CHECK(runs_of("/c", extents) == 4);
+    CHECK(pread_fs(fd, buf, sizeof(buf), 0) == (int)size && memcmp(buf, model, size) == 0);
+    close_fs(fd);
+    inode = inode_at("/c");
+    CHECK(inode_is_compressed(inode));
+
+    // Small enough to move into the inode.
+    fd = open_fs("/m", 0);
+    REQUIRE(fd >= 0);
+    CHECK(truncate_fs(fd, 50) == 0);
+    close_fs(fd);
+    inode = inode_at("/m");
+    CHECK(inode_is_inline(inode) && !inode_is_compressed(inode));
+    CHECK(reads_back("/m", text, 50));
+}
+
+int main(void) {
+    test_init();
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 8192, .max_inodes = 128, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    set_file_compression(true);
+    fill_text(text, TEXT_BYTES);
+    fill_noise(noise, 2 * CHUNK);
+    Extent* extents = alloc_extent_list();
+    test_chunks(extents);
+    test_mixed(extents);
+    test_damaged_chunk(extents);
+    test_writes(extents);
+    free(extents);
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    CHECK(reads_back("/c", model, 3 * CHUNK + 10));
+    CHECK(reads_back("/r", noise, 2 * CHUNK));
+    unmount_fs();
+    FsckOptions opts = {.nthreads = 1, .repair = false, .out = stderr};
+    FsckReport report;
+    CHECK(fsck_fs(TEST_IMAGE, &opts, &report) == 0 && report.problems == 0);
+    return test_done("compress");
+}
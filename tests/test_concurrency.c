@@ -0,0 +1,111 @@
+#include <pthread.h>
+#include <stdint.h>
+#include <string.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fsck.h"
+#include "test.h"
+
+#define NTHREADS 8
+#define NFILES 60
+#define PIECE 100
+#define NPIECES 200
+
+static DirectoryEntry entries[NTHREADS * NFILES + 16];
+
+static void shared_name(char* name, int t, int i) {
+    snprintf(name, 32, "/shared/t%d_%d", t, i);
+}
+
+// Byte `k` of thread `t`'s own file.
+static char own_byte(int t, size_t k) {
+    return (char)('a' + (t * 7 + k / PIECE) % 26);
+}
+
+// Creates, reads and deletes in the shared directory, and writes a file of its own.
+static void* worker(void* arg) {
+    int t = (int)(intptr_t)arg;
+    char name[32], data[32], buf[64];
+    for (int i = 0; i < NFILES; ++i) {
+        shared_name(name, t, i);
+        snprintf(data, sizeof(data), "%d:%d", t, i);
+        CHECK(write_fs(name, data) == (int)strlen(data));
+        CHECK(read_fs(name, buf, sizeof(buf)) == (int)strlen(data));
+        CHECK(memcmp(buf, data, strlen(data)) == 0);
+    }
+    for (int i = 0; i < NFILES; i += 3) {
+        shared_name(name, t, i);
+        CHECK(delete_fs(name) == 0);
+    }
+
+    snprintf(name, sizeof(name), "/own%d", t);
+    int fd = open_fs(name, OPEN_FS_CREATE);
+    REQUIRE(fd >= 0);
+    char piece[PIECE];
+    for (size_t p = 0; p < NPIECES; ++p) {
+        memset(piece, own_byte(t, p * PIECE), PIECE);
+        CHECK(append_fs(fd, piece, PIECE) == PIECE);
+        if (p % 50 == 49) {
+            CHECK(fsync_fs(fd) == 0);
+        }
+    }
+    for (size_t k = 0; k < NPIECES * PIECE; k += 997) {
+        CHECK(pread_fs(fd, buf, 1, k) == 1 && buf[0] == own_byte(t, k));
+    }
+    CHECK(close_fs(fd) == 0);
+    return NULL;
+}
+
+static bool holds_everything(void) {
+    bool ok = true;
+    char name[32], want[32], buf[64];
+    for (int t = 0; t < NTHREADS; ++t) {
+        for (int i = 0; i < NFILES; ++i) {
+            shared_name(name, t, i);
+            int n = read_fs(name, buf, sizeof(buf));
+            snprintf(want, sizeof(want), "%d:%d", t, i);
+            ok &= i % 3 == 0 ? n == -1 : n == (int)strlen(want) && !memcmp(buf, want, n);
+        }
+        snprintf(name, sizeof(name), "/own%d", t);
+        int fd = open_fs(name, 0);
+        REQUIRE(fd >= 0);
+        static char file[NPIECES * PIECE + 1];
+        ok &= pread_fs(fd, file, sizeof(file), 0) == NPIECES * PIECE;
+        for (size_t k = 0; k < NPIECES * PIECE; ++k) {
+            ok &= file[k] == own_byte(t, k);
+        }
+        CHECK(close_fs(fd) == 0);
+    }
+    return ok;
+}
+
+int main(void) {
+    test_init();
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 8192, .max_inodes = 1024, .journal_blocks = 256};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    REQUIRE(mkdir_fs("/shared") == 0);
+    int before = ls_fs("/shared", entries, sizeof(entries) / sizeof(entries[0]));
+    REQUIRE(before >= 0);
+
+    pthread_t threads[NTHREADS];
+    for (int t = 0; t < NTHREADS; ++t) {
+        REQUIRE(pthread_create(&threads[t], NULL, worker, (void*)(intptr_t)t) == 0);
+    }
+    for (int t = 0; t < NTHREADS; ++t) {
+        pthread_join(threads[t], NULL);
+    }
+    int kept = NTHREADS * (NFILES - (NFILES + 2) / 3);
+    CHECK(ls_fs("/shared", entries, sizeof(entries) / sizeof(entries[0])) == before + kept);
+    CHECK(holds_everything());
+
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    CHECK(ls_fs("/shared", entries, sizeof(entries) / sizeof(entries[0])) == before + kept);
+    CHECK(holds_everything());
+    unmount_fs();
+    FsckOptions opts = {.nthreads = 1, .repair = false, .out = stderr};
+    CHECK(fsck_fs(TEST_IMAGE, &opts, NULL) == 0);
+    return test_done("concurrency");
+}
@@ -0,0 +1,95 @@
+#include "dcache.h"
+#include "disk.h"
+#include "fs.h"
+#include "path.h"
+#include "stats.h"
+#include "test.h"
+#include "tree.h"
+
+static uint64_t counter(StatCounter c) {
+    MinifsStats stats;
+    minifs_stats(&stats);
+    return stats.counters[c];
+}
+
+static int inode_no_of(const char* path) {
+    int inode_no;
+    return get_inode_no_from_path(path, &inode_no) == 0 ? inode_no : -1;
+}
+
+// A name looked up before it exists is cached as absent, until it is created or removed again.
+static void test_negative_entries(void) {
+    REQUIRE(mkdir_fs("/d") == 0);
+    int dir = inode_no_of("/d");
+    int cached;
+    CHECK(inode_no_of("/d/n") == -1);
+    CHECK(dcache_lookup(dir, "n", &cached) == 0);
+    CHECK(mkfile_fs("/d/n") == 0);
+    int file = inode_no_of("/d/n");
+    CHECK(file > 0);
+    CHECK(dcache_lookup(dir, "n", &cached) == 1 && cached == file);
+    CHECK(delete_fs("/d/n") == 0);
+    CHECK(dcache_lookup(dir, "n", &cached) == 0);
+    CHECK(inode_no_of("/d/n") == -1);
+}
+
+// Repeated lookups are served from the cache, one hit per path component.
+static void test_hits(void) {
+    CHECK(mkfile_fs("/d/h") == 0);
+    int file = inode_no_of("/d/h");
+    minifs_stats_reset();
+    for (int i = 0; i < 10; ++i) {
+        CHECK(inode_no_of("/d/h") == file);
+    }
+    CHECK(counter(STAT_DCACHE_HITS) == 20);
+    CHECK(counter(STAT_DCACHE_MISSES) == 0);
+}
+
+// Nothing cached under a removed directory survives it, even when its number comes back.
+static void test_removed_directories(void) {
+    REQUIRE(mkdir_fs("/x") == 0);
+    int dir = inode_no_of("/x");
+    CHECK(mkfile_fs("/x/a") == 0);
+    CHECK(inode_no_of("/x/a") > 0);
+    CHECK(inode_no_of("/x/ghost") == -1);
+    CHECK(delete_fs("/x/a") == 0);
+    CHECK(rmdir_fs("/x") == 0);
+    int cached;
+    CHECK(dcache_lookup(dir, "a", &cached) == -1);
+    CHECK(dcache_lookup(dir, "ghost", &cached) == -1);
+    CHECK(inode_no_of("/x/a") == -1);
+    REQUIRE(mkdir_fs("/y") == 0);
+    CHECK(inode_no_of("/y") == dir);
+    CHECK(inode_no_of("/y/a") == -1);
+    CHECK(mkfile_fs("/y/ghost") == 0 && inode_no_of("/y/ghost") > 0);
+
+    // A whole tree removed at once.
+    REQUIRE(mkdir_fs("/t") == 0 && mkdir_fs("/t/s") == 0 && mkfile_fs("/t/s/f") == 0);
+    int top = inode_no_of("/t");
+    int sub = inode_no_of("/t/s");
+    CHECK(inode_no_of("/t/s/f") > 0 && inode_no_of("/t/s/none") == -1);
+    CHECK(rm_tree_fs("/t", 1) == 0);
+    CHECK(dcache_lookup(top, "s", &cached) == -1);
+    CHECK(dcache_lookup(sub, "f", &cached) == -1);
+    CHECK(dcache_lookup(sub, "none", &cached) == -1);
+    CHECK(inode_no_of("/t/s/f") == -1);
+}
+
+int main(void) {
+    test_init();
+    set_dcache_capacity(DEFAULT_DCACHE_CAPACITY);
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 2048, .max_inodes = 128, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    test_negative_entries();
+    test_hits();
+    test_removed_directories();
+    // A remount starts with nothing cached.
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    int cached;
+    CHECK(dcache_lookup(0, "d", &cached) == -1);
+    CHECK(inode_no_of("/d/h") > 0 && inode_no_of("/y/ghost") > 0);
+    unmount_fs();
+    return test_done("dcache");
+}
@@ -0,0 +1,127 @@
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "extent.h"
+#include "file.h"
+#include "fs.h"
+#include "fsck.h"
+#include "inode.h"
+#include "path.h"
+#include "stats.h"
+#include "test.h"
+
+#define PIECE 1000
+#define NPIECES 40
+
+static char piece[PIECE];
+static char buf[NPIECES * PIECE];
+
+static uint64_t disk_writes(void) {
+    MinifsStats stats;
+    minifs_stats(&stats);
+    return stats.counters[STAT_DISK_WRITES];
+}
+
+static bool holds_pieces(int fd, size_t npieces, char first) {
+    if (pread_fs(fd, buf, sizeof(buf), 0) != (int)(npieces * PIECE)) {
+        return false;
+    }
+    for (size_t i = 0; i < npieces; ++i) {
+        char* p = buf + i * PIECE;
+        if (p[0] != (char)(first + i % 26) || p[PIECE - 1] != p[0]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void append_piece(int fd, char c) {
+    memset(piece, c, PIECE);
+    CHECK(append_fs(fd, piece, PIECE) == PIECE);
+}
+
+/*
+ * Appends to two files at once are held in memory: nothing reaches
+ * the disk and their sizes on disk stay 0, yet reads see every byte.
+ * Flushed, each file gets one run instead of interleaved blocks.
+ */
+static void test_interleaved_appends(void) {
+    int a = open_fs("/a", OPEN_FS_CREATE);
+    int b = open_fs("/b", OPEN_FS_CREATE);
+    REQUIRE(a >= 0 && b >= 0);
+    CHECK(fsync_fs(a) == 0);
+    uint64_t writes = disk_writes();
+    for (int i = 0; i < NPIECES; ++i) {
+        append_piece(a, (char)('a' + i % 26));
+        append_piece(b, (char)('A' + i % 26));
+    }
+    CHECK(disk_writes() == writes);
+    CHECK(inode_at("/a").size == 0 && inode_at("/b").size == 0);
+    CHECK(holds_pieces(a, NPIECES, 'a') && holds_pieces(b, NPIECES, 'A'));
+    CHECK(fsync_fs(a) == 0 && fsync_fs(b) == 0);
+    Inode ia = inode_at("/a");
+    Inode ib = inode_at("/b");
+    CHECK(ia.size == NPIECES * PIECE && ib.size == NPIECES * PIECE);
+    CHECK(ia.nextents == 1 && ib.nextents == 1);
+    CHECK(holds_pieces(a, NPIECES, 'a') && holds_pieces(b, NPIECES, 'A'));
+    CHECK(close_fs(a) == 0 && close_fs(b) == 0);
+}
+
+// Past the per-file cap, the writer flushes its own file.
+static void test_cap(void) {
+    int fd = open_fs("/big", OPEN_FS_CREATE);
+    REQUIRE(fd >= 0);
+    static char chunk[64 << 10];
+    memset(chunk, 'z', sizeof(chunk));
+    size_t total = 0;
+    while (total <= MAX_DELAYED_FILE_BYTES) {
+        CHECK(append_fs(fd, chunk, sizeof(chunk)) == (int)sizeof(chunk));
+        total += sizeof(chunk);
+    }
+    CHECK(inode_at("/big").size > 0);
+    CHECK(close_fs(fd) == 0);
+    CHECK(delete_fs("/big") == 0);
+}
+
+static void crash_with_appends(void) {
+    if (mount_fs(TEST_IMAGE) != 0) {
+        _exit(1);
+    }
+    int fd = open_fs("/a", 0);
+    append_piece(fd, '!');
+    _exit(test_failures > 0);
+}
+
+// A size that was never synced is not on disk after a crash, so no stale block shows through.
+static void test_crash(void) {
+    unmount_fs();
+    pid_t pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0) {
+        crash_with_appends();
+    }
+    int status;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    int fd = open_fs("/a", 0);
+    REQUIRE(fd >= 0);
+    CHECK(inode_at("/a").size == NPIECES * PIECE && holds_pieces(fd, NPIECES, 'a'));
+    CHECK(close_fs(fd) == 0);
+}
+
+int main(void) {
+    test_init();
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 8192, .max_inodes = 128, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    test_interleaved_appends();
+    test_cap();
+    test_crash();
+    unmount_fs();
+    FsckOptions opts = {.nthreads = 1, .repair = false, .out = stderr};
+    CHECK(fsck_fs(TEST_IMAGE, &opts, NULL) == 0);
+    return test_done("delayed");
+}
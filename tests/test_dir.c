@@ -0,0 +1,105 @@
+#include <string.h>
+
+#include "dcache.h"
+#include "dir.h"
+#include "disk.h"
+#include "fs.h"
+#include "inode.h"
+#include "journal.h"
+#include "path.h"
+#include "test.h"
+
+#define NAMES 6000
+
+static bool present[NAMES];
+
+static DirectoryEntry entry(int i) {
+    DirectoryEntry e = {0};
+    e.inode_number = 1000 + i;
+    snprintf(e.name, sizeof(e.name), "name_%d", i);
+    return e;
+}
+
+static bool is_indexed(int inode_no) {
+    Inode inode;
+    return read_inode(inode_no, &inode) == 1 && inode_is_indexed(inode);
+}
+
+// Each change in a handle of its own, as the filesystem calls make them.
+static int add(int dir, int i) {
+    journal_begin();
+    int rc = add_dirent(dir, entry(i));
+    journal_end_nowait();
+    return rc;
+}
+
+static int remove_name(int dir, int i) {
+    journal_begin();
+    int rc = remove_dirent(dir, entry(i).name);
+    journal_end_nowait();
+    return rc;
+}
+
+static bool lookups_match(int dir) {
+    for (int i = 0; i < NAMES; ++i) {
+        int inode_no;
+        int rc = lookup_dirent(dir, entry(i).name, &inode_no);
+        if ((rc == 0) != present[i] || (rc == 0 && inode_no != 1000 + i)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * A directory stays linear up to LINEAR_DIR_MAX_BLOCKS blocks, then
+ * is converted to the hashed index, whose leaves and interior blocks
+ * split as it grows. Random adds and removals afterwards keep every
+ * name reachable, through a remount.
+ */
+static void test_index_splits(int dir) {
+    size_t linear_max = LINEAR_DIR_MAX_BLOCKS * DIRENTS_PER_BLOCK;
+    for (int i = 0; i < NAMES; ++i) {
+        REQUIRE(add(dir, i) == 0);
+        present[i] = true;
+        if ((size_t)i + 1 == linear_max) {
+            CHECK(!is_indexed(dir));
+        }
+    }
+    CHECK(is_indexed(dir));
+    CHECK(add(dir, 0) != 0);
+    CHECK(lookups_match(dir));
+
+    srand(1);
+    for (int r = 0; r < 2 * NAMES; ++r) {
+        int i = rand() % NAMES;
+        CHECK((present[i] ? remove_name(dir, i) : add(dir, i)) == 0);
+        present[i] = !present[i];
+    }
+    REQUIRE(flush_disk());
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    CHECK(lookups_match(dir));
+    Inode inode;
+    read_inode(dir, &inode);
+    size_t n = 0;
+    for (int i = 0; i < NAMES; ++i) {
+        n += present[i];
+    }
+    CHECK(inode.size == n);
+}
+
+int main(void) {
+    test_init();
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 8192, .max_inodes = 128, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    // Lookups must go to the directory blocks.
+    set_dcache_capacity(0);
+    REQUIRE(mkdir_fs("/d") == 0);
+    int dir;
+    REQUIRE(get_inode_no_from_path("/d", &dir) == 0);
+    test_index_splits(dir);
+    unmount_fs();
+    return test_done("dir");
+}
@@ -0,0 +1,105 @@
+#include <string.h>
+
+#include "allocator.h"
+#include "disk.h"
+#include "fs.h"
+#include "test.h"
+
+// More than a ring holds, so a batch takes several submissions.
+#define NREQS 200
+#define PIECE 512
+
+static uint8_t bufs[NREQS][2][PIECE];
+static struct iovec iovs[NREQS][2];
+static DiskIoReq reqs[NREQS];
+static off_t base;
+
+static const char* mode_name(DiskMode mode) {
+    return mode == DISK_MODE_MMAP ? "mmap" : mode == DISK_MODE_URING ? "io_uring" : "pread";
+}
+
+// Each request moves two pieces, scattered in memory, to or from its own spot on disk.
+static void prepare(DiskIoOp op, int seed) {
+    for (size_t i = 0; i < NREQS; ++i) {
+        for (int k = 0; k < 2; ++k) {
+            memset(bufs[i][k], op == DISK_IO_WRITE ? (int)(i * 2 + k + seed) & 0xFF : 0, PIECE);
+            iovs[i][k] = (struct iovec){.iov_base = bufs[i][k], .iov_len = PIECE};
+        }
+        // Every other request, going backwards, so the batch is not one sequential run.
+        size_t slot = i % 2 ? NREQS - i : i;
+        reqs[i] = (DiskIoReq){
+            .op = op, .iov = iovs[i], .iovcnt = 2, .offset = base + (off_t)slot * 2 * PIECE};
+    }
+}
+
+static bool holds(int seed) {
+    bool ok = true;
+    for (size_t i = 0; i < NREQS; ++i) {
+        ok &= reqs[i].result == 2 * PIECE;
+        for (int k = 0; k < 2; ++k) {
+            for (size_t j = 0; j < PIECE; ++j) {
+                ok &= bufs[i][k][j] == ((i * 2 + k + seed) & 0xFF);
+            }
+        }
+    }
+    return ok;
+}
+
+// A batch written in one mode reads back in the same mode, and in every other after a remount.
+static void test_batches(DiskMode mode, int seed) {
+    set_disk_mode(mode);
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    // Well past the blocks the filesystem itself uses.
+    base = (off_t)(DATA_START + 1024) * BLOCK_SIZE;
+    prepare(DISK_IO_WRITE, seed);
+    CHECK(submit_disk_io(reqs, NREQS) == NREQS);
+    prepare(DISK_IO_READ, seed);
+    CHECK(submit_disk_io(reqs, NREQS) == NREQS);
+    if (!holds(seed)) {
+        fprintf(stderr, "%s: batch did not read back\n", mode_name(mode));
+        test_failures++;
+    }
+    REQUIRE(flush_disk());
+    unmount_fs();
+    DiskMode modes[] = {DISK_MODE_PREAD, DISK_MODE_MMAP, DISK_MODE_URING};
+    for (size_t m = 0; m < 3; ++m) {
+        set_disk_mode(modes[m]);
+        REQUIRE(mount_fs(TEST_IMAGE) == 0);
+        prepare(DISK_IO_READ, seed);
+        CHECK(submit_disk_io(reqs, NREQS) == NREQS);
+        if (!holds(seed)) {
+            fprintf(stderr, "%s: %s batch lost\n", mode_name(modes[m]), mode_name(mode));
+            test_failures++;
+        }
+        unmount_fs();
+    }
+}
+
+// A request past the end of the disk fails the batch before any of it is issued.
+static void test_out_of_range(void) {
+    set_disk_mode(DISK_MODE_URING);
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    prepare(DISK_IO_WRITE, 99);
+    reqs[NREQS - 1].offset = (off_t)disk_size() - PIECE;
+    CHECK(submit_disk_io(reqs, NREQS) == 0);
+    unmount_fs();
+    set_disk_mode(DISK_MODE_PREAD);
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    prepare(DISK_IO_READ, 99);
+    CHECK(submit_disk_io(reqs, NREQS - 1) == NREQS - 1);
+    CHECK(!holds(99));
+    unmount_fs();
+}
+
+int main(void) {
+    test_init();
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 4096, .max_inodes = 128, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    unmount_fs();
+    test_batches(DISK_MODE_PREAD, 1);
+    test_batches(DISK_MODE_MMAP, 2);
+    test_batches(DISK_MODE_URING, 3);
+    test_out_of_range();
+    return test_done("disk");
+}
@@ -0,0 +1,98 @@
+#include <string.h>
+
+#include "allocator.h"
+#include "dir.h"
+#include "disk.h"
+#include "extent.h"
+#include "fs.h"
+#include "fsck.h"
+#include "inode.h"
+#include "path.h"
+#include "test.h"
+
+static char contents[3000];
+
+static void populate(void) {
+    memset(contents, 'z', sizeof(contents) - 1);
+    char path[64];
+    for (int d = 0; d < 4; ++d) {
+        snprintf(path, sizeof(path), "/d%d", d);
+        REQUIRE(mkdir_fs(path) == 0);
+        for (int i = 0; i < 8; ++i) {
+            snprintf(path, sizeof(path), "/d%d/g%d", d, i);
+            REQUIRE(write_fs(path, contents) == (int)sizeof(contents) - 1);
+        }
+    }
+}
+
+static int inode_of(const char* path) {
+    int inode_no = -1;
+    get_inode_no_from_path(path, &inode_no);
+    return inode_no;
+}
+
+static FsckReport check(bool repair) {
+    FsckOptions opts = {.nthreads = 2, .repair = repair, .out = NULL};
+    FsckReport report;
+    int rc = fsck_fs(TEST_IMAGE, &opts, &report);
+    REQUIRE(rc >= 0);
+    CHECK((size_t)rc == report.problems - report.repaired);
+    return report;
+}
+
+int main(void) {
+    test_init();
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 8192, .max_inodes = 512, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    populate();
+    unmount_fs();
+    FsckReport report = check(false);
+    CHECK(report.problems == 0);
+    CHECK(report.dirs == 5);
+    CHECK(report.inodes == 5 + 32);
+
+    // One of each problem a repair can fix.
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    int leaked = alloc_block();
+    Inode inode;
+    read_inode(inode_of("/d0/g0"), &inode);
+    int unmarked = extent_map_block(&inode, 0);
+    free_block(unmarked);
+    int orphan = alloc_inode();
+    DirectoryEntry ghost = {.inode_number = 400};
+    strcpy(ghost.name, "ghost");
+    REQUIRE(add_dirent(0, ghost) == 0);
+    int grown = inode_of("/d1/g1");
+    read_inode(grown, &inode);
+    inode.size += 5000;
+    write_inode(grown, inode);
+    int cut_off = inode_of("/d2");
+    REQUIRE(remove_dirent(0, "d2") == 0);
+    unmount_fs();
+    REQUIRE(leaked >= 0 && orphan >= 0);
+
+    report = check(false);
+    CHECK(report.problems >= 6);
+    CHECK(report.repaired == 0);
+    report = check(true);
+    CHECK(report.repaired == report.problems);
+    report = check(false);
+    CHECK(report.problems == 0);
+
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    char path[64];
+    snprintf(path, sizeof(path), "/lost+found/#%d", orphan);
+    CHECK(inode_of(path) == orphan);
+    snprintf(path, sizeof(path), "/lost+found/#%d/g3", cut_off);
+    char buf[sizeof(contents)];
+    CHECK(read_fs(path, buf, sizeof(buf)) == (int)sizeof(contents) - 1);
+    CHECK(inode_of("/ghost") < 0);
+    // Cut back to the blocks the file has.
+    read_inode(grown, &inode);
+    CHECK(inode.size == 3 * BLOCK_SIZE);
+    CHECK(!block_is_free(unmarked));
+    CHECK(block_is_free(leaked));
+    unmount_fs();
+    return test_done("fsck");
+}
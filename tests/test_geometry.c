@@ -0,0 +1,92 @@
+#include <string.h>
+
+#include "disk.h"
+#include "file.h"
+#include "fs.h"
+#include "fsck.h"
+#include "test.h"
+
+// Spans several 64 KiB blocks and compression chunks, and ends partway into both.
+#define DATA_BYTES (200 * 1024 + 123)
+#define NDIR_FILES 100
+
+static char data[DATA_BYTES + 1];
+static char buf[DATA_BYTES + 1];
+
+// Compresses well, and has no zero byte, so `write_fs` takes it whole.
+static void fill(size_t seed) {
+    for (size_t k = 0; k < DATA_BYTES; ++k) {
+        data[k] = (char)('a' + (k / 100 + seed) % 26);
+    }
+    data[DATA_BYTES] = '\0';
+}
+
+static void populate(void) {
+    CHECK(mkdir_fs("/d") == 0);
+    char name[32];
+    for (int i = 0; i < NDIR_FILES; ++i) {
+        snprintf(name, sizeof(name), "/d/f%d", i);
+        CHECK(write_fs(name, name) == (int)strlen(name));
+    }
+    CHECK(write_fs("/big", data) == DATA_BYTES);
+    // Unaligned writes through a handle, across block boundaries.
+    int fd = open_fs("/h", OPEN_FS_CREATE);
+    REQUIRE(fd >= 0);
+    for (size_t at = 0; at < DATA_BYTES; at += 7001) {
+        size_t n = DATA_BYTES - at < 7001 ? DATA_BYTES - at : 7001;
+        CHECK(pwrite_fs(fd, data + at, n, at) == (int)n);
+    }
+    CHECK(close_fs(fd) == 0);
+}
+
+static bool holds_everything(void) {
+    bool ok = true;
+    char name[32];
+    for (int i = 0; i < NDIR_FILES; ++i) {
+        snprintf(name, sizeof(name), "/d/f%d", i);
+        int n = read_fs(name, buf, sizeof(buf));
+        ok &= n == (int)strlen(name) && memcmp(buf, name, n) == 0;
+    }
+    ok &= read_fs("/big", buf, sizeof(buf)) == DATA_BYTES && !memcmp(buf, data, DATA_BYTES);
+    ok &= read_fs("/h", buf, sizeof(buf)) == DATA_BYTES && !memcmp(buf, data, DATA_BYTES);
+    return ok;
+}
+
+// Formats, fills, remounts and checks an image with blocks of `block_size`.
+static void test_block_size(uint32_t block_size, bool compress) {
+    FsGeometry geometry = {
+        .block_size = block_size,
+        // 8 MiB of image, with at least a few hundred blocks.
+        .num_blocks = block_size < 16384 ? (8 << 20) / block_size : 512,
+        .max_inodes = 256,
+        .journal_blocks = 0,
+    };
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    set_file_compression(compress);
+    fill(block_size + compress);
+    populate();
+    CHECK(inode_is_compressed(inode_at("/big")) == compress);
+    CHECK(holds_everything());
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    CHECK(BLOCK_SIZE == block_size);
+    if (!holds_everything()) {
+        fprintf(stderr, "%u-byte blocks%s: contents lost\n", block_size,
+                compress ? ", compressed" : "");
+        test_failures++;
+    }
+    unmount_fs();
+    set_file_compression(false);
+    FsckOptions opts = {.nthreads = 1, .repair = false, .out = stderr};
+    FsckReport report;
+    CHECK(fsck_fs(TEST_IMAGE, &opts, &report) == 0 && report.problems == 0);
+}
+
+int main(void) {
+    test_init();
+    test_block_size(MIN_BLOCK_SIZE, false);
+    test_block_size(MIN_BLOCK_SIZE, true);
+    test_block_size(MAX_BLOCK_SIZE, false);
+    test_block_size(MAX_BLOCK_SIZE, true);
+    return test_done("geometry");
+}
@@ -0,0 +1,125 @@
+#include <string.h>
+
+#include "disk.h"
+#include "file.h"
+#include "fs.h"
+#include "fsck.h"
+#include "test.h"
+
+#define MODEL_BYTES (64 << 10)
+
+// What the file under test should hold.
+static char model[MODEL_BYTES];
+static size_t model_size;
+static char buf[MODEL_BYTES];
+
+static bool matches_model(int fd) {
+    return pread_fs(fd, buf, sizeof(buf), 0) == (int)model_size &&
+           memcmp(buf, model, model_size) == 0;
+}
+
+static void model_write(size_t offset, const char* data, size_t nbytes) {
+    if (offset > model_size) {
+        memset(model + model_size, 0, offset - model_size);
+    }
+    memcpy(model + offset, data, nbytes);
+    if (offset + nbytes > model_size) {
+        model_size = offset + nbytes;
+    }
+}
+
+static void test_open_close(void) {
+    CHECK(open_fs("/none", 0) == -1);
+    int a = open_fs("/a", OPEN_FS_CREATE);
+    int b = open_fs("/b", OPEN_FS_CREATE);
+    REQUIRE(a >= 0 && b >= 0 && a != b);
+    CHECK(close_fs(a) == 0);
+    CHECK(close_fs(a) == -1);
+    CHECK(close_fs(-1) == -1 && close_fs(MAX_OPEN_FILES) == -1);
+    CHECK(pread_fs(a, buf, 1, 0) == -1);
+    // The lowest free descriptor comes back.
+    CHECK(open_fs("/a", 0) == a);
+    // An open file can't be deleted.
+    CHECK(delete_fs("/b") == -1);
+    CHECK(close_fs(b) == 0);
+    CHECK(delete_fs("/b") == 0);
+    CHECK(close_fs(a) == 0);
+}
+
+static void test_descriptor_limit(void) {
+    static int fds[MAX_OPEN_FILES];
+    for (int i = 0; i < MAX_OPEN_FILES; ++i) {
+        fds[i] = open_fs("/a", 0);
+        CHECK(fds[i] >= 0);
+    }
+    CHECK(open_fs("/a", 0) == -1);
+    for (int i = 0; i < MAX_OPEN_FILES; ++i) {
+        CHECK(close_fs(fds[i]) == 0);
+    }
+}
+
+// Random writes, appends and truncates agree with a plain array.
+static void test_against_model(void) {
+    int fd = open_fs("/m", OPEN_FS_CREATE);
+    REQUIRE(fd >= 0);
+    char data[3000];
+    srand(7);
+    for (int it = 0; it < 400; ++it) {
+        size_t nbytes = 1 + (size_t)rand() % sizeof(data);
+        for (size_t i = 0; i < nbytes; ++i) {
+            data[i] = (char)('a' + rand() % 26);
+        }
+        int op = rand() % 10;
+        if (op < 5) {
+            size_t offset = (size_t)rand() % (MODEL_BYTES - sizeof(data));
+            CHECK(pwrite_fs(fd, data, nbytes, offset) == (int)nbytes);
+            model_write(offset, data, nbytes);
+        } else if (op < 8) {
+            if (model_size + nbytes <= MODEL_BYTES) {
+                CHECK(append_fs(fd, data, nbytes) == (int)nbytes);
+                model_write(model_size, data, nbytes);
+            }
+        } else if (op < 9) {
+            size_t size = (size_t)rand() % MODEL_BYTES;
+            CHECK(truncate_fs(fd, size) == 0);
+            if (size > model_size) {
+                memset(model + model_size, 0, size - model_size);
+            }
+            model_size = size;
+        } else {
+            CHECK(fsync_fs(fd) == 0);
+        }
+        size_t offset = (size_t)rand() % MODEL_BYTES;
+        size_t want = offset < model_size ? model_size - offset : 0;
+        want = want < 5000 ? want : 5000;
+        CHECK(pread_fs(fd, buf, 5000, offset) == (int)want);
+        CHECK(memcmp(buf, model + offset, want) == 0);
+    }
+    CHECK(matches_model(fd));
+    CHECK(close_fs(fd) == 0);
+}
+
+int main(void) {
+    test_init();
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 4096, .max_inodes = 128, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    test_open_close();
+    test_descriptor_limit();
+    test_against_model();
+    // Durable across a remount, where the truncating open empties it.
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    int fd = open_fs("/m", 0);
+    REQUIRE(fd >= 0);
+    CHECK(matches_model(fd));
+    CHECK(close_fs(fd) == 0);
+    fd = open_fs("/m", OPEN_FS_TRUNC);
+    REQUIRE(fd >= 0);
+    CHECK(pread_fs(fd, buf, 10, 0) == 0);
+    CHECK(close_fs(fd) == 0);
+    unmount_fs();
+    FsckOptions opts = {.nthreads = 1, .repair = false, .out = stderr};
+    CHECK(fsck_fs(TEST_IMAGE, &opts, NULL) == 0);
+    return test_done("handles");
+}
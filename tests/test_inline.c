@@ -0,0 +1,95 @@
+#include <string.h>
+
+#include "allocator.h"
+#include "disk.h"
+#include "extent.h"
+#include "fs.h"
+#include "fsck.h"
+#include "inode.h"
+#include "path.h"
+#include "test.h"
+
+static char buf[4096];
+
+static size_t free_blocks(void) {
+    size_t n = 0;
+    for (uint32_t b = DATA_START; b < NUM_BLOCKS; ++b) {
+        n += block_is_free((int)b);
+    }
+    return n;
+}
+
+static void fill(char* s, size_t n, char c) {
+    memset(s, c, n);
+    s[n] = '\0';
+}
+
+// A small file takes no block; directories never live inline.
+static void test_small_files(void) {
+    size_t before = free_blocks();
+    fill(buf, INODE_INLINE_SIZE, 's');
+    CHECK(write_fs("/s", buf) == INODE_INLINE_SIZE);
+    CHECK(write_fs("/t", "tiny") == 4);
+    CHECK(mkfile_fs("/e") == 0);
+    Inode s = inode_at("/s");
+    CHECK(inode_is_inline(s) && inode_num_blocks(&s) == 0);
+    CHECK(inode_is_inline(inode_at("/t")));
+    CHECK(free_blocks() == before);
+    CHECK(read_fs("/s", buf, sizeof(buf)) == INODE_INLINE_SIZE);
+    CHECK(buf[INODE_INLINE_SIZE - 1] == 's');
+    CHECK(mkdir_fs("/d") == 0);
+    CHECK(!inode_is_inline(inode_at("/d")));
+}
+
+// A file moves to a block once it outgrows the inode, and back once it shrinks.
+static void test_promote_and_demote(void) {
+    int fd = open_fs("/s", 0);
+    REQUIRE(fd >= 0);
+    CHECK(append_fs(fd, "+", 1) == 1);
+    CHECK(fsync_fs(fd) == 0);
+    Inode grown = inode_at("/s");
+    CHECK(!inode_is_inline(grown) && inode_num_blocks(&grown) == 1);
+    CHECK(pread_fs(fd, buf, sizeof(buf), 0) == INODE_INLINE_SIZE + 1);
+    CHECK(buf[0] == 's' && buf[INODE_INLINE_SIZE - 1] == 's' && buf[INODE_INLINE_SIZE] == '+');
+
+    int block_no = extent_map_block(&grown, 0);
+    CHECK(truncate_fs(fd, 10) == 0);
+    CHECK(fsync_fs(fd) == 0);
+    CHECK(inode_is_inline(inode_at("/s")));
+    CHECK(block_is_free(block_no));
+    CHECK(pread_fs(fd, buf, sizeof(buf), 0) == 10 && buf[9] == 's');
+
+    // A write past the end of an inline file leaves zeros in the gap, inline or not.
+    CHECK(pwrite_fs(fd, "x", 1, 50) == 1);
+    CHECK(inode_is_inline(inode_at("/s")));
+    CHECK(pread_fs(fd, buf, sizeof(buf), 0) == 51);
+    CHECK(buf[10] == 0 && buf[49] == 0 && buf[50] == 'x');
+    CHECK(pwrite_fs(fd, "y", 1, 3000) == 1);
+    CHECK(fsync_fs(fd) == 0);
+    CHECK(!inode_is_inline(inode_at("/s")));
+    CHECK(pread_fs(fd, buf, sizeof(buf), 0) == 3001);
+    CHECK(buf[9] == 's' && buf[50] == 'x' && buf[51] == 0 && buf[2999] == 0 && buf[3000] == 'y');
+    CHECK(close_fs(fd) == 0);
+
+    // Rewriting it whole with few bytes brings it back too.
+    CHECK(write_fs("/s", "short") == 5);
+    CHECK(inode_is_inline(inode_at("/s")));
+}
+
+int main(void) {
+    test_init();
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 2048, .max_inodes = 128, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    test_small_files();
+    test_promote_and_demote();
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    CHECK(read_fs("/s", buf, sizeof(buf)) == 5 && memcmp(buf, "short", 5) == 0);
+    CHECK(read_fs("/t", buf, sizeof(buf)) == 4 && memcmp(buf, "tiny", 4) == 0);
+    CHECK(read_fs("/e", buf, sizeof(buf)) == 0);
+    unmount_fs();
+    FsckOptions opts = {.nthreads = 1, .repair = false, .out = stderr};
+    CHECK(fsck_fs(TEST_IMAGE, &opts, NULL) == 0);
+    return test_done("inline");
+}
@@ -0,0 +1,162 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "allocator.h"
+#include "disk.h"
+#include "fs.h"
+#include "journal.h"
+#include "on-disk/journal.h"
+#include "test.h"
+
+#define NFILES 30
+
+// Layout of the test image, kept for when it is not mounted.
+static uint32_t block_size, bitmap_start, journal_start, data_start;
+
+static void format(uint32_t journal_blocks) {
+    FsGeometry geometry = {
+        .block_size = 1024,
+        .num_blocks = 2048,
+        .max_inodes = 128,
+        .journal_blocks = journal_blocks,
+    };
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    block_size = BLOCK_SIZE;
+    bitmap_start = BITMAP_START;
+    journal_start = JOURNAL_START;
+    data_start = DATA_START;
+}
+
+static void name_of(char* name, int i) {
+    snprintf(name, 32, "/d/f%d", i);
+}
+
+// Runs `work` on the mounted image in a child that exits without unmounting.
+static void crash_after(void (*work)(void)) {
+    pid_t pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0) {
+        if (mount_fs(TEST_IMAGE) != 0) {
+            _exit(1);
+        }
+        work();
+        _exit(test_failures > 0);
+    }
+    int status;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+}
+
+static void write_files(void) {
+    CHECK(mkdir_fs("/d") == 0);
+    char name[32];
+    for (int i = 0; i < NFILES; ++i) {
+        name_of(name, i);
+        CHECK(write_fs(name, "payload") == 7);
+    }
+    CHECK(delete_fs("/d/f3") == 0);
+}
+
+static void write_late_file(void) {
+    CHECK(write_fs("/d/late", "late") == 4);
+}
+
+static void fill_blocks(int fd, uint32_t first, uint32_t end, int byte) {
+    uint8_t* block = (uint8_t*)malloc(block_size);
+    REQUIRE(block != NULL);
+    memset(block, byte, block_size);
+    for (uint32_t b = first; b < end; ++b) {
+        REQUIRE(pwrite(fd, block, block_size, (off_t)b * block_size) == (ssize_t)block_size);
+    }
+    free(block);
+}
+
+static bool files_are_intact(void) {
+    bool ok = true;
+    char name[32], buf[16];
+    for (int i = 0; i < NFILES; ++i) {
+        name_of(name, i);
+        int n = read_fs(name, buf, sizeof(buf));
+        ok &= i == 3 ? n < 0 : n == 7 && memcmp(buf, "payload", 7) == 0;
+    }
+    return ok;
+}
+
+/*
+ * Every transaction that was committed is replayed: losing every
+ * home write of the bitmap and the inode table loses nothing.
+ */
+static void test_replay_after_crash(void) {
+    crash_after(write_files);
+    int fd = open(TEST_IMAGE, O_RDWR);
+    REQUIRE(fd >= 0);
+    fill_blocks(fd, bitmap_start, journal_start, 0);
+    close(fd);
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    CHECK(files_are_intact());
+    unmount_fs();
+    // Replay emptied the log; nothing is replayed twice.
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    CHECK(files_are_intact());
+    unmount_fs();
+}
+
+// A transaction whose images do not match its commit block is not replayed.
+static void test_torn_transaction_is_skipped(void) {
+    crash_after(write_late_file);
+    int fd = open(TEST_IMAGE, O_RDWR);
+    REQUIRE(fd >= 0);
+    JournalDescriptor desc;
+    off_t first = (off_t)(journal_start + 1) * block_size;
+    REQUIRE(pread(fd, &desc, sizeof(desc), first) == (ssize_t)sizeof(desc));
+    REQUIRE(desc.h.magic == JOURNAL_MAGIC && desc.h.type == JOURNAL_DESCRIPTOR);
+    // Garbage in place of the first image, which replay must not write home.
+    uint32_t home;
+    REQUIRE(pread(fd, &home, sizeof(home), first + sizeof(desc)) == (ssize_t)sizeof(home));
+    fill_blocks(fd, journal_start + 2, journal_start + 3, 0xA5);
+    uint8_t before[64], after[64];
+    REQUIRE(pread(fd, before, sizeof(before), (off_t)home * block_size) == sizeof(before));
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    REQUIRE(pread(fd, after, sizeof(after), (off_t)home * block_size) == sizeof(after));
+    close(fd);
+    CHECK(memcmp(before, after, sizeof(before)) == 0);
+    CHECK(files_are_intact());
+    char buf[8];
+    CHECK(read_fs("/d/late", buf, sizeof(buf)) == 4);
+    unmount_fs();
+}
+
+// A transaction too large for the log fails to commit and is not written in place either.
+static void test_oversized_transaction_fails(void) {
+    format(MIN_JOURNAL_BLOCKS);
+    uint8_t* block = (uint8_t*)malloc(block_size);
+    REQUIRE(block != NULL);
+    memset(block, 0x5A, block_size);
+    for (uint32_t i = 0; i < MIN_JOURNAL_BLOCKS; ++i) {
+        write_data_block((int)(data_start + i), block, block_size);
+    }
+    CHECK(!journal_commit());
+    int fd = open(TEST_IMAGE, O_RDONLY);
+    REQUIRE(fd >= 0);
+    for (uint32_t i = 0; i < MIN_JOURNAL_BLOCKS; ++i) {
+        uint8_t home = 0;
+        REQUIRE(pread(fd, &home, 1, (off_t)(data_start + i) * block_size) == 1);
+        CHECK(home != 0x5A);
+    }
+    close(fd);
+    free(block);
+}
+
+int main(void) {
+    test_init();
+    // Large enough to hold every transaction of `write_files`.
+    format(256);
+    unmount_fs();
+    test_replay_after_crash();
+    test_torn_transaction_is_skipped();
+    test_oversized_transaction_fails();
+    // Its blocks are still dirty and do not fit; the image is scratch.
+    return test_done("journal");
+}
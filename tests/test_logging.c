@@ -0,0 +1,135 @@
+// INFO calls in this file are compiled out, as in a release build.
+#define LOG_COMPILE_LEVEL WARN_LOG
+
+#include <string.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "logging.h"
+#include "test.h"
+
+#define NMESSAGES 5000
+
+static char* contents;
+
+static void start(void) {
+    set_log_level(INFO_LOG);
+    init_logs(TEST_LOG, O_WRONLY | O_CREAT | O_TRUNC);
+}
+
+// Reads back everything written so far.
+static void read_log(void) {
+    free(contents);
+    FILE* f = fopen(TEST_LOG, "r");
+    REQUIRE(f != NULL);
+    struct stat st;
+    REQUIRE(fstat(fileno(f), &st) == 0);
+    contents = (char*)malloc((size_t)st.st_size + 1);
+    REQUIRE(contents != NULL);
+    REQUIRE(fread(contents, 1, (size_t)st.st_size, f) == (size_t)st.st_size);
+    contents[st.st_size] = '\0';
+    fclose(f);
+}
+
+static void finish(void) {
+    end_logs();
+    read_log();
+}
+
+static size_t count(const char* needle) {
+    size_t n = 0;
+    for (const char* p = contents; (p = strstr(p, needle)) != NULL; p += strlen(needle)) {
+        n++;
+    }
+    return n;
+}
+
+static int evaluations;
+
+static int evaluated(void) {
+    return ++evaluations;
+}
+
+// Messages below the level never reach the file; raising it lets them through again.
+static void test_levels(void) {
+    start();
+    set_log_level(WARN_LOG);
+    _logMsg(INFO_LOG, "hidden info");
+    logMsg(WARN_LOG, "shown warn");
+    logMsg(ERROR_LOG, "shown error");
+    set_log_level(ERROR_LOG);
+    logMsg(WARN_LOG, "hidden warn");
+    logMsg(ERROR_LOG, "shown error");
+    set_log_level(INFO_LOG);
+    _logMsg(INFO_LOG, "shown info");
+    finish();
+    CHECK(count("hidden") == 0);
+    CHECK(count("[WARN] shown warn") == 1);
+    CHECK(count("[ERROR] shown error") == 2);
+    CHECK(count("[INFO] shown info") == 1);
+}
+
+// A compiled-out call writes nothing and doesn't even evaluate its arguments.
+static void test_compiled_out(void) {
+    start();
+    logMsg(INFO_LOG, "compiled out %d", evaluated());
+    logMsg(WARN_LOG, "kept %d", evaluated());
+    finish();
+    CHECK(evaluations == 1);
+    CHECK(count("compiled out") == 0 && count("[WARN] kept 1") == 1);
+}
+
+// With no periodic sync, every WARN still reaches the file, in order, by `end_logs`.
+static void test_all_written_by_end(void) {
+    start();
+    set_log_fsync_interval(0);
+    for (int i = 0; i < NMESSAGES; ++i) {
+        logMsg(WARN_LOG, "message %d;", i);
+    }
+    finish();
+    set_log_fsync_interval(DEFAULT_LOG_FSYNC_INTERVAL_MS);
+    CHECK(count("message ") == NMESSAGES);
+    const char* p = contents;
+    char want[32];
+    for (int i = 0; i < NMESSAGES && p != NULL; ++i) {
+        snprintf(want, sizeof(want), "message %d;", i);
+        p = strstr(p, want);
+    }
+    CHECK(p != NULL);
+}
+
+// INFO that finds the ring full is dropped, and the drop is counted in the log.
+static void test_dropped_info(void) {
+    start();
+    for (int i = 0; i < 10 * NMESSAGES; ++i) {
+        _logMsg(INFO_LOG, "flood");
+    }
+    // Once this is written the ring is empty, so what `end_logs` logs is not dropped too.
+    logMsg(WARN_LOG, "flood done");
+    struct timespec pause = {0, 1000000};
+    for (int i = 0; i < 5000; ++i) {
+        read_log();
+        if (count("flood done") > 0) {
+            break;
+        }
+        nanosleep(&pause, NULL);
+    }
+    finish();
+    size_t ndropped = 0;
+    const char* needle = "logging: dropped ";
+    for (const char* p = contents; (p = strstr(p, needle)) != NULL; p += strlen(needle)) {
+        ndropped += strtoul(p + strlen(needle), NULL, 10);
+    }
+    CHECK(count("[INFO] flood") + ndropped == 10 * NMESSAGES);
+}
+
+int main(void) {
+    test_init();
+    test_levels();
+    test_compiled_out();
+    test_all_written_by_end();
+    test_dropped_info();
+    free(contents);
+    return test_done("logging");
+}
@@ -0,0 +1,171 @@
+#include <stdint.h>
+#include <string.h>
+
+#include "lz.h"
+#include "test.h"
+
+#define MAX_INPUT (256 << 10)
+// Past the end of a decompression buffer; must come through untouched.
+#define GUARD 64
+
+static uint8_t input[MAX_INPUT];
+static uint8_t packed[MAX_INPUT + MAX_INPUT / 255 + 16];
+static uint8_t output[MAX_INPUT + GUARD];
+static uint32_t seed = 1;
+
+static uint32_t next_random(void) {
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static void fill_text(uint8_t* s, size_t n) {
+    static const char* words[] = {"the ", "quick ", "brown ", "fox\n", "jumps ", "over "};
+    for (size_t k = 0; k < n;) {
+        const char* w = words[next_random() % 6];
+        for (size_t j = 0; w[j] && k < n; ++j) {
+            s[k++] = (uint8_t)w[j];
+        }
+    }
+}
+
+static void fill_noise(uint8_t* s, size_t n) {
+    for (size_t k = 0; k < n; ++k) {
+        s[k] = (uint8_t)next_random();
+    }
+}
+
+static size_t get_len(const uint8_t** ip, size_t len) {
+    if (len == 15) {
+        uint8_t b;
+        do {
+            b = *(*ip)++;
+            len += b;
+        } while (b == 255);
+    }
+    return len;
+}
+
+/*
+ * Walks the `csize` bytes of `packed` and checks LZ4's end-of-block
+ * rules for `n` bytes of output: no match starts in the last 12 and
+ * none reaches into the last 5.
+ */
+static bool follows_lz4_rules(size_t csize, size_t n) {
+    const uint8_t* ip = packed;
+    const uint8_t* end = packed + csize;
+    size_t pos = 0;
+    while (ip < end) {
+        uint8_t token = *ip++;
+        size_t nlit = get_len(&ip, token >> 4);
+        ip += nlit;
+        pos += nlit;
+        if (ip == end) {
+            break;
+        }
+        ip += 2;
+        size_t mlen = get_len(&ip, token & 15) + 4;
+        if (pos + 12 > n || pos + mlen + 5 > n) {
+            return false;
+        }
+        pos += mlen;
+    }
+    return ip == end && pos == n;
+}
+
+// Compresses and decompresses `n` bytes of `input`. Returns the compressed size.
+static size_t round_trip(size_t n) {
+    size_t csize = lz_compress(input, n, packed, sizeof(packed));
+    CHECK(csize > 0);
+    CHECK(follows_lz4_rules(csize, n));
+    memset(output, 0xA5, sizeof(output));
+    CHECK(lz_decompress(packed, csize, output, n) == (long)n);
+    CHECK(memcmp(output, input, n) == 0);
+    for (size_t i = n; i < n + GUARD; ++i) {
+        CHECK(output[i] == 0xA5);
+    }
+    return csize;
+}
+
+static void test_round_trips(void) {
+    size_t sizes[] = {0, 1, 3, 4, 5, 15, 16, 19, 270, 4096, 65536, MAX_INPUT};
+    for (size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); ++i) {
+        fill_text(input, sizes[i]);
+        size_t csize = round_trip(sizes[i]);
+        if (sizes[i] >= 4096) {
+            CHECK(csize < sizes[i] / 2);
+        }
+        fill_noise(input, sizes[i]);
+        round_trip(sizes[i]);
+    }
+    // One long match and one long run of literals, both past what a nibble holds.
+    memset(input, 'z', MAX_INPUT);
+    CHECK(round_trip(MAX_INPUT) < 2048);
+    fill_noise(input, 1000);
+    memset(input + 1000, 'z', 5000);
+    round_trip(6000);
+}
+
+// Runs that could match to the last byte still end in literals, and short inputs are all literals.
+static void test_block_end(void) {
+    for (size_t n = 0; n <= 40; ++n) {
+        memset(input, 'q', n);
+        size_t csize = round_trip(n);
+        if (n < 13) {
+            CHECK(csize == 1 + n);
+        }
+    }
+    fill_text(input, 5000);
+    memcpy(input + 5000 - 200, input, 200);
+    round_trip(5000);
+}
+
+static void test_no_room(void) {
+    fill_noise(input, 4096);
+    CHECK(lz_compress(input, 4096, packed, 4096 - 4096 / 8) == 0);
+    fill_text(input, 4096);
+    size_t csize = lz_compress(input, 4096, packed, sizeof(packed));
+    REQUIRE(csize > 0);
+    CHECK(lz_compress(input, 4096, packed, csize - 1) == 0);
+    // Output that would not fit.
+    CHECK(lz_decompress(packed, csize, output, 4095) == -1);
+}
+
+static void test_corrupt(void) {
+    // A match before any output.
+    const uint8_t early[] = {0x00, 0x05, 0x00};
+    CHECK(lz_decompress(early, sizeof(early), output, 100) == -1);
+    // Literals that run past the input.
+    const uint8_t short_literals[] = {0x50, 'a', 'b'};
+    CHECK(lz_decompress(short_literals, sizeof(short_literals), output, 100) == -1);
+    // A length extension cut off.
+    const uint8_t cut[] = {0xF0, 0xFF};
+    CHECK(lz_decompress(cut, sizeof(cut), output, 100) == -1);
+
+    // Damaged data fails or decodes to something, but never writes past the buffer.
+    fill_text(input, 16384);
+    size_t csize = lz_compress(input, 16384, packed, sizeof(packed));
+    REQUIRE(csize > 0);
+    static uint8_t damaged[sizeof(packed)];
+    for (int round = 0; round < 2000; ++round) {
+        memcpy(damaged, packed, csize);
+        for (int k = 0; k < 3; ++k) {
+            damaged[next_random() % csize] = (uint8_t)next_random();
+        }
+        size_t n = round % 2 ? csize : next_random() % csize;
+        memset(output, 0xA5, sizeof(output));
+        long len = lz_decompress(damaged, n, output, 16384);
+        CHECK(len >= -1 && len <= 16384);
+        for (size_t i = 16384; i < 16384 + GUARD; ++i) {
+            CHECK(output[i] == 0xA5);
+        }
+    }
+}
+
+int main(void) {
+    test_init();
+    test_round_trips();
+    test_block_end();
+    test_no_room();
+    test_corrupt();
+    return test_done("lz");
+}
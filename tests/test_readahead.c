@@ -0,0 +1,139 @@
+#include <string.h>
+#include <time.h>
+
+#include "cache.h"
+#include "disk.h"
+#include "extent.h"
+#include "file.h"
+#include "fs.h"
+#include "readahead.h"
+#include "stats.h"
+#include "test.h"
+
+#define FILE_BLOCKS 512
+// Each read takes four blocks.
+#define READ_BYTES 4096
+#define PACKED_BYTES (200 * 1024)
+
+static char buf[FILE_BLOCKS * 1024];
+// Half of each block is noise, so it compresses only so far and takes many blocks.
+static char packed[PACKED_BYTES + 1];
+
+static uint64_t counter(StatCounter c) {
+    MinifsStats stats;
+    minifs_stats(&stats);
+    return stats.counters[c];
+}
+
+static char byte_at(size_t k) {
+    return (char)('a' + (k / 1024) % 26);
+}
+
+/*
+ * Readahead runs on a thread of its own, one request at a time in
+ * order: waits up to five seconds for it to have read `want` blocks.
+ */
+static uint64_t wait_for_readahead(uint64_t want) {
+    struct timespec pause = {0, 1000000};
+    for (int i = 0; i < 5000 && counter(STAT_READAHEAD_BLOCKS) < want; ++i) {
+        nanosleep(&pause, NULL);
+    }
+    return counter(STAT_READAHEAD_BLOCKS);
+}
+
+static bool read_is_right(int fd, size_t offset) {
+    return pread_fs(fd, buf, READ_BYTES, offset) == READ_BYTES && buf[0] == byte_at(offset) &&
+           buf[READ_BYTES - 1] == byte_at(offset + READ_BYTES - 1);
+}
+
+/*
+ * Each read that picks up where the last one ended reads twice as far
+ * ahead, up to the largest window, and the reads after it find their
+ * blocks in the cache.
+ */
+static void test_window_grows(int fd) {
+    uint64_t total = counter(STAT_READAHEAD_BLOCKS);
+    size_t offset = 0;
+    for (uint64_t want = MIN_READAHEAD_BLOCKS; want <= MAX_READAHEAD_BLOCKS; want *= 2) {
+        CHECK(read_is_right(fd, offset));
+        offset += READ_BYTES;
+        total += want;
+        CHECK(wait_for_readahead(total) == total);
+    }
+    // Everything up to block 96 has been read or read ahead.
+    int other = open_fs("/f", 0);
+    REQUIRE(other >= 0);
+    uint64_t reads = counter(STAT_DISK_READS);
+    uint64_t hits = counter(STAT_CACHE_HITS);
+    CHECK(pread_fs(other, buf, 64 * 1024, offset) == 64 * 1024);
+    CHECK(buf[0] == byte_at(offset) && buf[64 * 1024 - 1] == byte_at(offset + 64 * 1024 - 1));
+    CHECK(counter(STAT_DISK_READS) == reads);
+    CHECK(counter(STAT_CACHE_HITS) >= hits + 64);
+    CHECK(close_fs(other) == 0);
+}
+
+// A read elsewhere in the file starts the window over from the smallest.
+static void test_random_read_collapses(int fd) {
+    uint64_t total = counter(STAT_READAHEAD_BLOCKS);
+    size_t offset = 300 * 1024;
+    CHECK(read_is_right(fd, offset));
+    CHECK(read_is_right(fd, offset + READ_BYTES));
+    total += MIN_READAHEAD_BLOCKS;
+    CHECK(wait_for_readahead(total) == total);
+}
+
+// Neither an inline nor a compressed file is read ahead, however it is read.
+static void test_never_read_ahead(int fd) {
+    CHECK(write_fs("/i", "small") == 5);
+    uint32_t x = 1;
+    for (size_t k = 0; k < PACKED_BYTES; ++k) {
+        x = x * 1103515245 + 12345;
+        packed[k] = k % 1024 < 512 ? byte_at(k) : (char)('a' + (x >> 16) % 26);
+    }
+    set_file_compression(true);
+    CHECK(write_fs("/c", packed) == PACKED_BYTES);
+    set_file_compression(false);
+    int i = open_fs("/i", 0);
+    int c = open_fs("/c", 0);
+    REQUIRE(i >= 0 && c >= 0);
+    Inode inode = inode_at("/c");
+    CHECK(inode_is_compressed(inode) && inode_num_blocks(&inode) > PACKED_BYTES / 1024 / 4);
+    uint64_t total = counter(STAT_READAHEAD_BLOCKS);
+    for (size_t offset = 0; offset < PACKED_BYTES; offset += READ_BYTES) {
+        CHECK(pread_fs(i, buf, 1, offset < 5 ? offset : 5) == (offset < 5 ? 1 : 0));
+        CHECK(pread_fs(c, buf, READ_BYTES, offset) == READ_BYTES);
+        CHECK(memcmp(buf, packed + offset, READ_BYTES) == 0);
+    }
+    // Requests are served in order, so once this one is done none of theirs is left.
+    CHECK(read_is_right(fd, 400 * 1024));
+    CHECK(read_is_right(fd, 400 * 1024 + READ_BYTES));
+    total += MIN_READAHEAD_BLOCKS;
+    CHECK(wait_for_readahead(total) == total);
+    CHECK(close_fs(i) == 0 && close_fs(c) == 0);
+}
+
+int main(void) {
+    test_init();
+    set_cache_capacity(1024);
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 4096, .max_inodes = 128, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    int fd = open_fs("/f", OPEN_FS_CREATE);
+    REQUIRE(fd >= 0);
+    for (size_t k = 0; k < sizeof(buf); ++k) {
+        buf[k] = byte_at(k);
+    }
+    CHECK(append_fs(fd, buf, sizeof(buf)) == sizeof(buf));
+    CHECK(close_fs(fd) == 0);
+    // Remounted, so nothing of it is in the cache.
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    fd = open_fs("/f", 0);
+    REQUIRE(fd >= 0);
+    test_window_grows(fd);
+    test_random_read_collapses(fd);
+    test_never_read_ahead(fd);
+    CHECK(close_fs(fd) == 0);
+    unmount_fs();
+    return test_done("readahead");
+}
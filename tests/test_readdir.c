@@ -0,0 +1,126 @@
+#include <string.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "test.h"
+
+#define MAX_FILES 3000
+
+// How many times each file was listed; -1 once it is deleted.
+static int seen[MAX_FILES];
+
+static int file_of(const ReaddirEntry* e) {
+    int k;
+    return sscanf(e->dirent.name, "f%d", &k) == 1 && k < MAX_FILES ? k : -1;
+}
+
+static void populate(int nfiles) {
+    REQUIRE(mkdir_fs("/d") == 0);
+    REQUIRE(mkdir_fs("/d/sub") == 0);
+    char path[64];
+    for (int i = 0; i < nfiles; ++i) {
+        snprintf(path, sizeof(path), "/d/f%d", i);
+        REQUIRE(mkfile_fs(path) == 0);
+        if (i % 7 != 0) {
+            int fd = open_fs(path, 0);
+            REQUIRE(append_fs(fd, "abcdefg", i % 7) == i % 7);
+            close_fs(fd);
+        }
+    }
+}
+
+// Lists "/d" in batches of `batch`; every entry comes exactly once, with its type and size.
+static void check_listing(int nfiles, size_t batch, int flags) {
+    ReaddirEntry* entries = (ReaddirEntry*)malloc(batch * sizeof(ReaddirEntry));
+    REQUIRE(entries != NULL);
+    memset(seen, 0, sizeof(seen));
+    uint64_t cookie = 0;
+    int n, dirs = 0;
+    while ((n = readdir_fs("/d", &cookie, entries, batch, flags)) > 0) {
+        for (int i = 0; i < n; ++i) {
+            int k = file_of(&entries[i]);
+            if (k < 0) {
+                CHECK(strcmp(entries[i].dirent.name, "sub") == 0);
+                CHECK(entries[i].is_dir == ((flags & READDIR_FS_PLUS) != 0));
+                dirs++;
+                continue;
+            }
+            seen[k]++;
+            if (flags & READDIR_FS_PLUS) {
+                CHECK(!entries[i].is_dir && entries[i].size == (size_t)(k % 7));
+            }
+        }
+    }
+    CHECK(n == 0);
+    CHECK(dirs == 1);
+    for (int i = 0; i < nfiles; ++i) {
+        CHECK(seen[i] == 1);
+    }
+    free(entries);
+}
+
+/*
+ * A walk resumed from its cookie after entries it has not reached
+ * yet were deleted returns every other entry exactly once, even
+ * across a remount.
+ */
+static void check_resumption(int nfiles) {
+    memset(seen, 0, sizeof(seen));
+    ReaddirEntry entries[5];
+    uint64_t cookie = 0;
+    int n = readdir_fs("/d", &cookie, entries, 5, 0);
+    REQUIRE(n == 5);
+    for (int i = 0; i < n; ++i) {
+        int k = file_of(&entries[i]);
+        if (k >= 0) {
+            seen[k]++;
+        }
+    }
+    char path[64];
+    for (int i = 0; i < nfiles; i += 3) {
+        if (seen[i] == 0) {
+            snprintf(path, sizeof(path), "/d/f%d", i);
+            REQUIRE(delete_fs(path) == 0);
+            seen[i] = -1;
+        }
+    }
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    while ((n = readdir_fs("/d", &cookie, entries, 5, 0)) > 0) {
+        for (int i = 0; i < n; ++i) {
+            int k = file_of(&entries[i]);
+            if (k >= 0) {
+                CHECK(seen[k] >= 0);
+                seen[k]++;
+            }
+        }
+    }
+    for (int i = 0; i < nfiles; ++i) {
+        CHECK(seen[i] == 1 || seen[i] == -1);
+    }
+}
+
+// Both a linear directory and an indexed one.
+static void run(int nfiles) {
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 16384, .max_inodes = 4096, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    populate(nfiles);
+    size_t batches[] = {1, 3, 64, MAX_FILES + 2};
+    for (size_t b = 0; b < sizeof(batches) / sizeof(batches[0]); ++b) {
+        check_listing(nfiles, batches[b], b % 2 ? READDIR_FS_PLUS : 0);
+    }
+    check_resumption(nfiles);
+    uint64_t cookie = 0;
+    ReaddirEntry entry;
+    CHECK(readdir_fs("/d/sub", &cookie, &entry, 1, 0) == 0);
+    CHECK(readdir_fs("/d/missing", &cookie, &entry, 1, 0) == -1);
+    unmount_fs();
+}
+
+int main(void) {
+    test_init();
+    run(20);
+    run(MAX_FILES);
+    return test_done("readdir");
+}
@@ -0,0 +1,179 @@
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fsck.h"
+#include "inode.h"
+#include "journal.h"
+#include "path.h"
+#include "super.h"
+#include "test.h"
+
+#define NINODES 256
+#define PER_BLOCK (1024 / INODE_SIZE)
+// Enough files to fill a few inode-table blocks.
+#define NFILES (3 * PER_BLOCK)
+
+static void name_of(char* name, int i) {
+    snprintf(name, 32, "/f%d", i);
+}
+
+// A large image formats without writing its inode table, so it stays sparse.
+static void test_large_format(void) {
+    FsGeometry geometry = {
+        .block_size = 4096, .num_blocks = 1 << 20, .max_inodes = 1 << 20, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    CHECK(get_itable_hwm() == 1);
+    CHECK(mkdir_fs("/d") == 0 && write_fs("/d/f", "data") == 4);
+    unmount_fs();
+    struct stat st;
+    REQUIRE(stat(TEST_IMAGE, &st) == 0);
+    CHECK(st.st_size == (off_t)4096 << 20);
+    // The inode table alone is 128 MiB.
+    CHECK((uint64_t)st.st_blocks * 512 < 16 << 20);
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    char buf[8];
+    CHECK(read_fs("/d/f", buf, sizeof(buf)) == 4);
+    unmount_fs();
+}
+
+static void format_small(void) {
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 4096, .max_inodes = NINODES, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+}
+
+// The mark covers every inode handed out, and never comes down.
+static void test_mark_only_rises(void) {
+    format_small();
+    uint32_t hwm = get_itable_hwm();
+    CHECK(hwm == 1);
+    char name[32];
+    for (int i = 0; i < NFILES; ++i) {
+        name_of(name, i);
+        CHECK(mkfile_fs(name) == 0);
+        int inode_no;
+        REQUIRE(get_inode_no_from_path(name, &inode_no) == 0);
+        CHECK(get_itable_hwm() >= hwm && get_itable_hwm() > (uint32_t)inode_no / PER_BLOCK);
+        hwm = get_itable_hwm();
+    }
+    CHECK(hwm > 1);
+    for (int i = 0; i < NFILES; ++i) {
+        name_of(name, i);
+        CHECK(delete_fs(name) == 0);
+    }
+    CHECK(get_itable_hwm() == hwm);
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    CHECK(get_itable_hwm() == hwm);
+    unmount_fs();
+}
+
+// Fills every record of inode-table blocks [1, end) with a copy of the root's.
+static void plant_stale_inodes(uint32_t end) {
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    off_t table = (off_t)get_inode_start() * 1024;
+    unmount_fs();
+    int fd = open(TEST_IMAGE, O_RDWR);
+    REQUIRE(fd >= 0);
+    uint8_t root[INODE_SIZE];
+    REQUIRE(pread(fd, root, INODE_SIZE, table) == INODE_SIZE);
+    for (off_t at = table + 1024; at < table + (off_t)end * 1024; at += INODE_SIZE) {
+        REQUIRE(pwrite(fd, root, INODE_SIZE, at) == INODE_SIZE);
+    }
+    close(fd);
+}
+
+static int count_valid_inodes(void) {
+    int nvalid = 0;
+    for (int i = 0; i < NINODES; ++i) {
+        Inode inode;
+        REQUIRE(read_inode(i, &inode) == 1);
+        nvalid += inode_is_valid(inode);
+    }
+    return nvalid;
+}
+
+// Writing an inode far above the mark writes out the blocks it rises over too.
+static void test_skipped_blocks(void) {
+    format_small();
+    unmount_fs();
+    plant_stale_inodes(NINODES / PER_BLOCK);
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    Inode inode;
+    REQUIRE(read_inode(NINODES - 1, &inode) == 1 && !inode_is_valid(inode));
+    journal_begin();
+    write_inode(NINODES - 1, inode);
+    CHECK(journal_end());
+    CHECK(get_itable_hwm() == NINODES / PER_BLOCK);
+    unmount_fs();
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    CHECK(count_valid_inodes() == 1);
+    unmount_fs();
+}
+
+static void crash_after_creates(void) {
+    if (mount_fs(TEST_IMAGE) != 0) {
+        _exit(1);
+    }
+    char name[32];
+    for (int i = 0; i < NFILES; ++i) {
+        name_of(name, i);
+        if (mkfile_fs(name) != 0) {
+            _exit(1);
+        }
+    }
+    _exit(0);
+}
+
+/*
+ * Stale bytes in the inode table are never read as inodes: the blocks
+ * the mark rises over are written out, and those above it are free
+ * after a crash as they are after a clean unmount.
+ */
+static void test_crash_above_mark(void) {
+    format_small();
+    unmount_fs();
+    plant_stale_inodes(NINODES / PER_BLOCK);
+    pid_t pid = fork();
+    REQUIRE(pid >= 0);
+    if (pid == 0) {
+        crash_after_creates();
+    }
+    int status;
+    REQUIRE(waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    REQUIRE(mount_fs(TEST_IMAGE) == 0);
+    uint32_t hwm = get_itable_hwm();
+    CHECK(hwm > 1 && hwm < NINODES / PER_BLOCK);
+    for (int i = hwm * PER_BLOCK; i < NINODES; ++i) {
+        Inode inode;
+        REQUIRE(read_inode(i, &inode) == 1);
+        CHECK(!inode_is_valid(inode));
+    }
+    CHECK(count_valid_inodes() == 1 + NFILES);
+    // Every other inode can still be had.
+    char name[32];
+    for (int i = NFILES; i < NINODES - 1; ++i) {
+        name_of(name, i);
+        CHECK(mkfile_fs(name) == 0);
+    }
+    CHECK(mkfile_fs("/one_too_many") == -1);
+    CHECK(get_itable_hwm() == NINODES / PER_BLOCK);
+    unmount_fs();
+    FsckOptions opts = {.nthreads = 1, .repair = false, .out = stderr};
+    CHECK(fsck_fs(TEST_IMAGE, &opts, NULL) == 0);
+}
+
+int main(void) {
+    test_init();
+    test_large_format();
+    test_mark_only_rises();
+    test_skipped_blocks();
+    test_crash_above_mark();
+    return test_done("sparse");
+}
@@ -0,0 +1,125 @@
+#include <string.h>
+
+#include "stats.h"
+#include "test.h"
+
+static StatHistogram histogram(void) {
+    StatHistogram h;
+    memset(&h, 0, sizeof(h));
+    return h;
+}
+
+// Percentiles report the upper bound of a bucket, never past the largest sample.
+static void test_percentiles(void) {
+    StatHistogram h = histogram();
+    CHECK(stat_histogram_percentile(&h, 0.5) == 0);
+
+    // 90 samples in [8, 16) and 10 in [1024, 2048), the largest 1500.
+    h.count = 100;
+    h.buckets[3] = 90;
+    h.buckets[10] = 10;
+    h.max_ns = 1500;
+    CHECK(stat_histogram_percentile(&h, 0.0) == 15);
+    CHECK(stat_histogram_percentile(&h, 0.5) == 15);
+    CHECK(stat_histogram_percentile(&h, 0.9) == 15);
+    CHECK(stat_histogram_percentile(&h, 0.91) == 1500);
+    CHECK(stat_histogram_percentile(&h, 1.0) == 1500);
+    h.max_ns = 5000;
+    CHECK(stat_histogram_percentile(&h, 0.99) == 2047);
+
+    // The last bucket has no upper bound but the largest sample.
+    h = histogram();
+    h.count = 2;
+    h.buckets[0] = 1;
+    h.buckets[STAT_HIST_BUCKETS - 1] = 1;
+    h.max_ns = 1ULL << 50;
+    CHECK(stat_histogram_percentile(&h, 0.5) == 1);
+    CHECK(stat_histogram_percentile(&h, 1.0) == 1ULL << 50);
+}
+
+// A recorded latency lands in the bucket [2^i, 2^(i+1)) that holds it.
+static void test_recording(void) {
+    minifs_stats_reset();
+    uint64_t ns = 3ULL << 20;
+    _stats_record_op(STAT_OP_MKDIR, _stats_now_ns() - ns);
+    _stats_record_op(STAT_OP_MKDIR, _stats_now_ns() - ns);
+    // Far past the last bucket's lower bound, 2^39 ns.
+    _stats_record_op(STAT_OP_MKDIR, _stats_now_ns() - (1ULL << 45));
+    MinifsStats s;
+    minifs_stats(&s);
+    const StatHistogram* h = &s.ops[STAT_OP_MKDIR];
+    CHECK(h->count == 3);
+    CHECK(h->buckets[21] == 2 && h->buckets[STAT_HIST_BUCKETS - 1] == 1);
+    CHECK(h->total_ns >= 2 * ns + (1ULL << 45));
+    CHECK(h->max_ns >= 1ULL << 45 && h->max_ns < 1ULL << 46);
+    CHECK(stat_histogram_percentile(h, 0.5) == (1ULL << 22) - 1);
+    CHECK(stat_histogram_percentile(h, 1.0) == h->max_ns);
+    CHECK(s.ops[STAT_OP_RMDIR].count == 0);
+}
+
+// Reset zeroes every counter and histogram.
+static void test_reset(void) {
+    _stats_add(STAT_CACHE_HITS, 5);
+    _stats_record_op(STAT_OP_FSYNC, _stats_now_ns());
+    minifs_stats_reset();
+    MinifsStats s, zero;
+    minifs_stats(&s);
+    memset(&zero, 0, sizeof(zero));
+    CHECK(memcmp(&s, &zero, sizeof(s)) == 0);
+}
+
+// Only what is non-zero is printed, one line each.
+static void test_print(void) {
+    minifs_stats_reset();
+    _stats_add(STAT_CACHE_HITS, 5);
+    _stats_add(STAT_JOURNAL_COMMITS, 2);
+    _stats_record_op(STAT_OP_MKDIR, _stats_now_ns() - (3ULL << 20));
+    char* text = NULL;
+    size_t len = 0;
+    FILE* out = open_memstream(&text, &len);
+    REQUIRE(out != NULL);
+    minifs_stats_print(out);
+    fclose(out);
+    CHECK(strstr(text, "cache_hits 5\n") != NULL);
+    CHECK(strstr(text, "journal_commits 2\n") != NULL);
+    CHECK(strstr(text, "cache_misses") == NULL);
+    CHECK(strstr(text, "op mkdir count=1 ") != NULL);
+    // One sample: every percentile is that sample.
+    MinifsStats s;
+    minifs_stats(&s);
+    char want[80];
+    uint64_t max = s.ops[STAT_OP_MKDIR].max_ns;
+    snprintf(want, sizeof(want), "p50_ns<=%ju p99_ns<=%ju max_ns=%ju\n", (uintmax_t)max,
+             (uintmax_t)max, (uintmax_t)max);
+    CHECK(strstr(text, want) != NULL);
+    CHECK(strstr(text, "op rmdir") == NULL);
+    size_t lines = 0;
+    for (const char* p = text; *p; ++p) {
+        lines += *p == '\n';
+    }
+    CHECK(lines == 3);
+    free(text);
+    minifs_stats_reset();
+}
+
+static void test_names(void) {
+    for (int i = 0; i < NUM_STAT_COUNTERS; ++i) {
+        CHECK(strcmp(stat_counter_name((StatCounter)i), "unknown") != 0);
+    }
+    for (int i = 0; i < NUM_STAT_OPS; ++i) {
+        CHECK(strcmp(stat_op_name((StatOp)i), "unknown") != 0);
+    }
+    CHECK(strcmp(stat_counter_name(STAT_DCACHE_HITS), "dcache_hits") == 0);
+    CHECK(strcmp(stat_op_name(STAT_OP_FSYNC), "fsync") == 0);
+    CHECK(strcmp(stat_counter_name(NUM_STAT_COUNTERS), "unknown") == 0);
+}
+
+int main(void) {
+    test_init();
+    test_percentiles();
+    test_recording();
+    test_reset();
+    test_print();
+    test_names();
+    return test_done("stats");
+}
@@ -0,0 +1,156 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "disk.h"
+#include "fs.h"
+#include "fsck.h"
+#include "path.h"
+#include "test.h"
+#include "tree.h"
+
+#define NTHREADS 4
+#define DEPTH 2
+#define FILES_PER_DIR 6
+#define DIRS_PER_DIR 3
+
+static size_t nfiles, ndirs, nbytes;
+static atomic_size_t visited_files, visited_dirs;
+
+static int file_size(int i, int depth) {
+    return (i * 977 + depth * 31) % 3000;
+}
+
+static void build(const char* dir, int depth) {
+    char path[200], data[3000];
+    for (int i = 0; i < FILES_PER_DIR; ++i) {
+        snprintf(path, sizeof(path), "%s/f%d", dir, i);
+        int n = file_size(i, depth);
+        memset(data, 'a' + i, (size_t)n);
+        data[n] = '\0';
+        REQUIRE(n > 0 ? write_fs(path, data) == n : mkfile_fs(path) == 0);
+        nfiles++;
+        nbytes += (size_t)n;
+    }
+    for (int i = 0; depth > 0 && i < DIRS_PER_DIR; ++i) {
+        snprintf(path, sizeof(path), "%s/d%d", dir, i);
+        REQUIRE(mkdir_fs(path) == 0);
+        ndirs++;
+        build(path, depth - 1);
+    }
+}
+
+static bool same_tree(const char* a, const char* b, int depth) {
+    char p[200], q[200];
+    static char x[4000], y[4000];
+    bool same = true;
+    for (int i = 0; i < FILES_PER_DIR; ++i) {
+        snprintf(p, sizeof(p), "%s/f%d", a, i);
+        snprintf(q, sizeof(q), "%s/f%d", b, i);
+        int n = read_fs(p, x, sizeof(x));
+        same &= n == file_size(i, depth) && read_fs(q, y, sizeof(y)) == n && !memcmp(x, y, n);
+    }
+    for (int i = 0; depth > 0 && i < DIRS_PER_DIR; ++i) {
+        snprintf(p, sizeof(p), "%s/d%d", a, i);
+        snprintf(q, sizeof(q), "%s/d%d", b, i);
+        same &= same_tree(p, q, depth - 1);
+    }
+    return same;
+}
+
+static bool exists(const char* path) {
+    int inode_no;
+    return get_inode_no_from_path(path, &inode_no) == 0;
+}
+
+static int count(const char* path, const ReaddirEntry* entry, void* arg) {
+    (void)arg;
+    const char* name = strrchr(path, '/');
+    CHECK(name && strcmp(name + 1, entry->dirent.name) == 0);
+    atomic_fetch_add(entry->is_dir ? &visited_dirs : &visited_files, 1);
+    return 0;
+}
+
+static int stop_early(const char* path, const ReaddirEntry* entry, void* arg) {
+    (void)path;
+    (void)entry;
+    return atomic_fetch_add((atomic_size_t*)arg, 1) >= 5 ? 42 : 0;
+}
+
+static void test_walk_and_du(void) {
+    CHECK(walk_tree_fs("/t", count, NULL, NTHREADS) == 0);
+    CHECK(visited_files == nfiles && visited_dirs == ndirs);
+    atomic_size_t calls = 0;
+    CHECK(walk_tree_fs("/t", stop_early, &calls, NTHREADS) == 42);
+    TreeUsage usage;
+    CHECK(du_tree_fs("/t", &usage, NTHREADS) == 0);
+    CHECK(usage.files == nfiles && usage.dirs == ndirs && usage.bytes == nbytes);
+}
+
+static void test_copy_and_rm(void) {
+    CHECK(copy_tree_fs("/t", "/t/inside", NTHREADS) == -1);
+    CHECK(copy_tree_fs("/t", "/c", NTHREADS) == 0);
+    CHECK(same_tree("/t", "/c", DEPTH));
+    // An open file and the directories above it stay.
+    int fd = open_fs("/c/d1/f2", 0);
+    REQUIRE(fd >= 0);
+    CHECK(rm_tree_fs("/c", NTHREADS) == -1);
+    CHECK(exists("/c/d1/f2") && !exists("/c/d0") && !exists("/c/f0"));
+    close_fs(fd);
+    CHECK(rm_tree_fs("/c", NTHREADS) == 0);
+    CHECK(!exists("/c"));
+}
+
+// Slow enough that the other workers take tasks of their own.
+static int count_slowly(const char* path, const ReaddirEntry* entry, void* arg) {
+    usleep(1000);
+    return count(path, entry, arg);
+}
+
+static void* write_outside_batch(void* arg) {
+    (void)arg;
+    CHECK(write_fs("/outside", "x") == 1);
+    return NULL;
+}
+
+/*
+ * Inside a batch, while another thread waits for a commit that waits
+ * for the batch, tree operations still finish: they run on the
+ * calling thread, in the batch.
+ */
+static void test_inside_batch(void) {
+    begin_batch_fs();
+    pthread_t writer;
+    REQUIRE(pthread_create(&writer, NULL, write_outside_batch, NULL) == 0);
+    usleep(50 * 1000);
+    visited_files = visited_dirs = 0;
+    CHECK(walk_tree_fs("/t", count_slowly, NULL, NTHREADS) == 0);
+    CHECK(visited_files == nfiles && visited_dirs == ndirs);
+    CHECK(copy_tree_fs("/t", "/b", NTHREADS) == 0);
+    CHECK(rm_tree_fs("/b/d0", NTHREADS) == 0);
+    CHECK(commit_batch_fs() == 0);
+    pthread_join(writer, NULL);
+    CHECK(same_tree("/t/d1", "/b/d1", DEPTH - 1) && !exists("/b/d0"));
+    CHECK(exists("/outside"));
+}
+
+int main(void) {
+    test_init();
+    // A deadlock fails the test instead of hanging it.
+    alarm(60);
+    FsGeometry geometry = {
+        .block_size = 1024, .num_blocks = 16384, .max_inodes = 1024, .journal_blocks = 0};
+    REQUIRE(mkfs_with_geometry(TEST_IMAGE, &geometry) == 0);
+    REQUIRE(mkdir_fs("/t") == 0);
+    build("/t", DEPTH);
+    test_walk_and_du();
+    test_copy_and_rm();
+    test_inside_batch();
+    CHECK(rm_tree_fs("/", NTHREADS) == 0);
+    unmount_fs();
+    FsckOptions opts = {.nthreads = 1, .repair = false, .out = NULL};
+    FsckReport report;
+    CHECK(fsck_fs(TEST_IMAGE, &opts, &report) == 0 && report.inodes == 1);
+    return test_done("tree");
+}